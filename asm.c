@@ -0,0 +1,898 @@
+#include "kcc.h"
+
+// Assembler
+//
+// encodes the Intel-syntax text produced by gen into machine code, so that
+// kcc can write object files (and run code) without an external assembler.
+// only the subset of x86-64 and of gas directives that kcc emits is accepted.
+// jumps always use rel32; references that cannot be resolved within a section
+// are left as relocations in the ObjectFile.
+
+#define REG_RIP 16
+
+typedef struct {
+    char *name;
+    int num;
+    int size;
+} RegInfo;
+
+static RegInfo regs[] = {
+    {"rax", 0, 8}, {"rcx", 1, 8}, {"rdx", 2, 8}, {"rbx", 3, 8},
+    {"rsp", 4, 8}, {"rbp", 5, 8}, {"rsi", 6, 8}, {"rdi", 7, 8},
+    {"r8", 8, 8}, {"r9", 9, 8}, {"r10", 10, 8}, {"r11", 11, 8},
+    {"r12", 12, 8}, {"r13", 13, 8}, {"r14", 14, 8}, {"r15", 15, 8},
+    {"eax", 0, 4}, {"ecx", 1, 4}, {"edx", 2, 4}, {"ebx", 3, 4},
+    {"esp", 4, 4}, {"ebp", 5, 4}, {"esi", 6, 4}, {"edi", 7, 4},
+    {"r8d", 8, 4}, {"r9d", 9, 4}, {"r10d", 10, 4}, {"r11d", 11, 4},
+    {"r12d", 12, 4}, {"r13d", 13, 4}, {"r14d", 14, 4}, {"r15d", 15, 4},
+    {"al", 0, 1}, {"cl", 1, 1}, {"dl", 2, 1}, {"bl", 3, 1},
+    {"spl", 4, 1}, {"bpl", 5, 1}, {"sil", 6, 1}, {"dil", 7, 1},
+    {"r8b", 8, 1}, {"r9b", 9, 1}, {"r10b", 10, 1}, {"r11b", 11, 1},
+    {"r12b", 12, 1}, {"r13b", 13, 1}, {"r14b", 14, 1}, {"r15b", 15, 1},
+    {"rip", REG_RIP, 8},
+    {NULL, 0, 0},
+};
+
+typedef struct {
+    char *name;
+    int val;
+} NameVal;
+
+// condition codes of jcc/setcc/cmovcc
+static NameVal conds[] = {
+    {"o", 0}, {"no", 1}, {"b", 2}, {"c", 2}, {"nae", 2}, {"ae", 3}, {"nb", 3}, {"nc", 3},
+    {"e", 4}, {"z", 4}, {"ne", 5}, {"nz", 5}, {"be", 6}, {"na", 6}, {"a", 7}, {"nbe", 7},
+    {"s", 8}, {"ns", 9}, {"p", 10}, {"np", 11}, {"l", 12}, {"nge", 12}, {"ge", 13}, {"nl", 13},
+    {"le", 14}, {"ng", 14}, {"g", 15}, {"nle", 15},
+    {NULL, 0},
+};
+
+// "/digit" of the 0x80/0x81/0x83 group, and the base of the reg/reg forms (digit * 8)
+static NameVal alu_ops[] = {
+    {"add", 0}, {"or", 1}, {"adc", 2}, {"sbb", 3},
+    {"and", 4}, {"sub", 5}, {"xor", 6}, {"cmp", 7},
+    {NULL, 0},
+};
+
+// 0xF7 group, one operand
+static NameVal unary_ops[] = {
+    {"not", 2}, {"neg", 3}, {"mul", 4}, {"div", 6}, {"idiv", 7},
+    {NULL, 0},
+};
+
+// 0xC1/0xD1/0xD3 group
+static NameVal shift_ops[] = {
+    {"rol", 0}, {"ror", 1}, {"shl", 4}, {"sal", 4}, {"shr", 5}, {"sar", 7},
+    {NULL, 0},
+};
+
+typedef enum {
+    OP_NONE,
+    OP_REG,
+    OP_IMM,
+    OP_MEM,
+    OP_SYM, // a bare symbol: jump/call target
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    int size;   // operand size in bytes; 0 for a memory operand without "ptr"
+    int reg;    // OP_REG
+    long imm;   // OP_IMM; displacement of OP_MEM
+    int base;   // OP_MEM, -1 if absent
+    int index;  // OP_MEM, -1 if absent
+    int scale;  // OP_MEM
+    AsmSymbol *sym; // OP_SYM; symbol of a rip-relative OP_MEM
+} Operand;
+
+// one encoded instruction
+typedef struct {
+    uint8_t buf[16];
+    int len;
+    int fixup_pos;  // position of a 32-bit field to relocate, -1 if none
+    AsmSymbol *sym;
+    long addend;    // added to the symbol's address
+    RelocType type;
+} Ins;
+
+typedef struct {
+    int section;
+    int offset;
+    int size;
+    RelocType type;
+    AsmSymbol *sym;
+    AsmSymbol *sub; // value is sym - sub (same section as the fixup)
+    long addend;
+} Fixup;
+
+typedef struct {
+    ObjectFile *obj;
+    int section;
+    HashMap *symbols;
+    Fixup *fixups;
+    int nfixup;
+    int fixup_cap;
+    int line;
+} Assembler;
+
+static Assembler *as;
+
+static void error(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "assembler: line %d: ", as->line);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    exit(1);
+}
+
+// Output
+
+static void section_reserve(Section *sec, int n) {
+    if (sec->len + n <= sec->capacity) return;
+    int capacity = sec->capacity ? sec->capacity : 256;
+    while (capacity < sec->len + n) capacity *= 2;
+    char *tmp = realloc(sec->buf, capacity);
+    if (!tmp) panic("cannot reallocate memory: %s", strerror(errno));
+    sec->buf = tmp;
+    sec->capacity = capacity;
+}
+
+static void out_bytes(const void *p, int n) {
+    Section *sec = &as->obj->sections[as->section];
+    section_reserve(sec, n);
+    memcpy(sec->buf + sec->len, p, n);
+    sec->len += n;
+}
+
+static void out_int(long val, int size) {
+    uint8_t b[8];
+    for (int i = 0; i < size; i++) b[i] = val >> (i * 8);
+    out_bytes(b, size);
+}
+
+static int cur_offset(void) {
+    return as->obj->sections[as->section].len;
+}
+
+static void add_fixup(int offset, int size, RelocType type, AsmSymbol *sym, AsmSymbol *sub, long addend) {
+    if (as->nfixup == as->fixup_cap) {
+        as->fixup_cap = as->fixup_cap ? as->fixup_cap * 2 : 64;
+        as->fixups = realloc(as->fixups, sizeof(Fixup) * as->fixup_cap);
+        if (!as->fixups) panic("cannot reallocate memory: %s", strerror(errno));
+    }
+    as->fixups[as->nfixup++] = (Fixup){as->section, offset, size, type, sym, sub, addend};
+}
+
+static AsmSymbol *get_symbol(const char *name, int len) {
+    AsmSymbol *sym = hashmap_get(as->symbols, name, len);
+    if (sym) return sym;
+    sym = calloc(1, sizeof(AsmSymbol));
+    sym->name = calloc(1, len + 1);
+    memcpy(sym->name, name, len);
+    sym->section = -1;
+    sym->is_local_label = len >= 2 && name[0] == '.' && name[1] == 'L';
+    hashmap_put(as->symbols, sym->name, len, sym);
+
+    ObjectFile *obj = as->obj;
+    if (obj->nsym == obj->sym_cap) {
+        obj->sym_cap = obj->sym_cap ? obj->sym_cap * 2 : 64;
+        obj->syms = realloc(obj->syms, sizeof(AsmSymbol *) * obj->sym_cap);
+        if (!obj->syms) panic("cannot reallocate memory: %s", strerror(errno));
+    }
+    sym->id = obj->nsym;
+    obj->syms[obj->nsym++] = sym;
+    return sym;
+}
+
+static void add_reloc(Fixup *f, AsmSymbol *sym, RelocType type, long addend) {
+    ObjectFile *obj = as->obj;
+    if (obj->nreloc == obj->reloc_cap) {
+        obj->reloc_cap = obj->reloc_cap ? obj->reloc_cap * 2 : 64;
+        obj->relocs = realloc(obj->relocs, sizeof(Reloc) * obj->reloc_cap);
+        if (!obj->relocs) panic("cannot reallocate memory: %s", strerror(errno));
+    }
+    obj->relocs[obj->nreloc++] = (Reloc){f->section, f->offset, type, sym, addend};
+}
+
+// Operands
+
+static char *skip_space(char *p) {
+    while (*p == ' ' || *p == '\t') p++;
+    return p;
+}
+
+static bool is_symchar(char c) {
+    return isalnum(c) || c == '_' || c == '.' || c == '$';
+}
+
+static RegInfo *find_reg(const char *name, int len) {
+    for (int i = 0; regs[i].name; i++)
+        if (strlen(regs[i].name) == len && strncmp(regs[i].name, name, len) == 0) return &regs[i];
+    return NULL;
+}
+
+static long parse_number(char **p) {
+    char *end;
+    errno = 0;
+    long val = strtol(*p, &end, 0);
+    if (end == *p || errno) error("invalid number: %s", *p);
+    *p = end;
+    return val;
+}
+
+// [base+index*scale+disp], [rip+disp] or [disp]
+static void parse_mem(char *p, Operand *op) {
+    op->kind = OP_MEM;
+    op->base = op->index = -1;
+    op->scale = 1;
+    int sign = 1;
+    p = skip_space(p + 1); // [
+    while (*p != ']') {
+        if (*p == '\0') error("']' expected");
+        if (isdigit(*p)) {
+            op->imm += sign * parse_number(&p);
+        } else {
+            char *start = p;
+            while (is_symchar(*p)) p++;
+            RegInfo *reg = find_reg(start, p - start);
+            if (!reg || reg->size != 8) error("invalid address: %.*s", (int)(p - start), start);
+            if (sign < 0) error("cannot subtract a register");
+            p = skip_space(p);
+            if (*p == '*') {
+                p = skip_space(p + 1);
+                op->index = reg->num;
+                op->scale = parse_number(&p);
+                if (op->scale != 1 && op->scale != 2 && op->scale != 4 && op->scale != 8)
+                    error("invalid scale: %d", op->scale);
+            } else if (op->base < 0) {
+                op->base = reg->num;
+            } else if (op->index < 0) {
+                op->index = reg->num;
+            } else {
+                error("too many registers in address");
+            }
+        }
+        p = skip_space(p);
+        if (*p == '+') sign = 1;
+        else if (*p == '-') sign = -1;
+        else continue;
+        p = skip_space(p + 1);
+    }
+    if (op->index == 4) error("rsp cannot be an index");
+    if (op->base == REG_RIP && op->index >= 0) error("rip cannot be used with an index");
+}
+
+static void parse_operand(char *p, Operand *op) {
+    memset(op, 0, sizeof(*op));
+    p = skip_space(p);
+    if (*p == '\0') return;
+
+    static struct { char *name; int size; } ptrs[] = {
+        {"byte ptr", 1}, {"word ptr", 2}, {"dword ptr", 4}, {"qword ptr", 8}, {NULL, 0},
+    };
+    for (int i = 0; ptrs[i].name; i++) {
+        int len = strlen(ptrs[i].name);
+        if (strncmp(p, ptrs[i].name, len) == 0) {
+            op->size = ptrs[i].size;
+            p = skip_space(p + len);
+            break;
+        }
+    }
+    if (op->size == 2) error("16-bit operands are not supported");
+
+    if (*p == '[') {
+        parse_mem(p, op);
+        return;
+    }
+    if (isdigit(*p) || *p == '-' || *p == '+') {
+        if (op->size) error("a size is only allowed on memory operands");
+        op->kind = OP_IMM;
+        op->imm = parse_number(&p);
+        return;
+    }
+
+    char *start = p;
+    while (is_symchar(*p)) p++;
+    if (p == start) error("invalid operand: %s", start);
+    int len = p - start;
+    p = skip_space(p);
+    if (*p == '[') {
+        // sym[rip], sym[rip+disp]
+        parse_mem(p, op);
+        if (op->base != REG_RIP) error("a symbol is only allowed rip-relative");
+        op->sym = get_symbol(start, len);
+        return;
+    }
+    RegInfo *reg = find_reg(start, len);
+    if (reg) {
+        if (reg->num == REG_RIP) error("rip is not a general register");
+        op->kind = OP_REG;
+        op->reg = reg->num;
+        op->size = reg->size;
+        return;
+    }
+    op->kind = OP_SYM;
+    op->sym = get_symbol(start, len);
+}
+
+// Encoding
+
+static void put8(Ins *ins, int b) {
+    ins->buf[ins->len++] = b;
+}
+
+static void put32(Ins *ins, long val) {
+    for (int i = 0; i < 4; i++) put8(ins, val >> (i * 8));
+}
+
+static bool is_int8(long val) {
+    return -128 <= val && val <= 127;
+}
+
+static bool is_int32(long val) {
+    return INT32_MIN <= val && val <= INT32_MAX;
+}
+
+// spl, bpl, sil and dil are only reachable with a REX prefix
+static bool needs_rex_byte(Operand *op) {
+    return op->kind == OP_REG && op->size == 1 && 4 <= op->reg && op->reg <= 7;
+}
+
+// REX prefix for an instruction with ModRM reg field `reg` and r/m operand `rm`
+static void put_rex(Ins *ins, int size, int reg, Operand *rm, bool force) {
+    int rex = 0x40;
+    if (size == 8) rex |= 8;
+    if (reg & 8) rex |= 4;
+    if (rm->kind == OP_MEM) {
+        if (0 <= rm->index && (rm->index & 8)) rex |= 2;
+        if (0 <= rm->base && rm->base != REG_RIP && (rm->base & 8)) rex |= 1;
+    } else if (rm->reg & 8) {
+        rex |= 1;
+    }
+    if (rex != 0x40 || force || needs_rex_byte(rm)) put8(ins, rex);
+}
+
+static void put_modrm(Ins *ins, int reg, Operand *rm) {
+    reg &= 7;
+    if (rm->kind == OP_REG) {
+        put8(ins, 0xC0 | reg << 3 | (rm->reg & 7));
+        return;
+    }
+    if (rm->base == REG_RIP) {
+        put8(ins, reg << 3 | 5);
+        ins->fixup_pos = ins->len;
+        ins->sym = rm->sym;
+        ins->addend = rm->imm;
+        ins->type = RELOC_PC32;
+        put32(ins, 0);
+        return;
+    }
+    int scale_bits = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0;
+    if (rm->base < 0) {
+        // [index*scale+disp32] or [disp32]
+        put8(ins, reg << 3 | 4);
+        put8(ins, scale_bits << 6 | (rm->index < 0 ? 4 : rm->index & 7) << 3 | 5);
+        if (!is_int32(rm->imm)) error("displacement out of range");
+        put32(ins, rm->imm);
+        return;
+    }
+    int mod;
+    if (rm->imm == 0 && (rm->base & 7) != 5) mod = 0; // rbp/r13 need a displacement
+    else if (is_int8(rm->imm)) mod = 1;
+    else if (is_int32(rm->imm)) mod = 2;
+    else error("displacement out of range");
+
+    if (rm->index < 0 && (rm->base & 7) != 4) {
+        put8(ins, mod << 6 | reg << 3 | (rm->base & 7));
+    } else {
+        // SIB; rsp/r12 as base always need one
+        put8(ins, mod << 6 | reg << 3 | 4);
+        put8(ins, scale_bits << 6 | (rm->index < 0 ? 4 : rm->index & 7) << 3 | (rm->base & 7));
+    }
+    if (mod == 1) put8(ins, rm->imm);
+    else if (mod == 2) put32(ins, rm->imm);
+}
+
+// [REX] opcode ModRM..., for opcodes of 1 or 2 bytes (0x0F xx)
+static void put_op_rm(Ins *ins, int size, int opcode, int reg, Operand *rm, bool force_rex) {
+    put_rex(ins, size, reg, rm, force_rex);
+    if (opcode > 0xFF) put8(ins, opcode >> 8);
+    put8(ins, opcode & 0xFF);
+    put_modrm(ins, reg, rm);
+}
+
+static int operand_size(Operand *a, Operand *b) {
+    int size = a->size ? a->size : b ? b->size : 0;
+    if (!size) error("operand size unknown; use byte/dword/qword ptr");
+    if (b && b->kind != OP_IMM && b->size && b->size != size) error("operand size mismatch");
+    return size;
+}
+
+static void require(bool cond, const char *mnemonic) {
+    if (!cond) error("invalid operands for %s", mnemonic);
+}
+
+static int lookup(NameVal *table, const char *name) {
+    for (int i = 0; table[i].name; i++)
+        if (strcmp(table[i].name, name) == 0) return table[i].val;
+    return -1;
+}
+
+// jcc/setcc/cmovcc suffix -> condition code, or -1
+static int find_cond(const char *prefix, const char *name) {
+    int len = strlen(prefix);
+    if (strncmp(name, prefix, len) != 0) return -1;
+    return lookup(conds, name + len);
+}
+
+static void encode_branch(Ins *ins, Operand *target) {
+    ins->fixup_pos = ins->len;
+    ins->sym = target->sym;
+    ins->addend = 0;
+    ins->type = RELOC_PC32;
+    put32(ins, 0);
+}
+
+static void encode(Ins *ins, const char *m, Operand *a, Operand *b, Operand *c) {
+    int digit, cc;
+
+    if (strcmp(m, "mov") == 0) {
+        if (a->kind == OP_REG && b->kind == OP_IMM) {
+            int size = a->size;
+            if (size == 8 && 0 <= b->imm && b->imm <= UINT32_MAX) size = 4; // zero-extends
+            if (size == 8 && !is_int32(b->imm)) {
+                put_rex(ins, 8, 0, a, false);
+                put8(ins, 0xB8 | (a->reg & 7));
+                for (int i = 0; i < 8; i++) put8(ins, b->imm >> (i * 8));
+            } else if (size == 8) {
+                put_op_rm(ins, 8, 0xC7, 0, a, false);
+                put32(ins, b->imm);
+            } else {
+                put_rex(ins, 0, 0, a, false);
+                put8(ins, (size == 1 ? 0xB0 : 0xB8) | (a->reg & 7));
+                if (size == 1) put8(ins, b->imm);
+                else put32(ins, b->imm);
+            }
+            return;
+        }
+        if (a->kind == OP_MEM && b->kind == OP_IMM) {
+            int size = operand_size(a, NULL);
+            put_op_rm(ins, size, size == 1 ? 0xC6 : 0xC7, 0, a, false);
+            if (size == 1) put8(ins, b->imm);
+            else put32(ins, b->imm);
+            return;
+        }
+        require((a->kind == OP_REG || a->kind == OP_MEM) && (b->kind == OP_REG || b->kind == OP_MEM)
+                && (a->kind == OP_REG || b->kind == OP_REG), m);
+        int size = operand_size(a, b);
+        if (b->kind == OP_REG) put_op_rm(ins, size, size == 1 ? 0x88 : 0x89, b->reg, a, needs_rex_byte(b));
+        else put_op_rm(ins, size, size == 1 ? 0x8A : 0x8B, a->reg, b, needs_rex_byte(a));
+        return;
+    }
+
+    if ((digit = lookup(alu_ops, m)) >= 0) {
+        require(a->kind == OP_REG || a->kind == OP_MEM, m);
+        if (b->kind == OP_IMM) {
+            int size = operand_size(a, NULL);
+            if (size == 1) {
+                put_op_rm(ins, 1, 0x80, digit, a, false);
+                put8(ins, b->imm);
+            } else if (is_int8(b->imm)) {
+                put_op_rm(ins, size, 0x83, digit, a, false);
+                put8(ins, b->imm);
+            } else {
+                if (!is_int32(b->imm)) error("immediate out of range");
+                put_op_rm(ins, size, 0x81, digit, a, false);
+                put32(ins, b->imm);
+            }
+            return;
+        }
+        require(b->kind == OP_REG || (b->kind == OP_MEM && a->kind == OP_REG), m);
+        int size = operand_size(a, b);
+        int opcode = digit * 8 + (size == 1 ? 0 : 1);
+        if (b->kind == OP_REG) put_op_rm(ins, size, opcode, b->reg, a, needs_rex_byte(b));
+        else put_op_rm(ins, size, opcode + 2, a->reg, b, needs_rex_byte(a));
+        return;
+    }
+
+    if (strcmp(m, "test") == 0) {
+        require(a->kind == OP_REG || a->kind == OP_MEM, m);
+        int size = operand_size(a, b);
+        if (b->kind == OP_IMM) {
+            put_op_rm(ins, size, size == 1 ? 0xF6 : 0xF7, 0, a, false);
+            if (size == 1) put8(ins, b->imm);
+            else put32(ins, b->imm);
+            return;
+        }
+        require(b->kind == OP_REG, m);
+        put_op_rm(ins, size, size == 1 ? 0x84 : 0x85, b->reg, a, needs_rex_byte(b));
+        return;
+    }
+
+    if (strcmp(m, "lea") == 0) {
+        require(a->kind == OP_REG && a->size != 1 && b->kind == OP_MEM, m);
+        put_op_rm(ins, a->size, 0x8D, a->reg, b, false);
+        return;
+    }
+
+    if (strcmp(m, "movsx") == 0 || strcmp(m, "movzx") == 0 || strcmp(m, "movzb") == 0) {
+        require(a->kind == OP_REG && a->size != 1 && (b->kind == OP_REG || b->kind == OP_MEM), m);
+        if (b->size == 0) b->size = 1; // movzb, or a memory operand without ptr
+        if (b->size == 4 && m[3] == 's') {
+            put_op_rm(ins, a->size, 0x63, a->reg, b, false); // movsx r64, r/m32 = movsxd
+            return;
+        }
+        require(b->size == 1, m);
+        put_op_rm(ins, a->size, m[3] == 's' ? 0x0FBE : 0x0FB6, a->reg, b, needs_rex_byte(b));
+        return;
+    }
+
+    if (strcmp(m, "movsxd") == 0) {
+        require(a->kind == OP_REG && a->size == 8 && (b->kind == OP_REG || b->kind == OP_MEM), m);
+        if (b->size && b->size != 4) error("invalid operands for movsxd");
+        put_op_rm(ins, 8, 0x63, a->reg, b, false);
+        return;
+    }
+
+    if (strcmp(m, "imul") == 0) {
+        if (b->kind == OP_NONE) {
+            // rdx:rax = rax * a
+            require(a->kind == OP_REG || a->kind == OP_MEM, m);
+            int size = operand_size(a, NULL);
+            put_op_rm(ins, size, size == 1 ? 0xF6 : 0xF7, 5, a, false);
+            return;
+        }
+        if (b->kind == OP_IMM && c->kind == OP_NONE) {
+            *c = *b;
+            *b = *a;
+        }
+        require(a->kind == OP_REG && a->size != 1 && (b->kind == OP_REG || b->kind == OP_MEM), m);
+        int size = operand_size(a, b);
+        if (c->kind == OP_NONE) {
+            put_op_rm(ins, size, 0x0FAF, a->reg, b, false);
+        } else if (c->kind == OP_IMM && is_int8(c->imm)) {
+            put_op_rm(ins, size, 0x6B, a->reg, b, false);
+            put8(ins, c->imm);
+        } else {
+            require(c->kind == OP_IMM, m);
+            if (!is_int32(c->imm)) error("immediate out of range");
+            put_op_rm(ins, size, 0x69, a->reg, b, false);
+            put32(ins, c->imm);
+        }
+        return;
+    }
+
+    if ((digit = lookup(unary_ops, m)) >= 0) {
+        require((a->kind == OP_REG || a->kind == OP_MEM) && b->kind == OP_NONE, m);
+        int size = operand_size(a, NULL);
+        put_op_rm(ins, size, size == 1 ? 0xF6 : 0xF7, digit, a, false);
+        return;
+    }
+
+    if (strcmp(m, "inc") == 0 || strcmp(m, "dec") == 0) {
+        require((a->kind == OP_REG || a->kind == OP_MEM) && b->kind == OP_NONE, m);
+        int size = operand_size(a, NULL);
+        put_op_rm(ins, size, size == 1 ? 0xFE : 0xFF, m[0] == 'd', a, false);
+        return;
+    }
+
+    if ((digit = lookup(shift_ops, m)) >= 0) {
+        require(a->kind == OP_REG || a->kind == OP_MEM, m);
+        int size = operand_size(a, NULL);
+        if (b->kind == OP_REG && b->reg == 1 && b->size == 1) {
+            put_op_rm(ins, size, size == 1 ? 0xD2 : 0xD3, digit, a, false);
+        } else if (b->kind == OP_IMM && b->imm == 1) {
+            put_op_rm(ins, size, size == 1 ? 0xD0 : 0xD1, digit, a, false);
+        } else {
+            require(b->kind == OP_IMM && 0 <= b->imm && b->imm < 64, m);
+            put_op_rm(ins, size, size == 1 ? 0xC0 : 0xC1, digit, a, false);
+            put8(ins, b->imm);
+        }
+        return;
+    }
+
+    if ((cc = find_cond("set", m)) >= 0) {
+        require((a->kind == OP_REG || a->kind == OP_MEM) && (a->size == 1 || a->size == 0), m);
+        put_op_rm(ins, 0, 0x0F90 + cc, 0, a, false);
+        return;
+    }
+
+    if ((cc = find_cond("cmov", m)) >= 0) {
+        require(a->kind == OP_REG && a->size != 1 && (b->kind == OP_REG || b->kind == OP_MEM), m);
+        put_op_rm(ins, operand_size(a, b), 0x0F40 + cc, a->reg, b, false);
+        return;
+    }
+
+    if (strcmp(m, "push") == 0 || strcmp(m, "pop") == 0) {
+        require(a->kind == OP_REG && a->size == 8, m);
+        if (a->reg & 8) put8(ins, 0x41);
+        put8(ins, (m[1] == 'u' ? 0x50 : 0x58) | (a->reg & 7));
+        return;
+    }
+
+    if (strcmp(m, "jmp") == 0 || strcmp(m, "call") == 0) {
+        bool call = m[0] == 'c';
+        if (a->kind == OP_SYM) {
+            put8(ins, call ? 0xE8 : 0xE9);
+            encode_branch(ins, a);
+            if (call) ins->type = RELOC_PLT32;
+            return;
+        }
+        require(a->kind == OP_REG || a->kind == OP_MEM, m);
+        if (a->kind == OP_REG) require(a->size == 8, m);
+        put_op_rm(ins, 0, 0xFF, call ? 2 : 4, a, false);
+        return;
+    }
+
+    if ((cc = find_cond("j", m)) >= 0) {
+        require(a->kind == OP_SYM, m);
+        put8(ins, 0x0F);
+        put8(ins, 0x80 + cc);
+        encode_branch(ins, a);
+        return;
+    }
+
+    static struct {
+        char *name; int len; uint8_t bytes[2];
+    } plain[] = {
+        {"ret", 1, {0xC3}}, {"leave", 1, {0xC9}}, {"nop", 1, {0x90}},
+        {"cqo", 2, {0x48, 0x99}}, {"cdq", 1, {0x99}},
+        {NULL, 0, {0}},
+    };
+    for (int i = 0; plain[i].name; i++) {
+        if (strcmp(m, plain[i].name) != 0) continue;
+        require(a->kind == OP_NONE, m);
+        for (int j = 0; j < plain[i].len; j++) put8(ins, plain[i].bytes[j]);
+        return;
+    }
+
+    error("unsupported instruction: %s", m);
+}
+
+static void assemble_ins(char *p) {
+    char mnemonic[16];
+    int n = 0;
+    while (*p && *p != ' ' && *p != '\t') {
+        if (n == sizeof(mnemonic) - 1) error("unknown mnemonic");
+        mnemonic[n++] = *p++;
+    }
+    mnemonic[n] = '\0';
+
+    Operand ops[3];
+    char *fields[3] = {NULL, NULL, NULL};
+    p = skip_space(p);
+    for (int i = 0; i < 3 && *p; i++) {
+        fields[i] = p;
+        char *comma = strchr(p, ',');
+        if (!comma) break;
+        *comma = '\0';
+        p = comma + 1;
+        if (i == 2) error("too many operands");
+    }
+    for (int i = 0; i < 3; i++) {
+        if (fields[i]) parse_operand(fields[i], &ops[i]);
+        else memset(&ops[i], 0, sizeof(ops[i]));
+    }
+
+    Ins ins = {.fixup_pos = -1};
+    encode(&ins, mnemonic, &ops[0], &ops[1], &ops[2]);
+
+    int start = cur_offset();
+    if (ins.fixup_pos >= 0) {
+        // pc-relative fields are relative to the end of the instruction
+        long addend = ins.addend - (ins.len - ins.fixup_pos);
+        add_fixup(start + ins.fixup_pos, 4, ins.type, ins.sym, NULL, addend);
+    }
+    out_bytes(ins.buf, ins.len);
+}
+
+// Directives
+
+static int find_section(const char *name) {
+    if (strcmp(name, ".text") == 0) return SEC_TEXT;
+    if (strcmp(name, ".data") == 0) return SEC_DATA;
+    if (strcmp(name, ".rodata") == 0) return SEC_RODATA;
+    error("unsupported section: %s", name);
+    return -1;
+}
+
+// sym, sym-sym or sym+num as the operand of .long/.quad
+static void data_expr(char *p, int size) {
+    p = skip_space(p);
+    if (isdigit(*p) || *p == '-' || *p == '+') {
+        out_int(parse_number(&p), size);
+        return;
+    }
+    char *start = p;
+    while (is_symchar(*p)) p++;
+    AsmSymbol *sym = get_symbol(start, p - start);
+    AsmSymbol *sub = NULL;
+    long addend = 0;
+    p = skip_space(p);
+    if (*p == '-' && !isdigit(*skip_space(p + 1))) {
+        p = skip_space(p + 1);
+        start = p;
+        while (is_symchar(*p)) p++;
+        sub = get_symbol(start, p - start);
+        p = skip_space(p);
+    }
+    if (*p == '+' || *p == '-') addend = parse_number(&p);
+    if (*skip_space(p)) error("invalid expression");
+    if (sub && size != 4) error("a difference of symbols must be 32-bit");
+    add_fixup(cur_offset(), size, size == 8 ? RELOC_ABS64 : RELOC_ABS32, sym, sub, addend);
+    out_int(0, size);
+}
+
+// the text between the quotes of a .string, with gas escapes
+static void string_data(char *p) {
+    p = skip_space(p);
+    if (*p++ != '"') error("string expected");
+    while (*p != '"') {
+        if (*p == '\0') error("unterminated string");
+        if (*p != '\\') {
+            out_bytes(p++, 1);
+            continue;
+        }
+        p++;
+        char c;
+        switch (*p) {
+            case 'n': c = '\n'; p++; break;
+            case 't': c = '\t'; p++; break;
+            case 'r': c = '\r'; p++; break;
+            case 'b': c = '\b'; p++; break;
+            case 'f': c = '\f'; p++; break;
+            case 'x': {
+                p++;
+                int val = 0;
+                while (isxdigit(*p)) {
+                    val = val * 16 + (isdigit(*p) ? *p - '0' : tolower(*p) - 'a' + 10);
+                    p++;
+                }
+                c = val;
+                break;
+            }
+            default:
+                if ('0' <= *p && *p <= '7') {
+                    int val = 0;
+                    for (int i = 0; i < 3 && '0' <= *p && *p <= '7'; i++) val = val * 8 + *p++ - '0';
+                    c = val;
+                } else {
+                    c = *p++; // \\, \", \'
+                }
+        }
+        out_bytes(&c, 1);
+    }
+}
+
+static void align_to(int align) {
+    Section *sec = &as->obj->sections[as->section];
+    if (sec->align < align) sec->align = align;
+    char fill = as->section == SEC_TEXT ? 0x90 : 0;
+    while (sec->len % align) out_bytes(&fill, 1);
+}
+
+static void assemble_directive(char *p) {
+    char *name = p;
+    while (*p && *p != ' ' && *p != '\t') p++;
+    char *args = *p ? skip_space(p + 1) : p;
+    *p = '\0';
+
+    if (strcmp(name, ".intel_syntax") == 0) {
+        if (strcmp(args, "noprefix") != 0) error("only .intel_syntax noprefix is supported");
+    } else if (strcmp(name, ".text") == 0 || strcmp(name, ".data") == 0) {
+        as->section = find_section(name);
+    } else if (strcmp(name, ".section") == 0) {
+        as->section = find_section(args);
+    } else if (strcmp(name, ".globl") == 0 || strcmp(name, ".global") == 0) {
+        get_symbol(args, strlen(args))->is_global = true;
+    } else if (strcmp(name, ".byte") == 0) {
+        out_int(parse_number(&args), 1);
+    } else if (strcmp(name, ".long") == 0) {
+        data_expr(args, 4);
+    } else if (strcmp(name, ".quad") == 0) {
+        data_expr(args, 8);
+    } else if (strcmp(name, ".zero") == 0) {
+        long n = parse_number(&args);
+        Section *sec = &as->obj->sections[as->section];
+        section_reserve(sec, n);
+        memset(sec->buf + sec->len, 0, n);
+        sec->len += n;
+    } else if (strcmp(name, ".string") == 0 || strcmp(name, ".asciz") == 0) {
+        string_data(args);
+        out_int(0, 1);
+    } else if (strcmp(name, ".p2align") == 0) {
+        align_to(1 << parse_number(&args));
+    } else {
+        error("unsupported directive: %s", name);
+    }
+}
+
+// Resolution
+
+static void patch(Fixup *f, long val) {
+    char *p = as->obj->sections[f->section].buf + f->offset;
+    if (f->size == 4 && !is_int32(val) && f->type != RELOC_ABS32) error("relocation out of range");
+    for (int i = 0; i < f->size; i++) p[i] = val >> (i * 8);
+}
+
+static void resolve(Fixup *f) {
+    AsmSymbol *sym = f->sym;
+    long addend = f->addend;
+    RelocType type = f->type;
+
+    if (f->sub) {
+        // sym - sub, with sub in the fixup's section: pc-relative to the fixup
+        if (f->sub->section != f->section) error("unsupported difference of symbols: %s-%s", sym->name, f->sub->name);
+        addend += f->offset - f->sub->offset;
+        type = RELOC_PC32;
+    }
+
+    bool pcrel = type == RELOC_PC32 || type == RELOC_PLT32;
+    if (pcrel && sym->section == f->section) {
+        patch(f, sym->offset + addend - f->offset);
+        return;
+    }
+    if (sym->section < 0 && sym->is_local_label) error("undefined label: %s", sym->name);
+    if (sym->section < 0) sym->is_global = true; // external reference
+    add_reloc(f, sym, type, addend);
+}
+
+ObjectFile *assemble(const char *src, int len) {
+    Assembler state = {0};
+    as = &state;
+    as->obj = calloc(1, sizeof(ObjectFile));
+    as->symbols = hashmap_new();
+    as->section = SEC_TEXT;
+    for (int i = 0; i < NUM_SECTIONS; i++) as->obj->sections[i].align = 1;
+    as->obj->sections[SEC_TEXT].align = 16;
+
+    char *line = NULL;
+    int cap = 0;
+    for (int pos = 0; pos < len; ) {
+        int end = pos;
+        while (end < len && src[end] != '\n') end++;
+        as->line++;
+        if (cap <= end - pos) {
+            cap = (end - pos + 1) * 2;
+            line = realloc(line, cap);
+            if (!line) panic("cannot reallocate memory: %s", strerror(errno));
+        }
+        memcpy(line, src + pos, end - pos);
+        line[end - pos] = '\0';
+        pos = end + 1;
+
+        // strip a comment, outside of string literals
+        bool quoted = false;
+        for (char *p = line; *p; p++) {
+            if (*p == '\\' && quoted && p[1]) p++;
+            else if (*p == '"') quoted = !quoted;
+            else if (*p == '#' && !quoted) {
+                *p = '\0';
+                break;
+            }
+        }
+        char *p = skip_space(line);
+        int n = strlen(p);
+        while (n && (p[n - 1] == ' ' || p[n - 1] == '\t' || p[n - 1] == '\r')) p[--n] = '\0';
+        if (n == 0) continue;
+
+        if (p[n - 1] == ':') {
+            AsmSymbol *sym = get_symbol(p, n - 1);
+            if (sym->section >= 0) error("symbol redefined: %s", sym->name);
+            sym->section = as->section;
+            sym->offset = cur_offset();
+        } else if (p[0] == '.') {
+            assemble_directive(p);
+        } else {
+            assemble_ins(p);
+        }
+    }
+    free(line);
+
+    for (int i = 0; i < as->nfixup; i++) resolve(&as->fixups[i]);
+    free(as->fixups);
+    as = NULL;
+    return state.obj;
+}
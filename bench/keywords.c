@@ -0,0 +1,124 @@
+// micro-benchmark for keyword recognition in the lexer.
+// compares lookup_ident against the linear table scan it replaced,
+// then times tokenize on the same identifier-heavy input.
+//
+//   make bench
+
+#include "../lexer.c"
+
+Stats stats;
+
+void panic(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+void count_alloc(size_t size) {
+    (void)size;
+}
+
+char *source_base;
+
+static struct {
+    char *str; TokenTag tag;
+} linear_keywords[] = {
+    {"return",   TT_KW_RETURN},
+    {"if",       TT_KW_IF},
+    {"else",     TT_KW_ELSE},
+    {"while",    TT_KW_WHILE},
+    {"for",      TT_KW_FOR},
+    {"void",     TT_KW_VOID},
+    {"int",      TT_KW_INT},
+    {"char",     TT_KW_CHAR},
+    {"sizeof",   TT_KW_SIZEOF},
+    {"struct",   TT_KW_STRUCT},
+    {"const",    TT_KW_CONST},
+    {"break",    TT_KW_BREAK},
+    {"continue", TT_KW_CONTINUE},
+    {"do",       TT_KW_DO},
+    {"switch",   TT_KW_SWITCH},
+    {"case",     TT_KW_CASE},
+    {"default",  TT_KW_DEFAULT},
+    {"union",    TT_KW_UNION},
+    {"enum",     TT_KW_ENUM},
+    {"typedef",  TT_KW_TYPEDEF},
+    {"define",   TT_PP_DEFINE},
+    {"include",  TT_PP_INCLUDE},
+    {NULL, -1},
+};
+
+// the previous lookup_ident
+static TokenTag lookup_linear(const char *str, int len) {
+    for (int i = 0; linear_keywords[i].str != NULL; i++) {
+        if (strlen(linear_keywords[i].str) != len) continue;
+        else if (strncmp(str, linear_keywords[i].str, len) == 0) return linear_keywords[i].tag;
+    }
+    return TT_IDENT;
+}
+
+static double now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define NWORDS 2000000
+#define ROUNDS 10
+
+int main(void) {
+    // identifiers typical of generated code, with a keyword every few words
+    static const char *names[] = {
+        "x", "i", "len", "count", "buffer", "node_next", "result_value", "tmp42",
+        "is_valid", "parse_expression", "ch", "index", "offset", "data", "ptr", "cases",
+    };
+    int nnames = sizeof(names) / sizeof(names[0]);
+    char **words = malloc(sizeof(char *) * NWORDS);
+    int *lens = malloc(sizeof(int) * NWORDS);
+    size_t total = 0;
+    unsigned seed = 1;
+    for (int i = 0; i < NWORDS; i++) {
+        seed = seed * 1103515245 + 12345;
+        int r = seed >> 16;
+        words[i] = r % 4 == 0 ? linear_keywords[r / 4 % 22].str : (char *)names[r / 4 % nnames];
+        lens[i] = strlen(words[i]);
+        total += lens[i] + 1;
+    }
+
+    // both lookups must agree on every word
+    for (int i = 0; i < NWORDS; i++)
+        if (lookup_linear(words[i], lens[i]) != lookup_ident(words[i], lens[i]))
+            panic("mismatch on %s", words[i]);
+
+    long sink = 0;
+    double t0 = now();
+    for (int r = 0; r < ROUNDS; r++)
+        for (int i = 0; i < NWORDS; i++) sink += lookup_linear(words[i], lens[i]);
+    double t1 = now();
+    for (int r = 0; r < ROUNDS; r++)
+        for (int i = 0; i < NWORDS; i++) sink += lookup_ident(words[i], lens[i]);
+    double t2 = now();
+
+    double n = (double)NWORDS * ROUNDS;
+    printf("linear scan:  %8.1f M identifiers/s\n", n / (t1 - t0) / 1e6);
+    printf("perfect hash: %8.1f M identifiers/s (%.1fx)\n", n / (t2 - t1) / 1e6, (t1 - t0) / (t2 - t1));
+
+    // the same words as source text, through the whole lexer
+    char *src = malloc(total + 1);
+    char *p = src;
+    for (int i = 0; i < NWORDS; i++) {
+        memcpy(p, words[i], lens[i]);
+        p += lens[i];
+        *p++ = ' ';
+    }
+    *p = '\0';
+    source_base = src;
+    double t3 = now();
+    Token tokens = tokenize(lexer_new(src), &token_buf);
+    double t4 = now();
+    printf("tokenize:     %8.1f M identifiers/s (%.1f MB/s)\n",
+           NWORDS / (t4 - t3) / 1e6, total / (t4 - t3) / 1e6);
+    return tokens == 0 || sink == 42;
+}
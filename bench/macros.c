@@ -0,0 +1,124 @@
+// benchmark for macro replacement in the preprocessor.
+// preprocesses a generated file with 10k #defines and a use of each, and
+// compares against the scan of every definition per token that the hash
+// table replaced. then expands a chain of nested object-like macros many
+// times, with and without the expansion cache (a #define between uses
+// invalidates it).
+//
+//   make bench
+
+#include "../kcc.h"
+
+char *source_base;
+
+void panic(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+char *read_file(char *path) {
+    panic("#include is not used in this benchmark: %s", path);
+    return NULL;
+}
+
+char *source_alloc(size_t size) {
+    panic("no tokens are made by # or ## in this benchmark");
+    return NULL;
+}
+
+int align_n(int x, int n) {
+    return (x + n - 1) / n * n;
+}
+
+static double now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define NDEFINES 10000
+#define DEPTH 16
+#define NUSES 20000
+
+// the previous replacement loop: every token against every definition
+static void replace_linear(Token first, Symbol *defines, TokenBuf *raw) {
+    for (Token t = first; t < token_buf.len; t++) {
+        for (Symbol *sym = defines; sym != NULL; sym = sym->next) {
+            int len = raw->lens[sym->token];
+            if (tok_len(t) != len || memcmp(tok_start(t), source_base + raw->offsets[sym->token], len) != 0) continue;
+            token_buf.tags[t] = raw->tags[sym->macro->body];
+            token_buf.offsets[t] = raw->offsets[sym->macro->body];
+            token_buf.lens[t] = raw->lens[sym->macro->body];
+            break;
+        }
+    }
+}
+
+// A0 .. A<DEPTH>, each defined with the one before it, and NUSES uses of the last
+static char *nested_source(char *src, bool define_between) {
+    size_t cap = (size_t)DEPTH * 40 + NUSES * 40 + 64, len = 0;
+    len += snprintf(src + len, cap - len, "#define A0 1\n");
+    for (int i = 1; i <= DEPTH; i++) len += snprintf(src + len, cap - len, "#define A%d (A%d + %d)\n", i, i - 1, i);
+    len += snprintf(src + len, cap - len, "int nested() {\n    int sum = 0;\n");
+    for (int i = 0; i < NUSES; i++) {
+        if (define_between) len += snprintf(src + len, cap - len, "#define USE_%d\n", i);
+        len += snprintf(src + len, cap - len, "    sum = sum + A%d;\n", DEPTH);
+    }
+    len += snprintf(src + len, cap - len, "    return sum;\n}\n");
+    return src + len + 1 + SOURCE_PADDING;
+}
+
+static double nested_ms(char *src, long *cached) {
+    Preprocessor *pp = preprocessor_new(src, NULL);
+    long before = stats.cached_expansions;
+    double t0 = now();
+    preprocess(pp);
+    double t1 = now();
+    *cached = stats.cached_expansions - before;
+    return (t1 - t0) * 1e3;
+}
+
+int main(void) {
+    size_t cap = (size_t)NDEFINES * 80 + 64, len = 0;
+    size_t nested_cap = 2 * ((size_t)DEPTH * 40 + NUSES * 40 + 64 + 1 + SOURCE_PADDING);
+    char *src = calloc(1, cap + 1 + SOURCE_PADDING + nested_cap); // one region: tokens are offsets from source_base
+    for (int i = 0; i < NDEFINES; i++) len += snprintf(src + len, cap - len, "#define CONFIG_OPTION_%d %d\n", i, i);
+    len += snprintf(src + len, cap - len, "int config_sum() {\n    int sum = 0;\n");
+    for (int i = 0; i < NDEFINES; i++) len += snprintf(src + len, cap - len, "    sum = sum + CONFIG_OPTION_%d;\n", i);
+    len += snprintf(src + len, cap - len, "    return sum;\n}\n");
+    source_base = src;
+    char *cached_src = src + cap + 1 + SOURCE_PADDING;
+    char *uncached_src = nested_source(cached_src, false);
+    nested_source(uncached_src, true);
+
+    arena_use(arena_new("preprocess"));
+    Preprocessor *pp = preprocessor_new(src, NULL);
+    double t0 = now();
+    Token first = preprocess(pp);
+    double t1 = now();
+    Token end = token_buf.len;
+
+    // the same tokens, unreplaced, through the old loop. the raw tokens
+    // start with # define NAME VALUE for every definition.
+    Token first2 = token_buf.len;
+    for (Token t = 1 + 4 * NDEFINES; t < pp->raw->len; t++) token_copy(&token_buf, pp->raw, t);
+    double t2 = now();
+    replace_linear(first2, pp->defines, pp->raw);
+    double t3 = now();
+
+    long ntokens = end - first;
+    printf("%d #defines, %ld tokens after preprocessing\n", NDEFINES, ntokens);
+    printf("hash table:  %9.2f ms (whole preprocess)\n", (t1 - t0) * 1e3);
+    printf("linear scan: %9.2f ms (replacement loop only, %.0fx)\n", (t3 - t2) * 1e3, (t3 - t2) / (t1 - t0));
+
+    long hits, misses;
+    double cached_ms = nested_ms(cached_src, &hits);
+    double uncached_ms = nested_ms(uncached_src, &misses);
+    printf("%d uses of a macro nested %d deep\n", NUSES, DEPTH);
+    printf("cached:      %9.2f ms (%ld replayed)\n", cached_ms, hits);
+    printf("uncached:    %9.2f ms (%ld replayed, a #define between uses)\n", uncached_ms, misses);
+    return 0;
+}
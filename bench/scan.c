@@ -0,0 +1,81 @@
+// benchmark for the lexer's scanning kernels.
+// tokenizes a large generated source file, heavy in indentation,
+// comments, long identifiers and string literals, with the kernels this
+// binary was built with; make bench runs a -DSCAN_SCALAR build first for
+// comparison. the lines column is scan_line alone walking every line, as
+// when skipping // comments. tokenize gains much less than the kernels
+// alone: most of its time goes to the work done per token (token_push,
+// intern, the dispatch on the first character), which no kernel touches.
+//
+//   make bench
+
+#include "../lexer.c"
+
+Stats stats;
+
+void panic(char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    exit(1);
+}
+
+void count_alloc(size_t size) {
+    (void)size;
+}
+
+char *source_base;
+
+static double now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define NFUNCS 20000
+#define ROUNDS 5
+
+static const char *chunk =
+    "/*\n"
+    " * compute_checksum_for_block - walks the block and folds every word\n"
+    " * into the running checksum; returns the number of words visited.\n"
+    " */\n"
+    "int compute_checksum_for_block_%d(int *block_pointer, int block_length) {\n"
+    "        int running_checksum_value = 0;    // accumulated checksum\n"
+    "        int word_index_counter = 0;\n"
+    "        while (word_index_counter < block_length) {\n"
+    "                running_checksum_value = running_checksum_value + block_pointer[word_index_counter];\n"
+    "                word_index_counter = word_index_counter + 1;\n"
+    "        }\n"
+    "        printf(\"checksum of block %%d is %%d after visiting every word\\n\", %d, running_checksum_value);\n"
+    "        return word_index_counter;\n"
+    "}\n"
+    "\n";
+
+int main(void) {
+    size_t cap = strlen(chunk) * 2 * NFUNCS, len = 0;
+    char *src = malloc(cap + 1);
+    for (int i = 0; i < NFUNCS; i++) len += snprintf(src + len, cap - len, chunk, i, i);
+
+    source_base = src;
+
+    double best = 1e9, best_lines = 1e9;
+    for (int r = 0; r < ROUNDS; r++) {
+        double t0 = now();
+        for (const char *p = src; *(p = scan_line(p)); p++);
+        double t = now() - t0;
+        if (t < best_lines) best_lines = t;
+    }
+    for (int r = 0; r < ROUNDS; r++) {
+        token_buf.len = 0;
+        stats.tokens = 0;
+        double t0 = now();
+        tokenize(lexer_new(src), &token_buf);
+        double t = now() - t0;
+        if (t < best) best = t;
+    }
+    printf("%-7s tokenize %7.1f MB/s %6.1f M tokens/s   lines %7.1f MB/s\n",
+           scan_impl_name(), len / best / 1e6, stats.tokens / best / 1e6, len / best_lines / 1e6);
+    return 0;
+}
@@ -0,0 +1,218 @@
+#define _DEFAULT_SOURCE // st_mtim, futimens
+#include "kcc.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Compile cache
+//
+// when KCC_CACHE_DIR is set, the output of a compile (assembly or object
+// file) is stored there under a hash of everything it depends on: the
+// preprocessed tokens, the compiler binary, the flags that change the
+// output and the precompiled header, if one is loaded. a later compile
+// with the same hash copies the stored output and skips parsing and code
+// generation.
+//
+// entries are written to a temporary file and renamed into place, so a
+// concurrent kcc sees either the whole entry or none. a hit updates the
+// entry's mtime; after each store the oldest entries are removed until the
+// directory fits in KCC_CACHE_SIZE (default 256M).
+
+#define CACHE_VERSION "1"
+#define CACHE_DEFAULT_SIZE (256L << 20)
+#define CACHE_STALE_TMP_SECONDS 3600 // left by a kcc that died mid-store
+
+// FNV-1a, 128 bits
+typedef unsigned __int128 Hash;
+
+static Hash hash_bytes(Hash h, const void *data, size_t len) {
+    const Hash prime = ((Hash)1 << 88) + 0x13b;
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= prime;
+    }
+    return h;
+}
+
+static Hash hash_str(Hash h, const char *s) {
+    return hash_bytes(h, s, strlen(s) + 1);
+}
+
+static Hash hash_file(Hash h, const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) panic("cannot open %s: %s", path, strerror(errno));
+    char buf[64 * 1024];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) h = hash_bytes(h, buf, n);
+    if (ferror(fp)) panic("cannot read %s: %s", path, strerror(errno));
+    fclose(fp);
+    return h;
+}
+
+// a rebuilt kcc gets a new size or mtime
+static Hash hash_compiler(Hash h) {
+    struct stat st;
+    if (stat("/proc/self/exe", &st) != 0) return hash_str(h, __DATE__ " " __TIME__);
+    h = hash_bytes(h, &st.st_size, sizeof(st.st_size));
+    h = hash_bytes(h, &st.st_mtim, sizeof(st.st_mtim));
+    return h;
+}
+
+// "123", "64K", "256M", "1G"
+static size_t parse_size(const char *s) {
+    char *end;
+    unsigned long n = strtoul(s, &end, 10);
+    if (end == s) panic("KCC_CACHE_SIZE: not a size: %s", s);
+    switch (*end) {
+        case 'G': n <<= 10; // fall through
+        case 'M': n <<= 10; // fall through
+        case 'K': n <<= 10; end++; break;
+    }
+    if (*end != '\0') panic("KCC_CACHE_SIZE: not a size: %s", s);
+    return n;
+}
+
+Cache *cache_open(Token tokens, const char *flags, const char *pch_path) {
+    char *dir = getenv("KCC_CACHE_DIR");
+    if (!dir || !*dir) return NULL;
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) panic("cannot create %s: %s", dir, strerror(errno));
+
+    Cache *cache = calloc(1, sizeof(Cache));
+    cache->dir = dir;
+    char *size = getenv("KCC_CACHE_SIZE");
+    cache->max_size = size ? parse_size(size) : CACHE_DEFAULT_SIZE;
+
+    Hash h = ((Hash)0x6c62272e07bb0142 << 64) + 0x62b821756295c58d;
+    h = hash_str(h, CACHE_VERSION);
+    h = hash_compiler(h);
+    h = hash_str(h, flags);
+    if (pch_path) h = hash_file(h, pch_path);
+    for (Token t = tokens; ; t++) {
+        unsigned char tag = tok_tag(t);
+        int len = tok_len(t);
+        h = hash_bytes(h, &tag, 1);
+        h = hash_bytes(h, &len, sizeof(len));
+        h = hash_bytes(h, tok_start(t), len);
+        if (tag == TT_EOF) break;
+    }
+    snprintf(cache->key, sizeof(cache->key), "%016llx%016llx",
+             (unsigned long long)(h >> 64), (unsigned long long)h);
+    return cache;
+}
+
+static char *entry_path(Cache *cache, const char *name) {
+    char *path = malloc(strlen(cache->dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", cache->dir, name);
+    return path;
+}
+
+// marks an entry most recently used. the time is taken here rather than
+// left to the file system, whose timestamps are only as fine as the
+// kernel tick: entries touched within one tick would tie for eviction.
+static void touch(int fd) {
+    struct timespec now[2];
+    clock_gettime(CLOCK_REALTIME, &now[0]);
+    now[1] = now[0];
+    futimens(fd, now);
+}
+
+// the stored output, or NULL on a miss
+char *cache_get(Cache *cache, size_t *len) {
+    char *path = entry_path(cache, cache->key);
+    // an entry removed by another kcc after this open stays readable
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        free(path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) panic("cannot stat %s: %s", path, strerror(errno));
+    char *data = malloc(st.st_size ? st.st_size : 1);
+    size_t n = 0;
+    while (n < (size_t)st.st_size) {
+        ssize_t r = read(fd, data + n, st.st_size - n);
+        if (r <= 0) panic("cannot read %s: %s", path, r ? strerror(errno) : "truncated");
+        n += r;
+    }
+    touch(fd);
+    close(fd);
+    free(path);
+    *len = n;
+    return data;
+}
+
+typedef struct {
+    char *name;
+    struct timespec mtime;
+    off_t size;
+} Entry;
+
+static int older(const void *a, const void *b) {
+    const struct timespec *x = &((const Entry *)a)->mtime, *y = &((const Entry *)b)->mtime;
+    if (x->tv_sec != y->tv_sec) return x->tv_sec < y->tv_sec ? -1 : 1;
+    if (x->tv_nsec != y->tv_nsec) return x->tv_nsec < y->tv_nsec ? -1 : 1;
+    return 0;
+}
+
+// removes the least recently used entries until the directory fits.
+// concurrent kccs may remove the same entry; a missing one is skipped.
+static void evict(Cache *cache) {
+    DIR *d = opendir(cache->dir);
+    if (!d) return;
+    Entry *entries = NULL;
+    int n = 0, capacity = 0;
+    size_t total = 0;
+    struct dirent *de;
+    time_t now = time(NULL);
+    while ((de = readdir(d)) != NULL) {
+        struct stat st;
+        if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (de->d_name[0] == '.') {
+            if (now - st.st_mtime > CACHE_STALE_TMP_SECONDS) unlinkat(dirfd(d), de->d_name, 0);
+            continue;
+        }
+        if (n == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            entries = realloc(entries, capacity * sizeof(Entry));
+            if (!entries) panic("cannot reallocate memory: %s", strerror(errno));
+        }
+        entries[n++] = (Entry){strdup(de->d_name), st.st_mtim, st.st_size};
+        total += st.st_size;
+    }
+    if (total > cache->max_size) {
+        qsort(entries, n, sizeof(Entry), older);
+        for (int i = 0; i < n && total > cache->max_size; i++) {
+            if (unlinkat(dirfd(d), entries[i].name, 0) == 0 || errno == ENOENT) total -= entries[i].size;
+        }
+    }
+    for (int i = 0; i < n; i++) free(entries[i].name);
+    free(entries);
+    closedir(d);
+}
+
+// stores the output of this compile. failing to is not an error: the
+// output has been written already, and the next compile tries again.
+void cache_put(Cache *cache, const char *data, size_t len) {
+    // temporaries start with '.': lookups never match them, and eviction
+    // only removes stale ones
+    char name[64];
+    snprintf(name, sizeof(name), ".%s.%ld.tmp", cache->key, (long)getpid());
+    char *tmp = entry_path(cache, name);
+    char *path = entry_path(cache, cache->key);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd >= 0) {
+        size_t n = 0;
+        while (n < len) {
+            ssize_t w = write(fd, data + n, len - n);
+            if (w <= 0) break;
+            n += w;
+        }
+        touch(fd);
+        bool ok = close(fd) == 0 && n == len;
+        if (!ok || rename(tmp, path) != 0) unlink(tmp);
+        else evict(cache);
+    }
+    free(tmp);
+    free(path);
+}
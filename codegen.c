@@ -1,4 +1,7 @@
 #include "kcc.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 
 static char *argreg8[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
@@ -6,659 +9,1143 @@ static char *argreg32[] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
 static char *argreg64[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
 static char *str_label = ".L.STR";
 
-void print_token(Token *token) {
-    const char *start = token->start;
-    int len = token->len;
+// registers for expression temporaries (caller-saved).
+// rax holds the value being computed and rdi, rsi, rdx are scratch,
+// so they are never handed out as temporaries.
+// the order matters: see gen_call.
+static char *tmpreg64[] = {"r9", "r8", "rcx"};
+#define NUM_TMPREG ((int)(sizeof(tmpreg64) / sizeof(char*)))
+
+// registers for the homes of IR values. the first NUM_SCRATCH_HOMEREG are
+// caller-saved and only hold values that no call is made over; the rest
+// are callee-saved, so calls keep them, and are saved in the prologue.
+static char *homereg8[] = {"r10b", "r11b", "bl", "r12b", "r13b", "r14b", "r15b"};
+static char *homereg32[] = {"r10d", "r11d", "ebx", "r12d", "r13d", "r14d", "r15d"};
+static char *homereg64[] = {"r10", "r11", "rbx", "r12", "r13", "r14", "r15"};
+#define NUM_HOMEREG ((int)(sizeof(homereg64) / sizeof(char*)))
+#define NUM_SCRATCH_HOMEREG 2
+
+void print_token(Token token) {
+    const char *start = tok_start(token);
+    int len = tok_len(token);
     printf("%.*s", len, start);
 }
 
-GenContext *gencontext_new(Node *current_func, Symbol *local_vars, Symbol *global_vars,
-                           Symbol *func_types, Symbol *defined_types) {
-    GenContext *ctx = calloc(1, sizeof(GenContext));
-    ctx->current_func = current_func;
-    ctx->local_vars = local_vars;
-    ctx->global_vars = global_vars;
-    ctx->func_types = func_types;
-    ctx->defined_types = defined_types;
-    ctx->break_id_stack = stack_new(LOOP_STACK_SIZE);
-    ctx->continue_id_stack = stack_new(LOOP_STACK_SIZE);
-    return ctx;
-}
-
-static int count() {
-    static int i = 0;
-    return i++;
-}
-
-static void gen_load(Type *type);
-static void gen_store(Type *type);
-static void gen_addr(Node *node, GenContext *ctx);
-static void gen_fncall(Node *node, GenContext *ctx);
-static void gen_expr_unary(Node *node, GenContext *ctx);
-static void gen_expr_postfix(Node *node, GenContext *ctx);
-static void gen_expr_assign(Node *node, GenContext *ctx);
-static void gen_expr_binary(Node *node, GenContext *ctx);
-static void gen_expr_cond(Node *node, GenContext *ctx);
-static void gen_expr_logical(Node *node, GenContext *ctx);
-static void gen_expr(Node *node, GenContext *ctx);
-static void gen_lvardecl(Node *node, GenContext *ctx);
-static void gen_stmt(Node *node, GenContext *ctx);
-static void gen_func(Node *node, GenContext *ctx);
-
-static void gen_globalvar(Symbol *var);
-
-// load [rax] to rax
-static void gen_load(Type *type) {
-    printf("  # gen_load\n");
+// label ids are numbered per function; labels are .L<func_id>.<id>.*
+static int count(GenContext *ctx) {
+    return ctx->nlabel++;
+}
+
+// Temporaries
+//
+// gen_expr and gen_addr leave their result in rax. A value that has to survive
+// the evaluation of another subexpression is saved with push_tmp and restored
+// with pop_tmp. Temporaries live strictly nested, so the i-th live one always
+// gets tmpreg64[i]; once all of them are taken, the rest spill to the stack.
+
+// save rax as a new temporary
+static void push_tmp(GenContext *ctx) {
+    if (ctx->depth < NUM_TMPREG) emit_ins("mov", tmpreg64[ctx->depth], "rax");
+    else emit_ins("push", "rax", NULL);
+    ctx->depth++;
+}
+
+// move the newest temporary to reg and release it
+static void pop_tmp(GenContext *ctx, char *reg) {
+    if (ctx->depth <= 0) panic("internal error: temporary underflow");
+    ctx->depth--;
+    if (ctx->depth < NUM_TMPREG) emit_ins("mov", reg, tmpreg64[ctx->depth]);
+    else emit_ins("pop", reg, NULL);
+}
+
+// temporaries held in registers do not survive a call.
+// save them on the stack and start a fresh set; returns the old depth.
+static int save_tmps(GenContext *ctx) {
+    int depth = ctx->depth;
+    int nreg = depth < NUM_TMPREG ? depth : NUM_TMPREG;
+    for (int i = 0; i < nreg; i++) emit_ins("push", tmpreg64[i], NULL);
+    ctx->depth = 0;
+    return depth;
+}
+
+static void restore_tmps(GenContext *ctx, int depth) {
+    if (ctx->depth != 0) panic("internal error: temporaries left across call");
+    int nreg = depth < NUM_TMPREG ? depth : NUM_TMPREG;
+    for (int i = nreg - 1; 0 <= i; i--) emit_ins("pop", tmpreg64[i], NULL);
+    ctx->depth = depth;
+}
+
+// "dword ptr [rax]"; to be freed
+static char *sized(char *size, char *mem) {
+    char *buf = malloc(strlen(size) + strlen(mem) + 6);
+    sprintf(buf, "%s ptr %s", size, mem);
+    return buf;
+}
+
+// load mem ("[rbp-8]") to rax
+static void gen_load(Type *type, char *mem) {
+    emit_comment("  # gen_load\n");
+    char *src = NULL;
     switch (type->tag) {
         case TYP_VOID: panic("invalid load target: void");
         case TYP_CHAR:
-            printf("  movsx rax, byte ptr [rax]\n");
+            emit_ins("movsx", "rax", src = sized("byte", mem));
             break;
         case TYP_INT:
         case TYP_ENUM:
-            printf("  movsxd rax, dword ptr [rax]\n");
+            emit_ins("movsxd", "rax", src = sized("dword", mem));
             break;
         case TYP_PTR:
-            printf("  mov rax, qword ptr [rax]\n");
+            emit_ins("mov", "rax", src = sized("qword", mem));
             break;
-        case TYP_ARRAY: return;
+        case TYP_ARRAY: panic("invalid load target: array");
         case TYP_STRUCT: panic("invalid load target: struct");
         case TYP_UNION: panic("invalid load target: union");
     }
+    free(src);
+}
+
+// the value is stored without going through rax: a constant as an
+// immediate, a value in a register from there
+static bool is_direct(IrValue *v) {
+    return v->reg || (v->op == IR_CONST && v->imm == (int)v->imm);
 }
 
-// store *ax to [stack top]
-static void gen_store(Type *type) {
-    printf("  # gen_store\n");
-    printf("  pop rdi\n");
+// store v to mem: directly if is_direct, else from rax
+static void gen_store(Type *type, char *mem, IrValue *v) {
+    emit_comment("  # gen_store\n");
+    int r = v->reg - 1;
+    bool imm = !v->reg && is_direct(v);
+    char *dst = NULL;
     switch (type->tag) {
         case TYP_VOID: panic("invalid store target: void");
         case TYP_CHAR:
-            printf("  mov [rdi], al\n");
+            if (imm) emit_ins_imm("mov", dst = sized("byte", mem), (signed char)v->imm);
+            else emit_ins("mov", mem, v->reg ? homereg8[r] : "al");
             break;
         case TYP_INT:
         case TYP_ENUM:
-            printf("  mov [rdi], eax\n");
+            if (imm) emit_ins_imm("mov", dst = sized("dword", mem), (int)v->imm);
+            else emit_ins("mov", mem, v->reg ? homereg32[r] : "eax");
             break;
         case TYP_PTR:
-            printf("  mov [rdi], rax\n");
+            if (imm) emit_ins_imm("mov", dst = sized("qword", mem), (int)v->imm);
+            else emit_ins("mov", mem, v->reg ? homereg64[r] : "rax");
             break;
         case TYP_ARRAY: panic("invalid store target: array");
         case TYP_STRUCT: panic("invalid store target: struct");
         case TYP_UNION: panic("invalid store target: struct");
     }
+    free(dst);
 }
 
-static void gen_addr(Node *node, GenContext *ctx) {
-    printf("  # gen_addr\n");
-    switch (node->tag) {
-        case NT_IDENT: {
-            Symbol *var = find_symbol(ST_LVAR, ctx->local_vars, node->main_token);
-            Token *ident = node->main_token;
-            printf("  # address of `%.*s`\n", ident->len, ident->start);
-            if (var != NULL) {
-                int offset = var->offset;
-                printf("  mov rax, rbp\n");
-                printf("  sub rax, %d\n", offset);
-                printf("  push rax\n");
-                return;
+// Lowering
+//
+// the IR of a function is emitted block by block, instructions in order.
+// an instruction whose only use comes right after it in the same block
+// (nothing else emitted in between) is computed as part of that use, so
+// the trees the IR was built from come back and are emitted with the
+// stack-machine patterns: the result in rax, pending operands in
+// temporaries. constants and addresses are recomputed at each use. any
+// other value that is used gets a home, written where the value is defined
+// and read at each use: a register where one is free over the value's live
+// range, else a stack slot. phis are written by their predecessors, on
+// edges that critical-edge splitting has made unique.
+
+static bool is_remat(IrValue *v) {
+    return v->op == IR_CONST || v->op == IR_LOCAL || v->op == IR_GLOBAL || v->op == IR_STRING;
+}
+
+// the i-th operand in the order they are computed; arguments are
+// evaluated right to left
+static IrValue *operand(IrValue *v, int i) {
+    return v->op == IR_CALL ? v->args[v->nargs - 1 - i] : v->args[i];
+}
+
+// marks the operands of user that it computes itself: walking back from
+// pos, the position before user, each operand defined exactly there.
+// at[] of each gets at[user]. returns the position before the
+// instructions claimed.
+static int claim_operands(IrBlock *block, IrValue *user, int pos, int *at) {
+    if (user->op == IR_PHI) return pos;
+    for (int i = user->nargs - 1; 0 <= i; i--) {
+        IrValue *v = operand(user, i);
+        if (is_remat(v)) continue;
+        while (0 <= pos && is_remat(block->insts[pos])) pos--;
+        if (pos < 0 || block->insts[pos] != v || v->nuses != 1 || v->op == IR_PHI) continue;
+        // temporaries share r9, r8 and rcx with arguments, so only a store
+        // (which takes at most r10) reads an argument register in its tree
+        if (v->op == IR_PARAM && user->op != IR_STORE) continue;
+        v->inlined = true;
+        at[v->id] = at[user->id];
+        pos = claim_operands(block, v, pos - 1, at);
+    }
+    return pos;
+}
+
+static bool needs_home(IrValue *v) {
+    return v->nuses && !v->inlined && !is_remat(v);
+}
+
+// Registers
+//
+// linear scan over the blocks in layout order. a value's live range is
+// one interval from its first to its last position, holes included: the
+// instructions that use or define it, and the starts and ends of the
+// blocks it is live into or out of. a phi is written at the end of each
+// predecessor, unless the value it takes there shares its register: a phi
+// and the operands used by nothing else are coalesced when none of them is
+// live where another is defined. when more intervals overlap than there
+// are registers, the one reaching furthest goes to the stack. an interval
+// with a call inside gets a callee-saved register.
+
+typedef struct {
+    IrFunc *func;
+    int *at;         // by id: position of the instruction computing the value
+    int *index;      // by block id: layout index
+    int *first;      // by layout index: positions of the first and last instructions
+    int *last;
+    Stack **live_in; // by id: layout indices of the blocks the value is live
+    Stack **live_out; // into and out of, counting the operands of phi moves
+    int *start;      // by id: the live interval
+    int *end;
+    IrValue **group; // by id: the phi a value is coalesced with
+} RegAlloc;
+
+typedef struct {
+    IrValue *v; // the phi, for a coalesced group
+    int start;
+    int end;
+    bool over_call; // a call is made after start and up to end
+} Interval;
+
+static int interval_cmp(const void *a, const void *b) {
+    const Interval *x = a, *y = b;
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+    return x->v->id - y->v->id;
+}
+
+static void extend(RegAlloc *ra, int id, int pos) {
+    if (pos < ra->start[id]) ra->start[id] = pos;
+    if (ra->end[id] < pos) ra->end[id] = pos;
+}
+
+static bool in_list(Stack *list, int i) {
+    for (int k = 0; list && k < list->top; k++)
+        if (list->data[k] == i) return true;
+    return false;
+}
+
+static void add_live(Stack **list, int i) {
+    if (!*list) *list = stack_new(4);
+    stack_push(*list, i);
+}
+
+static void mark_live_out(RegAlloc *ra, IrValue *v, int i, int *out_mark, Stack *work) {
+    if (out_mark[i] == v->id + 1) return;
+    out_mark[i] = v->id + 1;
+    add_live(&ra->live_out[v->id], i);
+    extend(ra, v->id, ra->last[i]);
+    stack_push(work, i); // and live into it, unless defined there
+}
+
+// walks each value back from its uses in other blocks to its definition
+static void find_live(RegAlloc *ra) {
+    IrFunc *func = ra->func;
+    // a use in block i is noted as i, a phi's use at the end of block i as -1 - i
+    Stack **uses = calloc(func->nvalues, sizeof(Stack *));
+    IrValue **values = calloc(func->nvalues, sizeof(IrValue *));
+    for (int i = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        for (int j = 0; j < block->ninsts; j++) {
+            IrValue *u = block->insts[j];
+            values[u->id] = u;
+            for (int k = 0; k < u->nargs; k++) {
+                IrValue *v = u->args[k];
+                if (!needs_home(v)) continue;
+                if (u->op == IR_PHI) add_live(&uses[v->id], -1 - ra->index[block->preds[k]->id]);
+                else if (v->block != block) add_live(&uses[v->id], i);
             }
-            var = find_symbol(ST_GVAR, ctx->global_vars, node->main_token);
-            if (!var) panic("undefined variable");
-            printf("  lea rax, %.*s[rip]\n", var->token->len, var->token->start);
-            printf("  push rax\n");
-            break;
         }
-        case NT_DEREF:
-            gen_expr(node->unary_expr, ctx); // push rax
-            break;
-        case NT_STRING:
-            printf("  lea rax, %s%d[rip]\n", str_label, node->index);
-            printf("  push rax\n");
-            break;
-        case NT_DOT: {
-            Node *lhs = node->member_access.lhs;
-            Node *mnode = node->member_access.member;
-            int offset = 0;
-            Symbol *member = find_member(lhs->type->tagged_typ.list, mnode->main_token, &offset);
-            if (!member) panic("wrong member");
-            gen_addr(lhs, ctx);
-            printf("  pop rax\n");
-            printf("  add rax, %d\n", offset);
-            printf("  push rax\n");
-            break;
+    }
+
+    int *in_mark = calloc(func->nblocks, sizeof(int)); // id + 1 of the value walked
+    int *out_mark = calloc(func->nblocks, sizeof(int));
+    Stack *work = stack_new(16);
+    for (int id = 0; id < func->nvalues; id++) {
+        if (!uses[id]) continue;
+        IrValue *v = values[id];
+        int def = ra->index[v->block->id];
+        for (int k = 0; k < uses[id]->top; k++) {
+            int i = uses[id]->data[k];
+            if (0 <= i) stack_push(work, i);
+            else mark_live_out(ra, v, -1 - i, out_mark, work);
         }
-        case NT_ARROW: {
-            Node *lhs = node->member_access.lhs;
-            Node *mnode = node->member_access.member;
-            int offset = 0;
-            Symbol *member = find_member(lhs->type->base->tagged_typ.list, mnode->main_token, &offset);
-            if (!member) panic("wrong member");
-            gen_expr(lhs, ctx);
-            printf("  pop rax\n");
-            printf("  add rax, %d\n", offset);
-            printf("  push rax\n");
-            break;
+        while (work->top) {
+            int i = stack_pop(work);
+            if (i == def || in_mark[i] == id + 1) continue;
+            in_mark[i] = id + 1;
+            add_live(&ra->live_in[id], i);
+            extend(ra, id, ra->first[i]);
+            IrBlock *block = func->blocks[i];
+            for (int j = 0; j < block->npreds; j++)
+                mark_live_out(ra, v, ra->index[block->preds[j]->id], out_mark, work);
         }
-        default:
-            panic("unexpected node NodeTag=%d", node->tag);
-    }
-}
-
-static void gen_fncall(Node *node, GenContext *ctx) {
-    int id = count();
-    Node **nodes = node->fncall.args->nodes;
-    int narg = node->fncall.args->len;
-    if (sizeof(argreg64) / sizeof(char*) < narg) panic("too many args");
-
-    for (int i = 0; i < narg; i++) gen_expr(nodes[i], ctx);
-    for (int i = narg - 1; 0 <= i; i--) {
-        printf("  pop rax\n");
-        printf("  mov %s, rax\n", argreg64[i]);
-    }
-    printf("  mov rax, rsp\n");
-    printf("  and rax, 0xF\n");
-    printf("  cmp rax, 0\n");
-    printf("  je  .L.FNCALL%d.ALIGNED\n", id);
-    printf("  sub rsp, 8\n");
-    printf("  mov al, 0\n");
-    printf("  call ");
-    print_token(node->main_token);
-    printf("\n");
-    printf("  add rsp, 8\n");
-    printf("  jmp .L.FNCALL%d.END\n", id);
-    printf(".L.FNCALL%d.ALIGNED:\n", id);
-    printf("  mov al, 0\n");
-    printf("  call ");
-    print_token(node->main_token);
-    printf("\n");
-    printf(".L.FNCALL%d.END:\n", id);
-    if (node->type->tag == TYP_CHAR) printf("  movsx rax, al\n");
-    else if (node->type->tag == TYP_INT) printf("  movsxd rax, eax\n");
-    printf("  push rax\n");
-}
-
-static void gen_expr_unary(Node *node, GenContext *ctx) {
-    switch (node->tag) {
-        case NT_NEG:
-            gen_expr(node->unary_expr, ctx);
-            printf("  pop rax\n");
-            printf("  neg rax\n");
-            printf("  push rax\n");
-            break;
-        case NT_ADDR:
-            return gen_addr(node->unary_expr, ctx);
-        case NT_DEREF:
-            gen_expr(node->unary_expr, ctx);
-            printf("  pop rax\n");
-            gen_load(node->type);
-            printf("  push rax\n");
-            break;
-        case NT_BOOL_NOT:
-            gen_expr(node->unary_expr, ctx);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  sete al\n");
-            printf("  movzx rax, al\n");
-            printf("  push rax\n");
-            break;
-        case NT_SIZEOF: {
-            int size = sizeof_type(node->unary_expr->type);
-            printf("  push %d\n", size);
-            break;
+        stack_free(uses[id]);
+    }
+    stack_free(work);
+    free(in_mark);
+    free(out_mark);
+    free(uses);
+    free(values);
+}
+
+// x is live where y is defined (a use there reads before y is written)
+static bool live_at_def(RegAlloc *ra, IrValue *x, IrValue *y) {
+    int i = ra->index[y->block->id];
+    if (y->op == IR_PHI) return x->op == IR_PHI ? x->block == y->block : in_list(ra->live_in[x->id], i);
+    if (in_list(ra->live_out[x->id], i)) return true;
+    IrBlock *block = y->block;
+    for (int j = 0; j < block->ninsts; j++) {
+        IrValue *u = block->insts[j];
+        if (u->op == IR_PHI || ra->at[u->id] <= ra->at[y->id]) continue;
+        for (int k = 0; k < u->nargs; k++)
+            if (u->args[k] == x) return true;
+    }
+    return false;
+}
+
+static void coalesce(RegAlloc *ra, IrValue *phi) {
+    IrBlock *block = phi->block;
+    IrValue **members = calloc(phi->nargs + 1, sizeof(IrValue *));
+    int n = 0;
+    members[n++] = phi;
+    for (int j = 0; j < phi->nargs; j++) {
+        IrValue *arg = phi->args[j];
+        if (!needs_home(arg) || arg->op == IR_PHI || arg->nuses != 1 || ra->group[arg->id]) continue;
+        bool ok = true;
+        for (int m = 0; ok && m < n; m++)
+            ok = !live_at_def(ra, members[m], arg) && !live_at_def(ra, arg, members[m]);
+        // the phi is still written at the end of the other predecessors
+        for (int k = 0; ok && k < block->npreds; k++) {
+            if (k == j || phi->args[k] == arg) continue;
+            ok = !in_list(ra->live_out[arg->id], ra->index[block->preds[k]->id]);
         }
-        case NT_PREINC:
-            gen_addr(node->unary_expr, ctx); // push addr, rax=address
-            gen_load(node->type);
-            if (is_integer(node->type)) printf("  inc rax\n");
-            else if (is_ptr_or_arr(node->type)) printf("  add rax, %d\n", sizeof_type(node->type->base));
-            gen_store(node->type); // pop addr
-            printf("  push rax\n");
-            break;
-        case NT_PREDEC:
-            gen_addr(node->unary_expr, ctx); // push addr, rax=address
-            gen_load(node->type);
-            if (is_integer(node->type)) printf("  dec rax\n");
-            else if (is_ptr_or_arr(node->type)) printf("  sub rax, %d\n", sizeof_type(node->type->base));
-            gen_store(node->type); // pop addr
-            printf("  push rax\n");
-            break;
-        default: panic("codegen: error at gen_expr_unary");
-    }
-    return;
-}
-
-static void gen_expr_postfix(Node *node, GenContext *ctx) {
-    if (node->tag == NT_POSTINC) {
-        gen_addr(node->pre_expr, ctx); // push addr
-        gen_load(node->type);
-        printf(" mov rdx, rax\n");
-        if (is_integer(node->type)) printf("  inc rax\n");
-        else if (is_ptr_or_arr(node->type)) printf("  add rax, %d\n", sizeof_type(node->type->base));
-        gen_store(node->type); // pop addr
-        printf(" push rdx\n");
-    } else if (node->tag == NT_POSTDEC) {
-        gen_addr(node->pre_expr, ctx); // push addr
-        gen_load(node->type);
-        printf(" mov rdx, rax\n");
-        if (is_integer(node->type)) printf("  dec rax\n");
-        else if (is_ptr_or_arr(node->type)) printf("  sub rax, %d\n", sizeof_type(node->type->base));
-        gen_store(node->type); // pop addr
-        printf(" push rdx\n");
-    } else {
-        panic("codegen: error at gen_expr_postfix");
+        if (!ok) continue;
+        ra->group[arg->id] = phi;
+        members[n++] = arg;
+    }
+    ra->group[phi->id] = phi;
+    for (int j = 0; j < phi->nargs; j++) {
+        if (ra->group[phi->args[j]->id] == phi) continue;
+        extend(ra, phi->id, ra->last[ra->index[block->preds[j]->id]]);
     }
+    free(members);
 }
 
-static void gen_expr_assign(Node *node, GenContext *ctx) {
-    printf("  # gen_expr_assign\n");
-    gen_addr(node->bin_expr.lhs, ctx);
-    gen_expr(node->bin_expr.rhs, ctx);
-    if (node->tag == NT_ASSIGN) {
-        printf("  pop rax\n");
-    } else {
-        Type *lt = node->bin_expr.lhs->type;
-        Type *rt = node->bin_expr.rhs->type;
-
-        if (is_ptr_or_arr(lt) && is_integer(rt)) {
-            // ptr +=/-= int
-            if (node->tag != NT_ASSIGN_ADD && node->tag != NT_ASSIGN_SUB)
-                panic("codegen: invalid operands (ptr op ptr)");
-            printf("  pop rdi\n");
-            printf("  imul rdi, %d\n", sizeof_type(lt->base));
-            printf("  pop rsi\n");
-        } else {
-            printf("  pop rdi\n");
-            printf("  pop rsi\n");
+// at[]: position of the instruction computing each value. returns the
+// number of callee-saved registers used.
+static int alloc_regs(IrFunc *func, int *at) {
+    int nvalues = func->nvalues;
+    RegAlloc ra = {
+        .func = func,
+        .at = at,
+        .index = calloc(func->nblock_ids, sizeof(int)),
+        .first = calloc(func->nblocks, sizeof(int)),
+        .last = calloc(func->nblocks, sizeof(int)),
+        .live_in = calloc(nvalues, sizeof(Stack *)),
+        .live_out = calloc(nvalues, sizeof(Stack *)),
+        .start = malloc(nvalues * sizeof(int)),
+        .end = malloc(nvalues * sizeof(int)),
+        .group = calloc(nvalues, sizeof(IrValue *)),
+    };
+    for (int i = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        ra.index[block->id] = i;
+        ra.first[i] = at[block->insts[0]->id];
+        ra.last[i] = at[block->insts[block->ninsts - 1]->id];
+    }
+    for (int i = 0; i < nvalues; i++) {
+        ra.start[i] = INT_MAX;
+        ra.end[i] = -1;
+    }
+    for (int i = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        for (int j = 0; j < block->ninsts; j++) {
+            IrValue *v = block->insts[j];
+            if (v->op == IR_PHI) {
+                if (needs_home(v)) extend(&ra, v->id, ra.first[i]);
+                continue;
+            }
+            if (needs_home(v)) extend(&ra, v->id, at[v->id]);
+            for (int k = 0; k < v->nargs; k++)
+                if (needs_home(v->args[k])) extend(&ra, v->args[k]->id, at[v->id]);
         }
-        printf("  mov rax, rsi\n");
-        if (node->tag == NT_ASSIGN_ADD) {
-            gen_load(node->type);
-            printf("  add rax, rdi\n");
-            printf("  push rsi\n");
-        } else if (node->tag == NT_ASSIGN_SUB) {
-            gen_load(node->type);
-            printf("  sub rax, rdi\n");
-            printf("  push rsi\n");
-        } else if (node->tag == NT_ASSIGN_MUL) {
-            gen_load(node->type);
-            printf("  imul rax, rdi\n");
-            printf("  push rsi\n");
-        } else if (node->tag == NT_ASSIGN_DIV) {
-            gen_load(node->type);
-            printf("  cqo\n");
-            printf("  idiv rdi\n");
-            printf("  push rsi\n");
-        } else {
-            panic("codegen: error at gen_expr_assign");
+    }
+    find_live(&ra);
+    for (int i = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        for (int j = 0; j < block->ninsts && block->insts[j]->op == IR_PHI; j++)
+            if (needs_home(block->insts[j])) coalesce(&ra, block->insts[j]);
+    }
+
+    // one interval per group
+    Interval *intervals = calloc(nvalues + 1, sizeof(Interval));
+    int *interval_of = calloc(nvalues, sizeof(int)); // 1 + index
+    int n = 0;
+    for (int i = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        for (int j = 0; j < block->ninsts; j++) {
+            IrValue *v = block->insts[j];
+            if (!needs_home(v)) continue;
+            IrValue *leader = ra.group[v->id] ? ra.group[v->id] : v;
+            if (!interval_of[leader->id]) {
+                intervals[n] = (Interval){leader, INT_MAX, -1};
+                interval_of[leader->id] = ++n;
+            }
+            Interval *it = &intervals[interval_of[leader->id] - 1];
+            if (ra.start[v->id] < it->start) it->start = ra.start[v->id];
+            if (it->end < ra.end[v->id]) it->end = ra.end[v->id];
         }
     }
-    gen_store(node->type);
-    printf("  push rax\n");
-    return;
-}
-
-static void gen_expr_binary(Node *node, GenContext *ctx) {
-    gen_expr(node->bin_expr.lhs, ctx);
-    gen_expr(node->bin_expr.rhs, ctx);
-
-    Type *lt = node->bin_expr.lhs->type;
-    Type *rt = node->bin_expr.rhs->type;
-
-    if (is_ptr_or_arr(lt) && is_integer(rt)) {
-        // ptr +/- int
-        if (node->tag != NT_ADD && node->tag != NT_SUB
-            && node->tag != NT_EQ && node->tag != NT_NE)
-            panic("codegen: invalid operands (pointer op int)");
-        printf("  pop rdi\n");
-        printf("  imul rdi, %d\n", sizeof_type(lt->base));
-        printf("  pop rax\n");
-    } else if (is_integer(lt) && is_ptr_or_arr(rt)) {
-        // int + ptr
-        if (node->tag != NT_ADD) panic("codegen: invalid operands (int op pointer)");
-        printf("  pop rdi\n");
-        printf("  pop rax\n");
-        printf("  imul rax, %d\n", sizeof_type(rt->base));
-    } else if (is_ptr_or_arr(lt) && is_ptr_or_arr(rt)) {
-        // ptr - ptr
-        if (node->tag == NT_SUB) {
-            printf("  pop rdi\n");
-            printf("  pop rax\n");
-            printf("  sub rax, rdi\n");
-            printf("  mov rsi, %d\n", sizeof_type(lt->base));
-            printf("  cqo\n");
-            printf("  idiv rsi\n");
-            printf("  push rax\n");
-            return;
-        } else {
-            // ptr op ptr
-            if (node->tag != NT_EQ && node->tag != NT_NE
-                && node->tag != NT_LT && node->tag != NT_LE)
-                panic("codegen: invalid operands (pointer op pointer)");
-            printf("  pop rdi\n");
-            printf("  pop rax\n");
+    // a call computed as part of another instruction has its position, and
+    // may come before an operand of it is read, hence end inclusive
+    for (int i = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        for (int j = 0; j < block->ninsts; j++) {
+            if (block->insts[j]->op != IR_CALL) continue;
+            int pos = at[block->insts[j]->id];
+            for (int k = 0; k < n; k++)
+                if (intervals[k].start < pos && pos <= intervals[k].end) intervals[k].over_call = true;
         }
-    } else {
-        // int op int 
-        printf("  pop rdi\n");
-        printf("  pop rax\n");
     }
+    qsort(intervals, n, sizeof(Interval), interval_cmp);
 
-    switch (node->tag) {
-        case NT_ADD:
-            printf("  add rax, rdi\n");
-            break;
-        case NT_SUB:
-            printf("  sub rax, rdi\n");
-            break;
-        case NT_MUL:
-            printf("  imul rax, rdi\n");
-            break;
-        case NT_DIV:
-        case NT_MOD:
-            printf("  cqo\n");
-            printf("  idiv rdi\n");
-            if (node->tag == NT_MOD) printf("  mov rax, rdx\n");
-            break;
-        case NT_EQ:
-            printf("  cmp rax, rdi\n");
-            printf("  sete al\n");
-            printf("  movzb rax, al\n");
-            break;
-        case NT_NE:
-            printf("  cmp rax, rdi\n");
-            printf("  setne al\n");
-            printf("  movzb rax, al\n");
-            break;
-        case NT_LT:
-            printf("  cmp rax, rdi\n");
-            printf("  setl al\n");
-            printf("  movzb rax, al\n");
-            break;
-        case NT_LE:
-            printf("  cmp rax, rdi\n");
-            printf("  setle al\n");
-            printf("  movzb rax, al\n");
-            break;
-        case NT_COMMA:
-            printf("  mov rax, rdi\n");
-            break;
-        default: panic("codegen: invalid node NodeTag=%d", node->tag);
-    }
-    printf("  push rax\n");
-}
-
-static void gen_expr_cond(Node *node, GenContext *ctx) {
-    int id = count();
-    gen_expr(node->cond_expr.cond, ctx);
-    printf("  pop rax\n");
-    printf("  cmp rax, 0\n");
-    printf("  je  .L%d.ELSE\n", id);
-    gen_expr(node->cond_expr.then, ctx);
-    printf("  jmp .L%d.END\n", id);
-    printf(".L%d.ELSE:\n", id);
-    gen_expr(node->cond_expr.els, ctx);
-    printf(".L%d.END:\n", id);
-}
-
-static void gen_expr_logical(Node *node, GenContext *ctx) {
-    int id = count();
-    if (node->tag == NT_AND) {
-        gen_expr(node->bin_expr.lhs, ctx);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je  .L%d.END\n", id);
-        gen_expr(node->bin_expr.rhs, ctx);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf(".L%d.END:\n", id);
-        printf("  setne al\n");
-        printf("  movzb rax, al\n");
-        printf("  push rax\n");
-    } else if (node->tag == NT_OR) {
-        gen_expr(node->bin_expr.lhs, ctx);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  jne .L%d.END\n", id);
-        gen_expr(node->bin_expr.rhs, ctx);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf(".L%d.END:\n", id);
-        printf("  setne al\n");
-        printf("  movzb rax, al\n");
-        printf("  push rax\n");
-    } else panic("codegen: error at gen_expr_logical");
-}
-
-static void gen_expr(Node *node, GenContext *ctx) {
-    Token *token = node->main_token;
-    printf("  # gen_expr: %.*s\n", token->len, token->start);
-    switch (node->tag) {
-        case NT_INT:
-            printf("  push %d\n", node->integer);
-            return;
-        case NT_IDENT: {
-            Symbol *mem = find_enum_val(ctx->defined_types, node->main_token);
-            if (mem) {
-                printf("  push %d\n", mem->value);
-                return;
+    // a value last read where another is defined can share its register:
+    // operands are read before the result is written
+    Interval *active[NUM_HOMEREG] = {0}; // by register
+    int nused = 0;
+    for (int i = 0; i < n; i++) {
+        Interval *cur = &intervals[i];
+        int free_reg = -1, furthest = -1;
+        for (int r = cur->over_call ? NUM_SCRATCH_HOMEREG : 0; r < NUM_HOMEREG; r++) {
+            if (active[r] && active[r]->end <= cur->start) active[r] = NULL;
+            if (!active[r]) {
+                if (free_reg < 0) free_reg = r;
+            } else if (furthest < 0 || active[furthest]->end < active[r]->end) {
+                furthest = r;
             }
-            // fallthrough
         }
-        case NT_DOT:
-        case NT_ARROW:
-            gen_addr(node, ctx);
-            printf("  pop rax\n");
-            gen_load(node->type);
-            printf("  push rax\n");
-            return;
-        case NT_STRING: return gen_addr(node, ctx);
-        case NT_NEG:
-        case NT_ADDR:
-        case NT_DEREF:
-        case NT_BOOL_NOT:
-        case NT_PREINC:
-        case NT_PREDEC:
-        case NT_SIZEOF: return gen_expr_unary(node, ctx);
-        case NT_POSTINC:
-        case NT_POSTDEC: return gen_expr_postfix(node, ctx);
-        case NT_ASSIGN:
-        case NT_ASSIGN_ADD:
-        case NT_ASSIGN_SUB:
-        case NT_ASSIGN_MUL:
-        case NT_ASSIGN_DIV: return gen_expr_assign(node, ctx);
-        case NT_FNCALL: return gen_fncall(node, ctx);
-        case NT_ADD:
-        case NT_SUB:
-        case NT_MUL:
-        case NT_DIV:
-        case NT_MOD:
-        case NT_EQ:
-        case NT_NE:
-        case NT_LT:
-        case NT_LE:
-        case NT_COMMA: return gen_expr_binary(node, ctx);
-        case NT_COND: return gen_expr_cond(node, ctx);
-        case NT_AND:
-        case NT_OR: return gen_expr_logical(node, ctx);
-        default: panic("codegen: error at gen_expr");
-    }
-}
-
-static void gen_lvardecl(Node *node, GenContext *ctx) {
-    NodeList *declarators = node->declarators;
-    for (int i = 0; i < declarators->len; i++) {
-        Node *child = declarators->nodes[i]; // declarator
-        Node *name = child->declarator.name;
-        Node *init = child->declarator.init;
-        if (!init) continue;
-
-        gen_addr(name, ctx);
-        if (init->tag == NT_INITS) {
-            NodeList *inits = init->initializers;
-            printf("  mov rdx, rax\n");
-            for (int i = 0; i < inits->len; i++) {
-                Node *elem = inits->nodes[i]; // initializer
-                gen_expr(elem, ctx);
-                printf("  pop rax\n");
-                gen_store(name->type->base);
-                printf("  add rdx, %d\n", sizeof_type(name->type->base));
-                printf("  push rdx\n");
-            }
-        } else {
-            gen_expr(init, ctx);
-            printf("  pop rax\n");
-            gen_store(name->type);
+        int r = free_reg;
+        if (r < 0) {
+            if (active[furthest]->end <= cur->end) continue; // to the stack
+            active[furthest]->v->reg = 0;
+            r = furthest;
         }
+        cur->v->reg = r + 1;
+        active[r] = cur;
+        if (nused <= r - NUM_SCRATCH_HOMEREG) nused = r - NUM_SCRATCH_HOMEREG + 1;
     }
+    // the rest of each group goes where its phi went
+    for (int i = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        for (int j = 0; j < block->ninsts; j++) {
+            IrValue *v = block->insts[j];
+            if (ra.group[v->id] && ra.group[v->id] != v) v->reg = ra.group[v->id]->reg;
+        }
+    }
+
+    free(ra.index);
+    free(ra.first);
+    free(ra.last);
+    for (int i = 0; i < nvalues; i++) {
+        if (ra.live_in[i]) stack_free(ra.live_in[i]);
+        if (ra.live_out[i]) stack_free(ra.live_out[i]);
+    }
+    free(ra.live_in);
+    free(ra.live_out);
+    free(ra.start);
+    free(ra.end);
+    free(ra.group);
+    free(intervals);
+    free(interval_of);
+    return nused;
 }
 
-static void gen_stmt(Node *node, GenContext *ctx) {
-    if (!node) return;
-    printf("  # gen_stmt\n");
-    int id = count();
-    if (node->tag == NT_RETURN) {
-        Node *fnode = ctx->current_func;
-        const char *name = fnode->func.name->main_token->start;
-        int name_len = fnode->func.name->main_token->len;
-        if (node->unary_expr) {
-            gen_expr(node->unary_expr, ctx);
-            printf("  pop rax\n");
+// splits the edges into blocks with phis, picks the instructions that are
+// computed where they are used, and gives the rest homes below the locals
+static void plan_func(GenContext *ctx) {
+    IrFunc *func = ctx->func;
+    for (int i = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        if (block->ninsts == 0 || block->insts[0]->op != IR_PHI) continue;
+        for (int j = 0; j < block->npreds; j++) {
+            IrBlock *pred = block->preds[j];
+            IrValue *term = ir_terminator(pred);
+            if (term->ntargets < 2) continue;
+            for (int k = 0; k < term->ntargets; k++)
+                if (term->targets[k] == block) ir_split_edge(func, pred, k);
         }
-        printf("  jmp .L.RETURN.%.*s\n", name_len, name);
-        return;
-    } else if (node->tag == NT_BLOCK) {
-        for (int i = 0; i < node->block->len; i++) {
-            Node *child = node->block->nodes[i];
-            gen_stmt(child, ctx);
+    }
+
+    // instructions are numbered in layout order; the ones computed as part
+    // of another get its number
+    int *at = calloc(func->nvalues, sizeof(int));
+    for (int i = 0, n = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        for (int j = 0; j < block->ninsts; j++) at[block->insts[j]->id] = n++;
+    }
+    for (int i = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        for (int pos = block->ninsts - 1; 0 <= pos; ) {
+            IrValue *v = block->insts[pos];
+            pos = is_remat(v) ? pos - 1 : claim_operands(block, v, pos - 1, at);
         }
-        return;
-    } else if (node->tag == NT_IF) {
-        gen_expr(node->ifstmt.cond, ctx);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je  .L%d.ELSE\n", id);
-        gen_stmt(node->ifstmt.then, ctx);
-        printf("  jmp .L%d.END\n", id);
-        printf(".L%d.ELSE:\n", id);
-        gen_stmt(node->ifstmt.els, ctx);
-        printf(".L%d.END:\n", id);
-        return;
-    } else if (node->tag == NT_WHILE) {
-        stack_push(ctx->break_id_stack, id);
-        stack_push(ctx->continue_id_stack, id);
-
-        printf(".L%d.WHILE:\n", id);
-        printf(".L%d.CONTINUE:\n", id);
-        gen_expr(node->whilestmt.cond, ctx);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  je  .L%d.END\n", id);
-        gen_stmt(node->whilestmt.body, ctx);
-        printf("  jmp .L%d.WHILE\n", id);
-        printf(".L%d.END:\n", id);
-
-        stack_pop(ctx->break_id_stack);
-        stack_pop(ctx->continue_id_stack);
-        return;
-    } else if (node->tag == NT_DO_WHILE) {
-        stack_push(ctx->break_id_stack, id);
-        stack_push(ctx->continue_id_stack, id);
-
-        printf(".L%d.DO:\n", id);
-        gen_stmt(node->whilestmt.body, ctx);
-        printf(".L%d.CONTINUE:\n", id);
-        gen_expr(node->whilestmt.cond, ctx);
-        printf("  pop rax\n");
-        printf("  cmp rax, 0\n");
-        printf("  jne .L%d.DO\n", id);
-        printf(".L%d.END:\n", id);
-
-        stack_pop(ctx->break_id_stack);
-        stack_pop(ctx->continue_id_stack);
-        return;
-    } else if (node->tag == NT_CASE) {
-        for (int i = 0; i < node->caseblock.stmts->len; i++) {
-            Node *child = node->caseblock.stmts->nodes[i];
-            gen_stmt(child, ctx);
+    }
+    ctx->nsaved = alloc_regs(func, at);
+    free(at);
+
+    Symbol *locals = func->fnode->func.locals;
+    int frame = align_n(locals ? locals->offset : 0, 8);
+    for (int i = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        for (int j = 0; j < block->ninsts; j++) {
+            IrValue *v = block->insts[j];
+            if (!needs_home(v) || v->reg) continue;
+            frame += 8;
+            v->home = frame;
         }
-        return;
-    } else if (node->tag == NT_SWITCH) {
-        stack_push(ctx->break_id_stack, id);
-
-        int default_id = -1;
-        for (int i = 0; i < node->switchstmt.cases->len; i++) {
-            Node *child = node->switchstmt.cases->nodes[i];
-            if (child->caseblock.constant == NULL) {
-                default_id = i;
-                continue;
-            }
-            gen_expr(child->caseblock.constant, ctx); // push
-            gen_addr(node->switchstmt.control, ctx);  // push
-            printf("  pop rax\n");                    // pop
-            gen_load(node->switchstmt.control->type); // -> rax
-            printf("  pop rdi\n");                    // pop
-            printf("  cmp rax, rdi\n");
-            printf("  je .L%d.CASE%d\n", id, i);
+    }
+    ctx->frame = frame + 8 * ctx->nsaved;
+}
+
+static void gen_value(IrValue *v, GenContext *ctx);
+
+// "[rbp-8]"
+static char *frame_slot(char *buf, int offset) {
+    sprintf(buf, "[rbp-%d]", offset);
+    return buf;
+}
+
+// value of v to rax
+static void gen_operand(IrValue *v, GenContext *ctx) {
+    char slot[24];
+    if (v->reg) emit_ins("mov", "rax", homereg64[v->reg - 1]);
+    else if (v->home) emit_ins("mov", "rax", frame_slot(slot, v->home));
+    else gen_value(v, ctx);
+}
+
+// rax to the home of v
+static void gen_set_home(IrValue *v) {
+    char slot[24];
+    if (v->reg) emit_ins("mov", homereg64[v->reg - 1], "rax");
+    else emit_ins("mov", frame_slot(slot, v->home), "rax");
+}
+
+// Addressing modes
+//
+// the address of a load or store, and an add that computes an address,
+// fold into one x86 operand [base + index*scale + disp]. added constants
+// (member offsets) go to disp, a local's address is disp from rbp and a
+// global's from rip, and an index multiplied by 1, 2, 4 or 8 (the element
+// sizes of char, int and pointer arrays) uses the scale. only the parts of
+// the tree computed at this use fold; the base and index that remain are
+// read from their registers, or computed into scratch registers.
+
+typedef struct {
+    IrValue *sym;   // IR_LOCAL, IR_GLOBAL or IR_STRING: the base is rbp or rip
+    IrValue *base;  // or NULL
+    IrValue *index; // or NULL
+    int scale;
+    long disp;
+    bool swapped;   // index comes before base in the tree
+} Address;
+
+static bool fits_disp(long disp) {
+    return disp == (int)disp;
+}
+
+// an add that folds: computed as part of its use, or the root
+static bool folds(IrValue *v, IrValue *root) {
+    return v->op == IR_ADD && (v->inlined || v == root);
+}
+
+// v * 1, 2, 4 or 8, computed as part of its use
+static bool is_scaled(IrValue *v) {
+    if (!v->inlined || v->op != IR_MUL || v->args[1]->op != IR_CONST) return false;
+    long s = v->args[1]->imm;
+    return s == 1 || s == 2 || s == 4 || s == 8;
+}
+
+// the constants added to v go to disp; returns what they are added to
+static IrValue *add_disp(IrValue *v, IrValue *root, Address *a) {
+    while (folds(v, root) && v->args[1]->op == IR_CONST && fits_disp(a->disp + v->args[1]->imm)) {
+        a->disp += v->args[1]->imm;
+        v = v->args[0];
+    }
+    return v;
+}
+
+// root: an add computed here whose value is the address, or NULL
+static void match_addr(IrValue *addr, IrValue *root, Address *a) {
+    *a = (Address){.scale = 1};
+    IrValue *v = add_disp(addr, root, a);
+    if (folds(v, root)) {
+        IrValue *l = v->args[0], *r = v->args[1];
+        if ((is_scaled(l) && !is_scaled(r)) || (is_remat(r) && r->op != IR_CONST)) {
+            l = v->args[1];
+            r = v->args[0];
+            a->swapped = true;
         }
-        if (0 <= default_id) {
-            // default:
-            printf("  jmp .L%d.CASE%d\n", id, default_id);
+        if (is_scaled(r)) {
+            a->scale = r->args[1]->imm;
+            r = r->args[0];
         }
-        for (int i = 0; i < node->switchstmt.cases->len; i++) {
-            Node *child = node->switchstmt.cases->nodes[i];
-            printf(".L%d.CASE%d:\n", id, i);
-            gen_stmt(child, ctx);
+        a->index = r;
+        if (r->op == IR_CONST && fits_disp(r->imm) && fits_disp(a->disp + r->imm * a->scale)) {
+            a->disp += r->imm * a->scale;
+            a->index = NULL;
         }
-        printf(".L%d.END:\n", id);
+        v = add_disp(l, NULL, a);
+    }
+    bool rip = v->op == IR_GLOBAL || v->op == IR_STRING;
+    if (v->op == IR_LOCAL && fits_disp(a->disp - v->var->offset)) {
+        a->sym = v;
+        a->disp -= v->var->offset;
+    } else if (rip && !a->index) {
+        a->sym = v;
+    } else {
+        a->base = v;
+    }
+}
 
-        stack_pop(ctx->break_id_stack);
-        return;
-    } else if (node->tag == NT_FOR) {
-        stack_push(ctx->break_id_stack, id);
-        stack_push(ctx->continue_id_stack, id);
-
-        if (node->forstmt.def) {
-            if (node->forstmt.def->tag == NT_LOCALDECL) gen_lvardecl(node->forstmt.def, ctx);
-            else {
-                gen_expr(node->forstmt.def, ctx);
-                printf("  pop rax\n");
-            }
+static bool in_reg(IrValue *v) {
+    return !v || v->reg;
+}
+
+// "[base+index*scale+disp]", "[rbp-8]", "name[rip+4]"
+static char *format_addr(Address *a, char *base, char *index) {
+    IrValue *sym = a->sym;
+    bool rip = sym && sym->op != IR_LOCAL;
+    char *buf = malloc(64 + (rip && sym->op == IR_GLOBAL ? tok_len(sym->name) : 0));
+    char *p = buf;
+    if (rip && sym->op == IR_GLOBAL) p += sprintf(p, "%.*s[rip", tok_len(sym->name), tok_start(sym->name));
+    else if (rip) p += sprintf(p, "%s%ld[rip", str_label, sym->imm);
+    else p += sprintf(p, "[%s", sym ? "rbp" : base);
+    if (a->index) p += sprintf(p, "+%s*%d", index, a->scale);
+    if (a->disp) p += sprintf(p, "%+ld", a->disp);
+    sprintf(p, "]");
+    return buf;
+}
+
+// the operand for the memory at addr (see match_addr for root), to be
+// freed. the parts of it not in registers are computed, in the order of
+// the tree, then value if it is not NULL; its result is left in rax.
+static char *gen_addr(IrValue *addr, IrValue *root, IrValue *value, GenContext *ctx) {
+    Address a;
+    match_addr(addr, root, &a);
+    IrValue *first = a.swapped ? a.index : a.base;
+    IrValue *second = a.swapped ? a.base : a.index;
+    if (in_reg(first)) first = NULL;
+    if (in_reg(second)) second = NULL;
+    if (!first) {
+        first = second;
+        second = NULL;
+    }
+    // with a value computed after it, a part is held in a temporary
+    char *first_reg = "rax", *second_reg = "rax";
+    if (first) {
+        gen_operand(first, ctx);
+        if (second || value) push_tmp(ctx);
+    }
+    if (second) {
+        gen_operand(second, ctx);
+        if (value) push_tmp(ctx);
+    }
+    if (value) gen_operand(value, ctx);
+    if (second) {
+        if (value) {
+            second_reg = "rsi";
+            pop_tmp(ctx, second_reg);
         }
-        printf(".L%d.FOR:\n", id);
-        if (node->forstmt.cond) {
-            gen_expr(node->forstmt.cond, ctx);
-            printf("  pop rax\n");
-            printf("  cmp rax, 0\n");
-            printf("  je  .L%d.END\n", id);
+        first_reg = "rdi";
+        pop_tmp(ctx, first_reg);
+    } else if (first && value) {
+        first_reg = "rdi";
+        pop_tmp(ctx, first_reg);
+    }
+
+    char *base = NULL, *index = NULL;
+    if (a.base) base = a.base->reg ? homereg64[a.base->reg - 1] : a.base == first ? first_reg : second_reg;
+    if (a.index) index = a.index->reg ? homereg64[a.index->reg - 1] : a.index == first ? first_reg : second_reg;
+    return format_addr(&a, base, index);
+}
+
+// an add computing an address: one lea, when it folds into more than
+// rax + rdi or rax + imm
+static bool gen_lea(IrValue *v, GenContext *ctx) {
+    Address a;
+    match_addr(v, v, &a);
+    if (!a.sym && a.scale == 1 && !(a.index && a.disp)) return false;
+    char *mem = gen_addr(v, v, NULL, ctx);
+    emit_ins("lea", "rax", mem);
+    free(mem);
+    return true;
+}
+
+static void gen_call(IrValue *v, GenContext *ctx) {
+    int id = count(ctx);
+    int depth = save_tmps(ctx);
+    // arguments are evaluated right to left, so argument i ends up in
+    // temporary narg-1-i. moving them out from the newest one, argreg64[i]
+    // is written only after every temporary that shares its register is read.
+    for (int i = v->nargs - 1; 0 <= i; i--) {
+        gen_operand(v->args[i], ctx);
+        push_tmp(ctx);
+    }
+    for (int i = 0; i < v->nargs; i++) pop_tmp(ctx, argreg64[i]);
+    emit_ins("mov", "rax", "rsp");
+    emit_ins("and", "rax", "0xF");
+    emit_ins("cmp", "rax", "0");
+    emit_insf("je", ".L%d.FNCALL%d.ALIGNED", ctx->func_id, id);
+    emit_ins("sub", "rsp", "8");
+    emit_ins("mov", "al", "0");
+    emit_insf("call", "%.*s", tok_len(v->name), tok_start(v->name));
+    emit_ins("add", "rsp", "8");
+    emit_insf("jmp", ".L%d.FNCALL%d.END", ctx->func_id, id);
+    emit_label(".L%d.FNCALL%d.ALIGNED", ctx->func_id, id);
+    emit_ins("mov", "al", "0");
+    emit_insf("call", "%.*s", tok_len(v->name), tok_start(v->name));
+    emit_label(".L%d.FNCALL%d.END", ctx->func_id, id);
+    if (v->type->tag == TYP_CHAR) emit_ins("movsx", "rax", "al");
+    else if (v->type->tag == TYP_INT) emit_ins("movsxd", "rax", "eax");
+    restore_tmps(ctx, depth);
+}
+
+static char *setcc(IrOp op) {
+    switch (op) {
+        case IR_EQ: return "sete";
+        case IR_NE: return "setne";
+        case IR_LT: return "setl";
+        case IR_LE: return "setle";
+        default: panic("codegen: not a comparison: %d", op);
+    }
+    return NULL;
+}
+
+// Constant operands
+//
+// rax * c with shifts and lea, rax / c and rax % c without idiv: a power of
+// two is a shift after rounding negative dividends towards zero, anything
+// else a multiply by a magic number keeping the high half (Hacker's Delight,
+// chapter 10). the results are those of the 64-bit imul and idiv.
+
+// a constant these take: |c| < 2^31
+static bool reduces(long c) {
+    return c == (int)c && c != INT_MIN;
+}
+
+static int log2_exact(unsigned long n) {
+    return n && !(n & (n - 1)) ? __builtin_ctzl(n) : -1;
+}
+
+static void gen_mul_imm(long c) {
+    unsigned long n = c < 0 ? -(unsigned long)c : c;
+    int k = __builtin_ctzl(n | 1UL << 63);
+    switch (n >> k) {
+        case 0: emit_ins("mov", "rax", "0"); return;
+        case 1: break;
+        case 3: emit_ins("lea", "rax", "[rax+rax*2]"); break;
+        case 5: emit_ins("lea", "rax", "[rax+rax*4]"); break;
+        case 9: emit_ins("lea", "rax", "[rax+rax*8]"); break;
+        default:
+            emit_ins_imm("imul", "rax", c);
+            return;
+    }
+    if (k) emit_ins_imm("shl", "rax", k);
+    if (c < 0) emit_ins("neg", "rax", NULL);
+}
+
+// rdx = 2^k - 1 for a negative rax, 0 otherwise
+static void gen_round_bias(int k) {
+    emit_ins("mov", "rdx", "rax");
+    if (k > 1) emit_ins_imm("sar", "rdx", 63);
+    emit_ins_imm("shr", "rdx", 64 - k);
+}
+
+// m and s with n / d = (hi(m * n) [+-n]) >> s, rounded towards zero;
+// 2 <= |d| < 2^63
+static void magic(long d, long *m, int *s) {
+    const unsigned long two63 = 1UL << 63;
+    unsigned long ad = d < 0 ? -(unsigned long)d : d;
+    unsigned long t = two63 + ((unsigned long)d >> 63);
+    unsigned long anc = t - 1 - t % ad; // |nc|
+    unsigned long q1 = two63 / anc, r1 = two63 - q1 * anc;
+    unsigned long q2 = two63 / ad, r2 = two63 - q2 * ad;
+    unsigned long delta;
+    int p = 63;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if (r1 >= anc) {
+            q1++;
+            r1 -= anc;
         }
-        gen_stmt(node->forstmt.body, ctx);
-        printf(".L%d.CONTINUE:\n", id);
-        if (node->forstmt.next) {
-            gen_expr(node->forstmt.next, ctx);
-            printf("  pop rax\n");
+        q2 *= 2;
+        r2 *= 2;
+        if (r2 >= ad) {
+            q2++;
+            r2 -= ad;
         }
-        printf("  jmp .L%d.FOR\n", id);
-        printf(".L%d.END:\n", id);
+        delta = ad - r2;
+    } while (q1 < delta || (q1 == delta && r1 == 0));
+    *m = d < 0 ? -(q2 + 1) : q2 + 1;
+    *s = p - 64;
+}
 
-        stack_pop(ctx->break_id_stack);
-        stack_pop(ctx->continue_id_stack);
+// c nonzero
+static void gen_div_imm(IrOp op, long c) {
+    unsigned long n = c < 0 ? -(unsigned long)c : c;
+    int k = log2_exact(n);
+    if (n == 1) {
+        if (op == IR_MOD) emit_ins("mov", "rax", "0");
+        else if (c < 0) emit_ins("neg", "rax", NULL);
         return;
-    } else if (node->tag == NT_BREAK) {
-        int goto_id = stack_top(ctx->break_id_stack);
-        printf("  jmp .L%d.END\n", goto_id);
+    }
+    if (k > 0) {
+        gen_round_bias(k);
+        emit_ins("add", "rax", "rdx");
+        if (op == IR_MOD) {
+            // the bits below the quotient, less the bias
+            emit_ins_imm("and", "rax", (long)n - 1);
+            emit_ins("sub", "rax", "rdx");
+            return;
+        }
+        emit_ins_imm("sar", "rax", k);
+        if (c < 0) emit_ins("neg", "rax", NULL);
         return;
-    } else if (node->tag == NT_CONTINUE) {
-        int goto_id = stack_top(ctx->continue_id_stack);
-        printf("  jmp .L%d.CONTINUE\n", goto_id);
+    }
+    long m;
+    int s;
+    magic(c, &m, &s);
+    emit_ins("mov", "rdi", "rax");
+    emit_ins_imm("mov", "rax", m);
+    emit_ins("imul", "rdi", NULL);
+    if (c > 0 && m < 0) emit_ins("add", "rdx", "rdi");
+    if (c < 0 && m > 0) emit_ins("sub", "rdx", "rdi");
+    if (s) emit_ins_imm("sar", "rdx", s);
+    // plus one for a negative quotient
+    emit_ins("mov", "rax", "rdx");
+    emit_ins_imm("shr", "rax", 63);
+    emit_ins("add", "rax", "rdx");
+    if (op == IR_MOD) {
+        emit_ins_imm("imul", "rax", c);
+        emit_ins("sub", "rdi", "rax");
+        emit_ins("mov", "rax", "rdi");
+    }
+}
+
+static void gen_binary(IrValue *v, GenContext *ctx) {
+    IrValue *lhs = v->args[0], *rhs = v->args[1];
+    if (v->op == IR_MUL && lhs->op == IR_CONST && rhs->op != IR_CONST) {
+        lhs = v->args[1];
+        rhs = v->args[0];
+    }
+    if (rhs->op == IR_CONST && (v->op == IR_DIV || v->op == IR_MOD) && rhs->imm && reduces(rhs->imm)) {
+        gen_operand(lhs, ctx);
+        gen_div_imm(v->op, rhs->imm);
         return;
-    } else if (node->tag == NT_LOCALDECL) return gen_lvardecl(node, ctx);
-    else if (node->tag == NT_PARAMDECL) return;
+    }
+    if (rhs->op == IR_CONST) {
+        // an immediate operand
+        gen_operand(lhs, ctx);
+        switch (v->op) {
+            case IR_ADD: emit_ins_imm("add", "rax", rhs->imm); return;
+            case IR_SUB: emit_ins_imm("sub", "rax", rhs->imm); return;
+            case IR_MUL:
+                if (reduces(rhs->imm)) gen_mul_imm(rhs->imm);
+                else emit_ins_imm("imul", "rax", rhs->imm);
+                return;
+            case IR_EQ:
+            case IR_NE:
+            case IR_LT:
+            case IR_LE:
+                emit_ins_imm("cmp", "rax", rhs->imm);
+                emit_ins(setcc(v->op), "al", NULL);
+                emit_ins("movzb", "rax", "al");
+                return;
+            default:
+                emit_ins_imm("mov", "rdi", rhs->imm);
+                break;
+        }
+    } else if (rhs->reg) {
+        gen_operand(lhs, ctx);
+        emit_ins("mov", "rdi", homereg64[rhs->reg - 1]);
+    } else if (lhs->reg) {
+        // computing rhs writes no home, so lhs can be read after it
+        gen_operand(rhs, ctx);
+        emit_ins("mov", "rdi", "rax");
+        emit_ins("mov", "rax", homereg64[lhs->reg - 1]);
+    } else {
+        gen_operand(lhs, ctx);
+        push_tmp(ctx);
+        gen_operand(rhs, ctx);
+        emit_ins("mov", "rdi", "rax");
+        pop_tmp(ctx, "rax");
+    }
 
-    // expr statement
-    gen_expr(node, ctx);
-    printf("  pop rax\n");
+    switch (v->op) {
+        case IR_ADD:
+            emit_ins("add", "rax", "rdi");
+            break;
+        case IR_SUB:
+            emit_ins("sub", "rax", "rdi");
+            break;
+        case IR_MUL:
+            emit_ins("imul", "rax", "rdi");
+            break;
+        case IR_DIV:
+        case IR_MOD:
+            emit_ins("cqo", NULL, NULL);
+            emit_ins("idiv", "rdi", NULL);
+            if (v->op == IR_MOD) emit_ins("mov", "rax", "rdx");
+            break;
+        case IR_EQ:
+        case IR_NE:
+        case IR_LT:
+        case IR_LE:
+            emit_ins("cmp", "rax", "rdi");
+            emit_ins(setcc(v->op), "al", NULL);
+            emit_ins("movzb", "rax", "al");
+            break;
+        default: panic("codegen: invalid binary op %d", v->op);
+    }
+}
+
+// value of v, computed here, to rax
+static void gen_value(IrValue *v, GenContext *ctx) {
+    switch (v->op) {
+        case IR_CONST:
+            emit_ins_imm("mov", "rax", v->imm);
+            return;
+        case IR_LOCAL: {
+            Token ident = v->var->token;
+            emit_comment("  # address of `%.*s`\n", tok_len(ident), tok_start(ident));
+            char slot[24];
+            emit_ins("lea", "rax", frame_slot(slot, v->var->offset));
+            return;
+        }
+        case IR_GLOBAL:
+        case IR_STRING: {
+            char *mem = format_addr(&(Address){.sym = v, .scale = 1}, NULL, NULL);
+            emit_ins("lea", "rax", mem);
+            free(mem);
+            return;
+        }
+        case IR_PARAM:
+            if (v->type->tag == TYP_CHAR) emit_ins("movsx", "rax", argreg8[v->imm]);
+            else if (v->type->tag == TYP_PTR) emit_ins("mov", "rax", argreg64[v->imm]);
+            else emit_ins("movsxd", "rax", argreg32[v->imm]);
+            return;
+        case IR_LOAD: {
+            char *mem = gen_addr(v->args[0], NULL, NULL, ctx);
+            gen_load(v->type, mem);
+            free(mem);
+            return;
+        }
+        case IR_STORE: {
+            IrValue *value = v->args[1];
+            char *mem = gen_addr(v->args[0], NULL, is_direct(value) ? NULL : value, ctx);
+            gen_store(v->type, mem, value);
+            free(mem);
+            return;
+        }
+        case IR_NEG:
+            gen_operand(v->args[0], ctx);
+            emit_ins("neg", "rax", NULL);
+            return;
+        case IR_NOT:
+            gen_operand(v->args[0], ctx);
+            emit_ins("cmp", "rax", "0");
+            emit_ins("sete", "al", NULL);
+            emit_ins("movzx", "rax", "al");
+            return;
+        case IR_CAST:
+            gen_operand(v->args[0], ctx);
+            if (v->type->tag == TYP_CHAR) emit_ins("movsx", "rax", "al");
+            else if (v->type->tag != TYP_PTR) emit_ins("movsxd", "rax", "eax");
+            return;
+        case IR_CALL:
+            gen_call(v, ctx);
+            return;
+        case IR_ADD:
+            if (!gen_lea(v, ctx)) gen_binary(v, ctx);
+            return;
+        case IR_SUB:
+        case IR_MUL:
+        case IR_DIV:
+        case IR_MOD:
+        case IR_EQ:
+        case IR_NE:
+        case IR_LT:
+        case IR_LE:
+            gen_binary(v, ctx);
+            return;
+        default:
+            panic("codegen: unexpected IR op %d", v->op);
+    }
+}
+
+// Switch dispatch
+//
+// with all case labels constants, the control value is compared against
+// immediates: a jump table for dense label sets, a binary search over the
+// sorted labels otherwise.
+
+#define SWITCH_MIN_CASES 4   // fewer labels: a plain compare chain
+#define SWITCH_MAX_SPARSITY 3 // table slots allowed per case label
+
+typedef struct {
+    long value;
+    int block; // id of the target
+} CaseLabel;
+
+static int caselabel_cmp(const void *a, const void *b) {
+    const CaseLabel *x = a, *y = b;
+    return x->value < y->value ? -1 : x->value > y->value;
+}
+
+// compare chain for labels[lo, hi), then binary search above that size.
+// control value in rax.
+static void gen_switch_search(CaseLabel *labels, int lo, int hi, GenContext *ctx, int id, int miss) {
+    if (hi - lo < SWITCH_MIN_CASES) {
+        for (int i = lo; i < hi; i++) {
+            emit_ins_imm("cmp", "rax", labels[i].value);
+            emit_insf("je", ".L%d.%d", ctx->func_id, labels[i].block);
+        }
+        emit_insf("jmp", ".L%d.%d", ctx->func_id, miss);
+        return;
+    }
+    int mid = (lo + hi) / 2;
+    emit_ins_imm("cmp", "rax", labels[mid].value);
+    emit_insf("je", ".L%d.%d", ctx->func_id, labels[mid].block);
+    emit_insf("jl", ".L%d.%d.LT%d", ctx->func_id, id, mid);
+    gen_switch_search(labels, mid + 1, hi, ctx, id, miss);
+    emit_label(".L%d.%d.LT%d", ctx->func_id, id, mid);
+    gen_switch_search(labels, lo, mid, ctx, id, miss);
+}
+
+// control value in rax
+static void gen_switch_table(CaseLabel *labels, int n, GenContext *ctx, int id, int miss) {
+    long min = labels[0].value;
+    long range = labels[n - 1].value - min + 1;
+    if (min != 0) emit_ins_imm("sub", "rax", min);
+    emit_ins_imm("cmp", "rax", range - 1);
+    emit_insf("ja", ".L%d.%d", ctx->func_id, miss); // also catches control < min
+    char table[64];
+    snprintf(table, sizeof(table), ".L%d.%d.TABLE[rip]", ctx->func_id, id);
+    emit_ins("lea", "rdi", table);
+    emit_ins("movsxd", "rax", "dword ptr [rdi+rax*4]");
+    emit_ins("add", "rax", "rdi");
+    emit_ins("jmp", "rax", NULL);
+
+    emit_str(".section .rodata\n");
+    emit_str("  .p2align 2\n");
+    emitf(".L%d.%d.TABLE:\n", ctx->func_id, id);
+    for (long v = 0, i = 0; v < range; v++) {
+        while (i < n && labels[i].value - min < v) i++;
+        int target = labels[i].value - min == v ? labels[i].block : miss;
+        emitf("  .long .L%d.%d-.L%d.%d.TABLE\n", ctx->func_id, target, ctx->func_id, id);
+    }
+    emit_str(".text\n");
+}
+
+// the IR keeps only the first of duplicated labels
+static void gen_switch(IrValue *sw, GenContext *ctx) {
+    int n = sw->ntargets - 1;
+    int id = sw->block->id;
+    int miss = sw->targets[n]->id;
+    CaseLabel *labels = calloc(n + 1, sizeof(CaseLabel));
+    for (int i = 0; i < n; i++) labels[i] = (CaseLabel){sw->cases[i], sw->targets[i]->id};
+    qsort(labels, n, sizeof(CaseLabel), caselabel_cmp);
+
+    gen_operand(sw->args[0], ctx);
+    long range = n ? labels[n - 1].value - labels[0].value + 1 : 0;
+    if (SWITCH_MIN_CASES <= n && range <= (long)n * SWITCH_MAX_SPARSITY)
+        gen_switch_table(labels, n, ctx, id, miss);
+    else
+        gen_switch_search(labels, 0, n, ctx, id, miss);
+    free(labels);
+}
+
+// the phis of to take their values for the edge from -> to. every value
+// is read before any home is written, as phis may use each other.
+static void gen_phi_moves(IrBlock *from, IrBlock *to, GenContext *ctx) {
+    int j = 0;
+    while (to->preds[j] != from) j++;
+    IrValue **phis = calloc(to->ninsts + 1, sizeof(IrValue *));
+    int n = 0;
+    for (int i = 0; i < to->ninsts && to->insts[i]->op == IR_PHI; i++) {
+        IrValue *phi = to->insts[i];
+        if (!needs_home(phi) || (phi->reg && phi->reg == phi->args[j]->reg)) continue; // already there
+        phis[n++] = phi;
+    }
+    for (int i = 0; i < n; i++) {
+        gen_operand(phis[i]->args[j], ctx);
+        if (i < n - 1) push_tmp(ctx);
+    }
+    for (int i = n - 1; 0 <= i; i--) {
+        if (i < n - 1) pop_tmp(ctx, "rax");
+        gen_set_home(phis[i]);
+    }
+    free(phis);
+}
+
+// next: the block laid out after this one, or NULL
+static void gen_terminator(IrValue *term, IrBlock *next, GenContext *ctx) {
+    switch (term->op) {
+        case IR_JMP:
+            gen_phi_moves(term->block, term->targets[0], ctx);
+            if (term->targets[0] != next) emit_insf("jmp", ".L%d.%d", ctx->func_id, term->targets[0]->id);
+            return;
+        case IR_BR: {
+            IrBlock *then = term->targets[0], *els = term->targets[1];
+            gen_operand(term->args[0], ctx);
+            emit_ins("cmp", "rax", "0");
+            if (next == els) {
+                emit_insf("jne", ".L%d.%d", ctx->func_id, then->id);
+                return;
+            }
+            emit_insf("je", ".L%d.%d", ctx->func_id, els->id);
+            if (next != then) emit_insf("jmp", ".L%d.%d", ctx->func_id, then->id);
+            return;
+        }
+        case IR_SWITCH:
+            gen_switch(term, ctx);
+            return;
+        case IR_RET:
+            if (term->nargs) gen_operand(term->args[0], ctx);
+            if (next) emit_insf("jmp", ".L.RETURN.%.*s", tok_len(ctx->name), tok_start(ctx->name));
+            return;
+        default:
+            panic("codegen: not a terminator: %d", term->op);
+    }
+}
+
+static void gen_block(IrBlock *block, IrBlock *next, GenContext *ctx) {
+    emit_label(".L%d.%d", ctx->func_id, block->id);
+    for (int i = 0; i < block->ninsts; i++) {
+        IrValue *v = block->insts[i];
+        if (v->inlined || is_remat(v) || v->op == IR_PHI) continue;
+        if (ir_is_terminator(v)) {
+            gen_terminator(v, next, ctx);
+            break;
+        }
+        gen_value(v, ctx);
+        if (needs_home(v)) gen_set_home(v);
+        if (ctx->depth != 0) panic("internal error: temporaries left after v%d", v->id);
+    }
 }
 
 static char *type2asm(Type *type) {
@@ -674,8 +1161,8 @@ static char *type2asm(Type *type) {
 }
 
 static void gen_globalvar(Symbol *var) {
-    printf(".data\n");
-    printf("%.*s:\n", var->token->len, var->token->start);
+    emit_str(".data\n");
+    emitf("%.*s:\n", tok_len(var->token), tok_start(var->token));
     switch (var->type->tag) {
         case TYP_VOID: panic("codegen: error at gen_globalvar");
         case TYP_CHAR:
@@ -683,18 +1170,18 @@ static void gen_globalvar(Symbol *var) {
         case TYP_INT: {
             if (var->init && var->init->tag != NT_INT) panic("expression is not supported as initializers");
             int init_val = var->init ? var->init->integer : 0;
-            printf("  %s %d\n", type2asm(var->type), init_val);
+            emitf("  %s %d\n", type2asm(var->type), init_val);
             break;
         }
         case TYP_PTR:
             if (!var->init)
-                printf("  %s %d\n", type2asm(var->type), 0);
+                emitf("  %s %d\n", type2asm(var->type), 0);
             else
                 panic("unimplemented: global pointer initializer");
             break;
         case TYP_ARRAY: {
             if (!var->init) {
-                printf("  .zero %d\n", sizeof_type(var->type));
+                emitf("  .zero %d\n", sizeof_type(var->type));
                 break;
             }
             NodeList *inits = var->init->initializers;
@@ -702,83 +1189,184 @@ static void gen_globalvar(Symbol *var) {
                 Node *init = inits->nodes[i];
                 if (init->tag != NT_INT) panic("expression is not supported as initializers");
                 int init_val = init ? init->integer : 0;
-                printf("  %s %d\n", type2asm(var->type->base), init_val);
+                emitf("  %s %d\n", type2asm(var->type->base), init_val);
             }
             break;
         }
         case TYP_STRUCT:
         case TYP_UNION:
-            printf("  .zero %d\n", sizeof_type(var->type));
+            emitf("  .zero %d\n", sizeof_type(var->type));
             break;
     }
 }
 
-static void gen_func(Node *node, GenContext *ctx) {
-    int offset = ctx->local_vars ? ctx->local_vars->offset : 0;
-    const char *name = node->func.name->main_token->start;
-    int name_len = node->func.name->main_token->len;
-    Node *body = node->func.body;
+// whether operand s names home register r, in any size
+static bool names_homereg(const char *s, int r) {
+    char *names[] = {homereg64[r], homereg32[r], homereg8[r]};
+    for (int k = 0; k < 3; k++) {
+        int len = strlen(names[k]);
+        for (const char *p = s; (p = strstr(p, names[k])); p += len)
+            if ((p == s || !isalnum(p[-1])) && !isalnum(p[len])) return true;
+    }
+    return false;
+}
 
-    printf(".globl %.*s\n", name_len, name);
-    printf(".text\n");
-    printf("%.*s:\n", name_len, name);
+// the saves and restores of the callee-saved registers at lines saves
+// and restores of list are dropped for those that nothing else uses,
+// which peephole may have made so
+static void drop_unused_saves(AsmList *list, int saves, int restores, int nsaved) {
+    for (int i = 0; i < nsaved; i++) {
+        int r = NUM_SCRATCH_HOMEREG + i;
+        bool used = false;
+        for (int j = saves + nsaved; j < restores && !used; j++) {
+            AsmLine *line = &list->lines[j];
+            if (line->kind != ASM_INS) continue;
+            used = (line->dst >= 0 && names_homereg(list->text + line->dst, r)) ||
+                   (line->src >= 0 && names_homereg(list->text + line->src, r));
+        }
+        if (used) continue;
+        list->lines[saves + i].kind = ASM_DELETED;
+        list->lines[restores + i].kind = ASM_DELETED;
+    }
+}
+
+static void gen_func(IrFunc *func, GenContext *ctx) {
+    ctx->func = func;
+    ctx->name = func->fnode->func.name->main_token;
+    const char *name = tok_start(ctx->name);
+    int name_len = tok_len(ctx->name);
+    plan_func(ctx);
+
+    emitf(".globl %.*s\n", name_len, name);
+    emit_str(".text\n");
+    emitf("%.*s:\n", name_len, name);
+
+    AsmList *list = asm_list_new();
+    emit_to_list(list);
     // prologue
-    printf("  push rbp\n");
-    printf("  mov rbp, rsp\n");
-    printf("  sub rsp, %d\n", align_n(offset, 16));
-
-    // set args
-    NodeList *params = node->func.params;
-    int nparam = params->len;
-    for (int i = 0; i < nparam; i++) {
-        Node *node = params->nodes[i];
-        Symbol *var = find_symbol(ST_LVAR, ctx->local_vars, node->ident->main_token);
-        int offset = var->offset;
-        printf("  mov rax, rbp\n");
-        printf("  sub rax, %d\n", offset);
-        printf("  push rax\n");
-        if (var->type->tag == TYP_CHAR) printf("  mov [rbp-%d], %s\n", offset, argreg8[i]);
-        else if (var->type->tag == TYP_INT || var->type->tag == TYP_ENUM) printf("  mov [rbp-%d], %s\n", offset, argreg32[i]);
-        else if (var->type->tag == TYP_PTR) printf("  mov [rbp-%d], %s\n", offset, argreg64[i]);
-        else panic("codegen: unexpected type");
-    }
-
-    if (body->tag != NT_BLOCK) panic("codegen: expected block");
-    gen_stmt(body, ctx);
+    char slot[24];
+    emit_ins("push", "rbp", NULL);
+    emit_ins("mov", "rbp", "rsp");
+    emit_ins_imm("sub", "rsp", align_n(ctx->frame, 16));
+    int saves = list->len;
+    for (int i = 0; i < ctx->nsaved; i++)
+        emit_ins("mov", frame_slot(slot, ctx->frame - 8 * i), homereg64[NUM_SCRATCH_HOMEREG + i]);
+
+    for (int i = 0; i < func->nblocks; i++)
+        gen_block(func->blocks[i], i + 1 < func->nblocks ? func->blocks[i + 1] : NULL, ctx);
 
     // epilogue
-    printf(".L.RETURN.%.*s:\n", name_len, name);
-    printf("  mov rsp, rbp\n");
-    printf("  pop rbp\n");
-    printf("  ret\n");
+    emit_label(".L.RETURN.%.*s", name_len, name);
+    int restores = list->len;
+    for (int i = 0; i < ctx->nsaved; i++)
+        emit_ins("mov", homereg64[NUM_SCRATCH_HOMEREG + i], frame_slot(slot, ctx->frame - 8 * i));
+    emit_ins("mov", "rsp", "rbp");
+    emit_ins("pop", "rbp", NULL);
+    emit_ins("ret", NULL, NULL);
+    emit_to_list(NULL);
+
+    if (peephole_on) peephole(list);
+    drop_unused_saves(list, saves, restores, ctx->nsaved);
+    emit_list(list);
+    asm_list_free(list);
 }
 
-void gen(Program *prog) {
-    printf("# COMPILED BY %s\n", COMPILER_NAME);
-    printf(".intel_syntax noprefix\n\n");
+// Parallel codegen
+//
+// functions are independent after type_funcs, so a pool of workers takes
+// them one at a time from a shared counter. each worker appends to its own
+// buffer and records where every function's code landed; the pieces are
+// then written out in source order, so the output does not depend on the
+// number of threads.
+
+int gen_threads = 0; // 0: one per online CPU
+
+typedef struct {
+    Emitter *buf; // the worker's buffer
+    int start;
+    int len;
+} FuncCode;
+
+// lines of code that are neither labels, directives nor comments
+static long count_insns(const char *s, int len) {
+    long n = 0;
+    for (const char *p = s, *end = s + len; p < end; p++) {
+        if (p[0] == ' ' && p[1] == ' ' && p[2] != '.' && p[2] != '#') n++;
+        p = memchr(p, '\n', end - p);
+        if (!p) break;
+    }
+    return n;
+}
+
+typedef struct {
+    Program *prog;
+    FuncCode *code;
+    atomic_int next;
+} GenJob;
+
+static void *gen_worker(void *arg) {
+    GenJob *job = arg;
+    Program *prog = job->prog;
+    Emitter *buf = emitter_new(-1);
+    emit_to(buf);
+    GenContext *ctx = calloc(1, sizeof(GenContext));
+    for (;;) {
+        int i = atomic_fetch_add(&job->next, 1);
+        if (prog->funcs->len <= i) break;
+        IrFunc *func = ir_build(prog->funcs->nodes[i], prog);
+        ctx->func_id = i;
+        ctx->nlabel = 0;
+        int start = buf->len;
+        gen_func(func, ctx);
+        ir_free(func);
+        emit_str("\n");
+        job->code[i] = (FuncCode){buf, start, buf->len - start};
+    }
+    free(ctx);
+    return NULL;
+}
+
+void gen(Program *prog, Emitter *e) {
+    emit_to(e);
+    emit_comment("# COMPILED BY %s\n", COMPILER_NAME);
+    emit_str(".intel_syntax noprefix\n\n");
 
     // generate strings
+    if (prog->string_tokens->len) emit_str(".section .rodata\n");
     for (int i = 0; i < prog->string_tokens->len; i++) {
-        Token *token = prog->string_tokens->tokens[i];
-        printf("%s%d:\n", str_label, i);
-        printf("  .string %.*s\n\n", token->len, token->start);
+        Token token = prog->string_tokens->tokens[i];
+        emitf("%s%d:\n", str_label, i);
+        emitf("  .string %.*s\n\n", tok_len(token), tok_start(token));
     }
 
     // generate global variables
     for (Symbol *global = prog->global_vars; global != NULL; global = global->next) {
         gen_globalvar(global);
-        printf("\n");
+        emit_str("\n");
     }
+    emit_flush();
 
     // generate functions
-    GenContext *ctx = gencontext_new(NULL, NULL, prog->global_vars,
-                                     prog->func_types, prog->defined_types);
-    for (int i = 0; i < prog->funcs->len; i++) {
-        Node *fnode = prog->funcs->nodes[i];
-        ctx->current_func = fnode;
-        ctx->local_vars = fnode->func.locals; // set local variables
-        gen_func(fnode, ctx);
-        printf("\n");
+    int nfunc = prog->funcs->len;
+    int nthread = gen_threads > 0 ? gen_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nfunc < nthread) nthread = nfunc;
+    GenJob job = {.prog = prog, .code = calloc(nfunc + 1, sizeof(FuncCode))};
+    atomic_init(&job.next, 0);
+    pthread_t *threads = calloc(nthread + 1, sizeof(pthread_t));
+    for (int i = 1; i < nthread; i++) {
+        int err = pthread_create(&threads[i], NULL, gen_worker, &job);
+        if (err) panic("cannot create thread: %s", strerror(err));
     }
-    free(ctx);
+    gen_worker(&job); // this thread works too
+    for (int i = 1; i < nthread; i++) pthread_join(threads[i], NULL);
+
+    emit_to(e);
+    for (int i = 0; i < nfunc; i++) {
+        FuncCode *code = &job.code[i];
+        emit_strn(code->buf->buf + code->start, code->len);
+        emit_flush();
+        stats.insns += count_insns(code->buf->buf + code->start, code->len);
+    }
+    free(threads);
+    free(job.code);
 }
@@ -0,0 +1,214 @@
+#include "kcc.h"
+#include <elf.h>
+
+// ELF writer
+//
+// writes an ObjectFile as an ELF64 relocatable object for x86-64.
+// .L labels are not written to the symbol table; relocations against
+// them refer to their section's symbol instead.
+
+static char *section_names[NUM_SECTIONS] = {".text", ".data", ".rodata"};
+
+typedef struct {
+    char *buf;
+    int len;
+    int capacity;
+} Buf;
+
+static void buf_reserve(Buf *b, int n) {
+    if (b->len + n <= b->capacity) return;
+    int capacity = b->capacity ? b->capacity : 1024;
+    while (capacity < b->len + n) capacity *= 2;
+    char *tmp = realloc(b->buf, capacity);
+    if (!tmp) panic("cannot reallocate memory: %s", strerror(errno));
+    b->buf = tmp;
+    b->capacity = capacity;
+}
+
+static int buf_add(Buf *b, const void *p, int n) {
+    buf_reserve(b, n);
+    int offset = b->len;
+    memcpy(b->buf + offset, p, n);
+    b->len += n;
+    return offset;
+}
+
+static void buf_align(Buf *b, int align) {
+    static const char zero[16];
+    if (b->len % align) buf_add(b, zero, align - b->len % align);
+}
+
+static int buf_add_str(Buf *b, const char *s) {
+    return buf_add(b, s, strlen(s) + 1);
+}
+
+// section header indices
+enum {
+    SHN_TEXT = 1,                          // .text, .data, .rodata
+    SHN_RELA = SHN_TEXT + NUM_SECTIONS,    // .rela.text, .rela.data, .rela.rodata
+    SHN_SYMTAB = SHN_RELA + NUM_SECTIONS,
+    SHN_STRTAB,
+    SHN_SHSTRTAB,
+    SHN_NOTE_STACK,
+    NUM_SHDR,
+};
+
+static int elf_reloc_type(RelocType type) {
+    switch (type) {
+        case RELOC_PC32:  return R_X86_64_PC32;
+        case RELOC_PLT32: return R_X86_64_PLT32;
+        case RELOC_ABS32: return R_X86_64_32;
+        case RELOC_ABS64: return R_X86_64_64;
+    }
+    return R_X86_64_NONE;
+}
+
+// the object file's bytes; free them when done
+char *elf_image(ObjectFile *obj, size_t *len) {
+    Buf symtab = {0}, strtab = {0}, shstrtab = {0};
+    buf_add_str(&strtab, "");
+    buf_add_str(&shstrtab, "");
+
+    // symbols: null, section symbols, locals, then globals
+    int *index = calloc(obj->nsym, sizeof(int));
+    Elf64_Sym null_sym = {0};
+    buf_add(&symtab, &null_sym, sizeof(null_sym));
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        Elf64_Sym sym = {0};
+        sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+        sym.st_shndx = SHN_TEXT + i;
+        buf_add(&symtab, &sym, sizeof(sym));
+    }
+    int nsym = 1 + NUM_SECTIONS;
+    int first_global = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        bool global = pass == 1;
+        if (global) first_global = nsym;
+        for (int i = 0; i < obj->nsym; i++) {
+            AsmSymbol *s = obj->syms[i];
+            if (s->is_local_label || s->is_global != global) continue;
+            if (s->section < 0 && !s->is_global) continue;
+            Elf64_Sym sym = {0};
+            sym.st_name = buf_add_str(&strtab, s->name);
+            int type = s->section < 0 ? STT_NOTYPE : s->section == SEC_TEXT ? STT_FUNC : STT_OBJECT;
+            sym.st_info = ELF64_ST_INFO(global ? STB_GLOBAL : STB_LOCAL, type);
+            sym.st_shndx = s->section < 0 ? SHN_UNDEF : SHN_TEXT + s->section;
+            sym.st_value = s->section < 0 ? 0 : s->offset;
+            buf_add(&symtab, &sym, sizeof(sym));
+            index[i] = nsym++;
+        }
+    }
+
+    Buf rela[NUM_SECTIONS] = {{0}};
+    for (int i = 0; i < obj->nreloc; i++) {
+        Reloc *r = &obj->relocs[i];
+        int sym_index;
+        long addend = r->addend;
+        if (r->sym->is_local_label) {
+            sym_index = 1 + r->sym->section;
+            addend += r->sym->offset;
+        } else {
+            sym_index = index[r->sym->id];
+        }
+        Elf64_Rela rel = {0};
+        rel.r_offset = r->offset;
+        rel.r_info = ELF64_R_INFO(sym_index, elf_reloc_type(r->type));
+        rel.r_addend = addend;
+        buf_add(&rela[r->section], &rel, sizeof(rel));
+    }
+    free(index);
+
+    // file layout: header, section contents, section header table
+    Buf file = {0};
+    Elf64_Ehdr ehdr = {0};
+    buf_add(&file, &ehdr, sizeof(ehdr));
+
+    Elf64_Shdr shdr[NUM_SHDR] = {{0}};
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        Section *sec = &obj->sections[i];
+        buf_align(&file, sec->align < 16 ? sec->align : 16);
+        Elf64_Shdr *sh = &shdr[SHN_TEXT + i];
+        sh->sh_name = buf_add_str(&shstrtab, section_names[i]);
+        sh->sh_type = SHT_PROGBITS;
+        sh->sh_flags = SHF_ALLOC | (i == SEC_TEXT ? SHF_EXECINSTR : i == SEC_DATA ? SHF_WRITE : 0);
+        sh->sh_offset = file.len;
+        sh->sh_size = sec->len;
+        sh->sh_addralign = sec->align;
+        buf_add(&file, sec->buf, sec->len);
+    }
+    for (int i = 0; i < NUM_SECTIONS; i++) {
+        char name[32];
+        snprintf(name, sizeof(name), ".rela%s", section_names[i]);
+        buf_align(&file, 8);
+        Elf64_Shdr *sh = &shdr[SHN_RELA + i];
+        sh->sh_name = buf_add_str(&shstrtab, name);
+        sh->sh_type = SHT_RELA;
+        sh->sh_flags = SHF_INFO_LINK;
+        sh->sh_offset = file.len;
+        sh->sh_size = rela[i].len;
+        sh->sh_link = SHN_SYMTAB;
+        sh->sh_info = SHN_TEXT + i;
+        sh->sh_addralign = 8;
+        sh->sh_entsize = sizeof(Elf64_Rela);
+        buf_add(&file, rela[i].buf, rela[i].len);
+        free(rela[i].buf);
+    }
+
+    buf_align(&file, 8);
+    Elf64_Shdr *sh = &shdr[SHN_SYMTAB];
+    sh->sh_name = buf_add_str(&shstrtab, ".symtab");
+    sh->sh_type = SHT_SYMTAB;
+    sh->sh_offset = file.len;
+    sh->sh_size = symtab.len;
+    sh->sh_link = SHN_STRTAB;
+    sh->sh_info = first_global;
+    sh->sh_addralign = 8;
+    sh->sh_entsize = sizeof(Elf64_Sym);
+    buf_add(&file, symtab.buf, symtab.len);
+
+    sh = &shdr[SHN_STRTAB];
+    sh->sh_name = buf_add_str(&shstrtab, ".strtab");
+    sh->sh_type = SHT_STRTAB;
+    sh->sh_offset = file.len;
+    sh->sh_size = strtab.len;
+    sh->sh_addralign = 1;
+    buf_add(&file, strtab.buf, strtab.len);
+
+    // no executable stack
+    shdr[SHN_NOTE_STACK].sh_name = buf_add_str(&shstrtab, ".note.GNU-stack");
+    shdr[SHN_NOTE_STACK].sh_type = SHT_PROGBITS;
+    shdr[SHN_NOTE_STACK].sh_offset = file.len;
+    shdr[SHN_NOTE_STACK].sh_addralign = 1;
+
+    sh = &shdr[SHN_SHSTRTAB];
+    sh->sh_name = buf_add_str(&shstrtab, ".shstrtab");
+    sh->sh_type = SHT_STRTAB;
+    sh->sh_offset = file.len;
+    sh->sh_size = shstrtab.len;
+    sh->sh_addralign = 1;
+    buf_add(&file, shstrtab.buf, shstrtab.len);
+
+    buf_align(&file, 8);
+    int shoff = buf_add(&file, shdr, sizeof(shdr));
+
+    Elf64_Ehdr *eh = (Elf64_Ehdr *)file.buf;
+    memcpy(eh->e_ident, ELFMAG, SELFMAG);
+    eh->e_ident[EI_CLASS] = ELFCLASS64;
+    eh->e_ident[EI_DATA] = ELFDATA2LSB;
+    eh->e_ident[EI_VERSION] = EV_CURRENT;
+    eh->e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    eh->e_type = ET_REL;
+    eh->e_machine = EM_X86_64;
+    eh->e_version = EV_CURRENT;
+    eh->e_shoff = shoff;
+    eh->e_ehsize = sizeof(Elf64_Ehdr);
+    eh->e_shentsize = sizeof(Elf64_Shdr);
+    eh->e_shnum = NUM_SHDR;
+    eh->e_shstrndx = SHN_SHSTRTAB;
+
+    free(symtab.buf);
+    free(strtab.buf);
+    free(shstrtab.buf);
+    *len = file.len;
+    return file.buf;
+}
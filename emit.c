@@ -0,0 +1,272 @@
+#include "kcc.h"
+
+// Emitter
+//
+// codegen appends assembly to a growable buffer instead of calling printf
+// per line. the buffer is written out with a single write(2) per function,
+// or kept whole for the assembler when the emitter has no file descriptor.
+//
+// while an AsmList is selected with emit_to_list, instructions and labels
+// are recorded there with their mnemonic and operands apart, for the
+// peephole pass; emit_list then writes them out as text.
+
+#define EMITTER_INIT_CAP (64 * 1024)
+
+bool emit_comments = true;
+
+static _Thread_local Emitter *out; // each codegen worker has its own
+static _Thread_local AsmList *list;
+
+Emitter *emitter_new(int fd) {
+    Emitter *e = calloc(1, sizeof(Emitter));
+    e->fd = fd;
+    e->capacity = EMITTER_INIT_CAP;
+    e->buf = malloc(e->capacity);
+    if (!e->buf) panic("cannot allocate memory: %s", strerror(errno));
+    count_alloc(e->capacity);
+    return e;
+}
+
+void emit_to(Emitter *e) {
+    out = e;
+}
+
+static void reserve(int n) {
+    if (out->len + n <= out->capacity) return;
+    while (out->capacity < out->len + n) out->capacity *= 2;
+    char *tmp = realloc(out->buf, out->capacity);
+    if (!tmp) panic("cannot reallocate memory: %s", strerror(errno));
+    count_alloc(out->capacity);
+    out->buf = tmp;
+}
+
+static void append(const char *s, int len) {
+    reserve(len);
+    memcpy(out->buf + out->len, s, len);
+    out->len += len;
+}
+
+// AsmList
+
+AsmList *asm_list_new(void) {
+    AsmList *l = calloc(1, sizeof(AsmList));
+    l->capacity = 256;
+    l->lines = malloc(l->capacity * sizeof(AsmLine));
+    l->text_capacity = 4096;
+    l->text = malloc(l->text_capacity);
+    if (!l->lines || !l->text) panic("cannot allocate memory: %s", strerror(errno));
+    count_alloc(l->capacity * sizeof(AsmLine));
+    count_alloc(l->text_capacity);
+    return l;
+}
+
+void asm_list_free(AsmList *l) {
+    free(l->lines);
+    free(l->text);
+    free(l);
+}
+
+// a copy of s in the list's text; returns its offset
+int asm_text(AsmList *l, const char *s, int len) {
+    if (l->text_capacity < l->text_len + len + 1) {
+        while (l->text_capacity < l->text_len + len + 1) l->text_capacity *= 2;
+        l->text = realloc(l->text, l->text_capacity);
+        if (!l->text) panic("cannot reallocate memory: %s", strerror(errno));
+        count_alloc(l->text_capacity);
+    }
+    int pos = l->text_len;
+    memcpy(l->text + pos, s, len);
+    l->text[pos + len] = '\0';
+    l->text_len += len + 1;
+    return pos;
+}
+
+static int opt_text(AsmList *l, const char *s) {
+    return s ? asm_text(l, s, strlen(s)) : -1;
+}
+
+static void add_line(AsmKind kind, int op, int dst, int src) {
+    if (list->len == list->capacity) {
+        list->capacity *= 2;
+        list->lines = realloc(list->lines, list->capacity * sizeof(AsmLine));
+        if (!list->lines) panic("cannot reallocate memory: %s", strerror(errno));
+        count_alloc(list->capacity * sizeof(AsmLine));
+    }
+    list->lines[list->len++] = (AsmLine){kind, op, dst, src};
+}
+
+// instructions, labels and text go to l until emit_to_list(NULL)
+void emit_to_list(AsmList *l) {
+    list = l;
+}
+
+// the lines of l as text, with no list selected
+void emit_list(AsmList *l) {
+    for (int i = 0; i < l->len; i++) {
+        AsmLine *line = &l->lines[i];
+        switch (line->kind) {
+            case ASM_INS:
+                emit_ins(l->text + line->op, line->dst < 0 ? NULL : l->text + line->dst,
+                         line->src < 0 ? NULL : l->text + line->src);
+                break;
+            case ASM_LABEL:
+                emit_str(l->text + line->op);
+                append(":\n", 2);
+                break;
+            case ASM_COMMENT:
+            case ASM_TEXT:
+                emit_str(l->text + line->op);
+                break;
+            case ASM_DELETED:
+                break;
+        }
+    }
+}
+
+void emit_str(const char *s) {
+    emit_strn(s, strlen(s));
+}
+
+void emit_strn(const char *s, int len) {
+    if (list) add_line(ASM_TEXT, asm_text(list, s, len), -1, -1);
+    else append(s, len);
+}
+
+// fmt formatted into buf, or into a malloc'd string when it does not fit
+static char *vformat(char *buf, size_t size, int *len, const char *fmt, va_list ap) {
+    va_list ap2;
+    va_copy(ap2, ap);
+    int n = vsnprintf(buf, size, fmt, ap);
+    char *s = (size_t)n < size ? buf : malloc(n + 1);
+    if (s != buf) vsnprintf(s, n + 1, fmt, ap2);
+    va_end(ap2);
+    *len = n;
+    return s;
+}
+
+static void emit_vf(AsmKind kind, const char *fmt, va_list ap) {
+    if (list) {
+        char buf[256];
+        int n;
+        char *s = vformat(buf, sizeof(buf), &n, fmt, ap);
+        add_line(kind, asm_text(list, s, n), -1, -1);
+        if (s != buf) free(s);
+        return;
+    }
+    va_list ap2;
+    va_copy(ap2, ap);
+    int room = out->capacity - out->len;
+    int n = vsnprintf(out->buf + out->len, room, fmt, ap);
+    if (room <= n) {
+        reserve(n + 1);
+        vsnprintf(out->buf + out->len, n + 1, fmt, ap2);
+    }
+    va_end(ap2);
+    out->len += n;
+}
+
+void emitf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    emit_vf(ASM_TEXT, fmt, ap);
+    va_end(ap);
+}
+
+void emit_comment(const char *fmt, ...) {
+    if (!emit_comments) return;
+    va_list ap;
+    va_start(ap, fmt);
+    emit_vf(ASM_COMMENT, fmt, ap);
+    va_end(ap);
+}
+
+// "name:\n"
+void emit_label(const char *fmt, ...) {
+    char buf[256];
+    int n;
+    va_list ap;
+    va_start(ap, fmt);
+    char *s = vformat(buf, sizeof(buf), &n, fmt, ap);
+    va_end(ap);
+    if (list) {
+        add_line(ASM_LABEL, asm_text(list, s, n), -1, -1);
+    } else {
+        append(s, n);
+        append(":\n", 2);
+    }
+    if (s != buf) free(s);
+}
+
+// "  op operand\n", for jumps and calls
+void emit_insf(const char *op, const char *fmt, ...) {
+    char buf[256];
+    int n;
+    va_list ap;
+    va_start(ap, fmt);
+    char *s = vformat(buf, sizeof(buf), &n, fmt, ap);
+    va_end(ap);
+    emit_ins(op, s, NULL);
+    if (s != buf) free(s);
+}
+
+static void emit_int(long val) {
+    char tmp[24];
+    int i = sizeof(tmp);
+    unsigned long u = val < 0 ? -(unsigned long)val : (unsigned long)val;
+    do {
+        tmp[--i] = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (val < 0) tmp[--i] = '-';
+    append(tmp + i, sizeof(tmp) - i);
+}
+
+// "  op dst, src\n" (or "  op dst\n" when src is NULL, "  op\n" when dst is)
+void emit_ins(const char *op, const char *dst, const char *src) {
+    if (list) {
+        add_line(ASM_INS, opt_text(list, op), opt_text(list, dst), opt_text(list, src));
+        return;
+    }
+    append("  ", 2);
+    append(op, strlen(op));
+    if (dst) {
+        append(" ", 1);
+        append(dst, strlen(dst));
+    }
+    if (src) {
+        append(", ", 2);
+        append(src, strlen(src));
+    }
+    append("\n", 1);
+}
+
+// "  op dst, imm\n"
+void emit_ins_imm(const char *op, const char *dst, long imm) {
+    if (list) {
+        char buf[24];
+        snprintf(buf, sizeof(buf), "%ld", imm);
+        emit_ins(op, dst, buf);
+        return;
+    }
+    append("  ", 2);
+    append(op, strlen(op));
+    append(" ", 1);
+    append(dst, strlen(dst));
+    append(", ", 2);
+    emit_int(imm);
+    append("\n", 1);
+}
+
+void emit_flush(void) {
+    if (out->fd < 0) return;
+    fflush(stdout); // in case anything went through stdio first
+    for (int pos = 0; pos < out->len; ) {
+        ssize_t n = write(out->fd, out->buf + pos, out->len - pos);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            panic("cannot write output: %s", strerror(errno));
+        }
+        pos += n;
+    }
+    out->len = 0;
+}
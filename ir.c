@@ -0,0 +1,844 @@
+#include "kcc.h"
+
+// Intermediate representation
+//
+// each function becomes a control-flow graph of basic blocks holding
+// instructions in SSA form: every instruction defines at most one value,
+// and values that merge at a join are IR_PHI instructions at the start of
+// the join block. locals are built as stack slots (IR_LOCAL addresses,
+// read and written with IR_LOAD and IR_STORE); ir_promote_locals then turns
+// the scalar ones whose address is not taken into values. built from the
+// typed, folded Program; codegen lowers it to x86-64.
+
+#define IR_CHUNK_SIZE (64 * 1024)
+
+// a function's IR is allocated from its own chunks, so that codegen
+// workers can build and free it without sharing an arena
+struct IrChunk {
+    IrChunk *next;
+    size_t size;
+    size_t pos;
+    _Alignas(16) char data[]; // allocations are rounded to 16, so each is aligned
+};
+
+void *ir_alloc(IrFunc *func, size_t size) {
+    size = align_n(size, 16);
+    IrChunk *chunk = func->chunks;
+    if (!chunk || chunk->size - chunk->pos < size) {
+        size_t chunk_size = size < IR_CHUNK_SIZE ? IR_CHUNK_SIZE : size;
+        chunk = calloc(1, sizeof(IrChunk) + chunk_size);
+        if (!chunk) panic("cannot allocate memory: %s", strerror(errno));
+        count_alloc(sizeof(IrChunk) + chunk_size);
+        chunk->size = chunk_size;
+        chunk->next = func->chunks;
+        func->chunks = chunk;
+    }
+    void *p = chunk->data + chunk->pos;
+    chunk->pos += size;
+    return p;
+}
+
+void ir_free(IrFunc *func) {
+    IrChunk *chunk = func->chunks;
+    while (chunk) {
+        IrChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(func);
+}
+
+// append to a growable array allocated from func
+#define IR_APPEND(func, array, len, capacity, elem) do { \
+        if ((len) == (capacity)) { \
+            int _cap = (capacity) ? (capacity) * 2 : 4; \
+            void *_new = ir_alloc(func, _cap * sizeof(*(array))); \
+            if (len) memcpy(_new, array, (len) * sizeof(*(array))); \
+            (array) = _new; \
+            (capacity) = _cap; \
+        } \
+        (array)[(len)++] = (elem); \
+    } while (0)
+
+bool ir_is_terminator(IrValue *v) {
+    return v->op == IR_JMP || v->op == IR_BR || v->op == IR_SWITCH || v->op == IR_RET;
+}
+
+// the block's last instruction, if it ends the block
+IrValue *ir_terminator(IrBlock *block) {
+    if (block->ninsts == 0) return NULL;
+    IrValue *last = block->insts[block->ninsts - 1];
+    return ir_is_terminator(last) ? last : NULL;
+}
+
+IrValue *ir_value_new(IrFunc *func, IrOp op, Type *type, int nargs) {
+    IrValue *v = ir_alloc(func, sizeof(IrValue));
+    v->op = op;
+    v->id = func->nvalues++;
+    v->type = type;
+    v->nargs = nargs;
+    if (nargs) v->args = ir_alloc(func, nargs * sizeof(IrValue *));
+    return v;
+}
+
+static IrBlock *block_new(IrFunc *func) {
+    IrBlock *block = ir_alloc(func, sizeof(IrBlock));
+    block->id = func->nblock_ids++;
+    IR_APPEND(func, func->blocks, func->nblocks, func->blocks_capacity, block);
+    return block;
+}
+
+static void add_pred(IrFunc *func, IrBlock *block, IrBlock *pred) {
+    IR_APPEND(func, block->preds, block->npreds, block->preds_capacity, pred);
+}
+
+// the edge from -> from's succ-th target gets a block of its own, which
+// jumps on. the new block is laid out last.
+IrBlock *ir_split_edge(IrFunc *func, IrBlock *from, int succ) {
+    IrValue *term = ir_terminator(from);
+    IrBlock *to = term->targets[succ];
+    IrBlock *mid = block_new(func);
+    IrValue *jmp = ir_value_new(func, IR_JMP, NULL, 0);
+    jmp->block = mid;
+    jmp->targets = ir_alloc(func, sizeof(IrBlock *));
+    jmp->targets[0] = to;
+    jmp->ntargets = 1;
+    IR_APPEND(func, mid->insts, mid->ninsts, mid->insts_capacity, jmp);
+    add_pred(func, mid, from);
+    term->targets[succ] = mid;
+    for (int i = 0; i < to->npreds; i++) {
+        if (to->preds[i] != from) continue;
+        to->preds[i] = mid;
+        break;
+    }
+    return mid;
+}
+
+// Building
+
+typedef struct {
+    IrFunc *func;
+    IrBlock *block; // where instructions are appended
+    Program *prog;
+    HashMap *local_map;
+    // ids of the enclosing break and continue targets. while building,
+    // a block's id is its index in func->blocks.
+    Stack *break_ids;
+    Stack *continue_ids;
+} IrBuilder;
+
+static IrValue *build_expr(IrBuilder *b, Node *node);
+static void build_stmt(IrBuilder *b, Node *node);
+
+static IrValue *value_new(IrBuilder *b, IrOp op, Type *type, int nargs) {
+    return ir_value_new(b->func, op, type, nargs);
+}
+
+// append v to the current block. code after a jump (after return, break
+// or continue) goes to a block without predecessors, removed later.
+static IrValue *add_inst(IrBuilder *b, IrValue *v) {
+    if (ir_terminator(b->block)) b->block = block_new(b->func);
+    IrBlock *block = b->block;
+    v->block = block;
+    IR_APPEND(b->func, block->insts, block->ninsts, block->insts_capacity, v);
+    return v;
+}
+
+static IrValue *inst0(IrBuilder *b, IrOp op, Type *type) {
+    return add_inst(b, value_new(b, op, type, 0));
+}
+
+static IrValue *inst1(IrBuilder *b, IrOp op, Type *type, IrValue *x) {
+    IrValue *v = value_new(b, op, type, 1);
+    v->args[0] = x;
+    return add_inst(b, v);
+}
+
+static IrValue *inst2(IrBuilder *b, IrOp op, Type *type, IrValue *lhs, IrValue *rhs) {
+    IrValue *v = value_new(b, op, type, 2);
+    v->args[0] = lhs;
+    v->args[1] = rhs;
+    return add_inst(b, v);
+}
+
+static IrValue *const_int(IrBuilder *b, long imm) {
+    IrValue *v = inst0(b, IR_CONST, type_int);
+    v->imm = imm;
+    return v;
+}
+
+static IrValue *load(IrBuilder *b, Type *type, IrValue *addr) {
+    switch (type->tag) {
+        case TYP_VOID: panic("invalid load target: void");
+        case TYP_ARRAY: return addr; // an array is its address
+        case TYP_STRUCT: panic("invalid load target: struct");
+        case TYP_UNION: panic("invalid load target: union");
+        default: return inst1(b, IR_LOAD, type, addr);
+    }
+}
+
+static void store(IrBuilder *b, Type *type, IrValue *addr, IrValue *val) {
+    switch (type->tag) {
+        case TYP_VOID: panic("invalid store target: void");
+        case TYP_ARRAY: panic("invalid store target: array");
+        case TYP_STRUCT: panic("invalid store target: struct");
+        case TYP_UNION: panic("invalid store target: union");
+        default: inst2(b, IR_STORE, type, addr, val);
+    }
+}
+
+static IrValue *terminate(IrBuilder *b, IrOp op, IrValue *x, int ntargets) {
+    IrValue *v = value_new(b, op, NULL, x ? 1 : 0);
+    if (x) v->args[0] = x;
+    v->ntargets = ntargets;
+    if (ntargets) v->targets = ir_alloc(b->func, ntargets * sizeof(IrBlock *));
+    return add_inst(b, v);
+}
+
+static void jump(IrBuilder *b, IrBlock *target) {
+    IrValue *v = terminate(b, IR_JMP, NULL, 1);
+    v->targets[0] = target;
+    add_pred(b->func, target, v->block);
+}
+
+static void branch(IrBuilder *b, IrValue *cond, IrBlock *then, IrBlock *els) {
+    IrValue *v = terminate(b, IR_BR, cond, 2);
+    v->targets[0] = then;
+    v->targets[1] = els;
+    add_pred(b->func, then, v->block);
+    add_pred(b->func, els, v->block);
+}
+
+// continue in block; the current block falls through to it
+static void start(IrBuilder *b, IrBlock *block) {
+    if (!ir_terminator(b->block)) jump(b, block);
+    b->block = block;
+}
+
+static IrValue *build_addr(IrBuilder *b, Node *node) {
+    switch (node->tag) {
+        case NT_IDENT: {
+            Symbol *var = find_symbol(ST_LVAR, b->local_map, node->main_token);
+            if (var) {
+                IrValue *v = inst0(b, IR_LOCAL, var->type);
+                v->var = var;
+                return v;
+            }
+            var = find_symbol(ST_GVAR, b->prog->global_map, node->main_token);
+            if (!var) panic("undefined variable");
+            IrValue *v = inst0(b, IR_GLOBAL, var->type);
+            v->name = var->token;
+            return v;
+        }
+        case NT_DEREF:
+            return build_expr(b, node->unary_expr);
+        case NT_STRING: {
+            IrValue *v = inst0(b, IR_STRING, node->type);
+            v->imm = node->index;
+            return v;
+        }
+        case NT_DOT:
+        case NT_ARROW: {
+            Node *lhs = node->member_access.lhs;
+            Type *type = node->tag == NT_DOT ? lhs->type : lhs->type->base;
+            int offset = 0;
+            if (!find_member(type, node->member_access.member->main_token, &offset)) panic("wrong member");
+            IrValue *base = node->tag == NT_DOT ? build_addr(b, lhs) : build_expr(b, lhs);
+            if (offset == 0) return base;
+            return inst2(b, IR_ADD, node->type, base, const_int(b, offset));
+        }
+        default:
+            panic("unexpected node NodeTag=%d", node->tag);
+    }
+    return NULL;
+}
+
+// i * sizeof(*ptr), for pointer arithmetic
+static IrValue *scale(IrBuilder *b, IrValue *i, Type *ptr) {
+    int size = sizeof_type(ptr->base);
+    if (size == 1) return i;
+    return inst2(b, IR_MUL, i->type, i, const_int(b, size));
+}
+
+static IrOp binary_op(NodeTag tag) {
+    switch (tag) {
+        case NT_ADD: case NT_ASSIGN_ADD: case NT_PREINC: case NT_POSTINC: return IR_ADD;
+        case NT_SUB: case NT_ASSIGN_SUB: case NT_PREDEC: case NT_POSTDEC: return IR_SUB;
+        case NT_MUL: case NT_ASSIGN_MUL: return IR_MUL;
+        case NT_DIV: case NT_ASSIGN_DIV: return IR_DIV;
+        case NT_MOD: return IR_MOD;
+        case NT_EQ: return IR_EQ;
+        case NT_NE: return IR_NE;
+        case NT_LT: return IR_LT;
+        case NT_LE: return IR_LE;
+        default: panic("internal error: not a binary operator: NodeTag=%d", tag);
+    }
+    return IR_ADD;
+}
+
+static IrValue *build_binary(IrBuilder *b, Node *node) {
+    Node *lhs = node->bin_expr.lhs, *rhs = node->bin_expr.rhs;
+    IrValue *l = build_expr(b, lhs);
+    IrValue *r = build_expr(b, rhs);
+    Type *lt = lhs->type, *rt = rhs->type;
+    IrOp op = binary_op(node->tag);
+    if (is_ptr_or_arr(lt) && is_integer(rt)) {
+        // ptr +/- int
+        if (op != IR_ADD && op != IR_SUB && op != IR_EQ && op != IR_NE)
+            panic("codegen: invalid operands (pointer op int)");
+        if (op == IR_ADD || op == IR_SUB) r = scale(b, r, lt);
+    } else if (is_integer(lt) && is_ptr_or_arr(rt)) {
+        // int + ptr
+        if (op != IR_ADD) panic("codegen: invalid operands (int op pointer)");
+        l = scale(b, l, rt);
+    } else if (is_ptr_or_arr(lt) && is_ptr_or_arr(rt)) {
+        // ptr - ptr
+        if (op == IR_SUB) {
+            IrValue *diff = inst2(b, IR_SUB, node->type, l, r);
+            int size = sizeof_type(lt->base);
+            return size == 1 ? diff : inst2(b, IR_DIV, node->type, diff, const_int(b, size));
+        }
+        if (op != IR_EQ && op != IR_NE && op != IR_LT && op != IR_LE)
+            panic("codegen: invalid operands (pointer op pointer)");
+    }
+    return inst2(b, op, node->type, l, r);
+}
+
+// x = y, x op= y: the value is the one stored
+static IrValue *build_assign(IrBuilder *b, Node *node) {
+    Node *lhs = node->bin_expr.lhs;
+    IrValue *addr = build_addr(b, lhs);
+    if (node->tag == NT_ASSIGN) {
+        IrValue *val = build_expr(b, node->bin_expr.rhs);
+        store(b, node->type, addr, val);
+        return val;
+    }
+    // x is read before y is evaluated; the two are unsequenced
+    IrValue *old = load(b, node->type, addr);
+    IrValue *val = build_expr(b, node->bin_expr.rhs);
+    Type *lt = lhs->type;
+    if (is_ptr_or_arr(lt) && is_integer(node->bin_expr.rhs->type)) {
+        // ptr +=/-= int
+        if (node->tag != NT_ASSIGN_ADD && node->tag != NT_ASSIGN_SUB)
+            panic("codegen: invalid operands (ptr op ptr)");
+        val = scale(b, val, lt);
+    }
+    val = inst2(b, binary_op(node->tag), node->type, old, val);
+    store(b, node->type, addr, val);
+    return val;
+}
+
+// ++x, --x, x++, x--
+static IrValue *build_incdec(IrBuilder *b, Node *node) {
+    bool prefix = node->tag == NT_PREINC || node->tag == NT_PREDEC;
+    Node *operand = prefix ? node->unary_expr : node->pre_expr;
+    Type *type = operand->type;
+    IrValue *addr = build_addr(b, operand);
+    IrValue *old = load(b, type, addr);
+    IrValue *one = const_int(b, is_ptr_or_arr(type) ? sizeof_type(type->base) : 1);
+    IrValue *new = inst2(b, binary_op(node->tag), type, old, one);
+    store(b, type, addr, new);
+    return prefix ? new : old;
+}
+
+// phi of a two-way join, in the order of the join's predecessors
+static IrValue *phi2(IrBuilder *b, Type *type, IrBlock *from0, IrValue *v0, IrValue *v1) {
+    IrValue *phi = value_new(b, IR_PHI, type, 2);
+    IrBlock *join = b->block;
+    phi->args[0] = join->preds[0] == from0 ? v0 : v1;
+    phi->args[1] = join->preds[0] == from0 ? v1 : v0;
+    return add_inst(b, phi);
+}
+
+// a && b, a || b: 0 or 1, and b is evaluated only when needed
+static IrValue *build_logical(IrBuilder *b, Node *node) {
+    bool and = node->tag == NT_AND;
+    IrValue *l = build_expr(b, node->bin_expr.lhs);
+    IrValue *shortcut = const_int(b, and ? 0 : 1);
+    IrBlock *from = b->block;
+    IrBlock *rhs = block_new(b->func);
+    IrBlock *end = block_new(b->func);
+    if (and) branch(b, l, rhs, end);
+    else branch(b, l, end, rhs);
+    b->block = rhs;
+    IrValue *r = build_expr(b, node->bin_expr.rhs);
+    r = inst2(b, IR_NE, type_int, r, const_int(b, 0));
+    start(b, end);
+    return phi2(b, type_int, from, shortcut, r);
+}
+
+static IrValue *build_cond(IrBuilder *b, Node *node) {
+    IrValue *cond = build_expr(b, node->cond_expr.cond);
+    IrBlock *then = block_new(b->func);
+    IrBlock *els = block_new(b->func);
+    IrBlock *end = block_new(b->func);
+    branch(b, cond, then, els);
+    b->block = then;
+    IrValue *t = build_expr(b, node->cond_expr.then);
+    IrBlock *then_end = b->block;
+    jump(b, end);
+    b->block = els;
+    IrValue *e = build_expr(b, node->cond_expr.els);
+    start(b, end);
+    if (node->type->tag == TYP_VOID) return NULL;
+    return phi2(b, node->type, then_end, t, e);
+}
+
+static IrValue *build_fncall(IrBuilder *b, Node *node) {
+    Node **nodes = node->fncall.args->nodes;
+    int narg = node->fncall.args->len;
+    if (6 < narg) panic("too many args");
+    IrValue *call = value_new(b, IR_CALL, node->type, narg);
+    call->name = node->main_token;
+    // right to left, as before the IR
+    for (int i = narg - 1; 0 <= i; i--) call->args[i] = build_expr(b, nodes[i]);
+    return add_inst(b, call);
+}
+
+static IrValue *build_expr(IrBuilder *b, Node *node) {
+    switch (node->tag) {
+        case NT_INT:
+            return const_int(b, node->integer);
+        case NT_IDENT: {
+            // enum constants are normally folded away by optimize()
+            Symbol *mem = NULL;
+            if (!find_symbol(ST_LVAR, b->local_map, node->main_token)
+                && !find_symbol(ST_GVAR, b->prog->global_map, node->main_token))
+                mem = find_enum_val(b->prog->enum_map, node->main_token);
+            if (mem) return const_int(b, mem->value);
+            return load(b, node->type, build_addr(b, node));
+        }
+        case NT_DOT:
+        case NT_ARROW:
+            return load(b, node->type, build_addr(b, node));
+        case NT_STRING:
+            return build_addr(b, node);
+        case NT_NEG:
+            return inst1(b, IR_NEG, node->type, build_expr(b, node->unary_expr));
+        case NT_BOOL_NOT:
+            return inst1(b, IR_NOT, type_int, build_expr(b, node->unary_expr));
+        case NT_ADDR:
+            return build_addr(b, node->unary_expr);
+        case NT_DEREF:
+            return load(b, node->type, build_expr(b, node->unary_expr));
+        case NT_SIZEOF:
+            return const_int(b, sizeof_type(node->unary_expr->type));
+        case NT_PREINC:
+        case NT_PREDEC:
+        case NT_POSTINC:
+        case NT_POSTDEC:
+            return build_incdec(b, node);
+        case NT_ASSIGN:
+        case NT_ASSIGN_ADD:
+        case NT_ASSIGN_SUB:
+        case NT_ASSIGN_MUL:
+        case NT_ASSIGN_DIV:
+            return build_assign(b, node);
+        case NT_FNCALL:
+            return build_fncall(b, node);
+        case NT_COMMA:
+            build_expr(b, node->bin_expr.lhs);
+            return build_expr(b, node->bin_expr.rhs);
+        case NT_ADD:
+        case NT_SUB:
+        case NT_MUL:
+        case NT_DIV:
+        case NT_MOD:
+        case NT_EQ:
+        case NT_NE:
+        case NT_LT:
+        case NT_LE:
+            return build_binary(b, node);
+        case NT_COND:
+            return build_cond(b, node);
+        case NT_AND:
+        case NT_OR:
+            return build_logical(b, node);
+        default:
+            panic("codegen: error at gen_expr");
+    }
+    return NULL;
+}
+
+static void build_lvardecl(IrBuilder *b, Node *node) {
+    NodeList *declarators = node->declarators;
+    for (int i = 0; i < declarators->len; i++) {
+        Node *name = declarators->nodes[i]->declarator.name;
+        Node *init = declarators->nodes[i]->declarator.init;
+        if (!init) continue;
+        if (init->tag != NT_INITS) {
+            IrValue *addr = build_addr(b, name);
+            store(b, name->type, addr, build_expr(b, init));
+            continue;
+        }
+        Type *base = name->type->base;
+        for (int j = 0; j < init->initializers->len; j++) {
+            IrValue *val = build_expr(b, init->initializers->nodes[j]);
+            IrValue *addr = build_addr(b, name);
+            if (j) addr = inst2(b, IR_ADD, name->type, addr, const_int(b, sizeof_type(base) * j));
+            store(b, base, addr, val);
+        }
+    }
+}
+
+// a jump table or a search when every label is a constant, else a chain
+// of comparisons
+static void build_switch(IrBuilder *b, Node *node) {
+    NodeList *cases = node->switchstmt.cases;
+    IrValue *control = build_expr(b, node->switchstmt.control);
+    IrBlock *dispatch = b->block;
+    IrBlock **blocks = calloc(cases->len + 1, sizeof(IrBlock *));
+    for (int i = 0; i < cases->len; i++) blocks[i] = block_new(b->func);
+    IrBlock *end = block_new(b->func);
+    IrBlock *miss = end;
+    bool all_const = true;
+    int nlabel = 0;
+    for (int i = 0; i < cases->len; i++) {
+        Node *constant = cases->nodes[i]->caseblock.constant;
+        if (!constant) miss = blocks[i]; // default:
+        else if (constant->tag != NT_INT) all_const = false;
+        else nlabel++;
+    }
+
+    if (all_const) {
+        // keep the first of duplicated labels
+        IrValue *sw = terminate(b, IR_SWITCH, control, nlabel + 1);
+        sw->cases = ir_alloc(b->func, (nlabel + 1) * sizeof(long));
+        int n = 0;
+        for (int i = 0; i < cases->len; i++) {
+            Node *constant = cases->nodes[i]->caseblock.constant;
+            if (!constant) continue;
+            bool dup = false;
+            for (int j = 0; j < n; j++) dup |= sw->cases[j] == constant->integer;
+            if (dup) continue;
+            sw->cases[n] = constant->integer;
+            sw->targets[n++] = blocks[i];
+        }
+        sw->targets[n] = miss;
+        sw->ntargets = n + 1;
+        for (int i = 0; i < sw->ntargets; i++) add_pred(b->func, sw->targets[i], dispatch);
+    } else {
+        for (int i = 0; i < cases->len; i++) {
+            Node *constant = cases->nodes[i]->caseblock.constant;
+            if (!constant) continue;
+            IrValue *eq = inst2(b, IR_EQ, type_int, control, build_expr(b, constant));
+            IrBlock *next = block_new(b->func);
+            branch(b, eq, blocks[i], next);
+            b->block = next;
+        }
+        jump(b, miss);
+    }
+
+    stack_push(b->break_ids, end->id);
+    for (int i = 0; i < cases->len; i++) {
+        start(b, blocks[i]);
+        build_stmt(b, cases->nodes[i]);
+    }
+    start(b, end);
+    stack_pop(b->break_ids);
+    free(blocks);
+}
+
+static void build_loop_body(IrBuilder *b, Node *body, IrBlock *brk, IrBlock *cont) {
+    stack_push(b->break_ids, brk->id);
+    stack_push(b->continue_ids, cont->id);
+    build_stmt(b, body);
+    stack_pop(b->break_ids);
+    stack_pop(b->continue_ids);
+}
+
+static void build_stmt(IrBuilder *b, Node *node) {
+    if (!node) return;
+    switch (node->tag) {
+        case NT_RETURN:
+            terminate(b, IR_RET, node->unary_expr ? build_expr(b, node->unary_expr) : NULL, 0);
+            return;
+        case NT_BLOCK:
+            for (int i = 0; i < node->block->len; i++) build_stmt(b, node->block->nodes[i]);
+            return;
+        case NT_IF: {
+            IrValue *cond = build_expr(b, node->ifstmt.cond);
+            IrBlock *then = block_new(b->func);
+            IrBlock *els = node->ifstmt.els ? block_new(b->func) : NULL;
+            IrBlock *end = block_new(b->func);
+            branch(b, cond, then, els ? els : end);
+            b->block = then;
+            build_stmt(b, node->ifstmt.then);
+            if (els) {
+                if (!ir_terminator(b->block)) jump(b, end);
+                b->block = els;
+                build_stmt(b, node->ifstmt.els);
+            }
+            start(b, end);
+            return;
+        }
+        case NT_WHILE: {
+            IrBlock *head = block_new(b->func);
+            IrBlock *body = block_new(b->func);
+            IrBlock *end = block_new(b->func);
+            start(b, head);
+            branch(b, build_expr(b, node->whilestmt.cond), body, end);
+            b->block = body;
+            build_loop_body(b, node->whilestmt.body, end, head);
+            jump(b, head);
+            b->block = end;
+            return;
+        }
+        case NT_DO_WHILE: {
+            IrBlock *body = block_new(b->func);
+            IrBlock *cont = block_new(b->func);
+            IrBlock *end = block_new(b->func);
+            start(b, body);
+            build_loop_body(b, node->whilestmt.body, end, cont);
+            start(b, cont);
+            branch(b, build_expr(b, node->whilestmt.cond), body, end);
+            b->block = end;
+            return;
+        }
+        case NT_FOR: {
+            Node *def = node->forstmt.def;
+            if (def && def->tag == NT_LOCALDECL) build_lvardecl(b, def);
+            else if (def) build_expr(b, def);
+            IrBlock *head = block_new(b->func);
+            IrBlock *body = block_new(b->func);
+            IrBlock *cont = block_new(b->func);
+            IrBlock *end = block_new(b->func);
+            start(b, head);
+            if (node->forstmt.cond) {
+                branch(b, build_expr(b, node->forstmt.cond), body, end);
+                b->block = body;
+            } else {
+                start(b, body);
+            }
+            build_loop_body(b, node->forstmt.body, end, cont);
+            start(b, cont);
+            if (node->forstmt.next) build_expr(b, node->forstmt.next);
+            jump(b, head);
+            b->block = end;
+            return;
+        }
+        case NT_SWITCH:
+            build_switch(b, node);
+            return;
+        case NT_CASE:
+            for (int i = 0; i < node->caseblock.stmts->len; i++) build_stmt(b, node->caseblock.stmts->nodes[i]);
+            return;
+        case NT_BREAK:
+            jump(b, b->func->blocks[stack_top(b->break_ids)]);
+            return;
+        case NT_CONTINUE:
+            jump(b, b->func->blocks[stack_top(b->continue_ids)]);
+            return;
+        case NT_LOCALDECL:
+            build_lvardecl(b, node);
+            return;
+        case NT_PARAMDECL:
+            return;
+        default:
+            build_expr(b, node); // expression statement
+            return;
+    }
+}
+
+// drops the blocks that cannot be reached from the entry, and the phi
+// operands that came from them
+static void remove_unreachable(IrFunc *func) {
+    bool *reached = calloc(func->nblock_ids, sizeof(bool));
+    IrBlock **work = calloc(func->nblock_ids, sizeof(IrBlock *));
+    int nwork = 0;
+    reached[func->blocks[0]->id] = true;
+    work[nwork++] = func->blocks[0];
+    while (nwork) {
+        IrValue *term = ir_terminator(work[--nwork]);
+        for (int i = 0; term && i < term->ntargets; i++) {
+            IrBlock *succ = term->targets[i];
+            if (reached[succ->id]) continue;
+            reached[succ->id] = true;
+            work[nwork++] = succ;
+        }
+    }
+
+    int n = 0;
+    for (int i = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        if (!reached[block->id]) continue;
+        func->blocks[n++] = block;
+        int m = 0;
+        for (int j = 0; j < block->npreds; j++) {
+            if (!reached[block->preds[j]->id]) continue;
+            for (int k = 0; k < block->ninsts && block->insts[k]->op == IR_PHI; k++)
+                block->insts[k]->args[m] = block->insts[k]->args[j];
+            block->preds[m++] = block->preds[j];
+        }
+        for (int k = 0; k < block->ninsts && block->insts[k]->op == IR_PHI; k++) block->insts[k]->nargs = m;
+        block->npreds = m;
+    }
+    func->nblocks = n;
+    free(reached);
+    free(work);
+}
+
+// a division may trap, so it stays even when unused
+static bool has_effect(IrValue *v) {
+    return v->op == IR_STORE || v->op == IR_CALL || v->op == IR_DIV || v->op == IR_MOD || ir_is_terminator(v);
+}
+
+// drops the instructions without effect whose values are never used,
+// including phis that only feed each other around a loop
+static void remove_dead(IrFunc *func) {
+    bool *live = calloc(func->nvalues, sizeof(bool));
+    IrValue **work = calloc(func->nvalues, sizeof(IrValue *));
+    int nwork = 0;
+    for (int i = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        for (int j = 0; j < block->ninsts; j++) {
+            IrValue *v = block->insts[j];
+            if (!has_effect(v)) continue;
+            live[v->id] = true;
+            work[nwork++] = v;
+        }
+    }
+    while (nwork) {
+        IrValue *v = work[--nwork];
+        for (int k = 0; k < v->nargs; k++) {
+            IrValue *arg = v->args[k];
+            if (live[arg->id]) continue;
+            live[arg->id] = true;
+            work[nwork++] = arg;
+        }
+    }
+    for (int i = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        int n = 0;
+        for (int j = 0; j < block->ninsts; j++)
+            if (live[block->insts[j]->id]) block->insts[n++] = block->insts[j];
+        block->ninsts = n;
+    }
+    free(live);
+    free(work);
+}
+
+static void count_uses(IrFunc *func) {
+    for (int i = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        for (int j = 0; j < block->ninsts; j++) block->insts[j]->nuses = 0;
+    }
+    for (int i = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        for (int j = 0; j < block->ninsts; j++) {
+            IrValue *v = block->insts[j];
+            for (int k = 0; k < v->nargs; k++) v->args[k]->nuses++;
+        }
+    }
+}
+
+IrFunc *ir_build(Node *fnode, Program *prog) {
+    IrFunc *func = calloc(1, sizeof(IrFunc));
+    func->fnode = fnode;
+    IrBuilder b = {
+        .func = func,
+        .prog = prog,
+        .local_map = fnode->func.local_map,
+        .break_ids = stack_new(LOOP_STACK_SIZE),
+        .continue_ids = stack_new(LOOP_STACK_SIZE),
+    };
+    b.block = block_new(func);
+
+    // arguments are stored to their locals in order, before anything else
+    // can overwrite their registers
+    NodeList *params = fnode->func.params;
+    for (int i = 0; i < params->len; i++) {
+        Symbol *var = find_symbol(ST_LVAR, b.local_map, params->nodes[i]->ident->main_token);
+        if (!is_scalar(var->type)) panic("codegen: unexpected type");
+        IrValue *addr = inst0(&b, IR_LOCAL, var->type);
+        addr->var = var;
+        IrValue *arg = inst0(&b, IR_PARAM, var->type);
+        arg->imm = i;
+        store(&b, var->type, addr, arg);
+    }
+
+    Node *body = fnode->func.body;
+    if (body->tag != NT_BLOCK) panic("codegen: expected block");
+    build_stmt(&b, body);
+    if (!ir_terminator(b.block)) terminate(&b, IR_RET, NULL, 0);
+
+    stack_free(b.break_ids);
+    stack_free(b.continue_ids);
+    remove_unreachable(func);
+    ir_promote_locals(func);
+    remove_dead(func);
+    count_uses(func);
+    return func;
+}
+
+// Printing
+
+static char *op_names[] = {
+    [IR_CONST] = "const", [IR_LOCAL] = "local", [IR_GLOBAL] = "global", [IR_STRING] = "string",
+    [IR_PARAM] = "param", [IR_LOAD] = "load", [IR_STORE] = "store",
+    [IR_ADD] = "add", [IR_SUB] = "sub", [IR_MUL] = "mul", [IR_DIV] = "div", [IR_MOD] = "mod",
+    [IR_EQ] = "eq", [IR_NE] = "ne", [IR_LT] = "lt", [IR_LE] = "le",
+    [IR_NEG] = "neg", [IR_NOT] = "not", [IR_CAST] = "cast", [IR_CALL] = "call", [IR_PHI] = "phi",
+    [IR_JMP] = "jmp", [IR_BR] = "br", [IR_SWITCH] = "switch", [IR_RET] = "ret",
+};
+
+static char *type_name(Type *type) {
+    switch (type->tag) {
+        case TYP_CHAR: return "char";
+        case TYP_INT:
+        case TYP_ENUM: return "int";
+        case TYP_PTR: return "ptr";
+        default: return "?";
+    }
+}
+
+static void print_value(IrValue *v, FILE *fp) {
+    fprintf(fp, "  ");
+    if (v->nuses) fprintf(fp, "v%d = ", v->id);
+    fprintf(fp, "%s", op_names[v->op]);
+    switch (v->op) {
+        case IR_CONST: fprintf(fp, " %ld", v->imm); break;
+        case IR_LOCAL: fprintf(fp, " %.*s", tok_len(v->var->token), tok_start(v->var->token)); break;
+        case IR_GLOBAL: fprintf(fp, " %.*s", tok_len(v->name), tok_start(v->name)); break;
+        case IR_STRING: fprintf(fp, " .L.STR%ld", v->imm); break;
+        case IR_PARAM: fprintf(fp, " %ld %s", v->imm, type_name(v->type)); break;
+        case IR_LOAD:
+        case IR_STORE:
+        case IR_CAST: fprintf(fp, " %s", type_name(v->type)); break;
+        case IR_CALL: fprintf(fp, " %.*s", tok_len(v->name), tok_start(v->name)); break;
+        default: break;
+    }
+    for (int i = 0; i < v->nargs; i++) {
+        fprintf(fp, "%s v%d", i ? "," : "", v->args[i]->id);
+        if (v->op == IR_PHI) fprintf(fp, " b%d", v->block->preds[i]->id);
+    }
+    if (v->op == IR_SWITCH) {
+        for (int i = 0; i < v->ntargets - 1; i++) fprintf(fp, ", %ld b%d", v->cases[i], v->targets[i]->id);
+        fprintf(fp, ", default b%d", v->targets[v->ntargets - 1]->id);
+    } else {
+        for (int i = 0; i < v->ntargets; i++) fprintf(fp, "%s b%d", i || v->nargs ? "," : "", v->targets[i]->id);
+    }
+    fprintf(fp, "\n");
+}
+
+void ir_print(IrFunc *func, FILE *fp) {
+    Token name = func->fnode->func.name->main_token;
+    fprintf(fp, "function %.*s\n", tok_len(name), tok_start(name));
+    for (int i = 0; i < func->nblocks; i++) {
+        IrBlock *block = func->blocks[i];
+        fprintf(fp, "b%d:", block->id);
+        for (int j = 0; j < block->npreds; j++) fprintf(fp, "%s b%d", j ? "," : " # preds", block->preds[j]->id);
+        fprintf(fp, "\n");
+        for (int j = 0; j < block->ninsts; j++) print_value(block->insts[j], fp);
+    }
+}
+
+// --emit-ir
+void emit_ir(Program *prog, FILE *fp) {
+    for (int i = 0; i < prog->funcs->len; i++) {
+        IrFunc *func = ir_build(prog->funcs->nodes[i], prog);
+        if (i) fprintf(fp, "\n");
+        ir_print(func, fp);
+        ir_free(func);
+    }
+}
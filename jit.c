@@ -0,0 +1,109 @@
+#define _GNU_SOURCE // RTLD_DEFAULT, MAP_ANONYMOUS
+#include "kcc.h"
+#include <dlfcn.h>
+#include <sys/mman.h>
+
+// JIT
+//
+// loads an ObjectFile into memory and calls its main. sections are placed
+// in one mapping, each on its own pages so that .text can be made
+// executable and .rodata read-only after relocation. undefined symbols are
+// looked up with dlsym; calls to them go through a stub that jumps via a
+// 64-bit address, since the library may be mapped out of rel32 range.
+
+#define STUB_SIZE 16 // jmp [rip+2]; 2 bytes of padding; .quad addr
+
+typedef struct {
+    char *base[NUM_SECTIONS];
+    char *stubs;  // at the end of .text
+    int nstub;
+} Image;
+
+static long page_align(long n) {
+    long page = sysconf(_SC_PAGESIZE);
+    return (n + page - 1) / page * page;
+}
+
+static char *symbol_addr(Image *img, AsmSymbol *sym) {
+    if (0 <= sym->section) return img->base[sym->section] + sym->offset;
+    void *addr = dlsym(RTLD_DEFAULT, sym->name);
+    if (!addr) panic("undefined symbol: %s", sym->name);
+    return addr;
+}
+
+// a stub in .text that jumps to an external function
+static char *stub_for(Image *img, AsmSymbol *sym, char **stubs) {
+    if (stubs[sym->id]) return stubs[sym->id];
+    char *addr = symbol_addr(img, sym);
+    char *stub = img->stubs + img->nstub++ * STUB_SIZE;
+    static const uint8_t jmp[8] = {0xFF, 0x25, 0x02, 0x00, 0x00, 0x00, 0x0F, 0x0B}; // ud2 pads
+    memcpy(stub, jmp, sizeof(jmp));
+    memcpy(stub + 8, &addr, sizeof(addr));
+    return stubs[sym->id] = stub;
+}
+
+static void relocate(Image *img, ObjectFile *obj) {
+    char **stubs = calloc(obj->nsym, sizeof(char *));
+    for (int i = 0; i < obj->nreloc; i++) {
+        Reloc *r = &obj->relocs[i];
+        char *loc = img->base[r->section] + r->offset;
+        char *target = symbol_addr(img, r->sym);
+        if (r->type == RELOC_PLT32 && r->sym->section < 0) target = stub_for(img, r->sym, stubs);
+
+        long val;
+        switch (r->type) {
+            case RELOC_PC32:
+            case RELOC_PLT32:
+                val = (long)(target + r->addend - loc);
+                if (val < INT32_MIN || INT32_MAX < val) panic("relocation to %s out of range", r->sym->name);
+                memcpy(loc, &(int32_t){val}, 4);
+                break;
+            case RELOC_ABS32:
+                val = (long)(target + r->addend);
+                if (val < 0 || UINT32_MAX < val) panic("relocation to %s out of range", r->sym->name);
+                memcpy(loc, &(uint32_t){val}, 4);
+                break;
+            case RELOC_ABS64:
+                memcpy(loc, &(char *){target + r->addend}, 8);
+                break;
+        }
+    }
+    free(stubs);
+}
+
+int jit_run(ObjectFile *obj) {
+    // .text, stubs | .rodata | .data
+    int nstub = 0;
+    for (int i = 0; i < obj->nreloc; i++)
+        if (obj->relocs[i].type == RELOC_PLT32 && obj->relocs[i].sym->section < 0) nstub++;
+    long text_size = align_n(obj->sections[SEC_TEXT].len, STUB_SIZE) + (long)nstub * STUB_SIZE;
+    long size[NUM_SECTIONS];
+    size[SEC_TEXT] = page_align(text_size);
+    size[SEC_RODATA] = page_align(obj->sections[SEC_RODATA].len);
+    size[SEC_DATA] = page_align(obj->sections[SEC_DATA].len);
+    long total = size[SEC_TEXT] + size[SEC_RODATA] + size[SEC_DATA];
+
+    char *mem = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) panic("cannot map memory: %s", strerror(errno));
+    Image img = {0};
+    img.base[SEC_TEXT] = mem;
+    img.base[SEC_RODATA] = mem + size[SEC_TEXT];
+    img.base[SEC_DATA] = mem + size[SEC_TEXT] + size[SEC_RODATA];
+    img.stubs = mem + align_n(obj->sections[SEC_TEXT].len, STUB_SIZE);
+    for (int i = 0; i < NUM_SECTIONS; i++)
+        memcpy(img.base[i], obj->sections[i].buf, obj->sections[i].len);
+
+    relocate(&img, obj);
+
+    if (mprotect(img.base[SEC_TEXT], size[SEC_TEXT], PROT_READ | PROT_EXEC) != 0
+        || (size[SEC_RODATA] && mprotect(img.base[SEC_RODATA], size[SEC_RODATA], PROT_READ) != 0))
+        panic("cannot protect memory: %s", strerror(errno));
+
+    AsmSymbol *main_sym = NULL;
+    for (int i = 0; i < obj->nsym; i++)
+        if (strcmp(obj->syms[i]->name, "main") == 0 && obj->syms[i]->section == SEC_TEXT) main_sym = obj->syms[i];
+    if (!main_sym) panic("main is not defined");
+
+    int (*entry)(void) = (int (*)(void))(img.base[SEC_TEXT] + main_sym->offset);
+    return entry();
+}
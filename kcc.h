@@ -6,6 +6,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #define COMPILER_NAME "KCC"
 void panic(char *fmt, ...);
@@ -21,11 +23,59 @@ Stack* stack_new(int capacity);
 int stack_top(Stack *stack);
 int stack_pop(Stack *stack);
 void stack_push(Stack *stack, int val);
+void stack_free(Stack *stack);
+
+typedef struct {
+    const char *key;
+    int keylen;
+    void *val;
+} HashEntry;
+
+typedef struct {
+    HashEntry *buckets;
+    int capacity; // power of 2
+    int used;
+} HashMap;
+HashMap *hashmap_new(void);
+void *hashmap_get(HashMap *map, const char *key, int keylen);
+void hashmap_put(HashMap *map, const char *key, int keylen, void *val);
+void hashmap_free(HashMap *map);
+void *hashmap_get_atom(HashMap *map, int atom);
+void hashmap_put_atom(HashMap *map, int atom, void *val);
+
+typedef struct ArenaChunk ArenaChunk;
+typedef struct Arena Arena;
+struct Arena {
+    const char *name;
+    ArenaChunk *chunks;
+    size_t used;     // bytes handed out
+    size_t reserved; // bytes taken from malloc
+    long nalloc;
+    Arena *next;
+};
+Arena *arena_new(const char *name);
+void arena_use(Arena *arena);
+void *arena_alloc(size_t size);
+void arena_report(FILE *fp);
+void count_alloc(size_t size);
+void alloc_totals(long *nalloc, size_t *used);
+
+// counters for --time-report
+typedef struct {
+    long tokens;  // lexed
+    long nodes;
+    long symbols;
+    long insns;   // emitted instructions
+    long expansions;        // macro expansions
+    long cached_expansions; // of which replayed from the cache
+} Stats;
+extern Stats stats;
 
 // lexer
 typedef struct {
     const char *input;
     int pos;
+    bool space; // whitespace or a comment since the last token
 } Lexer;
 
 typedef enum {
@@ -51,6 +101,7 @@ typedef enum {
     TT_PAREN_L, TT_PAREN_R, // ( )
     TT_COMMA,               // ,
     TT_PERIOD,              // .
+    TT_ELLIPSIS,            // ...
     TT_MINUS_ANGLE_R,       // ->
     TT_PLUS_PLUS,           // ++
     TT_MINUS_MINUS,         // --
@@ -64,6 +115,7 @@ typedef enum {
     TT_COLON,               // :
     TT_SEMICOLON,           // ;
     TT_HASH,                // #
+    TT_HASH_HASH,           // ##
     TT_KW_RETURN,           // return
     TT_KW_IF,               // if
     TT_KW_ELSE,             // else
@@ -89,27 +141,92 @@ typedef enum {
     META_TT_NUM,
 } TokenTag;
 
-typedef struct Token Token;
-struct Token {
-    TokenTag tag;
-    const char *start;
+// every source file is read into one reserved region (see read_file),
+// so a token refers to its text by a 32-bit offset from source_base
+extern char *source_base;
+
+// tokens are stored in a TokenBuf as a struct of arrays and referred to by
+// index. index 0 is a dummy, so a zero Token means no token.
+typedef int Token;
+
+typedef struct {
+    uint8_t *tags;
+    uint32_t *offsets; // from source_base
+    uint32_t *lens;
+    uint32_t *atoms;   // TT_IDENT only, see intern
+    bool *spaces;      // preceded by whitespace; for # and the function-like macro test
     int len;
-    Token *next;
-};
+    int capacity;
+} TokenBuf;
+
+// the tokens of the translation unit, as preprocessed
+extern TokenBuf token_buf;
+
+static inline TokenTag tok_tag(Token t) { return token_buf.tags[t]; }
+static inline const char *tok_start(Token t) { return source_base + token_buf.offsets[t]; }
+static inline int tok_len(Token t) { return token_buf.lens[t]; }
+static inline int tok_atom(Token t) { return token_buf.atoms[t]; }
+
+int intern(const char *str, int len);
+const char *atom_str(int atom);
+int atom_len(int atom);
 
 Lexer *lexer_new(const char *input);
-Token *tokenize(Lexer *lexer);
+Token token_push(TokenBuf *buf, TokenTag tag, uint32_t offset, uint32_t len, int atom, bool space);
+Token token_copy(TokenBuf *dst, TokenBuf *src, Token t);
+Token tokenbuf_end(TokenBuf *buf);
+Token tokenize(Lexer *lexer, TokenBuf *buf);
+
+// scan
+const char *scan_impl_name(void);
+const char *scan_space(const char *p);   // first non-whitespace byte
+const char *scan_ident(const char *p);   // first byte not in [0-9A-Za-z_]
+const char *scan_line(const char *p);    // first '\n' or '\0'
+const char *scan_star(const char *p);    // first '*' or '\0'
+const char *scan_string(const char *p);  // first '"', '\\' or '\0'
 
 // preprocessor
 typedef struct Symbol Symbol;
+
+// a macro's name and replacement list are ranges of the preprocessor's raw
+// tokens; expanding one reads the list in place rather than copying it
+typedef struct {
+    Token body;       // first token of the replacement list
+    int len;          // tokens in it
+    int nparams;      // -1 for an object-like macro
+    int *params;      // atoms; __VA_ARGS__ is the last one of a variadic macro
+    bool variadic;
+    bool paste;       // the body contains ##
+    bool disabled;    // being expanded
+    // the expansion of an object-like macro, when it did not depend on
+    // what followed it; valid while cache_generation == pp->generation
+    Token cache;      // in pp->cache
+    int cache_len;
+    int cache_generation;
+} Macro;
+
+typedef struct MacroContext MacroContext;
+
 typedef struct {
     const char *input;
     int pos;
     Symbol *defines;
+    HashMap *macros;   // atom -> ST_DEFINE Symbol, or NULL after #undef
+    HashMap *includes; // canonical path -> cached included file
+    TokenBuf *raw;     // tokens as lexed, of every file
+    TokenBuf *scratch; // arguments and substituted bodies of the expansion in progress
+    TokenBuf *cache;   // cached expansions of object-like macros
+    MacroContext *contexts; // token ranges being expanded, innermost last
+    int ncontexts;
+    int contexts_capacity;
+    int ndisabled;     // macros being expanded
+    int generation;    // bumped by #define and #undef
 } Preprocessor;
 
 Preprocessor *preprocessor_new(const char *input, Symbol *defines);
-Token *preprocess(Preprocessor *pp);
+Token preprocess(Preprocessor *pp);
+Macro *macro_parse(Preprocessor *pp, Token name, Token end);
+void preprocessor_restore(Preprocessor *pp, Symbol *defines);
 
 // parser
 typedef struct Node Node;
@@ -119,13 +236,19 @@ typedef struct Type Type;
 typedef struct Env Env;
 
 typedef struct {
-    const Token *tokens;
-    Token *current_token;
+    Token tokens;
+    Token current_token;
     Node *current_func;
     Symbol *func_types;
     Symbol *global_vars;
     Symbol *defined_types;
     TokenList *string_tokens;
+    // name -> Symbol, one per namespace
+    HashMap *func_map;
+    HashMap *global_map;
+    HashMap *tag_map;     // struct, union and enum tags
+    HashMap *typedef_map;
+    HashMap *enum_map;    // enum constants
 } Parser;
 
 typedef enum {     // token node->???
@@ -183,7 +306,7 @@ typedef enum {     // token node->???
 
 struct Node {
     NodeTag tag;
-    Token *main_token;
+    Token main_token;
     Type *type;
     union {
         int integer;
@@ -198,7 +321,7 @@ struct Node {
         struct { Node *cond; Node *body; } whilestmt;
         struct { Node *def; Node *cond; Node *next; Node *body; } forstmt;
         NodeList *block;
-        struct { Node *name; NodeList *params; Node *body; Symbol *locals; } func;
+        struct { Node *name; NodeList *params; Node *body; Symbol *locals; HashMap *local_map; } func;
         struct { Node *name; Node *init; } declarator;
         NodeList *declarators;
         NodeList *initializers;
@@ -219,14 +342,14 @@ NodeList *nodelist_new(int capacity);
 void nodelist_append(NodeList *nlist, Node *node);
 
 struct TokenList {
-    Token **tokens;
+    Token *tokens;
     int len;
     int capacity;
 };
 
 #define DEFAULT_TOKENLIST_CAP 16
 TokenList *tokenlist_new(int capacity);
-void tokenlist_append(TokenList *tlist, Token *token);
+void tokenlist_append(TokenList *tlist, Token token);
 
 typedef enum {
     ST_LVAR, ST_GVAR, ST_FUNC, ST_STRUCT, ST_UNION, ST_ENUM, ST_MEMBER, ST_TYPEDEF, ST_DEFINE,
@@ -234,7 +357,7 @@ typedef enum {
 
 struct Symbol {
     SymbolTag tag;
-    Token *token;
+    Token token;
     Type *type;
     Symbol *next;
 
@@ -242,7 +365,7 @@ struct Symbol {
         int offset; // for local variable, struct
         int value;  // for enum
         Node *init; // for global variable
-        Token *pp_token; // for #define macro
+        Macro *macro; // for #define macro
     };
 };
 
@@ -255,14 +378,18 @@ typedef struct {
     Symbol *global_vars;
     Symbol *defined_types;
     TokenList *string_tokens;
+    HashMap *func_map;
+    HashMap *global_map;
+    HashMap *enum_map;
 } Program;
 
-Symbol *find_symbol(SymbolTag tag, Symbol *symlist, Token *ident);
-Symbol *find_member(Symbol *symlist, Token *ident, int *offset);
-Symbol *find_enum_val(Symbol *defined_types, Token *ident);
+Symbol *find_symbol(SymbolTag tag, HashMap *map, Token ident);
+Symbol *find_member(Type *type, Token ident, int *offset);
+Symbol *find_enum_val(HashMap *enum_map, Token ident);
 
-Parser *parser_new(Token *tokens);
+Parser *parser_new(Token tokens);
 Program *parse(Parser *parser);
+void parser_restore(Parser *parser, Symbol *func_types, Symbol *global_vars, Symbol *defined_types);
 
 // type
 struct Type {
@@ -270,7 +397,7 @@ struct Type {
     int array_size; // array
     union {
         Type *base; // pointer to
-        struct { Token *ident; Symbol *list; int size; int align; } tagged_typ; // struct
+        struct { Token ident; Symbol *list; int size; int align; HashMap *members; } tagged_typ; // struct
     };
 };
 
@@ -279,41 +406,263 @@ extern Type *type_int;
 extern Type *type_char;
 
 struct Env {
-    Symbol *local_vars;
-    Symbol *global_vars;
-    Symbol *func_types;
-    Symbol *defined_types;
+    HashMap *local_vars;
+    HashMap *global_vars;
+    HashMap *func_types;
+    HashMap *enum_vals;
 };
 
 bool is_integer(Type *type);
 bool is_scalar(Type *type);
 bool is_ptr_or_arr(Type *type);
-bool tokeneq(Token *a, Token *b);
-Env *env_new(Symbol *local_vars, Symbol *global_vars, Symbol *func_types, Symbol *defined_types);
+bool tokeneq(Token a, Token b);
+Env *env_new(HashMap *local_vars, HashMap *global_vars, HashMap *func_types, HashMap *enum_vals);
 
 int sizeof_type(Type *type);
 int alignof_type(Type *type);
 Type *type_copy(Type *type);
 Type *pointer_to(Type *base);
 Type *array_of(Type *base, int size);
-Type *struct_new(Token *ident, Symbol *list, int size, int align);
-Type *union_new(Token *ident, Symbol *list, int size, int align);
-Type *enum_new(Token *ident, Symbol *list);
+Type *struct_new(Token ident, Symbol *list, int size, int align);
+Type *union_new(Token ident, Symbol *list, int size, int align);
+Type *enum_new(Token ident, Symbol *list);
 void type_funcs(Program *prog);
 
-// codegen
+// optimizer
+void optimize(Program *prog);
+
+// ir
 #define LOOP_STACK_SIZE 16
+typedef struct IrValue IrValue;
+typedef struct IrBlock IrBlock;
+typedef struct IrChunk IrChunk;
+
+typedef enum {   // operands, other fields
+    IR_CONST,    // imm
+    IR_LOCAL,    // address of local var
+    IR_GLOBAL,   // address of global name
+    IR_STRING,   // address of string literal imm
+    IR_PARAM,    // argument imm
+    IR_LOAD,     // addr; type is the loaded type
+    IR_STORE,    // addr, value; type is the stored type
+    IR_ADD,      // lhs, rhs
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_MOD,
+    IR_EQ,       // lhs, rhs; 0 or 1
+    IR_NE,
+    IR_LT,
+    IR_LE,
+    IR_NEG,      // x
+    IR_NOT,      // x; x == 0
+    IR_CAST,     // x; truncated to type and sign-extended back
+    IR_CALL,     // args; name
+    IR_PHI,      // one value per predecessor, in block->preds order
+    // terminators, the last value of every block
+    IR_JMP,      // ; targets[0]
+    IR_BR,       // cond; cond != 0 ? targets[0] : targets[1]
+    IR_SWITCH,   // x; x == cases[i] ? targets[i] : targets[ncases]
+    IR_RET,      // value, if any
+} IrOp;
+
+// an instruction and the value it defines. values are 64 bits wide:
+// loads sign-extend and stores truncate to type.
+struct IrValue {
+    IrOp op;
+    int id;
+    Type *type;   // of the value; for IR_LOCAL, IR_GLOBAL and IR_STRING the type
+                  // of the object addressed, for IR_STORE the stored type
+    IrValue **args;
+    int nargs;
+    long imm;
+    Symbol *var;  // IR_LOCAL; for IR_PHI, the promoted local it merges
+    Token name;   // IR_GLOBAL, IR_CALL
+    IrBlock *block;
+    IrBlock **targets;
+    int ntargets;
+    long *cases;  // IR_SWITCH; ntargets - 1 of them
+    int nuses;
+    // set by codegen
+    bool inlined; // computed as part of its only user
+    int home;     // frame offset of the stack slot holding it, 0 if none
+    int reg;      // or 1 + index of the register holding it
+};
+
+struct IrBlock {
+    int id;
+    IrValue **insts;
+    int ninsts;
+    int insts_capacity;
+    IrBlock **preds;
+    int npreds;
+    int preds_capacity;
+};
+
 typedef struct {
-    Node *current_func;
-    Symbol *local_vars;
-    Symbol *global_vars;
-    Symbol *func_types;
-    Symbol *defined_types;
-    Stack *break_id_stack;
-    Stack *continue_id_stack;
+    Node *fnode;
+    IrBlock **blocks; // blocks[0] is the entry; code is laid out in this order
+    int nblocks;
+    int blocks_capacity;
+    int nvalues;
+    int nblock_ids;
+    IrChunk *chunks;  // everything above is allocated from these
+} IrFunc;
+
+IrFunc *ir_build(Node *fnode, Program *prog);
+void *ir_alloc(IrFunc *func, size_t size);
+IrValue *ir_value_new(IrFunc *func, IrOp op, Type *type, int nargs);
+void ir_free(IrFunc *func);
+IrBlock *ir_split_edge(IrFunc *func, IrBlock *from, int succ);
+bool ir_is_terminator(IrValue *v);
+IrValue *ir_terminator(IrBlock *block);
+void ir_print(IrFunc *func, FILE *fp);
+void emit_ir(Program *prog, FILE *fp);
+
+// mem2reg
+void ir_promote_locals(IrFunc *func);
+
+// emit
+typedef struct {
+    char *buf;
+    int len;
+    int capacity;
+    int fd; // emit_flush writes here; -1 keeps everything in buf
+} Emitter;
+
+typedef enum {
+    ASM_INS,     // op dst, src
+    ASM_LABEL,   // op is the name
+    ASM_COMMENT, // op is the text
+    ASM_TEXT,    // op is the text: directives, or anything else emitted raw
+    ASM_DELETED,
+} AsmKind;
+
+// strings are offsets into the list's text; -1 for a missing operand
+typedef struct {
+    AsmKind kind;
+    int op;
+    int dst;
+    int src;
+} AsmLine;
+
+typedef struct {
+    AsmLine *lines;
+    int len;
+    int capacity;
+    char *text;
+    int text_len;
+    int text_capacity;
+} AsmList;
+
+extern bool emit_comments;
+Emitter *emitter_new(int fd);
+void emit_to(Emitter *e);
+void emit_str(const char *s);
+void emit_strn(const char *s, int len);
+void emitf(const char *fmt, ...);
+void emit_comment(const char *fmt, ...);
+void emit_label(const char *fmt, ...);
+void emit_ins(const char *op, const char *dst, const char *src);
+void emit_ins_imm(const char *op, const char *dst, long imm);
+void emit_insf(const char *op, const char *fmt, ...);
+void emit_flush(void);
+AsmList *asm_list_new(void);
+void asm_list_free(AsmList *list);
+int asm_text(AsmList *list, const char *s, int len);
+void emit_to_list(AsmList *list);
+void emit_list(AsmList *list);
+
+// peephole
+extern bool peephole_on;
+void peephole(AsmList *list);
+void peephole_report(FILE *fp);
+
+// codegen
+typedef struct {
+    IrFunc *func;
+    Token name;  // of the function
+    int frame;   // bytes below rbp: locals, the homes of IR values, saved registers
+    int nsaved;  // callee-saved registers used for homes
+    int depth;   // number of live expression temporaries
+    int func_id; // index of the function; namespace for its labels
+    int nlabel;
 } GenContext;
-void print_token(Token *token);
-void gen(Program *prog);
+extern int gen_threads;
+void print_token(Token token);
+void gen(Program *prog, Emitter *e);
+
+// asm
+typedef enum {
+    SEC_TEXT,
+    SEC_DATA,
+    SEC_RODATA,
+    NUM_SECTIONS,
+} SectionId;
+
+typedef struct {
+    char *buf;
+    int len;
+    int capacity;
+    int align;
+} Section;
+
+typedef struct {
+    char *name;
+    int id;      // position in ObjectFile.syms
+    int section; // SectionId, -1 if undefined
+    int offset;
+    bool is_global;
+    bool is_local_label; // .L*: not written to the symbol table
+} AsmSymbol;
+
+typedef enum {
+    RELOC_PC32,  // S + A - P
+    RELOC_PLT32, // L + A - P (call)
+    RELOC_ABS32, // S + A
+    RELOC_ABS64, // S + A
+} RelocType;
+
+typedef struct {
+    int section; // where to patch
+    int offset;
+    RelocType type;
+    AsmSymbol *sym;
+    long addend;
+} Reloc;
+
+typedef struct {
+    Section sections[NUM_SECTIONS];
+    AsmSymbol **syms;
+    int nsym;
+    int sym_cap;
+    Reloc *relocs;
+    int nreloc;
+    int reloc_cap;
+} ObjectFile;
+ObjectFile *assemble(const char *src, int len);
+
+// elf
+char *elf_image(ObjectFile *obj, size_t *len);
+
+// jit
+int jit_run(ObjectFile *obj);
+
+// pch
+void write_pch(const char *path, Preprocessor *pp, Program *prog);
+void read_pch(char *path, Preprocessor *pp, Parser *parser);
+
+// cache
+typedef struct {
+    char *dir;
+    size_t max_size; // bytes; least recently used entries are removed past it
+    char key[33];    // hash of the tokens, compiler and flags, in hex
+} Cache;
+Cache *cache_open(Token tokens, const char *flags, const char *pch_path);
+char *cache_get(Cache *cache, size_t *len);
+void cache_put(Cache *cache, const char *data, size_t len);
 
 // main
+#define SOURCE_PADDING 64 // zero bytes after the text; lets scanners read ahead
 char *read_file(char *path);
+char *source_alloc(size_t size);
@@ -1,32 +1,48 @@
 #include "kcc.h"
 
-struct {
-    char *str; TokenTag tag;
-} keywords[] = {
-    {"return",   TT_KW_RETURN},
-    {"if",       TT_KW_IF},
-    {"else",     TT_KW_ELSE},
-    {"while",    TT_KW_WHILE},
-    {"for",      TT_KW_FOR},
-    {"void",     TT_KW_VOID},
-    {"int",      TT_KW_INT},
-    {"char",     TT_KW_CHAR},
-    {"sizeof",   TT_KW_SIZEOF},
-    {"struct",   TT_KW_STRUCT},
-    {"const",    TT_KW_CONST},
-    {"break",    TT_KW_BREAK},
-    {"continue", TT_KW_CONTINUE},
-    {"do",       TT_KW_DO},
-    {"switch",   TT_KW_SWITCH},
-    {"case",     TT_KW_CASE},
-    {"default",  TT_KW_DEFAULT},
-    {"union",    TT_KW_UNION},
-    {"enum",     TT_KW_ENUM},
-    {"typedef",  TT_KW_TYPEDEF},
-    {"define",   TT_PP_DEFINE},
-    {"include",  TT_PP_INCLUDE},
-    {NULL, -1},
+// Keywords
+//
+// perfect hash on (length, first char, last char): every keyword lands in
+// its own slot, so an identifier is classified with one probe and at most
+// one memcmp. the slots are computed by the compiler from KEYWORD_HASH,
+// and two keywords in one slot are a compile error (-Woverride-init);
+// change the multipliers if a new keyword collides.
+
+#define KEYWORD_TABLE_SIZE 64
+#define KEYWORD_HASH(len, first, last) \
+    (((len) * 2 + (unsigned char)(first) * 3 + (unsigned char)(last) * 2) & (KEYWORD_TABLE_SIZE - 1))
+#define KEYWORD(str, first, last, tag) \
+    [KEYWORD_HASH(sizeof(str) - 1, first, last)] = {str, sizeof(str) - 1, tag}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+static const struct {
+    char *str; int len; TokenTag tag;
+} keywords[KEYWORD_TABLE_SIZE] = {
+    KEYWORD("return",   'r', 'n', TT_KW_RETURN),
+    KEYWORD("if",       'i', 'f', TT_KW_IF),
+    KEYWORD("else",     'e', 'e', TT_KW_ELSE),
+    KEYWORD("while",    'w', 'e', TT_KW_WHILE),
+    KEYWORD("for",      'f', 'r', TT_KW_FOR),
+    KEYWORD("void",     'v', 'd', TT_KW_VOID),
+    KEYWORD("int",      'i', 't', TT_KW_INT),
+    KEYWORD("char",     'c', 'r', TT_KW_CHAR),
+    KEYWORD("sizeof",   's', 'f', TT_KW_SIZEOF),
+    KEYWORD("struct",   's', 't', TT_KW_STRUCT),
+    KEYWORD("const",    'c', 't', TT_KW_CONST),
+    KEYWORD("break",    'b', 'k', TT_KW_BREAK),
+    KEYWORD("continue", 'c', 'e', TT_KW_CONTINUE),
+    KEYWORD("do",       'd', 'o', TT_KW_DO),
+    KEYWORD("switch",   's', 'h', TT_KW_SWITCH),
+    KEYWORD("case",     'c', 'e', TT_KW_CASE),
+    KEYWORD("default",  'd', 't', TT_KW_DEFAULT),
+    KEYWORD("union",    'u', 'n', TT_KW_UNION),
+    KEYWORD("enum",     'e', 'm', TT_KW_ENUM),
+    KEYWORD("typedef",  't', 'f', TT_KW_TYPEDEF),
+    KEYWORD("define",   'd', 'e', TT_PP_DEFINE),
+    KEYWORD("include",  'i', 'e', TT_PP_INCLUDE),
 };
+#pragma GCC diagnostic pop
 
 Lexer *lexer_new(const char *input) {
     Lexer *lexer = calloc(1, sizeof(Lexer));
@@ -35,15 +51,117 @@ Lexer *lexer_new(const char *input) {
     return lexer;
 }
 
-static Token *token_new(TokenTag tag, const char *start, int len) {
-    Token *t = calloc(1, sizeof(Token));
-    t->tag = tag;
-    t->start = start;
-    t->len = len;
-    t->next = NULL;
+// Atoms
+//
+// every distinct identifier gets a small integer, so that identifiers are
+// compared and hashed as ints. atom 0 is not an identifier. the strings
+// are not copied; they point into the source text.
+
+#define INTERN_INIT_CAP 1024 // power of 2
+
+static struct { const char *str; int len; } *atoms;
+static int natoms = 1, atoms_capacity;
+static int *intern_slots; // atom, or 0 when empty
+static int intern_capacity;
+
+static uint32_t intern_hash(const char *str, int len) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < len; i++) hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+    return hash;
+}
+
+static int *intern_find(const char *str, int len) {
+    uint32_t mask = intern_capacity - 1;
+    for (uint32_t i = intern_hash(str, len) & mask; ; i = (i + 1) & mask) {
+        int a = intern_slots[i];
+        if (!a || (atoms[a].len == len && memcmp(atoms[a].str, str, len) == 0)) return &intern_slots[i];
+    }
+}
+
+static void intern_grow(void) {
+    int *old = intern_slots;
+    int old_capacity = intern_capacity;
+    intern_capacity = intern_capacity ? intern_capacity * 2 : INTERN_INIT_CAP;
+    intern_slots = calloc(intern_capacity, sizeof(int));
+    if (!intern_slots) panic("cannot allocate memory: %s", strerror(errno));
+    for (int i = 0; i < old_capacity; i++)
+        if (old[i]) *intern_find(atoms[old[i]].str, atoms[old[i]].len) = old[i];
+    free(old);
+}
+
+// the atom of an identifier, a new one if it has not been seen before
+int intern(const char *str, int len) {
+    if (intern_capacity <= natoms * 2) intern_grow();
+    int *slot = intern_find(str, len);
+    if (*slot) return *slot;
+    if (natoms >= atoms_capacity) {
+        atoms_capacity = atoms_capacity ? atoms_capacity * 2 : INTERN_INIT_CAP;
+        atoms = realloc(atoms, atoms_capacity * sizeof(*atoms));
+        if (!atoms) panic("cannot reallocate memory: %s", strerror(errno));
+    }
+    atoms[natoms].str = str;
+    atoms[natoms].len = len;
+    return *slot = natoms++;
+}
+
+const char *atom_str(int atom) {
+    return atoms[atom].str;
+}
+
+int atom_len(int atom) {
+    return atoms[atom].len;
+}
+
+// Tokens
+
+TokenBuf token_buf;
+
+static void tokenbuf_grow(TokenBuf *buf) {
+    int capacity = buf->capacity ? buf->capacity * 2 : 4096;
+    uint8_t *tags = realloc(buf->tags, capacity * sizeof(uint8_t));
+    uint32_t *offsets = realloc(buf->offsets, capacity * sizeof(uint32_t));
+    uint32_t *lens = realloc(buf->lens, capacity * sizeof(uint32_t));
+    uint32_t *atoms = realloc(buf->atoms, capacity * sizeof(uint32_t));
+    bool *spaces = realloc(buf->spaces, capacity * sizeof(bool));
+    if (!tags || !offsets || !lens || !atoms || !spaces) panic("cannot reallocate memory: %s", strerror(errno));
+    count_alloc(capacity * (sizeof(uint8_t) + 3 * sizeof(uint32_t) + sizeof(bool)));
+    buf->tags = tags;
+    buf->offsets = offsets;
+    buf->lens = lens;
+    buf->atoms = atoms;
+    buf->spaces = spaces;
+    buf->capacity = capacity;
+}
+
+Token token_push(TokenBuf *buf, TokenTag tag, uint32_t offset, uint32_t len, int atom, bool space) {
+    if (buf->len == buf->capacity) tokenbuf_grow(buf);
+    Token t = buf->len++;
+    buf->tags[t] = tag;
+    buf->offsets[t] = offset;
+    buf->lens[t] = len;
+    buf->atoms[t] = atom;
+    buf->spaces[t] = space;
     return t;
 }
 
+// append token t of src to dst
+Token token_copy(TokenBuf *dst, TokenBuf *src, Token t) {
+    return token_push(dst, src->tags[t], src->offsets[t], src->lens[t], src->atoms[t], src->spaces[t]);
+}
+
+// the index of the next token pushed to buf
+Token tokenbuf_end(TokenBuf *buf) {
+    if (buf->len == 0) token_push(buf, TT_EOF, 0, 0, 0, false); // the dummy token 0
+    return buf->len;
+}
+
+static Token token_new(Lexer *lexer, TokenBuf *buf, TokenTag tag, const char *start, int len) {
+    stats.tokens++;
+    bool space = lexer->space;
+    lexer->space = false;
+    return token_push(buf, tag, start - source_base, len, tag == TT_IDENT ? intern(start, len) : 0, space);
+}
+
 static char peek(Lexer *lexer) {
     return lexer->input[lexer->pos];
 }
@@ -53,153 +171,167 @@ static const char *consume(Lexer *lexer) {
 }
 
 static void skip_space(Lexer *lexer) {
-    while (isspace(peek(lexer))) consume(lexer);
+    int pos = scan_space(lexer->input + lexer->pos) - lexer->input;
+    if (pos != lexer->pos) lexer->space = true;
+    lexer->pos = pos;
 }
 
 // if the given token matches a keyword, return its TokenTag.
 // otherwise, return TT_IDENT.
 static TokenTag lookup_ident(const char *str, int len) {
-    for (int i = 0; keywords[i].str != NULL; i++) {
-        if (strlen(keywords[i].str) != len) continue;
-        else if (strncmp(str, keywords[i].str, len) == 0) return keywords[i].tag;
-    }
+    int h = KEYWORD_HASH(len, str[0], str[len - 1]);
+    if (keywords[h].len == len && memcmp(str, keywords[h].str, len) == 0) return keywords[h].tag;
     return TT_IDENT;
 }
 
-Token *tokenize(Lexer *lexer) {
-    Token head, *token = &head;
-    while (token->tag != TT_EOF) {
+// append the tokens of lexer's input, up to and including TT_EOF, to buf.
+// returns the first one.
+Token tokenize(Lexer *lexer, TokenBuf *buf) {
+    Token first = tokenbuf_end(buf);
+    for (;;) {
         skip_space(lexer);
         const char *start = consume(lexer);
         const char *end = start;
 
         switch (*start) {
             case '\0':
-                token->next = token_new(TT_EOF, start, 1);
-                break;
+                token_new(lexer, buf, TT_EOF, start, 1);
+                return first;
+            case '\\':
+                if (peek(lexer) != '\n') panic("tokenize error: \\");
+                consume(lexer); // a line continuation
+                continue;
             case '#':
-                token->next = token_new(TT_HASH, start, 1);
+                if (peek(lexer) == '#') {
+                    consume(lexer);
+                    token_new(lexer, buf, TT_HASH_HASH, start, 2);
+                } else {
+                    token_new(lexer, buf, TT_HASH, start, 1);
+                }
                 break;
             case '+':
                 if (peek(lexer) == '+') {
                     consume(lexer);
-                    token->next = token_new(TT_PLUS_PLUS, start, 2);
+                    token_new(lexer, buf, TT_PLUS_PLUS, start, 2);
                 } else if (peek(lexer) == '=') {
                     consume(lexer);
-                    token->next = token_new(TT_PLUS_EQ, start, 2);
+                    token_new(lexer, buf, TT_PLUS_EQ, start, 2);
                 } else {
-                    token->next = token_new(TT_PLUS, start, 1);
+                    token_new(lexer, buf, TT_PLUS, start, 1);
                 }
                 break;
             case '-':
                 if (peek(lexer) == '-') {
                     consume(lexer);
-                    token->next = token_new(TT_MINUS_MINUS, start, 2);
+                    token_new(lexer, buf, TT_MINUS_MINUS, start, 2);
                 } else if (peek(lexer) == '=') {
                     consume(lexer);
-                    token->next = token_new(TT_MINUS_EQ, start, 2);
+                    token_new(lexer, buf, TT_MINUS_EQ, start, 2);
                 } else if (peek(lexer) == '>') {
                     consume(lexer);
-                    token->next = token_new(TT_MINUS_ANGLE_R, start, 2);
+                    token_new(lexer, buf, TT_MINUS_ANGLE_R, start, 2);
                 } else {
-                    token->next = token_new(TT_MINUS, start, 1);
+                    token_new(lexer, buf, TT_MINUS, start, 1);
                 }
                 break;
             case '*':
                 if (peek(lexer) == '=') {
                     consume(lexer);
-                    token->next = token_new(TT_STAR_EQ, start, 2);
+                    token_new(lexer, buf, TT_STAR_EQ, start, 2);
                 } else {
-                    token->next = token_new(TT_STAR, start, 1);
+                    token_new(lexer, buf, TT_STAR, start, 1);
                 }
                 break;
             case '/':
                 if (peek(lexer) == '/') {
-                    while (peek(lexer) != '\n' && peek(lexer) != '\0') consume(lexer);
+                    lexer->pos = scan_line(lexer->input + lexer->pos) - lexer->input;
+                    lexer->space = true;
                     continue;
                 } else if (peek(lexer) == '*') {
-                    char *q = strstr(consume(lexer), "*/");
-                    if (!q) panic("\'*/\' not found");
+                    const char *q = consume(lexer) + 1;
+                    while (*(q = scan_star(q)) == '*' && q[1] != '/') q++;
+                    if (*q == '\0') panic("\'*/\' not found");
                     lexer->pos = q - lexer->input + 2;
+                    lexer->space = true; // a comment is a space
                     continue;
                 } else if (peek(lexer) == '=') {
                     consume(lexer);
-                    token->next = token_new(TT_SLASH_EQ, start, 2);
+                    token_new(lexer, buf, TT_SLASH_EQ, start, 2);
                 } else {
-                    token->next = token_new(TT_SLASH, start, 1);
+                    token_new(lexer, buf, TT_SLASH, start, 1);
                 }
                 break;
             case '(':
-                token->next = token_new(TT_PAREN_L, start, 1);
+                token_new(lexer, buf, TT_PAREN_L, start, 1);
                 break;
             case ')':
-                token->next = token_new(TT_PAREN_R, start, 1);
+                token_new(lexer, buf, TT_PAREN_R, start, 1);
                 break;
             case '{':
-                token->next = token_new(TT_BRACE_L, start, 1);
+                token_new(lexer, buf, TT_BRACE_L, start, 1);
                 break;
             case '}':
-                token->next = token_new(TT_BRACE_R, start, 1);
+                token_new(lexer, buf, TT_BRACE_R, start, 1);
                 break;
             case '[':
-                token->next = token_new(TT_BRACKET_L, start, 1);
+                token_new(lexer, buf, TT_BRACKET_L, start, 1);
                 break;
             case ']':
-                token->next = token_new(TT_BRACKET_R, start, 1);
+                token_new(lexer, buf, TT_BRACKET_R, start, 1);
                 break;
             case '%':
-                token->next = token_new(TT_PERCENT, start, 1);
+                token_new(lexer, buf, TT_PERCENT, start, 1);
                 break;
             case '=':
                 if (peek(lexer) != '=') {
-                    token->next = token_new(TT_EQ, start, 1);
+                    token_new(lexer, buf, TT_EQ, start, 1);
                 } else {
                     consume(lexer);
-                    token->next = token_new(TT_EQ_EQ, start, 2);
+                    token_new(lexer, buf, TT_EQ_EQ, start, 2);
                 }
                 break;
             case '!':
                 if (peek(lexer) != '=') {
-                    token->next = token_new(TT_BANG, start, 1);
+                    token_new(lexer, buf, TT_BANG, start, 1);
                 } else {
                     consume(lexer);
-                    token->next = token_new(TT_BANG_EQ, start, 2);
+                    token_new(lexer, buf, TT_BANG_EQ, start, 2);
                 }
                 break;
             case '?':
-                token->next = token_new(TT_QUESTION, start, 1);
+                token_new(lexer, buf, TT_QUESTION, start, 1);
                 break;
             case '<':
                 if (peek(lexer) != '=') {
-                    token->next = token_new(TT_ANGLE_L, start, 1);
+                    token_new(lexer, buf, TT_ANGLE_L, start, 1);
                 } else {
                     consume(lexer);
-                    token->next = token_new(TT_ANGLE_L_EQ, start, 2);
+                    token_new(lexer, buf, TT_ANGLE_L_EQ, start, 2);
                 }
                 break;
             case '>':
                 if (peek(lexer) != '=') {
-                    token->next = token_new(TT_ANGLE_R, start, 1);
+                    token_new(lexer, buf, TT_ANGLE_R, start, 1);
                 } else {
                     consume(lexer);
-                    token->next = token_new(TT_ANGLE_R_EQ, start, 2);
+                    token_new(lexer, buf, TT_ANGLE_R_EQ, start, 2);
                 }
                 break;
             case ':':
-                token->next = token_new(TT_COLON, start, 1);
+                token_new(lexer, buf, TT_COLON, start, 1);
                 break;
             case ';':
-                token->next = token_new(TT_SEMICOLON, start, 1);
+                token_new(lexer, buf, TT_SEMICOLON, start, 1);
                 break;
             case ',':
-                token->next = token_new(TT_COMMA, start, 1);
+                token_new(lexer, buf, TT_COMMA, start, 1);
                 break;
             case '&':
                 if (peek(lexer) != '&') {
-                    token->next = token_new(TT_AMPERSAND, start, 1);
+                    token_new(lexer, buf, TT_AMPERSAND, start, 1);
                 } else {
                     consume(lexer);
-                    token->next = token_new(TT_AND_AND, start, 1);
+                    token_new(lexer, buf, TT_AND_AND, start, 2);
                 }
                 break;
             case '|':
@@ -207,17 +339,17 @@ Token *tokenize(Lexer *lexer) {
                     panic("unimplemented: |");
                 } else {
                     consume(lexer);
-                    token->next = token_new(TT_PIPE_PIPE, start, 1);
+                    token_new(lexer, buf, TT_PIPE_PIPE, start, 2);
                 }
                 break;
             case '"': {
-                while (peek(lexer) != '"') {
-                    end = consume(lexer);
-                    if (*end == '\\' && *(end + 1) == '\"') consume(lexer);
-                }
-                consume(lexer); // end "
+                const char *q = start + 1;
+                while (*(q = scan_string(q)) == '\\' && q[1] != '\0') q += 2; // skip escaped char
+                if (*q != '"') panic("unterminated string literal");
+                end = q - 1;
+                lexer->pos = q - lexer->input + 1; // end "
                 int len = end - start + 2; // string literal's token contains double quotes
-                token->next = token_new(TT_STRING, start, len);
+                token_new(lexer, buf, TT_STRING, start, len);
                 break;
             }
             case '\'': {
@@ -227,27 +359,31 @@ Token *tokenize(Lexer *lexer) {
                 }
                 while (peek(lexer) != '\'') end = consume(lexer);
                 end = consume(lexer); // end '
-                token->next = token_new(TT_CHAR, start, end - start + 1);
+                token_new(lexer, buf, TT_CHAR, start, end - start + 1);
                 break;
             }
             case '.':
-                token->next = token_new(TT_PERIOD, start, 1);
+                if (peek(lexer) == '.' && start[2] == '.') {
+                    lexer->pos += 2;
+                    token_new(lexer, buf, TT_ELLIPSIS, start, 3);
+                } else {
+                    token_new(lexer, buf, TT_PERIOD, start, 1);
+                }
                 break;
             default:
                 if (isdigit(*start)) {
                     while (isdigit(peek(lexer))) end = consume(lexer);
-                    token->next = token_new(TT_INT, start, end - start + 1);
-                } else if (isalpha(*start)) {
-                    while (isalnum(peek(lexer)) || peek(lexer) == '_') end = consume(lexer);
+                    token_new(lexer, buf, TT_INT, start, end - start + 1);
+                } else if (isalpha(*start) || *start == '_') {
+                    lexer->pos = scan_ident(lexer->input + lexer->pos) - lexer->input;
+                    end = lexer->input + lexer->pos - 1;
                     int len = end - start + 1;
                     TokenTag tag = lookup_ident(start, len); // TT_IDENT or TT_<keyword>
-                    token->next = token_new(tag, start, end - start + 1);
+                    token_new(lexer, buf, tag, start, len);
                 } else {
                     panic("tokenize error: %c", *start);
                 }
                 break;
         }
-        token = token->next;
     }
-    return head.next;
 }
@@ -1,4 +1,8 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS, fdopen
 #include "kcc.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 void panic(char *fmt, ...) {
     va_list ap;
@@ -183,10 +187,20 @@ void dump_nodes(Node *node) {
     printf(" ");
 }
 
-void dump_tokens(Token *tokens) {
-    for (Token *t = tokens; t != NULL; t = t->next) {
+void dump_tokens(Token tokens) {
+    for (Token t = tokens; ; t++) {
         print_token(t);
-        printf("\tTokenTag=%d\n", t->tag);
+        printf("\tTokenTag=%d\n", tok_tag(t));
+        if (tok_tag(t) == TT_EOF) break;
+    }
+}
+
+// -E: the preprocessed tokens, one line per statement or brace
+static void print_preprocessed(Token tokens, FILE *fp) {
+    for (Token t = tokens; tok_tag(t) != TT_EOF; t++) {
+        TokenTag tag = tok_tag(t);
+        bool eol = tag == TT_SEMICOLON || tag == TT_BRACE_L || tag == TT_BRACE_R || tok_tag(t + 1) == TT_EOF;
+        fprintf(fp, "%.*s%c", tok_len(t), tok_start(t), eol ? '\n' : ' ');
     }
 }
 
@@ -199,8 +213,8 @@ void dump_nodelist(NodeList *nlist) {
 
 void dump_locals(Node *node_fn) {
     for (Symbol *var = node_fn->func.locals; var != NULL; var = var->next) {
-        const char *start = var->token->start;
-        int len = var->token->len;
+        const char *start = tok_start(var->token);
+        int len = tok_len(var->token);
         printf("name:%.*s\toffset:%d\ttype:", len, start, var->offset);
         dump_type(var->type);
         printf("\n");
@@ -216,60 +230,372 @@ void dump_funcs(NodeList *funcs) {
     }
 }
 
-char *read_file(char *path) {
-    FILE *fp = stdin;
-    if (strcmp(path, "-") != 0) {
-        fp = fopen(path, "r");
-        if (!fp) panic("cannot open %s: %s", path, strerror(errno));
+// the text of a file, followed by "\n\0" and at least SOURCE_PADDING zero
+// bytes. regular files are mapped rather than copied: the file is mapped
+// over the start of an anonymous mapping, which supplies the padding even
+// when the file ends on a page boundary. pipes and stdin are read in blocks.
+
+// Source space
+//
+// a reserved region that every source file is placed in, so that tokens
+// can refer to their text with 32-bit offsets from source_base. pages are
+// committed as files are read.
+
+#define SOURCE_SPACE (1L << 32)
+
+char *source_base;
+static size_t source_used;
+
+// zeroed, writable, page-aligned memory in the source space
+char *source_alloc(size_t size) {
+    long page = sysconf(_SC_PAGESIZE);
+    if (!source_base) {
+        source_base = mmap(NULL, SOURCE_SPACE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (source_base == MAP_FAILED) panic("cannot reserve source space: %s", strerror(errno));
     }
+    size = (size + page - 1) / page * page;
+    if (SOURCE_SPACE - source_used < size) panic("source files exceed %ld bytes", SOURCE_SPACE);
+    char *p = source_base + source_used;
+    if (mprotect(p, size, PROT_READ | PROT_WRITE) != 0) panic("cannot allocate source space: %s", strerror(errno));
+    source_used += size;
+    count_alloc(size);
+    return p;
+}
 
-    int capacity = 2048;
-    int len = 0;
+static char *read_stream(FILE *fp) {
+    size_t capacity = 64 * 1024;
+    size_t len = 0;
     char *buf = malloc(capacity);
     if (!buf) panic("cannot allocate memory: %s", strerror(errno));
-
-    int c;
-    while ((c = fgetc(fp)) != EOF) {
-        if (capacity <= len + 2) { // +2: \n\0
+    for (;;) {
+        if (capacity < len + 4096) {
             capacity *= 2;
             char *tmp = realloc(buf, capacity);
             if (!tmp) panic("cannot reallocate memory: %s", strerror(errno));
             buf = tmp;
         }
-        buf[len++] = (char)c;
+        size_t n = fread(buf + len, 1, capacity - len, fp);
+        len += n;
+        if (n == 0) break;
+    }
+    if (ferror(fp)) panic("cannot read input: %s", strerror(errno));
+    char *src = source_alloc(len + 2 + SOURCE_PADDING);
+    memcpy(src, buf, len);
+    src[len] = '\n';
+    free(buf);
+    return src;
+}
+
+char *read_file(char *path) {
+    if (strcmp(path, "-") == 0) return read_stream(stdin);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) panic("cannot open %s: %s", path, strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st) != 0) panic("cannot stat %s: %s", path, strerror(errno));
+    if (!S_ISREG(st.st_mode)) {
+        FILE *fp = fdopen(fd, "r");
+        if (!fp) panic("cannot open %s: %s", path, strerror(errno));
+        char *buf = read_stream(fp);
+        fclose(fp);
+        return buf;
     }
-    buf[len++] = '\n';
-    buf[len++] = '\0';
 
-    if (fp != stdin) fclose(fp);
+    size_t len = st.st_size;
+    char *buf = source_alloc(len + 2 + SOURCE_PADDING);
+    if (len && mmap(buf, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+        panic("cannot map %s: %s", path, strerror(errno));
+    close(fd);
+    // past EOF, the last page of the file reads as zeros; writing there
+    // only copies that page
+    buf[len] = '\n';
+    buf[len + 1] = '\0';
     return buf;
 }
 
+// foo/bar.c -> bar.o
+static char *obj_path(char *path) {
+    if (strcmp(path, "-") == 0) panic("-c with standard input needs -o");
+    char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    int len = strlen(base);
+    if (2 <= len && strcmp(base + len - 2, ".c") == 0) len -= 2;
+    char *out = malloc(len + 3);
+    sprintf(out, "%.*s.o", len, base);
+    return out;
+}
+
+// the output of a compile, to path or stdout
+static void write_output(char *path, const char *data, size_t len) {
+    FILE *fp = path ? fopen(path, "wb") : stdout;
+    if (!fp) panic("cannot open %s: %s", path, strerror(errno));
+    if (fwrite(data, 1, len, fp) != len || fflush(fp) != 0) panic("cannot write %s: %s", path ? path : "output", strerror(errno));
+    if (path) fclose(fp);
+}
+
+// --time-report
+
+typedef struct {
+    const char *name;
+    double ms;
+    long nalloc;  // allocations, see alloc_totals
+    size_t bytes;
+} Phase;
+
+#define MAX_PHASES 16
+static Phase phases[MAX_PHASES];
+static int nphase;
+static struct timespec phase_start;
+
+static double elapsed_ms(struct timespec *since) {
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (now.tv_sec - since->tv_sec) * 1e3 + (now.tv_nsec - since->tv_nsec) / 1e6;
+}
+
+static void phase_begin(const char *name) {
+    if (nphase == MAX_PHASES) panic("too many phases");
+    Phase *p = &phases[nphase];
+    p->name = name;
+    alloc_totals(&p->nalloc, &p->bytes);
+    timespec_get(&phase_start, TIME_UTC);
+}
+
+static void phase_end(void) {
+    Phase *p = &phases[nphase++];
+    p->ms = elapsed_ms(&phase_start);
+    long nalloc;
+    size_t bytes;
+    alloc_totals(&nalloc, &bytes);
+    p->nalloc = nalloc - p->nalloc;
+    p->bytes = bytes - p->bytes;
+}
+
+static void time_report(FILE *fp, bool json) {
+    double total = 0;
+    for (int i = 0; i < nphase; i++) total += phases[i].ms;
+
+    if (json) {
+        fprintf(fp, "{\"phases\": [");
+        for (int i = 0; i < nphase; i++) {
+            Phase *p = &phases[i];
+            fprintf(fp, "%s{\"name\": \"%s\", \"ms\": %.3f, \"allocs\": %ld, \"bytes\": %zu}",
+                    i ? ", " : "", p->name, p->ms, p->nalloc, p->bytes);
+        }
+        fprintf(fp, "], \"total_ms\": %.3f, \"tokens\": %ld, \"nodes\": %ld, \"symbols\": %ld, \"instructions\": %ld, "
+                "\"expansions\": %ld, \"cached_expansions\": %ld}\n",
+                total, stats.tokens, stats.nodes, stats.symbols, stats.insns, stats.expansions, stats.cached_expansions);
+        return;
+    }
+    fprintf(fp, "%-12s %10s %6s %10s %12s\n", "phase", "ms", "%", "allocs", "bytes");
+    for (int i = 0; i < nphase; i++) {
+        Phase *p = &phases[i];
+        fprintf(fp, "%-12s %10.3f %6.1f %10ld %12zu\n",
+                p->name, p->ms, total > 0 ? p->ms * 100 / total : 0, p->nalloc, p->bytes);
+    }
+    fprintf(fp, "%-12s %10.3f\n", "total", total);
+    fprintf(fp, "tokens %ld, nodes %ld, symbols %ld, instructions %ld, expansions %ld (%ld cached)\n",
+            stats.tokens, stats.nodes, stats.symbols, stats.insns, stats.expansions, stats.cached_expansions);
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: kcc [-E | --emit-ir | -c | --run] [-o <output>] [-j <threads>] [--mem-report] [--time-report[=json]] [--peephole-report] [--no-peephole] [--no-comments] [--emit-pch <pch> | --include-pch <pch>] <file>\n");
+    exit(1);
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "invalid arg\n");
-        return 1;
+    char *path = NULL;
+    char *out_path = NULL;
+    bool mem_report = false;
+    bool time_report_on = false, time_report_json = false;
+    bool peephole_report_on = false;
+    bool emit_obj = false;
+    bool preprocess_only = false;
+    bool ir_only = false;
+    bool run = false;
+    char *pch_out = NULL, *pch_in = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--mem-report") == 0) mem_report = true;
+        else if (strcmp(argv[i], "--time-report") == 0) time_report_on = true;
+        else if (strcmp(argv[i], "--time-report=json") == 0) time_report_on = time_report_json = true;
+        else if (strcmp(argv[i], "-c") == 0) emit_obj = true;
+        else if (strcmp(argv[i], "-E") == 0) preprocess_only = true;
+        else if (strcmp(argv[i], "--emit-ir") == 0) ir_only = true;
+        else if (strcmp(argv[i], "--run") == 0) run = true;
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) out_path = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) gen_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--no-comments") == 0) emit_comments = false;
+        else if (strcmp(argv[i], "--peephole-report") == 0) peephole_report_on = true;
+        else if (strcmp(argv[i], "--no-peephole") == 0) peephole_on = false;
+        else if (strcmp(argv[i], "--emit-pch") == 0 && i + 1 < argc) pch_out = argv[++i];
+        else if (strcmp(argv[i], "--include-pch") == 0 && i + 1 < argc) pch_in = argv[++i];
+        else if (argv[i][0] == '-' && argv[i][1] != '\0') usage();
+        else if (!path) path = argv[i];
+        else usage();
     }
+    if (!path || (emit_obj && run) || (pch_out && (pch_in || emit_obj || run))) usage();
+    if ((preprocess_only || ir_only) && (emit_obj || run || pch_out)) usage();
+    if (preprocess_only && ir_only) usage();
+    if (emit_obj && !out_path) out_path = obj_path(path);
+
+    Arena *pp_arena = arena_new("preprocess");
+    Arena *parse_arena = arena_new("parse");
+    Arena *type_arena = arena_new("type");
+    ObjectFile *obj = NULL;
 
 #ifdef DEBUG
-    char *src = read_file(argv[1]);
-    Lexer *lexer = lexer_new(src);
-    Token *tokens = tokenize(lexer);
+    // the same phases, dumping the tokens and functions on the way
+    phase_begin("read_file");
+    char *src = read_file(path);
+    phase_end();
+    phase_begin("preprocess");
+    arena_use(pp_arena);
+    Token tokens = preprocess(preprocessor_new(src, NULL));
+    phase_end();
+    if (preprocess_only) {
+        print_preprocessed(tokens, stdout);
+        return 0;
+    }
     dump_tokens(tokens);
+    phase_begin("parse");
+    arena_use(parse_arena);
     Parser *parser = parser_new(tokens);
     Program *prog = parse(parser);
+    phase_end();
+    phase_begin("type_funcs");
+    arena_use(type_arena);
     type_funcs(prog);
+    phase_end();
+    phase_begin("optimize");
+    optimize(prog);
+    arena_use(NULL);
+    phase_end();
     dump_funcs(prog->funcs);
-    gen(prog);
-    return 0;
+    Emitter *e = emitter_new(-1);
+    phase_begin("gen");
+    gen(prog, e);
+    phase_end();
+    write_output(out_path, e->buf, e->len);
 #else
-    char *src = read_file(argv[1]);
+    phase_begin("read_file");
+    char *src = read_file(path);
+    phase_end();
+
     Preprocessor *pp = preprocessor_new(src, NULL);
-    Token *tokens = preprocess(pp);
-    Parser *parser = parser_new(tokens);
+    Parser *parser = parser_new(0);
+    if (pch_in) {
+        phase_begin("read_pch");
+        arena_use(parse_arena);
+        read_pch(pch_in, pp, parser);
+        phase_end();
+    }
+
+    phase_begin("preprocess");
+    arena_use(pp_arena);
+    parser->tokens = parser->current_token = preprocess(pp);
+    phase_end();
+
+    if (preprocess_only) {
+        FILE *fp = out_path ? fopen(out_path, "w") : stdout;
+        if (!fp) panic("cannot open %s: %s", out_path, strerror(errno));
+        print_preprocessed(parser->tokens, fp);
+        fclose(fp);
+        if (time_report_on) time_report(stderr, time_report_json);
+        return 0;
+    }
+
+    // -E, --emit-pch, --emit-ir and --run produce nothing worth keeping;
+    // --peephole-report counts what codegen does
+    Cache *cache = NULL;
+    if (!pch_out && !run && !ir_only && !peephole_report_on) {
+        phase_begin("cache");
+        char flags[64];
+        snprintf(flags, sizeof(flags), "%s%s", emit_obj ? "-c" : emit_comments ? "-S" : "-S --no-comments",
+                 peephole_on ? "" : " --no-peephole");
+        cache = cache_open(parser->tokens, flags, pch_in);
+        size_t len;
+        char *cached = cache ? cache_get(cache, &len) : NULL;
+        if (cached) write_output(out_path, cached, len);
+        phase_end();
+        if (cached) {
+            if (mem_report) arena_report(stderr);
+            if (time_report_on) time_report(stderr, time_report_json);
+            return 0;
+        }
+    }
+
+    phase_begin("parse");
+    arena_use(parse_arena);
     Program *prog = parse(parser);
+    phase_end();
+
+    if (pch_out) {
+        phase_begin("write_pch");
+        write_pch(pch_out, pp, prog);
+        phase_end();
+        if (mem_report) arena_report(stderr);
+        if (time_report_on) time_report(stderr, time_report_json);
+        return 0;
+    }
+
+    phase_begin("type_funcs");
+    arena_use(type_arena);
     type_funcs(prog);
-    gen(prog);
-    return 0;
+    phase_end();
+
+    phase_begin("optimize");
+    optimize(prog);
+    arena_use(NULL);
+    phase_end();
+
+    if (ir_only) {
+        FILE *fp = out_path ? fopen(out_path, "w") : stdout;
+        if (!fp) panic("cannot open %s: %s", out_path, strerror(errno));
+        phase_begin("ir");
+        emit_ir(prog, fp);
+        phase_end();
+        fclose(fp);
+        if (mem_report) arena_report(stderr);
+        if (time_report_on) time_report(stderr, time_report_json);
+        return 0;
+    }
+
+    if (emit_obj || run) {
+        Emitter *e = emitter_new(-1);
+        phase_begin("gen");
+        gen(prog, e);
+        phase_end();
+        phase_begin("assemble");
+        obj = assemble(e->buf, e->len);
+        phase_end();
+        if (emit_obj) {
+            phase_begin("write_elf");
+            size_t len;
+            char *image = elf_image(obj, &len);
+            write_output(out_path, image, len);
+            if (cache) cache_put(cache, image, len);
+            phase_end();
+        }
+    } else if (cache) {
+        // kept whole, to be stored as well as written
+        Emitter *e = emitter_new(-1);
+        phase_begin("gen");
+        gen(prog, e);
+        phase_end();
+        phase_begin("write_cache");
+        write_output(out_path, e->buf, e->len);
+        cache_put(cache, e->buf, e->len);
+        phase_end();
+    } else {
+        if (out_path && !freopen(out_path, "w", stdout)) panic("cannot open %s: %s", out_path, strerror(errno));
+        phase_begin("gen");
+        gen(prog, emitter_new(STDOUT_FILENO));
+        phase_end();
+    }
 #endif
+    if (mem_report) arena_report(stderr);
+    if (time_report_on) time_report(stderr, time_report_json);
+    if (peephole_report_on) peephole_report(stderr);
+    if (run) return jit_run(obj);
+    return 0;
 }
@@ -0,0 +1,387 @@
+#include "kcc.h"
+
+// Promotion of locals to SSA values
+//
+// a scalar local whose address is only loaded from and stored to, never
+// taken with & or offset into, does not need its stack slot. every load of
+// it is replaced by the value stored last on the way there, with phis in
+// the blocks where stores from different paths meet (the iterated
+// dominance frontier of the stores). the loads, stores and addresses of
+// the local disappear; codegen keeps the values in registers.
+
+typedef struct {
+    int var;
+    IrValue *prev;
+} Undo;
+
+typedef struct {
+    IrFunc *func;
+    int nblocks;
+    IrBlock **order;   // reverse postorder
+    int *rpo;          // rpo number, by block id
+    int *idom;         // rpo number of the immediate dominator, by rpo number
+    Stack **frontier;  // dominance frontier, by rpo number
+    Stack **children;  // dominator tree, by rpo number
+    Symbol **vars;     // the promoted locals
+    int nvars;
+    int *var_index;    // 1 + index into vars, by frame offset
+    IrValue **current; // value of each var at this point of the renaming
+    Undo *undo;        // definitions to take back when renaming leaves a block
+    int nundo;
+    int undo_capacity;
+    IrValue **replace; // by id: the value a removed load read
+    bool *dead;        // by id
+    int nids;          // ids before renaming, which adds some
+    IrValue *zero;     // the value of a var read before it is stored
+} Promoter;
+
+// index of the promoted var addr points to, or -1
+static int var_of(Promoter *p, IrValue *addr) {
+    if (addr->op != IR_LOCAL) return -1;
+    return p->var_index[addr->var->offset] - 1;
+}
+
+static void find_vars(Promoter *p) {
+    Symbol *locals = p->func->fnode->func.locals;
+    p->var_index = calloc((locals ? locals->offset : 0) + 1, sizeof(int));
+    for (Symbol *var = locals; var; var = var->next)
+        if (is_scalar(var->type)) p->var_index[var->offset] = 1;
+    for (int i = 0; i < p->func->nblocks; i++) {
+        IrBlock *block = p->func->blocks[i];
+        for (int j = 0; j < block->ninsts; j++) {
+            IrValue *v = block->insts[j];
+            for (int k = 0; k < v->nargs; k++) {
+                IrValue *arg = v->args[k];
+                if (arg->op != IR_LOCAL) continue;
+                if ((v->op == IR_LOAD || v->op == IR_STORE) && k == 0) continue;
+                p->var_index[arg->var->offset] = 0; // the address escapes
+            }
+        }
+    }
+    for (Symbol *var = locals; var; var = var->next) p->nvars += p->var_index[var->offset];
+    p->vars = calloc(p->nvars + 1, sizeof(Symbol *));
+    int n = 0;
+    for (Symbol *var = locals; var; var = var->next) {
+        if (!p->var_index[var->offset]) continue;
+        p->vars[n] = var;
+        p->var_index[var->offset] = ++n;
+    }
+}
+
+// Dominators
+//
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm", over
+// rpo numbers: a block's dominators all have smaller numbers.
+
+static void number_blocks(Promoter *p) {
+    IrFunc *func = p->func;
+    p->order = calloc(func->nblocks, sizeof(IrBlock *));
+    p->rpo = calloc(func->nblock_ids, sizeof(int));
+    bool *seen = calloc(func->nblock_ids, sizeof(bool));
+    IrBlock **stack = calloc(func->nblocks, sizeof(IrBlock *));
+    int *next = calloc(func->nblocks, sizeof(int)); // next target to visit
+    int n = 0, post = func->nblocks;
+    stack[n++] = func->blocks[0];
+    seen[func->blocks[0]->id] = true;
+    while (n) {
+        IrBlock *block = stack[n - 1];
+        IrValue *term = ir_terminator(block);
+        if (term && next[n - 1] < term->ntargets) {
+            IrBlock *succ = term->targets[next[n - 1]++];
+            if (seen[succ->id]) continue;
+            seen[succ->id] = true;
+            next[n] = 0;
+            stack[n++] = succ;
+            continue;
+        }
+        p->order[--post] = block;
+        n--;
+    }
+    p->nblocks = func->nblocks - post; // all of them, after remove_unreachable
+    for (int i = 0; i < p->nblocks; i++) p->rpo[p->order[i]->id] = i;
+    free(seen);
+    free(stack);
+    free(next);
+}
+
+static int intersect(int *idom, int a, int b) {
+    while (a != b) {
+        while (a > b) a = idom[a];
+        while (b > a) b = idom[b];
+    }
+    return a;
+}
+
+static void find_dominators(Promoter *p) {
+    int n = p->nblocks;
+    p->idom = calloc(n, sizeof(int));
+    for (int i = 1; i < n; i++) p->idom[i] = -1;
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (int i = 1; i < n; i++) {
+            IrBlock *block = p->order[i];
+            int idom = -1;
+            for (int j = 0; j < block->npreds; j++) {
+                int pred = p->rpo[block->preds[j]->id];
+                if (p->idom[pred] < 0) continue;
+                idom = idom < 0 ? pred : intersect(p->idom, idom, pred);
+            }
+            if (p->idom[i] == idom) continue;
+            p->idom[i] = idom;
+            changed = true;
+        }
+    }
+
+    p->frontier = calloc(n, sizeof(Stack *));
+    p->children = calloc(n, sizeof(Stack *));
+    for (int i = 0; i < n; i++) {
+        p->frontier[i] = stack_new(4);
+        p->children[i] = stack_new(4);
+    }
+    for (int i = 1; i < n; i++) stack_push(p->children[p->idom[i]], i);
+    for (int i = 0; i < n; i++) {
+        IrBlock *block = p->order[i];
+        if (block->npreds < 2) continue;
+        for (int j = 0; j < block->npreds; j++) {
+            for (int runner = p->rpo[block->preds[j]->id]; runner != p->idom[i]; runner = p->idom[runner]) {
+                Stack *df = p->frontier[runner];
+                if (df->top && df->data[df->top - 1] == i) break; // from another pred
+                stack_push(df, i);
+            }
+        }
+    }
+}
+
+// Phis
+
+static void insert_phis(Promoter *p) {
+    int n = p->nblocks;
+    // the blocks that store to each var
+    Stack **stores = calloc(p->nvars, sizeof(Stack *));
+    for (int var = 0; var < p->nvars; var++) stores[var] = stack_new(4);
+    for (int i = 0; i < n; i++) {
+        IrBlock *block = p->order[i];
+        for (int j = 0; j < block->ninsts; j++) {
+            IrValue *v = block->insts[j];
+            int var = v->op == IR_STORE ? var_of(p, v->args[0]) : -1;
+            if (var < 0) continue;
+            Stack *s = stores[var];
+            if (!s->top || s->data[s->top - 1] != i) stack_push(s, i);
+        }
+    }
+
+    int *has_phi = calloc(n, sizeof(int)); // 1 + index of the last var given a phi
+    int *queued = calloc(n, sizeof(int));  // likewise, for the worklist
+    int *nphis = calloc(n, sizeof(int));
+    IrValue **phis = NULL;
+    int total = 0, capacity = 0;
+    for (int var = 0; var < p->nvars; var++) {
+        Stack *work = stores[var];
+        for (int i = 0; i < work->top; i++) queued[work->data[i]] = var + 1;
+        while (work->top) {
+            Stack *df = p->frontier[stack_pop(work)];
+            for (int k = 0; k < df->top; k++) {
+                int f = df->data[k];
+                if (has_phi[f] == var + 1) continue;
+                has_phi[f] = var + 1;
+                IrBlock *block = p->order[f];
+                IrValue *phi = ir_value_new(p->func, IR_PHI, p->vars[var]->type, block->npreds);
+                phi->var = p->vars[var];
+                phi->block = block;
+                if (total == capacity) {
+                    capacity = capacity ? capacity * 2 : 16;
+                    phis = realloc(phis, capacity * sizeof(IrValue *));
+                    if (!phis) panic("cannot reallocate memory: %s", strerror(errno));
+                }
+                phis[total++] = phi;
+                nphis[f]++;
+                if (queued[f] == var + 1) continue;
+                queued[f] = var + 1;
+                stack_push(work, f);
+            }
+        }
+        stack_free(work);
+    }
+
+    // the new phis go first in their blocks
+    for (int i = 0; i < n; i++) {
+        if (!nphis[i]) continue;
+        IrBlock *block = p->order[i];
+        IrValue **insts = ir_alloc(p->func, (nphis[i] + block->ninsts) * sizeof(IrValue *));
+        memcpy(insts + nphis[i], block->insts, block->ninsts * sizeof(IrValue *));
+        block->insts = insts;
+        block->ninsts += nphis[i];
+        block->insts_capacity = block->ninsts;
+        nphis[i] = 0;
+    }
+    for (int i = 0; i < total; i++) {
+        int b = p->rpo[phis[i]->block->id];
+        phis[i]->block->insts[nphis[b]++] = phis[i];
+    }
+    free(phis);
+    free(stores);
+    free(nphis);
+    free(has_phi);
+    free(queued);
+}
+
+// Renaming
+
+// bytes of the low end of v that the rest of it is the sign extension of
+static int width(IrValue *v, int depth) {
+    switch (v->op) {
+        case IR_CONST:
+            return v->imm == (signed char)v->imm ? 1 : v->imm == (int)v->imm ? 4 : 8;
+        case IR_LOAD:
+        case IR_PARAM:
+        case IR_CALL:
+        case IR_CAST:
+            return sizeof_type(v->type);
+        case IR_EQ:
+        case IR_NE:
+        case IR_LT:
+        case IR_LE:
+        case IR_NOT:
+            return 1;
+        case IR_PHI: {
+            // a promoted var's phi merges values stored to it
+            if (v->var) return sizeof_type(v->type);
+            if (depth == 4) return 8;
+            int w = 1;
+            for (int i = 0; i < v->nargs; i++) {
+                int x = width(v->args[i], depth + 1);
+                if (w < x) w = x;
+            }
+            return w;
+        }
+        default:
+            return 8;
+    }
+}
+
+static IrValue *resolve(Promoter *p, IrValue *v) {
+    while (v->id < p->nids && p->replace[v->id]) v = p->replace[v->id];
+    return v;
+}
+
+static IrValue *current(Promoter *p, int var) {
+    if (p->current[var]) return p->current[var];
+    if (!p->zero) {
+        p->zero = ir_value_new(p->func, IR_CONST, type_int, 0);
+        p->zero->block = p->func->blocks[0];
+    }
+    return p->zero;
+}
+
+static void define(Promoter *p, int var, IrValue *v) {
+    if (p->nundo == p->undo_capacity) {
+        p->undo_capacity = p->undo_capacity ? p->undo_capacity * 2 : 16;
+        p->undo = realloc(p->undo, p->undo_capacity * sizeof(Undo));
+        if (!p->undo) panic("cannot reallocate memory: %s", strerror(errno));
+    }
+    p->undo[p->nundo++] = (Undo){var, p->current[var]};
+    p->current[var] = v;
+}
+
+// in dominator tree order, so the value current at a load is the one
+// stored last on every path to it
+static void rename_block(Promoter *p, int b) {
+    int nundo = p->nundo;
+    IrBlock *block = p->order[b];
+    for (int i = 0; i < block->ninsts; i++) {
+        IrValue *v = block->insts[i];
+        int var = -1;
+        if (v->op == IR_PHI && v->var) {
+            define(p, p->var_index[v->var->offset] - 1, v);
+        } else if (v->op == IR_LOCAL) {
+            if (var_of(p, v) >= 0) p->dead[v->id] = true;
+        } else if (v->op == IR_LOAD && (var = var_of(p, v->args[0])) >= 0) {
+            p->replace[v->id] = current(p, var);
+            p->dead[v->id] = true;
+        } else if (v->op == IR_STORE && (var = var_of(p, v->args[0])) >= 0) {
+            // the store truncated; the value becomes a cast where that matters
+            IrValue *val = resolve(p, v->args[1]);
+            if (width(val, 0) <= sizeof_type(v->type)) {
+                p->dead[v->id] = true;
+                define(p, var, val);
+            } else {
+                v->op = IR_CAST;
+                v->args[0] = val;
+                v->nargs = 1;
+                define(p, var, v);
+            }
+        }
+    }
+
+    IrValue *term = ir_terminator(block);
+    for (int i = 0; term && i < term->ntargets; i++) {
+        IrBlock *succ = term->targets[i];
+        for (int j = 0; j < succ->npreds; j++) {
+            if (succ->preds[j] != block) continue;
+            for (int k = 0; k < succ->ninsts && succ->insts[k]->op == IR_PHI; k++) {
+                IrValue *phi = succ->insts[k];
+                if (phi->var) phi->args[j] = current(p, p->var_index[phi->var->offset] - 1);
+            }
+        }
+    }
+
+    Stack *children = p->children[b];
+    for (int i = 0; i < children->top; i++) rename_block(p, children->data[i]);
+    while (p->nundo > nundo) {
+        Undo *u = &p->undo[--p->nundo];
+        p->current[u->var] = u->prev;
+    }
+}
+
+void ir_promote_locals(IrFunc *func) {
+    Promoter p = {.func = func};
+    find_vars(&p);
+    if (p.nvars) {
+        number_blocks(&p);
+        find_dominators(&p);
+        insert_phis(&p);
+        p.nids = func->nvalues;
+        p.replace = calloc(p.nids, sizeof(IrValue *));
+        p.dead = calloc(p.nids, sizeof(bool));
+        p.current = calloc(p.nvars, sizeof(IrValue *));
+        rename_block(&p, 0);
+
+        // drop the locals' addresses, loads and stores; the users of a load
+        // get the value it read
+        for (int i = 0; i < func->nblocks; i++) {
+            IrBlock *block = func->blocks[i];
+            int n = 0;
+            for (int j = 0; j < block->ninsts; j++) {
+                IrValue *v = block->insts[j];
+                if (v->id < p.nids && p.dead[v->id]) continue;
+                for (int k = 0; k < v->nargs; k++) v->args[k] = resolve(&p, v->args[k]);
+                block->insts[n++] = v;
+            }
+            block->ninsts = n;
+        }
+        if (p.zero) {
+            IrBlock *entry = func->blocks[0];
+            IrValue **insts = ir_alloc(func, (entry->ninsts + 1) * sizeof(IrValue *));
+            insts[0] = p.zero;
+            memcpy(insts + 1, entry->insts, entry->ninsts * sizeof(IrValue *));
+            entry->insts = insts;
+            entry->insts_capacity = ++entry->ninsts;
+        }
+
+        for (int i = 0; i < p.nblocks; i++) {
+            stack_free(p.frontier[i]);
+            stack_free(p.children[i]);
+        }
+        free(p.order);
+        free(p.rpo);
+        free(p.idom);
+        free(p.frontier);
+        free(p.children);
+        free(p.current);
+        free(p.undo);
+        free(p.replace);
+        free(p.dead);
+    }
+    free(p.vars);
+    free(p.var_index);
+}
@@ -0,0 +1,267 @@
+#include "kcc.h"
+
+// AST-level constant folding and algebraic simplification.
+// runs after type_funcs; a rewritten expression keeps the type the
+// type checker gave it, or is replaced by a subtree that already has one.
+
+static Node *fold(Node *node, Env *env);
+
+static bool is_const(Node *node) {
+    return node && node->tag == NT_INT;
+}
+
+static bool is_const_val(Node *node, int val) {
+    return is_const(node) && node->integer == val;
+}
+
+// turn node into an integer constant; fails when val does not fit in int
+static bool to_const(Node *node, long val) {
+    if (val < INT32_MIN || INT32_MAX < val) return false;
+    node->tag = NT_INT;
+    node->integer = val;
+    node->type = type_int;
+    return true;
+}
+
+// true if evaluating node has no side effects, so it can be dropped
+static bool is_pure(Node *node) {
+    if (!node) return true;
+    switch (node->tag) {
+        case NT_INT:
+        case NT_IDENT:
+        case NT_STRING:
+        case NT_SIZEOF:
+            return true;
+        case NT_NEG:
+        case NT_BOOL_NOT:
+        case NT_ADDR:
+        case NT_DEREF:
+            return is_pure(node->unary_expr);
+        case NT_ADD:
+        case NT_SUB:
+        case NT_MUL:
+        case NT_EQ:
+        case NT_NE:
+        case NT_LT:
+        case NT_LE:
+        case NT_AND:
+        case NT_OR:
+        case NT_COMMA:
+            return is_pure(node->bin_expr.lhs) && is_pure(node->bin_expr.rhs);
+        case NT_COND:
+            return is_pure(node->cond_expr.cond)
+                && is_pure(node->cond_expr.then)
+                && is_pure(node->cond_expr.els);
+        case NT_DOT:
+        case NT_ARROW:
+            return is_pure(node->member_access.lhs);
+        default:
+            return false; // assignments, ++/--, calls, division (may trap)
+    }
+}
+
+// in a context that only tests for zero/non-zero, !!x == x
+static Node *fold_cond(Node *node, Env *env) {
+    node = fold(node, env);
+    while (node && node->tag == NT_BOOL_NOT && node->unary_expr->tag == NT_BOOL_NOT)
+        node = node->unary_expr->unary_expr;
+    return node;
+}
+
+static void fold_nodelist(NodeList *list, Env *env) {
+    for (int i = 0; i < list->len; i++)
+        list->nodes[i] = fold(list->nodes[i], env);
+}
+
+static Node *fold_binary(Node *node, Env *env) {
+    Node *lhs = node->bin_expr.lhs = fold(node->bin_expr.lhs, env);
+    Node *rhs = node->bin_expr.rhs = fold(node->bin_expr.rhs, env);
+
+    if (is_const(lhs) && is_const(rhs)) {
+        long l = lhs->integer, r = rhs->integer;
+        switch (node->tag) {
+            case NT_ADD: if (to_const(node, l + r)) return node; break;
+            case NT_SUB: if (to_const(node, l - r)) return node; break;
+            case NT_MUL: if (to_const(node, l * r)) return node; break;
+            case NT_DIV: if (r != 0 && to_const(node, l / r)) return node; break;
+            case NT_MOD: if (r != 0 && to_const(node, l % r)) return node; break;
+            case NT_EQ: to_const(node, l == r); return node;
+            case NT_NE: to_const(node, l != r); return node;
+            case NT_LT: to_const(node, l < r); return node;
+            case NT_LE: to_const(node, l <= r); return node;
+            default: break;
+        }
+    }
+
+    // identities. only for integer operands: pointer arithmetic scales rhs,
+    // and an array operand must keep decaying through the enclosing node.
+    if (!is_integer(lhs->type) || !is_integer(rhs->type)) return node;
+    switch (node->tag) {
+        case NT_ADD:
+            if (is_const_val(rhs, 0)) return lhs;
+            if (is_const_val(lhs, 0)) return rhs;
+            break;
+        case NT_SUB:
+            if (is_const_val(rhs, 0)) return lhs;
+            break;
+        case NT_MUL:
+            if (is_const_val(rhs, 1)) return lhs;
+            if (is_const_val(lhs, 1)) return rhs;
+            if ((is_const_val(rhs, 0) && is_pure(lhs)) || (is_const_val(lhs, 0) && is_pure(rhs))) {
+                to_const(node, 0);
+                return node;
+            }
+            break;
+        case NT_DIV:
+            if (is_const_val(rhs, 1)) return lhs;
+            break;
+        default:
+            break;
+    }
+    return node;
+}
+
+static Node *fold_logical(Node *node, Env *env) {
+    Node *lhs = node->bin_expr.lhs = fold_cond(node->bin_expr.lhs, env);
+    Node *rhs = node->bin_expr.rhs = fold_cond(node->bin_expr.rhs, env);
+    if (!is_const(lhs)) return node;
+    if (node->tag == NT_AND && lhs->integer == 0) to_const(node, 0);
+    else if (node->tag == NT_OR && lhs->integer != 0) to_const(node, 1);
+    else if (is_const(rhs)) to_const(node, rhs->integer != 0);
+    return node;
+}
+
+static Node *fold(Node *node, Env *env) {
+    if (!node) return node;
+    switch (node->tag) {
+        case NT_INT:
+        case NT_STRING:
+        case NT_TYPENAME:
+        case NT_BREAK:
+        case NT_CONTINUE:
+        case NT_PARAMDECL:
+        case NT_GLOBALDECL:
+            return node;
+        case NT_IDENT: {
+            // enum constant, unless shadowed by a variable
+            Token ident = node->main_token;
+            if (find_symbol(ST_LVAR, env->local_vars, ident)) return node;
+            if (find_symbol(ST_GVAR, env->global_vars, ident)) return node;
+            Symbol *mem = find_enum_val(env->enum_vals, ident);
+            if (mem) to_const(node, mem->value);
+            return node;
+        }
+        case NT_SIZEOF:
+            // the operand is not evaluated; do not fold it either,
+            // since that could change its type (e.g. a+0 -> a for an array)
+            to_const(node, sizeof_type(node->unary_expr->type));
+            return node;
+        case NT_NEG:
+            node->unary_expr = fold(node->unary_expr, env);
+            if (is_const(node->unary_expr)) to_const(node, -(long)node->unary_expr->integer);
+            return node;
+        case NT_BOOL_NOT:
+            node->unary_expr = fold_cond(node->unary_expr, env);
+            if (is_const(node->unary_expr)) to_const(node, !node->unary_expr->integer);
+            return node;
+        case NT_ADDR:
+        case NT_DEREF:
+        case NT_PREINC:
+        case NT_PREDEC:
+        case NT_RETURN:
+            node->unary_expr = fold(node->unary_expr, env);
+            return node;
+        case NT_POSTINC:
+        case NT_POSTDEC:
+            node->pre_expr = fold(node->pre_expr, env);
+            return node;
+        case NT_ADD:
+        case NT_SUB:
+        case NT_MUL:
+        case NT_DIV:
+        case NT_MOD:
+        case NT_EQ:
+        case NT_NE:
+        case NT_LT:
+        case NT_LE:
+            return fold_binary(node, env);
+        case NT_AND:
+        case NT_OR:
+            return fold_logical(node, env);
+        case NT_ASSIGN:
+        case NT_ASSIGN_ADD:
+        case NT_ASSIGN_SUB:
+        case NT_ASSIGN_MUL:
+        case NT_ASSIGN_DIV:
+        case NT_COMMA:
+            node->bin_expr.lhs = fold(node->bin_expr.lhs, env);
+            node->bin_expr.rhs = fold(node->bin_expr.rhs, env);
+            return node;
+        case NT_COND: {
+            Node *cond = node->cond_expr.cond = fold_cond(node->cond_expr.cond, env);
+            node->cond_expr.then = fold(node->cond_expr.then, env);
+            node->cond_expr.els = fold(node->cond_expr.els, env);
+            if (is_const(cond)) return cond->integer ? node->cond_expr.then : node->cond_expr.els;
+            return node;
+        }
+        case NT_DOT:
+        case NT_ARROW:
+            node->member_access.lhs = fold(node->member_access.lhs, env);
+            return node;
+        case NT_FNCALL:
+            fold_nodelist(node->fncall.args, env);
+            return node;
+        case NT_BLOCK:
+            fold_nodelist(node->block, env);
+            return node;
+        case NT_IF:
+            node->ifstmt.cond = fold_cond(node->ifstmt.cond, env);
+            node->ifstmt.then = fold(node->ifstmt.then, env);
+            node->ifstmt.els = fold(node->ifstmt.els, env);
+            return node;
+        case NT_WHILE:
+        case NT_DO_WHILE:
+            node->whilestmt.cond = fold_cond(node->whilestmt.cond, env);
+            node->whilestmt.body = fold(node->whilestmt.body, env);
+            return node;
+        case NT_FOR:
+            node->forstmt.def = fold(node->forstmt.def, env);
+            node->forstmt.cond = fold_cond(node->forstmt.cond, env);
+            node->forstmt.next = fold(node->forstmt.next, env);
+            node->forstmt.body = fold(node->forstmt.body, env);
+            return node;
+        case NT_SWITCH:
+            node->switchstmt.control = fold(node->switchstmt.control, env);
+            fold_nodelist(node->switchstmt.cases, env);
+            return node;
+        case NT_CASE:
+            node->caseblock.constant = fold(node->caseblock.constant, env);
+            fold_nodelist(node->caseblock.stmts, env);
+            return node;
+        case NT_FUNC:
+            node->func.body = fold(node->func.body, env);
+            return node;
+        case NT_DECLARATOR:
+            node->declarator.init = fold(node->declarator.init, env);
+            return node;
+        case NT_INITS:
+            fold_nodelist(node->initializers, env);
+            return node;
+        case NT_LOCALDECL:
+            fold_nodelist(node->declarators, env);
+            return node;
+    }
+    return node;
+}
+
+void optimize(Program *prog) {
+    Env *env = env_new(NULL, prog->global_map, prog->func_map, prog->enum_map);
+    for (Symbol *var = prog->global_vars; var != NULL; var = var->next)
+        var->init = fold(var->init, env);
+    for (int i = 0; i < prog->funcs->len; i++) {
+        Node *fnode = prog->funcs->nodes[i];
+        env->local_vars = fnode->func.local_map;
+        fold(fnode, env);
+    }
+    free(env);
+}
@@ -67,8 +67,8 @@ static bool is_right_assoc(TokenTag tag) {
 // NodeList
 
 NodeList *nodelist_new(int capacity) {
-    NodeList *nlist = calloc(1, sizeof(NodeList));
-    nlist->nodes = calloc(capacity, sizeof(Node*));
+    NodeList *nlist = arena_alloc(sizeof(NodeList));
+    nlist->nodes = arena_alloc(capacity * sizeof(Node*));
     nlist->len = 0;
     nlist->capacity = capacity;
     return nlist;
@@ -77,7 +77,9 @@ NodeList *nodelist_new(int capacity) {
 void nodelist_append(NodeList *nlist, Node *node) {
     if (nlist->capacity <= nlist->len) {
         nlist->capacity = nlist->capacity * 2 + 1;
-        nlist->nodes = realloc(nlist->nodes, nlist->capacity * sizeof(Node*));
+        Node **nodes = arena_alloc(nlist->capacity * sizeof(Node*));
+        memcpy(nodes, nlist->nodes, nlist->len * sizeof(Node*));
+        nlist->nodes = nodes;
     }
     nlist->nodes[nlist->len++] = node;
 }
@@ -85,25 +87,28 @@ void nodelist_append(NodeList *nlist, Node *node) {
 // TokenList
 
 TokenList *tokenlist_new(int capacity) {
-    TokenList *tlist = calloc(1, sizeof(TokenList));
-    tlist->tokens = calloc(capacity, sizeof(Token*));
+    TokenList *tlist = arena_alloc(sizeof(TokenList));
+    tlist->tokens = arena_alloc(capacity * sizeof(Token));
     tlist->len = 0;
     tlist->capacity = capacity;
     return tlist;
 }
 
-void tokenlist_append(TokenList *tlist, Token *token) {
+void tokenlist_append(TokenList *tlist, Token token) {
     if (tlist->capacity <= tlist->len) {
         tlist->capacity = tlist->capacity * 2 + 1;
-        tlist->tokens = realloc(tlist->tokens, tlist->capacity * sizeof(Token*));
+        Token *tokens = arena_alloc(tlist->capacity * sizeof(Token));
+        memcpy(tokens, tlist->tokens, tlist->len * sizeof(Token));
+        tlist->tokens = tokens;
     }
     tlist->tokens[tlist->len++] = token;
 }
 
 // Symbol
 
-static Symbol *symbol_new(SymbolTag tag, Token *ident, Type *type, Symbol *next) {
-    Symbol *symbol = calloc(1, sizeof(Symbol));
+static Symbol *symbol_new(SymbolTag tag, Token ident, Type *type, Symbol *next) {
+    Symbol *symbol = arena_alloc(sizeof(Symbol));
+    stats.symbols++;
     symbol->tag = tag;
     symbol->token = ident;
     symbol->type = type;
@@ -111,77 +116,94 @@ static Symbol *symbol_new(SymbolTag tag, Token *ident, Type *type, Symbol *next)
     return symbol;
 }
 
-static Symbol *append_local_var(Parser *parser, Token *ident, Type *type) {
+static void index_symbol(HashMap *map, Symbol *symbol) {
+    if (symbol->token) hashmap_put_atom(map, tok_atom(symbol->token), symbol);
+}
+
+static Symbol *append_local_var(Parser *parser, Token ident, Type *type) {
     Symbol **locals = &parser->current_func->func.locals;
     int current_offset = *locals ? (*locals)->offset : 0;
     int size = sizeof_type(type);
     Symbol *symbol = symbol_new(ST_LVAR, ident, type, *locals);
     symbol->offset = current_offset + size;
     *locals = symbol;
+    index_symbol(parser->current_func->func.local_map, symbol);
     return symbol;
 }
 
-static Symbol *append_global_var(Parser *parser, Token *ident, Type *type, Node *init) {
+static Symbol *append_global_var(Parser *parser, Token ident, Type *type, Node *init) {
     Symbol **globals = &parser->global_vars;
     Symbol *symbol = symbol_new(ST_GVAR, ident, type, *globals);
     symbol->init = init;
     *globals = symbol;
+    index_symbol(parser->global_map, symbol);
     return symbol;
 }
 
-static Symbol *append_func_type(Parser *parser, Token *ident, Type *type) {
+static Symbol *append_func_type(Parser *parser, Token ident, Type *type) {
     Symbol **fntypes = &parser->func_types;
     Symbol *symbol = symbol_new(ST_FUNC, ident, type, *fntypes);
     *fntypes = symbol;
+    index_symbol(parser->func_map, symbol);
     return symbol;
 }
 
-static Symbol *append_type(Parser *parser, SymbolTag tag, Token *ident, Type *type) {
+static HashMap *type_map(Parser *parser, SymbolTag tag) {
+    return tag == ST_TYPEDEF ? parser->typedef_map : parser->tag_map;
+}
+
+static Symbol *append_type(Parser *parser, SymbolTag tag, Token ident, Type *type) {
     Symbol **deftypes = &parser->defined_types;
     Symbol *symbol = symbol_new(tag, ident, type, *deftypes);
     *deftypes = symbol;
+    index_symbol(type_map(parser, tag), symbol);
     return symbol;
 }
 
-Symbol *find_symbol(SymbolTag tag, Symbol *symlist, Token *ident) {
-    for (Symbol *sym = symlist; sym != NULL; sym = sym->next) {
-        if (ident->len != sym->token->len) continue;
-        if (sym->tag == tag && tokeneq(ident, sym->token)) return sym;
-    }
+Symbol *find_symbol(SymbolTag tag, HashMap *map, Token ident) {
+    Symbol *sym = hashmap_get_atom(map, tok_atom(ident));
+    if (sym && sym->tag == tag) return sym;
     return NULL;
 }
 
-Symbol *find_member(Symbol *symlist, Token *ident, int *offset) {
-    for (Symbol *sym = symlist; sym != NULL; sym = sym->next) {
-        if (sym->token == NULL) {
+typedef struct {
+    Symbol *sym;
+    int offset;
+} MemberRef;
+
+// members of anonymous structs / unions are indexed as if they were
+// direct members. the first declaration of a name wins.
+static void index_members(HashMap *map, Symbol *list, int base) {
+    for (Symbol *sym = list; sym != NULL; sym = sym->next) {
+        if (!sym->token) {
             // anonymous struct / union
             if (sym->type->tag != TYP_STRUCT && sym->type->tag != TYP_UNION)
                 panic("invalid member");
-
-            if (offset) *offset += sym->offset;
-            Symbol *sub_sym = find_member(sym->type->tagged_typ.list, ident, offset);
-            if (sub_sym) {
-                return sub_sym;
-            }
-            if (offset) *offset -= sym->offset;
+            index_members(map, sym->type->tagged_typ.list, base + sym->offset);
             continue;
         }
-        if (ident->len != sym->token->len) continue;
-        if (sym->tag == ST_MEMBER && tokeneq(ident, sym->token)) {
-            if (offset) *offset += sym->offset;
-            return sym;
-        }
+        if (sym->tag != ST_MEMBER) continue;
+        if (hashmap_get_atom(map, tok_atom(sym->token))) continue;
+        MemberRef *ref = arena_alloc(sizeof(MemberRef));
+        ref->sym = sym;
+        ref->offset = base + sym->offset;
+        hashmap_put_atom(map, tok_atom(sym->token), ref);
     }
-    return NULL;
 }
 
-Symbol *find_enum_val(Symbol *defined_types, Token *ident) {
-    for (Symbol *sym = defined_types; sym != NULL; sym = sym->next) {
-        if (sym->tag != ST_ENUM) continue;
-        Symbol *mem = find_symbol(ST_MEMBER, sym->type->tagged_typ.list, ident);
-        if (mem) return mem;
+Symbol *find_member(Type *type, Token ident, int *offset) {
+    if (!type->tagged_typ.members) {
+        type->tagged_typ.members = hashmap_new();
+        index_members(type->tagged_typ.members, type->tagged_typ.list, 0);
     }
-    return NULL;
+    MemberRef *ref = hashmap_get_atom(type->tagged_typ.members, tok_atom(ident));
+    if (!ref) return NULL;
+    if (offset) *offset += ref->offset;
+    return ref->sym;
+}
+
+Symbol *find_enum_val(HashMap *enum_map, Token ident) {
+    return find_symbol(ST_MEMBER, enum_map, ident);
 }
 
 Symbol *reverse_symbols(Symbol *list) {
@@ -201,7 +223,7 @@ int align_n(int x, int n) {
 
 // Parser
 
-Parser *parser_new(Token *tokens) {
+Parser *parser_new(Token tokens) {
     Parser *parser = calloc(1, sizeof(Parser));
     parser->tokens = tokens;
     parser->current_token = tokens;
@@ -209,43 +231,49 @@ Parser *parser_new(Token *tokens) {
     parser->global_vars = NULL;
     parser->func_types = NULL;
     parser->string_tokens = tokenlist_new(DEFAULT_TOKENLIST_CAP);
+    parser->func_map = hashmap_new();
+    parser->global_map = hashmap_new();
+    parser->tag_map = hashmap_new();
+    parser->typedef_map = hashmap_new();
+    parser->enum_map = hashmap_new();
     return parser;
 }
 
-static Node *node_new(NodeTag tag, Token *main_token) {
-    Node *node = calloc(1, sizeof(Node));
+static Node *node_new(NodeTag tag, Token main_token) {
+    Node *node = arena_alloc(sizeof(Node));
+    stats.nodes++;
     node->tag = tag;
     node->main_token = main_token;
     return node;
 }
 
-static Node *int_new(Token *token, int val) {
+static Node *int_new(Token token, int val) {
     Node *node = node_new(NT_INT, token);
     node->integer = val;
     return node;
 }
 
-static Node *ident_new(Token *token) {
+static Node *ident_new(Token token) {
     return node_new(NT_IDENT, token);
 }
 
-static Node *string_new(TokenList *tlist, Token *token) {
+static Node *string_new(TokenList *tlist, Token token) {
     Node *node = node_new(NT_STRING, token);
     node->index = tlist->len;
     tokenlist_append(tlist, token);
     return node;
 }
 
-static Node *fncall_new(Token *token, Node *name, NodeList *args) {
+static Node *fncall_new(Token token, Node *name, NodeList *args) {
     Node *node = node_new(NT_FNCALL, token);
     node->fncall.name = name;
     node->fncall.args = args;
     return node;
 }
 
-static Node *unary_new(Token *token, Node *expr) {
+static Node *unary_new(Token token, Node *expr) {
     NodeTag tag;
-    switch (token->tag) {
+    switch (tok_tag(token)) {
         case TT_PLUS:       return expr;
         case TT_MINUS:      tag = NT_NEG; break;
         case TT_AMPERSAND:  tag = NT_ADDR; break;
@@ -254,19 +282,19 @@ static Node *unary_new(Token *token, Node *expr) {
         case TT_KW_SIZEOF:  tag = NT_SIZEOF; break;
         case TT_PLUS_PLUS:  tag = NT_PREINC; break;
         case TT_MINUS_MINUS:tag = NT_PREDEC; break;
-        default: panic("unary_new: invalid token TokenTag=%d (%.*s)", token->tag, token->len, token->start);
+        default: panic("unary_new: invalid token TokenTag=%d (%.*s)", tok_tag(token), tok_len(token), tok_start(token));
     }
     Node *node = node_new(tag, token);
     node->unary_expr = expr;
     return node;
 }
 
-static Node *member_access_new(Token *token, Node *lhs, Node *member) {
+static Node *member_access_new(Token token, Node *lhs, Node *member) {
     NodeTag tag;
-    switch (token->tag) {
+    switch (tok_tag(token)) {
         case TT_PERIOD: tag = NT_DOT; break;
         case TT_MINUS_ANGLE_R: tag = NT_ARROW; break;
-        default: panic("member_access_new: invalid token tag=%d", token->tag);
+        default: panic("member_access_new: invalid token tag=%d", tok_tag(token));
     }
     Node *node = node_new(tag, token);
     node->member_access.lhs = lhs;
@@ -274,9 +302,9 @@ static Node *member_access_new(Token *token, Node *lhs, Node *member) {
     return node;
 }
 
-static Node *expr_new(Token *token, Node *lhs, Node *rhs) {
+static Node *expr_new(Token token, Node *lhs, Node *rhs) {
     NodeTag tag;
-    switch (token->tag) {
+    switch (tok_tag(token)) {
         case TT_EQ:         tag = NT_ASSIGN; break;
         case TT_PLUS_EQ:    tag = NT_ASSIGN_ADD; break;
         case TT_MINUS_EQ:   tag = NT_ASSIGN_SUB; break;
@@ -297,7 +325,7 @@ static Node *expr_new(Token *token, Node *lhs, Node *rhs) {
         case TT_COMMA:      tag = NT_COMMA; break;
         case TT_AND_AND:    tag = NT_AND; break;
         case TT_PIPE_PIPE:  tag = NT_OR; break;
-        default: panic("expr_new: invalid token tag=%d", token->tag);
+        default: panic("expr_new: invalid token tag=%d", tok_tag(token));
     }
     Node *node = node_new(tag, token);
     node->bin_expr.lhs = lhs;
@@ -305,31 +333,31 @@ static Node *expr_new(Token *token, Node *lhs, Node *rhs) {
     return node;
 }
 
-static Node *postfix_new(Token *token, Node *expr) {
+static Node *postfix_new(Token token, Node *expr) {
     NodeTag tag;
-    switch (token->tag) {
+    switch (tok_tag(token)) {
         case TT_PLUS_PLUS: tag = NT_POSTINC; break;
         case TT_MINUS_MINUS: tag = NT_POSTDEC; break;
-        default: panic("postfix_new: invalid token tag=%d", token->tag);
+        default: panic("postfix_new: invalid token tag=%d", tok_tag(token));
     }
     Node *node = node_new(tag, token);
     node->pre_expr = expr;
     return node;
 }
 
-static Token *peek(Parser *parser) {
+static Token peek(Parser *parser) {
     return parser->current_token;
 }
 
-static Token *consume(Parser *parser) {
-    Token *token = parser->current_token;
-    parser->current_token = token->next;
+static Token consume(Parser *parser) {
+    Token token = parser->current_token;
+    if (tok_tag(token) != TT_EOF) parser->current_token++;
     return token;
 }
 
-static Type *struct_decl(Parser *parser, Token *ident_token, Type *incomplete_type);
-static Type *union_decl(Parser *parser, Token *ident_token, Type *incomplete_type);
-static Type *enum_decl(Parser *parser, Token *ident_token);
+static Type *struct_decl(Parser *parser, Token ident_token, Type *incomplete_type);
+static Type *union_decl(Parser *parser, Token ident_token, Type *incomplete_type);
+static Type *enum_decl(Parser *parser, Token ident_token);
 static Type *typedef_decl(Parser *parser);
 static Type *decl_spec(Parser *parser);
 static Type *pointer(Parser *parser, Type *type);
@@ -342,9 +370,9 @@ static Node *unary(Parser *parser);
 static Node *expr_prefix(Parser *parser);
 static Node *expr_postfix(Parser *parser, Node *lhs);
 static Node *expr_bp(Parser *parser, int min_bp);
-static Node *expr_cond(Parser *parser, Token *token, Node *cond);
-static Node *expr_fncall(Parser *parser, Token *token, Node *fn);
-static Node *expr_array_index(Parser *parser, Token *token, Node *lhs);
+static Node *expr_cond(Parser *parser, Token token, Node *cond);
+static Node *expr_fncall(Parser *parser, Token token, Node *fn);
+static Node *expr_array_index(Parser *parser, Token token, Node *lhs);
 static Node *expr(Parser *parser);
 static Node *expr_disable_comma(Parser *parser);
 static Node *block(Parser *parser);
@@ -363,24 +391,24 @@ static Node *init_declarator(Parser *parser, Type *type);
 static Node *local_decl(Parser *parser);
 static Node *param_decl(Parser *parser);
 static NodeList *params(Parser *parser);
-static Node *func(Parser *parser, Type *return_type, Token *name);
+static Node *func(Parser *parser, Type *return_type, Token name);
 static Node *toplevel(Parser *parser);
 
 // parse type
 
-static Type *check_defined_type(Parser *parser, SymbolTag tag, Token *token) {
-    Symbol *sym = find_symbol(tag, parser->defined_types, token);
+static Type *check_defined_type(Parser *parser, SymbolTag tag, Token token) {
+    Symbol *sym = find_symbol(tag, type_map(parser, tag), token);
     if (sym != NULL) return sym->type;
     return NULL;
 }
 
-static bool is_type_specifier(Parser *parser, Token *token) {
-    if (token->tag == TT_KW_VOID
-        || token->tag == TT_KW_INT
-        || token->tag == TT_KW_CHAR
-        || token->tag == TT_KW_STRUCT
-        || token->tag == TT_KW_UNION
-        || token->tag == TT_KW_ENUM) return true;
+static bool is_type_specifier(Parser *parser, Token token) {
+    if (tok_tag(token) == TT_KW_VOID
+        || tok_tag(token) == TT_KW_INT
+        || tok_tag(token) == TT_KW_CHAR
+        || tok_tag(token) == TT_KW_STRUCT
+        || tok_tag(token) == TT_KW_UNION
+        || tok_tag(token) == TT_KW_ENUM) return true;
     Type *type = check_defined_type(parser, ST_TYPEDEF, token);
     if (type) return true;
     return false;
@@ -391,21 +419,21 @@ static Symbol *struct_decl_list(Parser *parser) {
     while (is_type_specifier(parser, peek(parser))) {
         Type *type_spec = decl_spec(parser);
         Node *declr = NULL;
-        if (peek(parser)->tag != TT_SEMICOLON) declr = declarator(parser, type_spec);
+        if (tok_tag(peek(parser)) != TT_SEMICOLON) declr = declarator(parser, type_spec);
         list = symbol_new(ST_MEMBER,
-                          declr ? declr->main_token : NULL,
+                          declr ? declr->main_token : 0,
                           declr ? declr->type : type_spec,
                           list);
-        if (consume(parser)->tag != TT_SEMICOLON) panic("expected \';\'");
+        if (tok_tag(consume(parser)) != TT_SEMICOLON) panic("expected \';\'");
     }
     return list;
 }
 
-static Type *struct_decl(Parser *parser, Token *ident_token, Type *incomplete_type) {
-    Type *struct_typ = incomplete_type ? incomplete_type : struct_new(NULL, NULL, 0, 0); // placeholder
+static Type *struct_decl(Parser *parser, Token ident_token, Type *incomplete_type) {
+    Type *struct_typ = incomplete_type ? incomplete_type : struct_new(0, NULL, 0, 0); // placeholder
     if (ident_token && !incomplete_type)
         append_type(parser, ST_STRUCT, ident_token, struct_typ);
-    if (consume(parser)->tag != TT_BRACE_L) panic("expected \'{\'");
+    if (tok_tag(consume(parser)) != TT_BRACE_L) panic("expected \'{\'");
     if (struct_typ->tagged_typ.list) panic("redefinition of struct");
 
     Symbol *list = struct_decl_list(parser);
@@ -420,7 +448,7 @@ static Type *struct_decl(Parser *parser, Token *ident_token, Type *incomplete_ty
         current_offset += sizeof_type(elem->type);
         align_max = align > align_max ? align : align_max;
     }
-    if (consume(parser)->tag != TT_BRACE_R) panic("expected \'}\'");
+    if (tok_tag(consume(parser)) != TT_BRACE_R) panic("expected \'}\'");
     if (ident_token && !struct_typ->tagged_typ.ident)
         struct_typ->tagged_typ.ident = ident_token;
     struct_typ->tagged_typ.list = list;
@@ -429,11 +457,11 @@ static Type *struct_decl(Parser *parser, Token *ident_token, Type *incomplete_ty
     return struct_typ;
 }
 
-static Type *union_decl(Parser *parser, Token *ident_token, Type *incomplete_type) {
-    Type *union_typ = incomplete_type ? incomplete_type : union_new(NULL, NULL, 0, 0); // placeholder
+static Type *union_decl(Parser *parser, Token ident_token, Type *incomplete_type) {
+    Type *union_typ = incomplete_type ? incomplete_type : union_new(0, NULL, 0, 0); // placeholder
     if (ident_token && !incomplete_type)
         append_type(parser, ST_UNION, ident_token, union_typ);
-    if (consume(parser)->tag != TT_BRACE_L) panic("expected \'{\'");
+    if (tok_tag(consume(parser)) != TT_BRACE_L) panic("expected \'{\'");
     if (union_typ->tagged_typ.list) panic("redefinition of union");
 
     Symbol *list = struct_decl_list(parser);
@@ -448,7 +476,7 @@ static Type *union_decl(Parser *parser, Token *ident_token, Type *incomplete_typ
         align_max = align > align_max ? align : align_max;
         size_max = size > size_max ? size : size_max;
     }
-    if (consume(parser)->tag != TT_BRACE_R) panic("expected \'}\'");
+    if (tok_tag(consume(parser)) != TT_BRACE_R) panic("expected \'}\'");
     if (ident_token && !union_typ->tagged_typ.ident)
         union_typ->tagged_typ.ident = ident_token;
     union_typ->tagged_typ.list = list;
@@ -457,21 +485,22 @@ static Type *union_decl(Parser *parser, Token *ident_token, Type *incomplete_typ
     return union_typ;
 }
 
-static Type *enum_decl(Parser *parser, Token *ident_token) {
+static Type *enum_decl(Parser *parser, Token ident_token) {
     Type *enum_typ = enum_new(ident_token, NULL);
     if (ident_token) append_type(parser, ST_ENUM, ident_token, enum_typ);
-    if (consume(parser)->tag != TT_BRACE_L) panic("expected \'{\'");
+    if (tok_tag(consume(parser)) != TT_BRACE_L) panic("expected \'{\'");
 
     Symbol *list = NULL;
     int index = 0;
-    while (peek(parser)->tag == TT_IDENT) {
+    while (tok_tag(peek(parser)) == TT_IDENT) {
         Node *mnode = ident_new(consume(parser));
         list = symbol_new(ST_MEMBER, mnode->main_token, type_int, list);
         list->value = index++;
-        if (peek(parser)->tag == TT_COMMA) consume(parser);
+        index_symbol(parser->enum_map, list);
+        if (tok_tag(peek(parser)) == TT_COMMA) consume(parser);
     }
     list = reverse_symbols(list);
-    if (consume(parser)->tag != TT_BRACE_R) panic("expected \'}\'");
+    if (tok_tag(consume(parser)) != TT_BRACE_R) panic("expected \'}\'");
     enum_typ->tagged_typ.list = list;
     append_type(parser, ST_ENUM, ident_token, enum_typ);
     return enum_typ;
@@ -480,8 +509,8 @@ static Type *enum_decl(Parser *parser, Token *ident_token) {
 static Type *typedef_decl(Parser *parser) {
     Node *typenode = try_typename(parser);
     if (!typenode) panic("expected typename");
-    if (peek(parser)->tag != TT_IDENT) panic("expected identifier");
-    Token *ident = consume(parser);
+    if (tok_tag(peek(parser)) != TT_IDENT) panic("expected identifier");
+    Token ident = consume(parser);
     Type *type = typenode->type;
     append_type(parser, ST_TYPEDEF, ident, type);
     if (type->tag == TYP_STRUCT) {
@@ -495,20 +524,20 @@ static Type *typedef_decl(Parser *parser) {
 }
 
 static Type *decl_spec(Parser *parser) {
-    if (peek(parser)->tag == TT_KW_CONST) consume(parser); // ignore
-    if (peek(parser)->tag == TT_KW_TYPEDEF && consume(parser))
+    if (tok_tag(peek(parser)) == TT_KW_CONST) consume(parser); // ignore
+    if (tok_tag(peek(parser)) == TT_KW_TYPEDEF && consume(parser))
         return typedef_decl(parser);
-    Token *token = consume(parser);
-    if (token->tag == TT_KW_VOID) return type_void;
-    else if (token->tag == TT_KW_CHAR) return type_char;
-    else if (token->tag == TT_KW_INT) return type_int;
-    else if (token->tag == TT_KW_STRUCT) {
-        if (peek(parser)->tag == TT_BRACE_L) {
-            return struct_decl(parser, NULL, NULL);
-        } else if (peek(parser)->tag == TT_IDENT) {
-            Token *tag = consume(parser); // struct tag
+    Token token = consume(parser);
+    if (tok_tag(token) == TT_KW_VOID) return type_void;
+    else if (tok_tag(token) == TT_KW_CHAR) return type_char;
+    else if (tok_tag(token) == TT_KW_INT) return type_int;
+    else if (tok_tag(token) == TT_KW_STRUCT) {
+        if (tok_tag(peek(parser)) == TT_BRACE_L) {
+            return struct_decl(parser, 0, NULL);
+        } else if (tok_tag(peek(parser)) == TT_IDENT) {
+            Token tag = consume(parser); // struct tag
             Type *typ = check_defined_type(parser, ST_STRUCT, tag);
-            if (peek(parser)->tag == TT_BRACE_L) {
+            if (tok_tag(peek(parser)) == TT_BRACE_L) {
                 return struct_decl(parser, tag, typ);
             } else {
                 if (!typ) return struct_new(tag, NULL, 0, 0);
@@ -517,13 +546,13 @@ static Type *decl_spec(Parser *parser) {
         } else {
             panic("expected identifier or '{' after 'struct'");
         }
-    } else if (token->tag == TT_KW_UNION) {
-        if (peek(parser)->tag == TT_BRACE_L) {
-            return union_decl(parser, NULL, NULL);
-        } else if (peek(parser)->tag == TT_IDENT) {
-            Token *tag = consume(parser); // union tag
+    } else if (tok_tag(token) == TT_KW_UNION) {
+        if (tok_tag(peek(parser)) == TT_BRACE_L) {
+            return union_decl(parser, 0, NULL);
+        } else if (tok_tag(peek(parser)) == TT_IDENT) {
+            Token tag = consume(parser); // union tag
             Type *typ = check_defined_type(parser, ST_UNION, tag);
-            if (peek(parser)->tag == TT_BRACE_L) {
+            if (tok_tag(peek(parser)) == TT_BRACE_L) {
                 return union_decl(parser, tag, typ);
             } else {
                 if (!typ) return union_new(tag, NULL, 0, 0);
@@ -532,13 +561,13 @@ static Type *decl_spec(Parser *parser) {
         } else {
             panic("expected identifier or '{' after 'union'");
         }
-    } else if (token->tag == TT_KW_ENUM) {
-        if (peek(parser)->tag == TT_BRACE_L) {
-            return enum_decl(parser, NULL);
-        } else if (peek(parser)->tag == TT_IDENT) {
-            Token *tag = consume(parser); // enum tag
+    } else if (tok_tag(token) == TT_KW_ENUM) {
+        if (tok_tag(peek(parser)) == TT_BRACE_L) {
+            return enum_decl(parser, 0);
+        } else if (tok_tag(peek(parser)) == TT_IDENT) {
+            Token tag = consume(parser); // enum tag
             Type *typ = check_defined_type(parser, ST_ENUM, tag);
-            if (peek(parser)->tag == TT_BRACE_L) {
+            if (tok_tag(peek(parser)) == TT_BRACE_L) {
                 return enum_decl(parser, tag);
             } else {
                 if (!typ) panic("use of enum tag without definition");
@@ -556,7 +585,7 @@ static Type *decl_spec(Parser *parser) {
 }
 
 static Type *pointer(Parser *parser, Type *type) {
-    while (peek(parser)->tag == TT_STAR) {
+    while (tok_tag(peek(parser)) == TT_STAR) {
         consume(parser);
         type = pointer_to(type);
     }
@@ -564,7 +593,7 @@ static Type *pointer(Parser *parser, Type *type) {
 }
 
 static Node *try_typename(Parser *parser) {
-    Token *token = peek(parser);
+    Token token = peek(parser);
     if (!is_type_specifier(parser, token)) return NULL;
     Type *base = decl_spec(parser);
     Node *node = abstract_declarator(parser, base);
@@ -573,40 +602,40 @@ static Node *try_typename(Parser *parser) {
 
 static Node *integer(Parser *parser) {
     int val = 0;
-    Token *token = consume(parser);
-    if (token->tag != TT_INT) panic("expected an integer");
-    const char *p = token->start;
-    for (int i = 0; i < token->len; i++)
+    Token token = consume(parser);
+    if (tok_tag(token) != TT_INT) panic("expected an integer");
+    const char *p = tok_start(token);
+    for (int i = 0; i < tok_len(token); i++)
         val = val * 10 + (p[i] - '0');
     return int_new(token, val);
 }
 
 static NodeList *args(Parser *parser) {
     NodeList *args = nodelist_new(DEFAULT_NODELIST_CAP);
-    if (peek(parser)->tag == TT_PAREN_R) return args;
+    if (tok_tag(peek(parser)) == TT_PAREN_R) return args;
     do {
         nodelist_append(args, expr_disable_comma(parser));
-    } while (peek(parser)->tag == TT_COMMA && consume(parser));
-    if (peek(parser)->tag != TT_PAREN_R) panic("expected \')\'");
+    } while (tok_tag(peek(parser)) == TT_COMMA && consume(parser));
+    if (tok_tag(peek(parser)) != TT_PAREN_R) panic("expected \')\'");
     return args;
 }
 
 static Node *unary(Parser *parser) {
-    Token *token = consume(parser);
-    if (token->tag == TT_KW_SIZEOF) {
-        if (peek(parser)->tag == TT_PAREN_L)  {
+    Token token = consume(parser);
+    if (tok_tag(token) == TT_KW_SIZEOF) {
+        if (tok_tag(peek(parser)) == TT_PAREN_L)  {
             consume(parser); // (
             Node *node = try_typename(parser);
             if (!node) node = expr(parser);
-            if (consume(parser)->tag != TT_PAREN_R) panic("expected \')\'");
+            if (tok_tag(consume(parser)) != TT_PAREN_R) panic("expected \')\'");
             return unary_new(token, node);
         }
     }
     return unary_new(token, expr_bp(parser, PREC_PREFIX));
 }
 
-static int int_from_charlit(Token *token) {
-    const char *start = token->start + 1; // ignore '
+static int int_from_charlit(Token token) {
+    const char *start = tok_start(token) + 1; // ignore '
     if (*start == '\\') {
         start++;
         switch (*start) {
@@ -624,7 +653,7 @@ static int int_from_charlit(Token *token) {
 
 static Node *expr_prefix(Parser *parser) {
     Node *node;
-    switch (peek(parser)->tag) {
+    switch (tok_tag(peek(parser))) {
         case TT_INT:
             node = integer(parser);
             break;
@@ -632,7 +661,7 @@ static Node *expr_prefix(Parser *parser) {
             node = ident_new(consume(parser));
             break;
         case TT_CHAR: {
-            Token *token = consume(parser);
+            Token token = consume(parser);
             node = int_new(token, int_from_charlit(token));
             break;
         }
@@ -642,7 +671,7 @@ static Node *expr_prefix(Parser *parser) {
         case TT_PAREN_L:
             consume(parser);
             node = expr(parser);
-            if (consume(parser)->tag != TT_PAREN_R) panic("expected \')\'");
+            if (tok_tag(consume(parser)) != TT_PAREN_R) panic("expected \')\'");
             break;
         default:
             node = unary(parser);
@@ -652,11 +681,11 @@ static Node *expr_prefix(Parser *parser) {
 }
 
 static Node *expr_postfix(Parser *parser, Node *lhs) {
-    switch (peek(parser)->tag) {
+    switch (tok_tag(peek(parser))) {
         case TT_MINUS_ANGLE_R:
         case TT_PERIOD: {
-            Token *token_op = consume(parser);
-            Token *token_ident = consume(parser);
+            Token token_op = consume(parser);
+            Token token_ident = consume(parser);
             lhs = member_access_new(token_op, lhs, ident_new(token_ident));
             break;
         }
@@ -669,9 +698,9 @@ static Node *expr_postfix(Parser *parser, Node *lhs) {
     return lhs;
 }
 
-static Node *expr_cond(Parser *parser, Token *token, Node *cond) {
+static Node *expr_cond(Parser *parser, Token token, Node *cond) {
     Node *then = expr(parser);
-    if (consume(parser)->tag != TT_COLON) panic("expected \':\'");
+    if (tok_tag(consume(parser)) != TT_COLON) panic("expected \':\'");
     Node *els = expr(parser);
     Node *expr = node_new(NT_COND, token);
     expr->cond_expr.cond = cond;
@@ -680,15 +709,15 @@ static Node *expr_cond(Parser *parser, Token *token, Node *cond) {
     return expr;
 }
 
-static Node *expr_fncall(Parser *parser, Token *token, Node *fn) {
+static Node *expr_fncall(Parser *parser, Token token, Node *fn) {
     NodeList *arg_nodes = args(parser);
-    if (consume(parser)->tag != TT_PAREN_R) panic("expected \')\'"); // )
+    if (tok_tag(consume(parser)) != TT_PAREN_R) panic("expected \')\'"); // )
     return fncall_new(fn->main_token, fn, arg_nodes);
 }
 
-static Node *expr_array_index(Parser *parser, Token *token, Node *lhs) {
+static Node *expr_array_index(Parser *parser, Token token, Node *lhs) {
     Node *index = expr(parser);
-    if (consume(parser)->tag != TT_BRACKET_R) panic("expected \']\'"); // ]
+    if (tok_tag(consume(parser)) != TT_BRACKET_R) panic("expected \']\'"); // ]
     Node *add = expr_new(token, lhs, index);
     lhs = node_new(NT_DEREF, token);
     lhs->unary_expr = add;
@@ -697,29 +726,29 @@ static Node *expr_array_index(Parser *parser, Token *token, Node *lhs) {
 
 static Node *expr_bp(Parser *parser, int min_bp) {
     Node *lhs = expr_prefix(parser);
-    for (Token *token = peek(parser); ; token = peek(parser)) {
-        if (is_postfix(token->tag)) {
+    for (Token token = peek(parser); ; token = peek(parser)) {
+        if (is_postfix(tok_tag(token))) {
             lhs = expr_postfix(parser, lhs);
             continue;
         }
 
-        if (!is_infix(token->tag)) break;
-        int prec = precedences[token->tag];
-        bool left_assoc = !is_right_assoc(token->tag);
+        if (!is_infix(tok_tag(token))) break;
+        int prec = precedences[tok_tag(token)];
+        bool left_assoc = !is_right_assoc(tok_tag(token));
 
         if (left_assoc && prec <= min_bp) break;
         else if (prec < min_bp) break;
 
         token = consume(parser);
-        if (token->tag == TT_QUESTION) lhs = expr_cond(parser, token, lhs);
-        else if (token->tag == TT_PAREN_L) lhs = expr_fncall(parser, token, lhs);
-        else if (token->tag == TT_BRACKET_L) lhs = expr_array_index(parser, token, lhs);
+        if (tok_tag(token) == TT_QUESTION) lhs = expr_cond(parser, token, lhs);
+        else if (tok_tag(token) == TT_PAREN_L) lhs = expr_fncall(parser, token, lhs);
+        else if (tok_tag(token) == TT_BRACKET_L) lhs = expr_array_index(parser, token, lhs);
         else {
             Node *rhs = expr_bp(parser, prec);
             lhs = expr_new(token, lhs, rhs);
 
             // if token is ">" or ">=", swap lhs, rhs
-            if (token->tag == TT_ANGLE_R || token->tag == TT_ANGLE_R_EQ) {
+            if (tok_tag(token) == TT_ANGLE_R || tok_tag(token) == TT_ANGLE_R_EQ) {
                 Node *tmp = lhs->bin_expr.lhs;
                 lhs->bin_expr.lhs = lhs->bin_expr.rhs;
                 lhs->bin_expr.rhs = tmp;
@@ -740,20 +769,20 @@ static Node *expr_disable_comma(Parser *parser) {
 static Node *block(Parser *parser) {
     Node *node = node_new(NT_BLOCK, consume(parser));
     node->block = nodelist_new(DEFAULT_NODELIST_CAP);
-    while (peek(parser)->tag != TT_BRACE_R) {
+    while (tok_tag(peek(parser)) != TT_BRACE_R) {
         nodelist_append(node->block, stmt(parser));
     }
-    if (consume(parser)->tag != TT_BRACE_R) panic("expected \'}\'");
+    if (tok_tag(consume(parser)) != TT_BRACE_R) panic("expected \'}\'");
     return node;
 }
 
 static Node *if_stmt(Parser *parser) {
     Node *node = node_new(NT_IF, consume(parser));
-    if (consume(parser)->tag != TT_PAREN_L) panic("expected \'(\'");
+    if (tok_tag(consume(parser)) != TT_PAREN_L) panic("expected \'(\'");
     node->ifstmt.cond = expr(parser);
-    if (consume(parser)->tag != TT_PAREN_R) panic("expected \')\'");
+    if (tok_tag(consume(parser)) != TT_PAREN_R) panic("expected \')\'");
     node->ifstmt.then = stmt(parser);
-    if (peek(parser)->tag == TT_KW_ELSE) {
+    if (tok_tag(peek(parser)) == TT_KW_ELSE) {
         consume(parser);
         node->ifstmt.els = stmt(parser);
     } else {
@@ -764,9 +793,9 @@ static Node *if_stmt(Parser *parser) {
 
 static Node *while_stmt(Parser *parser) {
     Node *node = node_new(NT_WHILE, consume(parser));
-    if (consume(parser)->tag != TT_PAREN_L) panic("expected \'(\'");
+    if (tok_tag(consume(parser)) != TT_PAREN_L) panic("expected \'(\'");
     node->whilestmt.cond = expr(parser);
-    if (consume(parser)->tag != TT_PAREN_R) panic("expected \')\'");
+    if (tok_tag(consume(parser)) != TT_PAREN_R) panic("expected \')\'");
     node->whilestmt.body = stmt(parser);
     return node;
 }
@@ -774,43 +803,43 @@ static Node *while_stmt(Parser *parser) {
 static Node *do_while_stmt(Parser *parser) {
     Node *node = node_new(NT_DO_WHILE, consume(parser));
     node->whilestmt.body = stmt(parser);
-    if (consume(parser)->tag != TT_KW_WHILE) panic("expected \'while\'");
-    if (consume(parser)->tag != TT_PAREN_L) panic("expected \'(\'");
+    if (tok_tag(consume(parser)) != TT_KW_WHILE) panic("expected \'while\'");
+    if (tok_tag(consume(parser)) != TT_PAREN_L) panic("expected \'(\'");
     node->whilestmt.cond = expr(parser);
-    if (consume(parser)->tag != TT_PAREN_R) panic("expected \')\'");
+    if (tok_tag(consume(parser)) != TT_PAREN_R) panic("expected \')\'");
     return node;
 }
 
 static Node *for_stmt(Parser *parser) {
     Node *node = node_new(NT_FOR, consume(parser));
-    if (consume(parser)->tag != TT_PAREN_L) panic("expected \'(\'");
+    if (tok_tag(consume(parser)) != TT_PAREN_L) panic("expected \'(\'");
 
     // def
-    if (peek(parser)->tag != TT_SEMICOLON) {
+    if (tok_tag(peek(parser)) != TT_SEMICOLON) {
         node->forstmt.def = is_type_specifier(parser, peek(parser)) ?
                             local_decl(parser) : expr(parser);
     }
     consume(parser);
     // cond
-    if (peek(parser)->tag != TT_SEMICOLON) node->forstmt.cond = expr(parser);
+    if (tok_tag(peek(parser)) != TT_SEMICOLON) node->forstmt.cond = expr(parser);
     consume(parser);
     // next
-    if (peek(parser)->tag != TT_PAREN_R) node->forstmt.next = expr(parser);
+    if (tok_tag(peek(parser)) != TT_PAREN_R) node->forstmt.next = expr(parser);
 
-    if (consume(parser)->tag != TT_PAREN_R) panic("expected \')\'");
+    if (tok_tag(consume(parser)) != TT_PAREN_R) panic("expected \')\'");
     node->forstmt.body = stmt(parser);
     return node;
 }
 
 static Node *case_block(Parser *parser) {
-    Token *token = consume(parser);
+    Token token = consume(parser);
     Node *node = node_new(NT_CASE, token);
-    if (token->tag == TT_KW_CASE) node->caseblock.constant = expr(parser);
-    else if (token->tag != TT_KW_DEFAULT) panic("expected case/default");
-    if (consume(parser)->tag != TT_COLON) panic("expected \':\'");
+    if (tok_tag(token) == TT_KW_CASE) node->caseblock.constant = expr(parser);
+    else if (tok_tag(token) != TT_KW_DEFAULT) panic("expected case/default");
+    if (tok_tag(consume(parser)) != TT_COLON) panic("expected \':\'");
     node->caseblock.stmts = nodelist_new(DEFAULT_NODELIST_CAP);
     token = peek(parser);
-    while (token->tag != TT_KW_CASE && token->tag != TT_KW_DEFAULT && token->tag != TT_BRACE_R) {
+    while (tok_tag(token) != TT_KW_CASE && tok_tag(token) != TT_KW_DEFAULT && tok_tag(token) != TT_BRACE_R) {
         Node *stmtnode = stmt(parser);
         nodelist_append(node->caseblock.stmts, stmtnode);
         token = peek(parser);
@@ -820,28 +849,28 @@ static Node *case_block(Parser *parser) {
 
 static Node *switch_stmt(Parser *parser) {
     Node *node = node_new(NT_SWITCH, consume(parser));
-    if (consume(parser)->tag != TT_PAREN_L) panic("expected \'(\'");
+    if (tok_tag(consume(parser)) != TT_PAREN_L) panic("expected \'(\'");
     node->switchstmt.control = expr(parser);
-    if (consume(parser)->tag != TT_PAREN_R) panic("expected \')\'");
-    if (consume(parser)->tag != TT_BRACE_L) panic("expected \'{\'");
+    if (tok_tag(consume(parser)) != TT_PAREN_R) panic("expected \')\'");
+    if (tok_tag(consume(parser)) != TT_BRACE_L) panic("expected \'{\'");
     node->switchstmt.cases = nodelist_new(DEFAULT_NODELIST_CAP);
-    Token *token = peek(parser);
-    while (token->tag == TT_KW_CASE || token->tag == TT_KW_DEFAULT) {
+    Token token = peek(parser);
+    while (tok_tag(token) == TT_KW_CASE || tok_tag(token) == TT_KW_DEFAULT) {
         Node *casenode = case_block(parser);
         nodelist_append(node->switchstmt.cases, casenode);
         token = peek(parser);
     }
-    if (consume(parser)->tag != TT_BRACE_R) panic("expected \'}\'");
+    if (tok_tag(consume(parser)) != TT_BRACE_R) panic("expected \'}\'");
     return node;
 }
 
 static Type *array(Parser *parser, Type *type) {
     Stack *stack = stack_new(4);
-    while (peek(parser)->tag == TT_BRACKET_L) {
+    while (tok_tag(peek(parser)) == TT_BRACKET_L) {
         consume(parser); // [
         int size = integer(parser)->integer;
         stack_push(stack, size);
-        if (consume(parser)->tag != TT_BRACKET_R) panic("expected \']\'");
+        if (tok_tag(consume(parser)) != TT_BRACKET_R) panic("expected \']\'");
     }
     while (stack->top != 0) {
         type = array_of(type, stack_pop(stack));
@@ -851,16 +880,16 @@ static Type *array(Parser *parser, Type *type) {
 
 static Node *direct_declarator(Parser *parser, Type *type) {
     Node *node;
-    Token *token = peek(parser);
-    Type *placeholder = calloc(1, sizeof(Type));
-    if (token->tag == TT_IDENT) {
+    Token token = peek(parser);
+    Type *placeholder = arena_alloc(sizeof(Type));
+    if (tok_tag(token) == TT_IDENT) {
         node = ident_new(consume(parser));
         node->type = placeholder;
-    } else if (token->tag == TT_PAREN_L) {
+    } else if (tok_tag(token) == TT_PAREN_L) {
         consume(parser); // (
         *placeholder = *type;
         node = declarator(parser, placeholder);
-        if (consume(parser)->tag != TT_PAREN_R) panic("expected \')\'");
+        if (tok_tag(consume(parser)) != TT_PAREN_R) panic("expected \')\'");
     }
     *placeholder = *array(parser, type);
     return node;
@@ -868,15 +897,15 @@ static Node *direct_declarator(Parser *parser, Type *type) {
 
 static Node *direct_abstract_declarator(Parser *parser, Type *type) {
     Node *node;
-    Token *token = peek(parser);
-    Type *placeholder = calloc(1, sizeof(Type));
-    if (token->tag == TT_PAREN_L) {
+    Token token = peek(parser);
+    Type *placeholder = arena_alloc(sizeof(Type));
+    if (tok_tag(token) == TT_PAREN_L) {
         consume(parser); // (
         *placeholder = *type;
         node = abstract_declarator(parser, placeholder);
-        if (consume(parser)->tag != TT_PAREN_R) panic("expected \')\'");
+        if (tok_tag(consume(parser)) != TT_PAREN_R) panic("expected \')\'");
     } else {
-        node = node_new(NT_TYPENAME, NULL);
+        node = node_new(NT_TYPENAME, 0);
         node->type = placeholder;
     }
     *placeholder = *array(parser, type);
@@ -895,16 +924,16 @@ static Node *abstract_declarator(Parser *parser, Type *type) {
 }
 
 static Node *initializer(Parser *parser) {
-    if (peek(parser)->tag == TT_BRACE_L) {
+    if (tok_tag(peek(parser)) == TT_BRACE_L) {
         Node *node = node_new(NT_INITS, consume(parser));
         node->initializers = nodelist_new(DEFAULT_NODELIST_CAP);
         NodeList *inits = node->initializers;
         do {
-            if (peek(parser)->tag == TT_BRACE_R) break;
+            if (tok_tag(peek(parser)) == TT_BRACE_R) break;
             Node *init = expr_disable_comma(parser);
             nodelist_append(inits, init);
-        } while (peek(parser)->tag == TT_COMMA && consume(parser));
-        if (consume(parser)->tag != TT_BRACE_R) panic("expected \'}\'");
+        } while (tok_tag(peek(parser)) == TT_COMMA && consume(parser));
+        if (tok_tag(consume(parser)) != TT_BRACE_R) panic("expected \'}\'");
         return node;
     }
     return expr_disable_comma(parser);
@@ -913,7 +942,7 @@ static Node *initializer(Parser *parser) {
 static Node *init_declarator(Parser *parser, Type *type) {
     Node *node = node_new(NT_DECLARATOR, peek(parser));
     node->declarator.name = declarator(parser, type);
-    if (peek(parser)->tag == TT_EQ) {
+    if (tok_tag(peek(parser)) == TT_EQ) {
         consume(parser); // =
         node->declarator.init = initializer(parser);
     }
@@ -924,13 +953,13 @@ static Node *local_decl(Parser *parser) {
     Node *node = node_new(NT_LOCALDECL, peek(parser));
     node->declarators = nodelist_new(DEFAULT_NODELIST_CAP);
     Type *type_spec = decl_spec(parser);
-    if (peek(parser)->tag == TT_SEMICOLON) return node;
+    if (tok_tag(peek(parser)) == TT_SEMICOLON) return node;
     do {
         Node *dnode = init_declarator(parser, type_spec);
         Node *name = dnode->declarator.name;
         append_local_var(parser, name->main_token, name->type);
         nodelist_append(node->declarators, dnode);
-    } while (peek(parser)->tag == TT_COMMA && consume(parser));
+    } while (tok_tag(peek(parser)) == TT_COMMA && consume(parser));
     return node;
 }
 
@@ -940,7 +969,7 @@ static Node *global_decl(Parser *parser, Type *type_spec, Node *typed_ident) {
     
     Node *first_dnode = node_new(NT_DECLARATOR, typed_ident->main_token);
     first_dnode->declarator.name = typed_ident;
-    if (peek(parser)->tag == TT_EQ) {
+    if (tok_tag(peek(parser)) == TT_EQ) {
         consume(parser); // =
         first_dnode->declarator.init = initializer(parser);
     }
@@ -949,14 +978,14 @@ static Node *global_decl(Parser *parser, Type *type_spec, Node *typed_ident) {
     append_global_var(parser, name->main_token, name->type, init);
     nodelist_append(node->declarators, first_dnode);
 
-    while (peek(parser)->tag == TT_COMMA && consume(parser)) {
+    while (tok_tag(peek(parser)) == TT_COMMA && consume(parser)) {
         Node *dnode = init_declarator(parser, type_spec);
         name = dnode->declarator.name;
         init = dnode->declarator.init;
         append_global_var(parser, name->main_token, name->type, init);
         nodelist_append(node->declarators, dnode);
     }
-    if (consume(parser)->tag != TT_SEMICOLON) panic("expected \';\'");
+    if (tok_tag(consume(parser)) != TT_SEMICOLON) panic("expected \';\'");
     return node;
 }
 
@@ -971,7 +1000,7 @@ static Node *param_decl(Parser *parser) {
 
 static Node *stmt(Parser *parser) {
     Node *node = NULL;
-    switch (peek(parser)->tag) {
+    switch (tok_tag(peek(parser))) {
         case TT_BRACE_L:
             return block(parser);
         case TT_KW_IF:
@@ -999,7 +1028,7 @@ static Node *stmt(Parser *parser) {
             break;
         case TT_KW_RETURN:
             node = node_new(NT_RETURN, consume(parser));
-            if (peek(parser)->tag != TT_SEMICOLON) node->unary_expr = expr(parser);
+            if (tok_tag(peek(parser)) != TT_SEMICOLON) node->unary_expr = expr(parser);
             break;
         case TT_KW_BREAK:
             node = node_new(NT_BREAK, consume(parser));
@@ -1016,59 +1045,79 @@ static Node *stmt(Parser *parser) {
             break;
         }
     }
-    Token *token = consume(parser);
-    if (token->tag != TT_SEMICOLON)
-        panic("expected \';\' but got %.*s", token->len, token->start);
+    Token token = consume(parser);
+    if (tok_tag(token) != TT_SEMICOLON)
+        panic("expected \';\' but got %.*s", tok_len(token), tok_start(token));
     return node;
 }
 
 static NodeList *params(Parser *parser) {
     NodeList *params = nodelist_new(DEFAULT_NODELIST_CAP);
-    if (peek(parser)->tag == TT_PAREN_R) return params;
-    else if (peek(parser)->tag == TT_KW_VOID) {
+    if (tok_tag(peek(parser)) == TT_PAREN_R) return params;
+    else if (tok_tag(peek(parser)) == TT_KW_VOID) {
         consume(parser);
         return params;
     }
     do {
         Node *node = param_decl(parser);
         nodelist_append(params, node);
-    } while (peek(parser)->tag == TT_COMMA && consume(parser));
-    if (peek(parser)->tag != TT_PAREN_R) panic("expected \')\'");
+    } while (tok_tag(peek(parser)) == TT_COMMA && consume(parser));
+    if (tok_tag(peek(parser)) != TT_PAREN_R) panic("expected \')\'");
     return params;
 }
 
-static Node *func(Parser *parser, Type *return_type, Token *name) {
+static Node *func(Parser *parser, Type *return_type, Token name) {
     Node *node = node_new(NT_FUNC, name); 
-    Symbol *fn_symbol = find_symbol(ST_FUNC, parser->func_types, name);
+    Symbol *fn_symbol = find_symbol(ST_FUNC, parser->func_map, name);
     if (!fn_symbol) append_func_type(parser, name, return_type);
 
     parser->current_func = node;
     node->func.locals = NULL;
+    node->func.local_map = hashmap_new();
     
     node->func.name = ident_new(name);
-    if (consume(parser)->tag != TT_PAREN_L) panic("expected \'(\'");
+    if (tok_tag(consume(parser)) != TT_PAREN_L) panic("expected \'(\'");
     node->func.params = params(parser);
-    if (consume(parser)->tag != TT_PAREN_R) panic("expected \')\'");
-    if (peek(parser)->tag == TT_SEMICOLON && consume(parser)) return NULL;
+    if (tok_tag(consume(parser)) != TT_PAREN_R) panic("expected \')\'");
+    if (tok_tag(peek(parser)) == TT_SEMICOLON && consume(parser)) return NULL;
     node->func.body = stmt(parser);
     return node;
 }
 
 static Node *toplevel(Parser *parser) {
     Type *type_spec = decl_spec(parser);
-    if (peek(parser)->tag == TT_SEMICOLON && consume(parser)) return NULL;
+    if (tok_tag(peek(parser)) == TT_SEMICOLON && consume(parser)) return NULL;
     Node *node = declarator(parser, type_spec);
     Type *type = node->type;
-    Token *ident_token = node->main_token;
+    Token ident_token = node->main_token;
 
-    if (peek(parser)->tag == TT_PAREN_L) return func(parser, type, ident_token);
+    if (tok_tag(peek(parser)) == TT_PAREN_L) return func(parser, type, ident_token);
     return global_decl(parser, type_spec, node);
 }
 
+// install declarations loaded from a precompiled header. the lists are
+// newest first, so the first symbol seen for a name is the one in scope.
+static void index_symbol_once(HashMap *map, Symbol *symbol) {
+    if (symbol->token && !hashmap_get_atom(map, tok_atom(symbol->token))) index_symbol(map, symbol);
+}
+
+void parser_restore(Parser *parser, Symbol *func_types, Symbol *global_vars, Symbol *defined_types) {
+    parser->func_types = func_types;
+    parser->global_vars = global_vars;
+    parser->defined_types = defined_types;
+    for (Symbol *sym = func_types; sym != NULL; sym = sym->next) index_symbol_once(parser->func_map, sym);
+    for (Symbol *sym = global_vars; sym != NULL; sym = sym->next) index_symbol_once(parser->global_map, sym);
+    for (Symbol *sym = defined_types; sym != NULL; sym = sym->next) {
+        index_symbol_once(type_map(parser, sym->tag), sym);
+        if (sym->tag != ST_ENUM) continue;
+        for (Symbol *val = sym->type->tagged_typ.list; val != NULL; val = val->next) index_symbol_once(parser->enum_map, val);
+    }
+}
+
 Program *parse(Parser *parser) {
     Program *prog = calloc(1, sizeof(Program));
     prog->funcs = nodelist_new(DEFAULT_NODELIST_CAP);
-    while (peek(parser)->tag != TT_EOF) {
+    while (tok_tag(peek(parser)) != TT_EOF) {
         Node *node = toplevel(parser);
         if (node && node->tag == NT_FUNC) nodelist_append(prog->funcs, node);
     }
@@ -1076,5 +1125,8 @@ Program *parse(Parser *parser) {
     prog->global_vars = reverse_symbols(parser->global_vars);
     prog->string_tokens = parser->string_tokens;
     prog->defined_types = parser->defined_types;
+    prog->func_map = parser->func_map;
+    prog->global_map = parser->global_map;
+    prog->enum_map = parser->enum_map;
     return prog;
 }
@@ -0,0 +1,375 @@
+#include "kcc.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Precompiled headers
+//
+// --emit-pch writes the declarations of a header (types, function
+// prototypes, global variables and macros) to a file; --include-pch loads
+// them before the translation unit is preprocessed, as if the header had
+// been included at its top. the file is read with read_file, i.e. mapped
+// into the source space, so loaded tokens point straight at the text
+// stored in it. types and symbols refer to each other by index; index 0 is
+// NULL and the builtin types have fixed indices.
+
+#define PCH_MAGIC "KCCPCH2"
+
+typedef struct {
+    char magic[8];
+    uint32_t natoms, ntokens, ntypes, nsymbols, ntext;
+    uint32_t func_types, global_vars, defined_types, defines; // list heads
+} PchHeader;
+
+typedef struct {
+    uint32_t offset, len; // in the text
+} PchAtom;
+
+typedef struct {
+    uint32_t tag, atom, offset, len, space;
+} PchToken;
+
+typedef struct {
+    uint32_t tag, array_size;
+    uint32_t base;              // pointer, array
+    uint32_t ident, list;       // struct, union, enum
+    int32_t size, align;
+} PchType;
+
+typedef struct {
+    uint32_t tag, token, type, next;
+    int32_t value; // offset, enum value, or the number of tokens of a macro
+} PchSymbol;
+
+#define PCH_TYPE_VOID 1
+#define PCH_TYPE_CHAR 2
+#define PCH_TYPE_INT 3
+#define PCH_FIRST_TYPE 4
+
+typedef struct {
+    void **items;
+    int len;
+    int capacity;
+} PtrList;
+
+static int ptrlist_add(PtrList *list, void *p) {
+    if (list->len == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 256;
+        list->items = realloc(list->items, list->capacity * sizeof(void *));
+        if (!list->items) panic("cannot reallocate memory: %s", strerror(errno));
+    }
+    list->items[list->len] = p;
+    return list->len++;
+}
+
+// pointer -> index, open addressing
+typedef struct {
+    void **keys;
+    int *vals;
+    int capacity; // power of 2
+    int used;
+} PtrMap;
+
+static int *ptrmap_slot(PtrMap *map, void *key) {
+    if (2 * (map->used + 1) > map->capacity) {
+        PtrMap old = *map;
+        map->capacity = old.capacity ? old.capacity * 2 : 256;
+        map->keys = calloc(map->capacity, sizeof(void *));
+        map->vals = calloc(map->capacity, sizeof(int));
+        map->used = 0;
+        for (int i = 0; i < old.capacity; i++) {
+            if (old.keys[i]) *ptrmap_slot(map, old.keys[i]) = old.vals[i];
+        }
+        free(old.keys);
+        free(old.vals);
+    }
+    uintptr_t h = (uintptr_t)key;
+    h ^= h >> 17;
+    h *= 0x9e3779b97f4a7c15u;
+    int i = (h >> 32) & (map->capacity - 1);
+    while (map->keys[i] && map->keys[i] != key) i = (i + 1) & (map->capacity - 1);
+    if (!map->keys[i]) {
+        map->keys[i] = key;
+        map->used++;
+    }
+    return &map->vals[i];
+}
+
+typedef struct {
+    char *buf;
+    int len;
+    int capacity;
+} Buf;
+
+static int buf_add(Buf *b, const void *p, int n) {
+    if (b->len + n > b->capacity) {
+        int capacity = b->capacity ? b->capacity : 1024;
+        while (capacity < b->len + n) capacity *= 2;
+        char *tmp = realloc(b->buf, capacity);
+        if (!tmp) panic("cannot reallocate memory: %s", strerror(errno));
+        b->buf = tmp;
+        b->capacity = capacity;
+    }
+    int offset = b->len;
+    memcpy(b->buf + offset, p, n);
+    b->len += n;
+    return offset;
+}
+
+typedef struct {
+    PtrList types, symbols;
+    PtrMap type_ids, symbol_ids, token_ids;
+    Preprocessor *pp;
+    HashMap *atom_ids; // atom -> index in atoms
+    Buf atoms, tokens, text;
+} PchWriter;
+
+static uint32_t atom_id(PchWriter *w, int atom, uint32_t offset, uint32_t len) {
+    if (!atom) return 0;
+    intptr_t id = (intptr_t)hashmap_get_atom(w->atom_ids, atom);
+    if (!id) {
+        PchAtom pa = {offset, len};
+        id = 1 + buf_add(&w->atoms, &pa, sizeof(pa)) / sizeof(pa);
+        hashmap_put_atom(w->atom_ids, atom, (void *)id);
+    }
+    return id;
+}
+
+static uint32_t add_token(PchWriter *w, TokenBuf *buf, Token t) {
+    if (!t) return 0;
+    int *token_id = ptrmap_slot(&w->token_ids, (void *)(uintptr_t)t);
+    if (*token_id) return *token_id;
+    PchToken pt = {buf->tags[t], 0, 0, buf->lens[t], buf->spaces[t]};
+    pt.offset = buf_add(&w->text, source_base + buf->offsets[t], buf->lens[t]);
+    pt.atom = atom_id(w, buf->atoms[t], pt.offset, pt.len);
+    *token_id = 1 + buf_add(&w->tokens, &pt, sizeof(pt)) / sizeof(pt); // 0 is no token
+    return *token_id;
+}
+
+// tokens from .. to - 1 of buf as consecutive records, keeping the text
+// between them so that they read as they were written
+static uint32_t add_token_range(PchWriter *w, TokenBuf *buf, Token from, Token to) {
+    uint32_t start = buf->offsets[from];
+    uint32_t text = buf_add(&w->text, source_base + start, buf->offsets[to - 1] + buf->lens[to - 1] - start);
+    uint32_t first = 1 + w->tokens.len / sizeof(PchToken);
+    for (Token t = from; t < to; t++) {
+        PchToken pt = {buf->tags[t], 0, text + buf->offsets[t] - start, buf->lens[t], buf->spaces[t]};
+        pt.atom = atom_id(w, buf->atoms[t], pt.offset, pt.len);
+        buf_add(&w->tokens, &pt, sizeof(pt));
+    }
+    return first;
+}
+
+// the first define from sym on that has not been redefined or undefined
+static Symbol *live_define(Preprocessor *pp, Symbol *sym) {
+    while (sym && hashmap_get_atom(pp->macros, pp->raw->atoms[sym->token]) != sym) sym = sym->next;
+    return sym;
+}
+
+static uint32_t type_id(PchWriter *w, Type *type) {
+    if (!type) return 0;
+    if (type == type_void) return PCH_TYPE_VOID;
+    if (type == type_char) return PCH_TYPE_CHAR;
+    if (type == type_int) return PCH_TYPE_INT;
+    int *id = ptrmap_slot(&w->type_ids, type);
+    if (!*id) *id = PCH_FIRST_TYPE + ptrlist_add(&w->types, type);
+    return *id;
+}
+
+static uint32_t symbol_id(PchWriter *w, Symbol *sym) {
+    if (!sym) return 0;
+    int *id = ptrmap_slot(&w->symbol_ids, sym);
+    if (!*id) *id = 1 + ptrlist_add(&w->symbols, sym);
+    return *id;
+}
+
+static PchType write_type(PchWriter *w, Type *type) {
+    PchType pt = {type->tag, type->array_size};
+    switch (type->tag) {
+        case TYP_PTR:
+        case TYP_ARRAY:
+            pt.base = type_id(w, type->base);
+            break;
+        case TYP_STRUCT:
+        case TYP_UNION:
+        case TYP_ENUM:
+            pt.ident = add_token(w, &token_buf, type->tagged_typ.ident);
+            pt.list = symbol_id(w, type->tagged_typ.list);
+            pt.size = type->tagged_typ.size;
+            pt.align = type->tagged_typ.align;
+            break;
+        default:
+            break;
+    }
+    return pt;
+}
+
+static PchSymbol write_symbol(PchWriter *w, Symbol *sym) {
+    PchSymbol ps = {sym->tag, 0, type_id(w, sym->type), symbol_id(w, sym->next)};
+    if (sym->tag == ST_DEFINE) {
+        // the name and the rest of the #define line, parsed again when loaded
+        Macro *m = sym->macro;
+        ps.next = symbol_id(w, live_define(w->pp, sym->next));
+        ps.token = add_token_range(w, w->pp->raw, sym->token, m->body + m->len);
+        ps.value = m->body + m->len - sym->token;
+    } else {
+        ps.token = add_token(w, &token_buf, sym->token);
+        if (sym->tag == ST_GVAR && sym->init) panic("--emit-pch: global variable %.*s has an initializer", tok_len(sym->token), tok_start(sym->token));
+        if (sym->tag != ST_GVAR) ps.value = sym->offset;
+    }
+    return ps;
+}
+
+static void write_all(int fd, const void *p, size_t n) {
+    for (const char *s = p; n > 0;) {
+        ssize_t written = write(fd, s, n);
+        if (written < 0) panic("cannot write precompiled header: %s", strerror(errno));
+        s += written;
+        n -= written;
+    }
+}
+
+// write the declarations in prog and the macros defined by pp to path
+void write_pch(const char *path, Preprocessor *pp, Program *prog) {
+    if (prog->funcs->len > 0) panic("--emit-pch: the header defines functions");
+    PchWriter w = {0};
+    w.pp = pp;
+    w.atom_ids = hashmap_new();
+    PchHeader h = {PCH_MAGIC};
+    h.func_types = symbol_id(&w, prog->func_types);
+    h.global_vars = symbol_id(&w, prog->global_vars);
+    h.defined_types = symbol_id(&w, prog->defined_types);
+    h.defines = symbol_id(&w, live_define(pp, pp->defines));
+
+    // records refer to later ones by index, so walk until no new ones turn up
+    Buf types = {0}, symbols = {0};
+    int ntypes = 0, nsymbols = 0;
+    while (ntypes < w.types.len || nsymbols < w.symbols.len) {
+        for (; ntypes < w.types.len; ntypes++) {
+            PchType pt = write_type(&w, w.types.items[ntypes]);
+            buf_add(&types, &pt, sizeof(pt));
+        }
+        for (; nsymbols < w.symbols.len; nsymbols++) {
+            PchSymbol ps = write_symbol(&w, w.symbols.items[nsymbols]);
+            buf_add(&symbols, &ps, sizeof(ps));
+        }
+    }
+    h.natoms = w.atoms.len / sizeof(PchAtom);
+    h.ntokens = w.tokens.len / sizeof(PchToken);
+    h.ntypes = ntypes;
+    h.nsymbols = nsymbols;
+    h.ntext = w.text.len;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) panic("cannot open %s: %s", path, strerror(errno));
+    write_all(fd, &h, sizeof(h));
+    write_all(fd, w.atoms.buf, w.atoms.len);
+    write_all(fd, w.tokens.buf, w.tokens.len);
+    write_all(fd, types.buf, types.len);
+    write_all(fd, symbols.buf, symbols.len);
+    write_all(fd, w.text.buf, w.text.len);
+    close(fd);
+}
+
+// check that the counts of h add up to the file size and that every
+// index stored in the file is inside its table, so that a truncated or
+// stale file cannot make read_pch read out of bounds
+static void check_pch(char *path, PchHeader *h, uint64_t size) {
+    #define CHECK(cond) do { if (!(cond)) panic("%s: corrupt precompiled header", path); } while (0)
+    CHECK(sizeof(PchHeader) + (uint64_t)h->natoms * sizeof(PchAtom) + (uint64_t)h->ntokens * sizeof(PchToken)
+          + (uint64_t)h->ntypes * sizeof(PchType) + (uint64_t)h->nsymbols * sizeof(PchSymbol) + h->ntext == size);
+    PchAtom *patoms = (PchAtom *)(h + 1);
+    PchToken *ptokens = (PchToken *)(patoms + h->natoms);
+    PchType *ptypes = (PchType *)(ptokens + h->ntokens);
+    PchSymbol *psymbols = (PchSymbol *)(ptypes + h->ntypes);
+    uint64_t ntypes = PCH_FIRST_TYPE + (uint64_t)h->ntypes;
+
+    for (uint32_t i = 0; i < h->natoms; i++) CHECK((uint64_t)patoms[i].offset + patoms[i].len <= h->ntext);
+    for (uint32_t i = 0; i < h->ntokens; i++) {
+        PchToken *pt = &ptokens[i];
+        CHECK(pt->tag < META_TT_NUM && pt->atom <= h->natoms && (uint64_t)pt->offset + pt->len <= h->ntext);
+    }
+    for (uint32_t i = 0; i < h->ntypes; i++) {
+        PchType *pt = &ptypes[i];
+        CHECK(pt->tag <= TYP_ENUM && pt->base < ntypes && pt->ident <= h->ntokens && pt->list <= h->nsymbols);
+    }
+    for (uint32_t i = 0; i < h->nsymbols; i++) {
+        PchSymbol *ps = &psymbols[i];
+        CHECK(ps->tag <= ST_DEFINE && ps->type < ntypes && ps->next <= h->nsymbols && ps->token <= h->ntokens);
+        // a macro is its name and the value - 1 tokens after it
+        if (ps->tag == ST_DEFINE) CHECK(ps->token && ps->value >= 1 && (uint64_t)ps->token + ps->value - 1 <= h->ntokens);
+    }
+    CHECK(h->func_types <= h->nsymbols && h->global_vars <= h->nsymbols);
+    CHECK(h->defined_types <= h->nsymbols && h->defines <= h->nsymbols);
+    #undef CHECK
+}
+
+// load a file written by write_pch into pp and parser
+void read_pch(char *path, Preprocessor *pp, Parser *parser) {
+    struct stat st;
+    if (stat(path, &st) != 0) panic("cannot stat %s: %s", path, strerror(errno));
+    char *base = read_file(path);
+    PchHeader *h = (PchHeader *)base;
+    if ((uint64_t)st.st_size < sizeof(PchHeader) || memcmp(h->magic, PCH_MAGIC, sizeof(h->magic)) != 0)
+        panic("%s is not a precompiled header", path);
+    check_pch(path, h, st.st_size);
+    PchAtom *patoms = (PchAtom *)(h + 1);
+    PchToken *ptokens = (PchToken *)(patoms + h->natoms);
+    PchType *ptypes = (PchType *)(ptokens + h->ntokens);
+    PchSymbol *psymbols = (PchSymbol *)(ptypes + h->ntypes);
+    uint32_t text = (char *)(psymbols + h->nsymbols) - source_base;
+
+    int *atoms = malloc((h->natoms + 1) * sizeof(int));
+    atoms[0] = 0;
+    for (uint32_t i = 0; i < h->natoms; i++) atoms[i + 1] = intern(source_base + text + patoms[i].offset, patoms[i].len);
+
+    Type **types = malloc((PCH_FIRST_TYPE + h->ntypes) * sizeof(Type *));
+    types[0] = NULL;
+    types[PCH_TYPE_VOID] = type_void;
+    types[PCH_TYPE_CHAR] = type_char;
+    types[PCH_TYPE_INT] = type_int;
+    for (uint32_t i = 0; i < h->ntypes; i++) types[PCH_FIRST_TYPE + i] = arena_alloc(sizeof(Type));
+    Symbol **symbols = malloc((h->nsymbols + 1) * sizeof(Symbol *));
+    symbols[0] = NULL;
+    for (uint32_t i = 0; i < h->nsymbols; i++) symbols[i + 1] = arena_alloc(sizeof(Symbol));
+
+    #define LOAD_TOKEN(buf, i) ((i) ? token_push(buf, ptokens[(i) - 1].tag, text + ptokens[(i) - 1].offset, \
+                                                  ptokens[(i) - 1].len, atoms[ptokens[(i) - 1].atom], \
+                                                  ptokens[(i) - 1].space) : 0)
+    for (uint32_t i = 0; i < h->ntypes; i++) {
+        PchType *pt = &ptypes[i];
+        Type *type = types[PCH_FIRST_TYPE + i];
+        type->tag = pt->tag;
+        type->array_size = pt->array_size;
+        if (pt->tag == TYP_PTR || pt->tag == TYP_ARRAY) {
+            type->base = types[pt->base];
+        } else if (pt->tag == TYP_STRUCT || pt->tag == TYP_UNION || pt->tag == TYP_ENUM) {
+            type->tagged_typ.ident = LOAD_TOKEN(&token_buf, pt->ident);
+            type->tagged_typ.list = symbols[pt->list];
+            type->tagged_typ.size = pt->size;
+            type->tagged_typ.align = pt->align;
+        }
+    }
+    for (uint32_t i = 0; i < h->nsymbols; i++) {
+        PchSymbol *ps = &psymbols[i];
+        Symbol *sym = symbols[i + 1];
+        sym->tag = ps->tag;
+        sym->type = types[ps->type];
+        sym->next = symbols[ps->next];
+        if (ps->tag == ST_DEFINE) {
+            sym->token = LOAD_TOKEN(pp->raw, ps->token);
+            for (int j = 1; j < ps->value; j++) LOAD_TOKEN(pp->raw, ps->token + j);
+            sym->macro = macro_parse(pp, sym->token, sym->token + ps->value);
+        } else {
+            sym->token = LOAD_TOKEN(&token_buf, ps->token);
+            sym->offset = ps->value;
+        }
+    }
+    #undef LOAD_TOKEN
+
+    preprocessor_restore(pp, symbols[h->defines]);
+    // stored oldest first, as in Program; the parser keeps them newest first
+    parser_restore(parser, symbols[h->func_types], reverse_symbols(symbols[h->global_vars]), symbols[h->defined_types]);
+    free(atoms);
+    free(types);
+    free(symbols);
+}
@@ -0,0 +1,474 @@
+#include "kcc.h"
+#include <stdatomic.h>
+
+// Peephole
+//
+// rewrites the instructions of one function, as codegen recorded them in
+// an AsmList, before they are written out. each rule matches a window of
+// consecutive instructions; comments are skipped, and a label or raw text
+// ends the window. rules that drop a register write need the register dead
+// afterwards, so every round starts with liveness over the list, following
+// jumps to their labels. a rewrite only makes registers live for less
+// time, so the liveness of a round stays safe to use while the round
+// changes the list. rounds repeat until nothing changes.
+//
+// --peephole-report prints how often each rule fired; --no-peephole turns
+// the pass off.
+
+#define MAX_ROUNDS 8
+
+bool peephole_on = true;
+
+typedef enum {
+    RULE_MOV_SELF,      // mov rax, rax
+    RULE_PUSH_POP,      // push rax; pop rdi -> mov rdi, rax
+    RULE_MOV_BACK,      // mov rdi, rax; mov rax, rdi -> mov rdi, rax
+    RULE_COPY_FORWARD,  // movsxd rax, edi; mov rbx, rax -> movsxd rbx, edi
+    RULE_FOLD_OPERAND,  // mov rdi, rbx; add rax, rdi -> add rax, rbx, and for cmp
+                        // mov rax, rbx; cmp rax, 5 -> cmp rbx, 5
+    RULE_SETCC_BRANCH,  // setl al; movzb rax, al; cmp rax, 0; je L -> jge L
+    RULE_JUMP_NEXT,     // jmp L; L:
+    RULE_JUMP_OVER,     // je L1; jmp L2; L1: -> jne L2; L1:
+    RULE_UNREACHABLE,   // instructions after jmp or ret, up to a label
+    RULE_DEAD_DEF,      // a write to a register that is not read
+    NUM_RULES,
+} Rule;
+
+static char *rule_names[] = {
+    "mov-self", "push-pop", "mov-back", "copy-forward", "fold-operand", "setcc-branch",
+    "jump-next", "jump-over", "unreachable", "dead-def",
+};
+
+static atomic_long rule_hits[NUM_RULES];
+
+// Operands
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI }; // r8 .. r15 follow
+
+#define REG(r) (1u << (r))
+#define ALL_REGS 0xFFFFu
+#define ALWAYS_LIVE (REG(RSP) | REG(RBP))
+#define CALLER_SAVED (REG(RAX) | REG(RCX) | REG(RDX) | REG(RSI) | REG(RDI) | 0x0F00u)
+#define CALL_USES (REG(RAX) | REG(RDI) | REG(RSI) | REG(RDX) | REG(RCX) | 0x0300u) // al: vector args
+#define RET_USES (REG(RAX) | REG(RBX) | ALWAYS_LIVE | 0xF000u)
+
+static char *reg_names[3][16] = {
+    {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+     "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"},
+    {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+     "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"},
+    {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+     "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"},
+};
+static int reg_sizes[3] = {8, 4, 1};
+
+typedef enum { OPD_NONE, OPD_REG, OPD_IMM, OPD_MEM, OPD_SYM } OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    int reg;       // OPD_REG
+    int size;      // OPD_REG: of the register
+    unsigned addr; // OPD_MEM: registers the address is formed from
+    long imm;      // OPD_IMM
+} Operand;
+
+// the register named by s[0, len), or -1
+static int find_reg(const char *s, int len, int *size) {
+    for (int k = 0; k < 3; k++) {
+        for (int r = 0; r < 16; r++) {
+            if ((int)strlen(reg_names[k][r]) == len && memcmp(reg_names[k][r], s, len) == 0) {
+                *size = reg_sizes[k];
+                return r;
+            }
+        }
+    }
+    return -1;
+}
+
+static Operand parse_operand(const char *s) {
+    Operand op = {OPD_NONE, -1, 0, 0, 0};
+    if (!s) return op;
+    const char *bracket = strchr(s, '[');
+    if (bracket) {
+        op.kind = OPD_MEM;
+        for (const char *p = bracket + 1; *p && *p != ']'; ) {
+            if (!isalpha(*p)) {
+                p++;
+                continue;
+            }
+            const char *start = p;
+            while (isalnum(*p)) p++;
+            int size, r = find_reg(start, p - start, &size);
+            if (0 <= r) op.addr |= REG(r);
+        }
+        return op;
+    }
+    if (isdigit(*s) || *s == '-') {
+        op.kind = OPD_IMM;
+        op.imm = strtol(s, NULL, 0);
+        return op;
+    }
+    op.reg = find_reg(s, strlen(s), &op.size);
+    op.kind = op.reg < 0 ? OPD_SYM : OPD_REG;
+    return op;
+}
+
+// registers read by an operand that is only read
+static unsigned reads(Operand *op) {
+    if (op->kind == OPD_REG) return REG(op->reg);
+    if (op->kind == OPD_MEM) return op->addr;
+    return 0;
+}
+
+// Liveness
+
+typedef struct {
+    AsmList *list;
+    int n;
+    Operand *dst; // by line
+    Operand *src;
+    unsigned *live_out; // by line: registers live after it
+    long hits[NUM_RULES];
+    bool changed;
+} Peephole;
+
+static const char *text(Peephole *p, int off) {
+    return p->list->text + off;
+}
+
+static const char *op_of(Peephole *p, int i) {
+    return text(p, p->list->lines[i].op);
+}
+
+static bool is_op(Peephole *p, int i, const char *op) {
+    return strcmp(op_of(p, i), op) == 0;
+}
+
+static bool is_jump(Peephole *p, int i) {
+    return op_of(p, i)[0] == 'j';
+}
+
+static bool is_cond_jump(Peephole *p, int i) {
+    return is_jump(p, i) && !is_op(p, i, "jmp");
+}
+
+// writes all of a register: 32-bit writes clear the upper half, 8-bit
+// ones keep the rest, so they read it too
+static unsigned writes(Operand *op) {
+    return op->kind == OPD_REG && op->size != 1 ? REG(op->reg) : 0;
+}
+
+static unsigned partial(Operand *op) {
+    return op->kind == OPD_REG && op->size == 1 ? REG(op->reg) : 0;
+}
+
+// registers line i reads before it writes, and those it overwrites
+static void effects(Peephole *p, int i, unsigned *use, unsigned *def) {
+    Operand *dst = &p->dst[i], *src = &p->src[i];
+    const char *op = op_of(p, i);
+    *use = *def = 0;
+    if (!strcmp(op, "mov") || !strcmp(op, "movsx") || !strcmp(op, "movsxd") || !strcmp(op, "movzx") ||
+        !strcmp(op, "movzb") || !strcmp(op, "lea")) {
+        *use = reads(src) | partial(dst) | (dst->kind == OPD_MEM ? dst->addr : 0);
+        *def = writes(dst);
+    } else if (!strncmp(op, "set", 3)) {
+        *use = reads(dst);
+    } else if (!strcmp(op, "pop")) {
+        *def = writes(dst);
+    } else if (!strcmp(op, "cqo")) {
+        *use = REG(RAX);
+        *def = REG(RDX);
+    } else if (!strcmp(op, "idiv") || !strcmp(op, "div")) {
+        *use = REG(RAX) | REG(RDX) | reads(dst);
+    } else if (!strcmp(op, "imul") && src->kind == OPD_NONE) {
+        // rdx:rax = rax * dst
+        *use = REG(RAX) | reads(dst);
+        *def = REG(RAX) | REG(RDX);
+    } else if (!strcmp(op, "call")) {
+        *use = CALL_USES | reads(dst);
+        *def = CALLER_SAVED;
+    } else if (!strcmp(op, "ret")) {
+        *use = RET_USES;
+    } else if (!strcmp(op, "push") || !strcmp(op, "cmp") || !strcmp(op, "test") || !strcmp(op, "add") ||
+               !strcmp(op, "sub") || !strcmp(op, "imul") || !strcmp(op, "and") || !strcmp(op, "or") ||
+               !strcmp(op, "xor") || !strcmp(op, "neg") || !strcmp(op, "not") || !strcmp(op, "shl") ||
+               !strcmp(op, "shr") || !strcmp(op, "sar") || op[0] == 'j') {
+        *use = reads(dst) | reads(src);
+    } else {
+        *use = ALL_REGS; // not known here
+    }
+}
+
+static void find_live(Peephole *p) {
+    AsmList *list = p->list;
+    HashMap *labels = hashmap_new(); // name -> 1 + line
+    for (int i = 0; i < p->n; i++) {
+        AsmLine *line = &list->lines[i];
+        if (line->kind == ASM_LABEL)
+            hashmap_put(labels, text(p, line->op), strlen(text(p, line->op)), (void *)(intptr_t)(i + 1));
+    }
+    // live before each line, updated backwards until nothing changes
+    unsigned *live_in = calloc(p->n + 1, sizeof(unsigned));
+    live_in[p->n] = ALL_REGS;
+    for (bool changed = true; changed; ) {
+        changed = false;
+        for (int i = p->n - 1; 0 <= i; i--) {
+            AsmLine *line = &list->lines[i];
+            unsigned in = live_in[i + 1], out = in;
+            if (line->kind == ASM_TEXT) {
+                in = ALL_REGS;
+            } else if (line->kind == ASM_INS) {
+                if (is_jump(p, i) || is_op(p, i, "ret")) {
+                    out = is_cond_jump(p, i) ? live_in[i + 1] : 0;
+                    if (is_op(p, i, "ret")) {
+                        // nothing after
+                    } else if (p->dst[i].kind == OPD_SYM) {
+                        const char *name = text(p, line->dst);
+                        intptr_t target = (intptr_t)hashmap_get(labels, name, strlen(name));
+                        out |= target ? live_in[target - 1] : ALL_REGS;
+                    } else {
+                        out = ALL_REGS; // through a table
+                    }
+                }
+                unsigned use, def;
+                effects(p, i, &use, &def);
+                in = use | (out & ~def) | ALWAYS_LIVE;
+            }
+            p->live_out[i] = out | ALWAYS_LIVE;
+            if (live_in[i] != in) {
+                live_in[i] = in;
+                changed = true;
+            }
+        }
+    }
+    free(live_in);
+    hashmap_free(labels);
+}
+
+// Rules
+
+static void hit(Peephole *p, Rule rule) {
+    p->hits[rule]++;
+    p->changed = true;
+}
+
+static void delete(Peephole *p, int i) {
+    p->list->lines[i].kind = ASM_DELETED;
+}
+
+// the instruction after line i, or -1 when a label, raw text or the end
+// comes first
+static int next_ins(Peephole *p, int i) {
+    for (i++; i < p->n; i++) {
+        AsmKind kind = p->list->lines[i].kind;
+        if (kind == ASM_INS) return i;
+        if (kind != ASM_COMMENT && kind != ASM_DELETED) return -1;
+    }
+    return -1;
+}
+
+// line i is a jump to one of the labels right after line j
+static bool jumps_past(Peephole *p, int i, int j) {
+    if (p->dst[i].kind != OPD_SYM) return false;
+    const char *target = text(p, p->list->lines[i].dst);
+    for (j++; j < p->n; j++) {
+        AsmLine *line = &p->list->lines[j];
+        if (line->kind == ASM_COMMENT || line->kind == ASM_DELETED) continue;
+        if (line->kind != ASM_LABEL) return false;
+        if (strcmp(text(p, line->op), target) == 0) return true;
+    }
+    return false;
+}
+
+static bool is_reg64(Operand *op) {
+    return op->kind == OPD_REG && op->size == 8;
+}
+
+// writes all of its 64-bit destination register and nothing else
+static bool is_move(Peephole *p, int i) {
+    return (is_op(p, i, "mov") || is_op(p, i, "movsx") || is_op(p, i, "movsxd") || is_op(p, i, "movzx") ||
+            is_op(p, i, "movzb") || is_op(p, i, "lea")) && is_reg64(&p->dst[i]);
+}
+
+static bool dead_after(Peephole *p, int i, int reg) {
+    return !(p->live_out[i] & REG(reg));
+}
+
+static char *conds[][2] = {
+    {"e", "ne"}, {"l", "ge"}, {"le", "g"}, {"b", "ae"}, {"be", "a"},
+};
+
+// the condition code that is true when cc is false, or NULL
+static const char *invert(const char *cc) {
+    for (int k = 0; k < (int)(sizeof(conds) / sizeof(conds[0])); k++) {
+        if (!strcmp(cc, conds[k][0])) return conds[k][1];
+        if (!strcmp(cc, conds[k][1])) return conds[k][0];
+    }
+    return NULL;
+}
+
+// "j" or "set" followed by cc
+static void set_op(Peephole *p, int i, const char *prefix, const char *cc) {
+    char op[8];
+    snprintf(op, sizeof(op), "%s%s", prefix, cc);
+    p->list->lines[i].op = asm_text(p->list, op, strlen(op));
+}
+
+// the rules that start at instruction i; returns true on a rewrite
+static bool rewrite(Peephole *p, int i) {
+    AsmLine *lines = p->list->lines;
+    Operand *dst = p->dst, *src = p->src;
+    int j = next_ins(p, i);
+
+    if (is_op(p, i, "mov") && is_reg64(&dst[i]) && is_reg64(&src[i]) && dst[i].reg == src[i].reg) {
+        delete(p, i);
+        hit(p, RULE_MOV_SELF);
+        return true;
+    }
+
+    if (is_op(p, i, "jmp") || is_op(p, i, "ret")) {
+        bool any = false;
+        for (int k = j; 0 <= k; k = next_ins(p, k)) {
+            delete(p, k);
+            hit(p, RULE_UNREACHABLE);
+            any = true;
+        }
+        if (any) return true;
+    }
+
+    if (is_jump(p, i) && jumps_past(p, i, i)) {
+        delete(p, i);
+        hit(p, RULE_JUMP_NEXT);
+        return true;
+    }
+
+    if (j < 0) goto single;
+
+    if (is_op(p, i, "push") && is_op(p, j, "pop") && dst[i].kind == OPD_REG && dst[j].kind == OPD_REG) {
+        if (dst[i].reg == dst[j].reg) {
+            delete(p, i);
+        } else {
+            lines[i].op = asm_text(p->list, "mov", 3);
+            lines[i].src = lines[i].dst;
+            src[i] = dst[i];
+            lines[i].dst = lines[j].dst;
+            dst[i] = dst[j];
+        }
+        delete(p, j);
+        hit(p, RULE_PUSH_POP);
+        return true;
+    }
+
+    if (is_op(p, i, "mov") && is_op(p, j, "mov") && is_reg64(&dst[i]) && is_reg64(&src[i]) &&
+        is_reg64(&dst[j]) && is_reg64(&src[j]) && dst[j].reg == src[i].reg && src[j].reg == dst[i].reg) {
+        delete(p, j);
+        hit(p, RULE_MOV_BACK);
+        return true;
+    }
+
+    // op t, x; mov y, t with t dead after: op y, x. a memory y takes
+    // only a register x.
+    if (is_move(p, i) && is_op(p, j, "mov") && is_reg64(&src[j]) && src[j].reg == dst[i].reg &&
+        dead_after(p, j, dst[i].reg) && !(reads(&dst[j]) & REG(dst[i].reg)) &&
+        (is_reg64(&dst[j]) || (is_op(p, i, "mov") && src[i].kind == OPD_REG))) {
+        lines[i].dst = lines[j].dst;
+        dst[i] = dst[j];
+        delete(p, j);
+        hit(p, RULE_COPY_FORWARD);
+        return true;
+    }
+
+    // mov t, x; op d, t with t dead after: op d, x
+    if (is_op(p, i, "mov") && is_reg64(&dst[i]) && is_reg64(&src[j]) && src[j].reg == dst[i].reg &&
+        (is_op(p, j, "add") || is_op(p, j, "sub") || is_op(p, j, "imul") || is_op(p, j, "cmp") ||
+         is_op(p, j, "and") || is_op(p, j, "or") || is_op(p, j, "xor")) &&
+        dead_after(p, j, dst[i].reg) && !(reads(&dst[j]) & REG(dst[i].reg)) &&
+        (is_reg64(&src[i]) || (src[i].kind == OPD_IMM && src[i].imm == (int)src[i].imm) ||
+         (src[i].kind == OPD_MEM && dst[j].kind == OPD_REG))) {
+        lines[j].src = lines[i].src;
+        src[j] = src[i];
+        delete(p, i);
+        hit(p, RULE_FOLD_OPERAND);
+        return true;
+    }
+    // mov t, x; cmp t, y with t dead after: cmp x, y
+    if (is_op(p, i, "mov") && is_reg64(&dst[i]) && is_reg64(&src[i]) && is_op(p, j, "cmp") &&
+        is_reg64(&dst[j]) && dst[j].reg == dst[i].reg && !(reads(&src[j]) & REG(dst[i].reg)) &&
+        dead_after(p, j, dst[i].reg)) {
+        lines[j].dst = lines[i].src;
+        dst[j] = src[i];
+        delete(p, i);
+        hit(p, RULE_FOLD_OPERAND);
+        return true;
+    }
+
+    // setcc al; movzb rax, al; cmp rax, 0; je/jne L: branch on the flags
+    // the setcc read
+    if (!strncmp(op_of(p, i), "set", 3) && dst[i].kind == OPD_REG && dst[i].reg == RAX &&
+        (is_op(p, j, "movzb") || is_op(p, j, "movzx")) && dst[j].reg == RAX && src[j].reg == RAX) {
+        int k = next_ins(p, j);
+        int m = k < 0 ? -1 : next_ins(p, k);
+        const char *cc = op_of(p, i) + 3;
+        if (m < 0 || !is_op(p, k, "cmp") || dst[k].reg != RAX || src[k].kind != OPD_IMM ||
+            strcmp(text(p, lines[k].src), "0") != 0 || !(is_op(p, m, "je") || is_op(p, m, "jne")) ||
+            !dead_after(p, m, RAX) || !invert(cc))
+            goto single;
+        set_op(p, m, "j", is_op(p, m, "je") ? invert(cc) : cc);
+        delete(p, i);
+        delete(p, j);
+        delete(p, k);
+        hit(p, RULE_SETCC_BRANCH);
+        return true;
+    }
+
+    // jcc L1; jmp L2; L1: -> jncc L2
+    if (is_cond_jump(p, i) && is_op(p, j, "jmp") && dst[j].kind == OPD_SYM && jumps_past(p, i, j) &&
+        invert(op_of(p, i) + 1)) {
+        set_op(p, i, "j", invert(op_of(p, i) + 1));
+        lines[i].dst = lines[j].dst;
+        dst[i] = dst[j];
+        delete(p, j);
+        hit(p, RULE_JUMP_OVER);
+        return true;
+    }
+
+single:
+    if (is_move(p, i) && dead_after(p, i, dst[i].reg)) {
+        delete(p, i);
+        hit(p, RULE_DEAD_DEF);
+        return true;
+    }
+    return false;
+}
+
+void peephole(AsmList *list) {
+    Peephole p = {
+        .list = list,
+        .n = list->len,
+        .dst = malloc((list->len + 1) * sizeof(Operand)),
+        .src = malloc((list->len + 1) * sizeof(Operand)),
+        .live_out = malloc((list->len + 1) * sizeof(unsigned)),
+    };
+    for (int i = 0; i < p.n; i++) {
+        AsmLine *line = &list->lines[i];
+        if (line->kind != ASM_INS) continue;
+        p.dst[i] = parse_operand(line->dst < 0 ? NULL : list->text + line->dst);
+        p.src[i] = parse_operand(line->src < 0 ? NULL : list->text + line->src);
+    }
+    for (int round = 0; round < MAX_ROUNDS; round++) {
+        p.changed = false;
+        find_live(&p);
+        for (int i = 0; i < p.n; i++)
+            if (list->lines[i].kind == ASM_INS) rewrite(&p, i);
+        if (!p.changed) break;
+    }
+    for (int r = 0; r < NUM_RULES; r++) atomic_fetch_add(&rule_hits[r], p.hits[r]);
+    free(p.dst);
+    free(p.src);
+    free(p.live_out);
+}
+
+void peephole_report(FILE *fp) {
+    fprintf(fp, "%-14s %10s\n", "peephole rule", "hits");
+    for (int r = 0; r < NUM_RULES; r++) fprintf(fp, "%-14s %10ld\n", rule_names[r], atomic_load(&rule_hits[r]));
+}
@@ -1,23 +1,74 @@
+#define _DEFAULT_SOURCE // realpath
 #include "kcc.h"
 
+// Include cache
+//
+// every file included in a compilation is lexed once; its raw tokens are
+// kept, keyed by canonical path. a header whose tokens all sit inside
+// #ifndef X / #define X ... #endif, or that says #pragma once, is skipped
+// outright on later includes while X is defined. others are replayed from
+// their raw tokens without reading or lexing the file again.
+
+typedef struct {
+    Token first; // in pp->raw, up to the file's TT_EOF
+    int guard;   // atom of the include guard macro, or 0
+    bool once;   // #pragma once
+} IncludeEntry;
+
+// directive names and identifiers that are not keywords
+static int atom_ifdef, atom_ifndef, atom_elif, atom_endif, atom_undef, atom_error, atom_pragma, atom_once;
+static int atom_defined, atom_va_args;
+
 Preprocessor *preprocessor_new(const char *input, Symbol *defines) {
+    if (!atom_ifdef) {
+        atom_ifdef = intern("ifdef", 5);
+        atom_ifndef = intern("ifndef", 6);
+        atom_elif = intern("elif", 4);
+        atom_endif = intern("endif", 5);
+        atom_undef = intern("undef", 5);
+        atom_error = intern("error", 5);
+        atom_pragma = intern("pragma", 6);
+        atom_once = intern("once", 4);
+        atom_defined = intern("defined", 7);
+        atom_va_args = intern("__VA_ARGS__", 11);
+    }
     Preprocessor *pp = calloc(1, sizeof(Preprocessor));
     pp->input = input;
     pp->defines = defines;
+    pp->macros = hashmap_new();
+    pp->includes = hashmap_new();
+    pp->raw = calloc(1, sizeof(TokenBuf));
+    pp->scratch = calloc(1, sizeof(TokenBuf));
+    pp->cache = calloc(1, sizeof(TokenBuf));
+    tokenbuf_end(pp->scratch);
+    tokenbuf_end(pp->cache);
+    pp->generation = 1;
     return pp;
 }
 
-static Symbol *append_define(Preprocessor *pp, Token *token, Token *pp_token) {
+static Symbol *append_define(Preprocessor *pp, Token token, Macro *macro) {
     Symbol **defs = &pp->defines;
-    Symbol *symbol = calloc(1, sizeof(Symbol));
+    Symbol *symbol = arena_alloc(sizeof(Symbol));
     symbol->tag = ST_DEFINE;
     symbol->token = token;
-    symbol->pp_token = pp_token;
+    symbol->macro = macro;
     symbol->next = *defs;
     *defs = symbol;
+    hashmap_put_atom(pp->macros, pp->raw->atoms[token], symbol); // a redefinition replaces the old one
+    pp->generation++;
     return symbol;
 }
 
+// install macros loaded from a precompiled header; defines is newest first
+void preprocessor_restore(Preprocessor *pp, Symbol *defines) {
+    pp->defines = defines;
+    for (Symbol *sym = defines; sym != NULL; sym = sym->next) {
+        int atom = pp->raw->atoms[sym->token];
+        if (!hashmap_get_atom(pp->macros, atom)) hashmap_put_atom(pp->macros, atom, sym);
+    }
+    pp->generation++;
+}
+
 static char *strndupl(const char *str, int len) {
     char *buffer = malloc(len + 1);
     memcpy(buffer, str, len);
@@ -25,52 +76,688 @@ static char *strndupl(const char *str, int len) {
     return buffer;
 }
 
-Token *preprocess(Preprocessor *pp) {
-    Lexer *lexer = lexer_new(pp->input);
-    Token *tokens = tokenize(lexer);
-    Token head, *prev;
-    head.next = tokens;
-    // look up #define
-    for (Token *t = &head; t != NULL; t = t->next) {
-        if (t->tag != TT_HASH) {
-            prev = t;
+// whether raw token b, which follows a, starts a new line. a newline
+// after a backslash or inside a block comment does not end one.
+static bool at_line_start(TokenBuf *raw, Token a, Token b) {
+    if (raw->tags[b] == TT_EOF) return true;
+    const char *end = source_base + raw->offsets[b];
+    for (const char *p = source_base + raw->offsets[a] + raw->lens[a]; p < end; p++) {
+        if (*p == '\n' || (p[0] == '/' && p[1] == '/')) return true;
+        if (p[0] == '\\' && p[1] == '\n') {
+            p++;
+        } else if (p[0] == '/' && p[1] == '*') {
+            for (p += 2; p + 1 < end && !(p[0] == '*' && p[1] == '/'); p++);
+            p++;
+        }
+    }
+    return false;
+}
+
+// the last raw token on t's line
+static Token line_end(TokenBuf *raw, Token t) {
+    while (!at_line_start(raw, t, t + 1)) t++;
+    return t;
+}
+
+// the guard macro if the file's tokens from first are all inside one
+// #ifndef X / #define X ... #endif; otherwise 0
+static int include_guard(TokenBuf *raw, Token first) {
+    uint8_t *tags = raw->tags;
+    uint32_t *atoms = raw->atoms;
+    Token t = first;
+    if (tags[t] != TT_HASH || atoms[t + 1] != atom_ifndef || tags[t + 2] != TT_IDENT
+        || tags[t + 3] != TT_HASH || tags[t + 4] != TT_PP_DEFINE || atoms[t + 5] != atoms[t + 2]) return 0;
+    int depth = 0;
+    for (; tags[t] != TT_EOF; t++) {
+        if (tags[t] != TT_HASH) continue;
+        int a = atoms[t + 1];
+        if (a == atom_ifdef || a == atom_ifndef || tags[t + 1] == TT_KW_IF) {
+            depth++;
+        } else if ((tags[t + 1] == TT_KW_ELSE || a == atom_elif) && depth == 1) {
+            return 0;
+        } else if (a == atom_endif && --depth == 0) {
+            return tags[line_end(raw, t + 1) + 1] == TT_EOF ? atoms[first + 2] : 0;
+        }
+    }
+    return 0;
+}
+
+// Macros
+//
+// expansion reads from a stack of contexts, each a range of tokens in some
+// buffer. the base context is the rest of the file (or an argument being
+// expanded on its own); expanding a macro pushes its replacement list and
+// disables the macro until that context has been read. an object-like
+// body is read straight from the raw tokens; arguments and substituted
+// bodies of function-like macros are built in pp->scratch, which is
+// emptied after each expansion in the file.
+//
+// an identifier that names a disabled macro is marked PP_NOEXPAND, so that
+// it stays unexpanded when it is read again as part of an argument.
+
+#define PP_NOEXPAND 0x80 // tag bit; cleared when preprocessing is done
+
+struct MacroContext {
+    TokenBuf *buf;
+    Token pos;
+    Token end;    // 0: up to the TT_EOF of a file
+    Macro *macro; // disabled while this context is read
+};
+
+typedef struct {
+    int floor;       // index of the base context
+    TokenBuf *out;
+    bool read_base;  // a token of the base context was looked at
+    int space;       // the spacing of the next token out, from the macro name it
+                     // comes from; -1 for its own
+} Expander;
+
+static int param_index(Macro *m, TokenBuf *buf, Token t) {
+    if (buf->tags[t] != TT_IDENT) return -1;
+    for (int i = 0; i < m->nparams; i++) {
+        if (m->params[i] == (int)buf->atoms[t]) return i;
+    }
+    return -1;
+}
+
+// the macro defined by raw tokens name .. end - 1: NAME body or NAME(params) body
+Macro *macro_parse(Preprocessor *pp, Token name, Token end) {
+    TokenBuf *raw = pp->raw;
+    Macro *m = calloc(1, sizeof(Macro));
+    m->nparams = -1;
+    Token t = name + 1;
+    if (t < end && raw->tags[t] == TT_PAREN_L && !raw->spaces[t]) {
+        m->nparams = 0;
+        m->params = malloc((end - t) * sizeof(int));
+        t++;
+        while (t < end && raw->tags[t] != TT_PAREN_R) {
+            if (raw->tags[t] == TT_ELLIPSIS) {
+                m->variadic = true;
+                m->params[m->nparams++] = atom_va_args;
+            } else if (raw->tags[t] == TT_IDENT) {
+                m->params[m->nparams++] = raw->atoms[t];
+            } else panic("preprocess error: macro parameter");
+            t++;
+            if (m->variadic || t >= end || raw->tags[t] != TT_COMMA) break;
+            t++;
+        }
+        if (t >= end || raw->tags[t] != TT_PAREN_R) panic("preprocess error: expected \')\' after macro parameters");
+        t++;
+    }
+    m->body = t;
+    m->len = end - t;
+    if (m->len && (raw->tags[t] == TT_HASH_HASH || raw->tags[end - 1] == TT_HASH_HASH))
+        panic("preprocess error: '##' cannot appear at either end of a macro expansion");
+    for (; t < end; t++) {
+        if (raw->tags[t] == TT_HASH_HASH) m->paste = true;
+        if (raw->tags[t] == TT_HASH && m->nparams >= 0 && (t + 1 == end || param_index(m, raw, t + 1) < 0))
+            panic("preprocess error: '#' is not followed by a macro parameter");
+    }
+    return m;
+}
+
+static void push_context(Preprocessor *pp, TokenBuf *buf, Token pos, Token end, Macro *macro) {
+    if (pp->ncontexts == pp->contexts_capacity) {
+        pp->contexts_capacity = pp->contexts_capacity ? pp->contexts_capacity * 2 : 16;
+        pp->contexts = realloc(pp->contexts, pp->contexts_capacity * sizeof(MacroContext));
+        if (!pp->contexts) panic("cannot reallocate memory: %s", strerror(errno));
+    }
+    pp->contexts[pp->ncontexts++] = (MacroContext){buf, pos, end, macro};
+    if (macro) {
+        macro->disabled = true;
+        pp->ndisabled++;
+    }
+}
+
+static void pop_context(Preprocessor *pp) {
+    MacroContext *c = &pp->contexts[--pp->ncontexts];
+    if (c->macro) {
+        c->macro->disabled = false;
+        pp->ndisabled--;
+    }
+}
+
+static bool context_done(MacroContext *c) {
+    return c->end ? c->pos >= c->end : c->buf->tags[c->pos] == TT_EOF;
+}
+
+// the next token of the contexts above x's base, popping those that are
+// done; 0 once they all are
+static Token next_above_base(Preprocessor *pp, Expander *x, TokenBuf **buf) {
+    while (pp->ncontexts - 1 > x->floor) {
+        MacroContext *c = &pp->contexts[pp->ncontexts - 1];
+        if (!context_done(c)) {
+            *buf = c->buf;
+            return c->pos++;
+        }
+        pop_context(pp);
+    }
+    return 0;
+}
+
+// the next token, reading on into the base; 0 at its end
+static Token next_token(Preprocessor *pp, Expander *x, TokenBuf **buf) {
+    Token t = next_above_base(pp, x, buf);
+    if (t) return t;
+    MacroContext *c = &pp->contexts[x->floor];
+    x->read_base = true;
+    if (context_done(c)) return 0;
+    *buf = c->buf;
+    return c->pos++;
+}
+
+// if the next token is '(', consume it and return true. the contexts that
+// end before it are popped only then.
+static bool next_is_paren(Preprocessor *pp, Expander *x) {
+    for (int i = pp->ncontexts - 1; i >= x->floor; i--) {
+        MacroContext *c = &pp->contexts[i];
+        if (i == x->floor) x->read_base = true;
+        if (context_done(c)) continue;
+        if (c->buf->tags[c->pos] != TT_PAREN_L) return false;
+        while (pp->ncontexts - 1 > i) pop_context(pp);
+        pp->contexts[i].pos++;
+        return true;
+    }
+    return false;
+}
+
+static void emit(Expander *x, TokenBuf *buf, Token t, bool noexpand) {
+    Token u = token_copy(x->out, buf, t);
+    if (noexpand) x->out->tags[u] |= PP_NOEXPAND;
+    if (x->space >= 0) x->out->spaces[u] = x->space;
+    x->space = -1;
+}
+
+// the tokens made by # and ## need text in the source space, followed by
+// the zero padding that the scanners expect
+#define PP_TEXT_CHUNK (64 * 1024)
+
+static char *pp_text(int len) {
+    static char *next;
+    static size_t left;
+    size_t size = len + 2 + SOURCE_PADDING;
+    if (size > left) {
+        left = size > PP_TEXT_CHUNK ? size : PP_TEXT_CHUNK;
+        next = source_alloc(left);
+    }
+    char *p = next;
+    next += size;
+    left -= size;
+    return p;
+}
+
+// push tokens from .. to - 1 of s as one string literal, spaced as given
+static void stringify(TokenBuf *s, Token from, Token to, bool space) {
+    int len = 2;
+    for (Token t = from; t < to; t++) len += 2 * s->lens[t] + 1;
+    char *text = pp_text(len);
+    char *p = text;
+    *p++ = '"';
+    for (Token t = from; t < to; t++) {
+        if (t > from && s->spaces[t]) *p++ = ' ';
+        const char *q = source_base + s->offsets[t];
+        bool quoted = s->tags[t] == TT_STRING || s->tags[t] == TT_CHAR;
+        for (uint32_t i = 0; i < s->lens[t]; i++) {
+            if (quoted && (q[i] == '"' || q[i] == '\\')) *p++ = '\\';
+            *p++ = q[i];
+        }
+    }
+    *p++ = '"';
+    token_push(s, TT_STRING, text - source_base, p - text, 0, space);
+}
+
+// replace the last token of s with it pasted to token t of buf, keeping
+// the spacing of the last token
+static void paste(TokenBuf *s, TokenBuf *buf, Token t) {
+    static TokenBuf pasted;
+    Token l = s->len - 1;
+    bool space = s->spaces[l];
+    int llen = s->lens[l], rlen = buf->lens[t];
+    char *text = pp_text(llen + rlen);
+    memcpy(text, source_base + s->offsets[l], llen);
+    memcpy(text + llen, source_base + buf->offsets[t], rlen);
+    pasted.len = 0;
+    Token first = tokenize(lexer_new(text), &pasted);
+    if (pasted.tags[first] == TT_EOF || pasted.tags[first + 1] != TT_EOF)
+        panic("preprocess error: pasting gives no single token: %.*s", llen + rlen, text);
+    s->len--;
+    s->spaces[token_copy(s, &pasted, first)] = space;
+}
+
+static void expand_token(Preprocessor *pp, Expander *x, TokenBuf *buf, Token t);
+
+// expand the contexts above x's base to their end
+static void expand_contexts(Preprocessor *pp, Expander *x) {
+    TokenBuf *buf;
+    Token t;
+    while ((t = next_above_base(pp, x, &buf))) expand_token(pp, x, buf, t);
+}
+
+// fully expand tokens from .. to - 1 of pp->scratch on their own and
+// append the result to it. returns the first token of the result.
+static Token expand_range(Preprocessor *pp, Token from, Token to) {
+    // the expansion works in pp->scratch too, so the result is collected
+    // apart, in one buffer per level of nesting
+    static TokenBuf **outs;
+    static int depth, capacity;
+    if (depth == capacity) {
+        capacity = capacity ? capacity * 2 : 8;
+        outs = realloc(outs, capacity * sizeof(TokenBuf *));
+        if (!outs) panic("cannot reallocate memory: %s", strerror(errno));
+        for (int i = depth; i < capacity; i++) outs[i] = calloc(1, sizeof(TokenBuf));
+    }
+    TokenBuf *out = outs[depth++];
+    out->len = 0;
+    Token first = tokenbuf_end(out);
+    push_context(pp, pp->scratch, from, to, NULL);
+    Expander x = {pp->ncontexts - 1, out, false, -1};
+    TokenBuf *buf;
+    Token t;
+    while ((t = next_token(pp, &x, &buf))) expand_token(pp, &x, buf, t);
+    pop_context(pp);
+    depth--;
+    Token result = pp->scratch->len;
+    for (t = first; t < out->len; t++) token_copy(pp->scratch, out, t);
+    return result;
+}
+
+// substitute args into m's replacement list at the end of pp->scratch and
+// push the result. args holds the first and end token of each argument; the
+// first token of one is spaced like the parameter it replaces.
+static void substitute(Preprocessor *pp, Macro *m, Token *args) {
+    TokenBuf *s = pp->scratch;
+    TokenBuf *raw = pp->raw;
+    Token end = m->body + m->len;
+
+    // arguments not next to # or ## are expanded first, each once
+    int nparams = m->nparams > 0 ? m->nparams : 0;
+    Token *expanded = calloc(2 * nparams + 1, sizeof(Token));
+    for (Token b = m->body; b < end; b++) {
+        int p = param_index(m, raw, b);
+        if (p < 0 || expanded[2 * p]) continue;
+        if (b > m->body && (raw->tags[b - 1] == TT_HASH || raw->tags[b - 1] == TT_HASH_HASH)) continue;
+        if (b + 1 < end && raw->tags[b + 1] == TT_HASH_HASH) continue;
+        expanded[2 * p] = expand_range(pp, args[2 * p], args[2 * p + 1]);
+        expanded[2 * p + 1] = s->len;
+    }
+
+    Token start = s->len;
+    bool placemarker = false; // the left operand of a ## is an empty argument
+    for (Token b = m->body; b < end; b++) {
+        int p;
+        if (raw->tags[b] == TT_HASH && b + 1 < end && (p = param_index(m, raw, b + 1)) >= 0) {
+            stringify(s, args[2 * p], args[2 * p + 1], raw->spaces[b]);
+            b++;
+        } else if (raw->tags[b] == TT_HASH_HASH && b > m->body && b + 1 < end) {
+            b++;
+            TokenBuf *src = raw;
+            Token from = b, to = b + 1;
+            bool va_comma = false; // , ## __VA_ARGS__ keeps the comma apart, or drops it with no arguments
+            if ((p = param_index(m, raw, b)) >= 0) {
+                src = s;
+                from = args[2 * p];
+                to = args[2 * p + 1];
+                va_comma = m->variadic && p == m->nparams - 1 && s->len > start && s->tags[s->len - 1] == TT_COMMA;
+                if (va_comma && from == to) s->len--;
+            }
+            if (from == to) continue;
+            if (placemarker || va_comma || s->len == start) s->spaces[token_copy(s, src, from)] = raw->spaces[b];
+            else paste(s, src, from);
+            for (Token t = from + 1; t < to; t++) token_copy(s, src, t);
+            placemarker = false;
+        } else if ((p = param_index(m, raw, b)) >= 0) {
+            Token from = args[2 * p], to = args[2 * p + 1];
+            if (b + 1 < end && raw->tags[b + 1] == TT_HASH_HASH) {
+                placemarker = from == to;
+            } else {
+                from = expanded[2 * p];
+                to = expanded[2 * p + 1];
+            }
+            for (Token t = from; t < to; t++) token_copy(s, s, t);
+            if (from < to) s->spaces[s->len - (to - from)] = raw->spaces[b];
+        } else {
+            token_copy(s, raw, b);
+        }
+    }
+    free(expanded);
+    push_context(pp, s, start, s->len, m);
+}
+
+// read the arguments of a call to m, whose '(' has been read, into
+// pp->scratch and push the expansion
+static void expand_call(Preprocessor *pp, Expander *x, Macro *m) {
+    TokenBuf *s = pp->scratch;
+    int nslots = m->nparams > 0 ? m->nparams : 1;
+    Token *args = malloc(2 * nslots * sizeof(Token));
+    int nargs = 0;
+    int depth = 0;
+    args[0] = s->len;
+    for (;;) {
+        TokenBuf *buf;
+        Token t = next_token(pp, x, &buf);
+        if (!t) panic("preprocess error: unterminated macro call");
+        int tag = buf->tags[t];
+        if (tag == TT_HASH && buf == pp->raw && pp->ncontexts - 1 == x->floor && at_line_start(buf, t - 1, t))
+            panic("preprocess error: directive inside macro arguments");
+        if (tag == TT_PAREN_R && depth == 0) break;
+        if (tag == TT_COMMA && depth == 0 && !(m->variadic && nargs == m->nparams - 1)) {
+            if (++nargs == nslots) panic("preprocess error: too many macro arguments");
+            args[2 * nargs - 1] = args[2 * nargs] = s->len;
             continue;
         }
-        Token *token_directive = t->next;
-        if (token_directive->tag == TT_PP_DEFINE) {
-            Token *token_from = token_directive ? token_directive->next : NULL;
-            Token *token_to = token_from ? token_from->next : NULL;
-            if (!token_from || !token_to) panic("preprocess error: #define");
-            append_define(pp, token_from, token_to);
-            prev->next = token_to->next;
-            t = token_to;
-        } else if (token_directive->tag == TT_PP_INCLUDE) {
-            Token *token_file = token_directive->next;
-            if (!token_file || token_file->tag != TT_STRING) panic("preprocess error: #include");
-            char *path = strndupl(token_file->start + 1, token_file->len - 2);
-            char *src = read_file(path);
-            Preprocessor *pp2 = preprocessor_new(src, pp->defines);
-            Token *tokens2 = preprocess(pp2);
-            pp->defines = pp2->defines;
-            if (tokens2->tag != TT_EOF) {
-                prev->next = tokens2;
-                while (tokens2->next && tokens2->next->tag != TT_EOF) tokens2 = tokens2->next;
-                tokens2->next = token_file->next;
-                prev = tokens2;
+        if (tag == TT_PAREN_L) depth++;
+        else if (tag == TT_PAREN_R) depth--;
+        token_copy(s, buf, t);
+    }
+    args[2 * nargs + 1] = s->len;
+    nargs++;
+    if (m->nparams == 0 && args[1] != args[0]) panic("preprocess error: too many macro arguments");
+    if (m->variadic && nargs == m->nparams - 1) {
+        args[2 * nargs] = args[2 * nargs + 1] = s->len; // no variadic arguments
+        nargs++;
+    }
+    if (nargs < m->nparams) panic("preprocess error: too few macro arguments");
+    if (m->nparams == 0 && !m->paste) push_context(pp, pp->raw, m->body, m->body + m->len, m);
+    else substitute(pp, m, args);
+    free(args);
+}
+
+static void expand_object(Preprocessor *pp, Expander *x, Macro *m) {
+    // with nothing above the base and no macro disabled, the expansion
+    // depends only on the macro table, unless it looked past its end
+    bool cacheable = pp->ncontexts - 1 == x->floor && pp->ndisabled == 0;
+    if (cacheable && m->cache_generation == pp->generation) {
+        stats.cached_expansions++;
+        for (int i = 0; i < m->cache_len; i++) token_copy(x->out, pp->cache, m->cache + i);
+        if (m->cache_len && x->space >= 0) x->out->spaces[x->out->len - m->cache_len] = x->space;
+        if (m->cache_len) x->space = -1;
+        return;
+    }
+    if (m->paste) substitute(pp, m, NULL);
+    else push_context(pp, pp->raw, m->body, m->body + m->len, m);
+    if (!cacheable) return; // the caller reads on
+    Token start = x->out->len;
+    bool read_base = x->read_base;
+    x->read_base = false;
+    expand_contexts(pp, x);
+    if (!x->read_base) {
+        m->cache = pp->cache->len;
+        m->cache_len = x->out->len - start;
+        m->cache_generation = pp->generation;
+        for (Token t = start; t < x->out->len; t++) token_copy(pp->cache, x->out, t);
+    }
+    x->read_base |= read_base;
+}
+
+// whether the expansion just made is empty: its context was pushed with
+// nothing in it, or it was read to its end in place without emitting
+static bool expansion_empty(Preprocessor *pp, Expander *x) {
+    return pp->ncontexts - 1 == x->floor || context_done(&pp->contexts[pp->ncontexts - 1]);
+}
+
+static void expand_token(Preprocessor *pp, Expander *x, TokenBuf *buf, Token t) {
+    Symbol *sym = buf->tags[t] == TT_IDENT ? hashmap_get_atom(pp->macros, buf->atoms[t]) : NULL;
+    if (!sym || sym->macro->disabled || (sym->macro->nparams >= 0 && !next_is_paren(pp, x))) {
+        emit(x, buf, t, sym && sym->macro->disabled);
+        return;
+    }
+    // the first token out is spaced like the outermost macro name it comes
+    // from. an empty expansion leaves a space for the next token, as gcc does.
+    bool outermost = x->space < 0;
+    if (outermost) x->space = buf->spaces[t];
+    stats.expansions++;
+    if (sym->macro->nparams < 0) expand_object(pp, x, sym->macro);
+    else expand_call(pp, x, sym->macro);
+    if (outermost && x->space == 0 && expansion_empty(pp, x)) x->space = -1;
+}
+
+// expand the macro named by raw token t into token_buf, reading any
+// arguments from the tokens after it. returns the last token used.
+static Token expand_in_file(Preprocessor *pp, Token t) {
+    push_context(pp, pp->raw, t + 1, 0, NULL);
+    Expander x = {pp->ncontexts - 1, &token_buf, false, -1};
+    expand_token(pp, &x, pp->raw, t);
+    expand_contexts(pp, &x);
+    Token next = pp->contexts[x.floor].pos;
+    pop_context(pp);
+    pp->scratch->len = 1;
+    return next - 1;
+}
+
+// #if
+//
+// defined X and defined(X) are replaced first, then the line is expanded;
+// identifiers left after that are 0.
+
+typedef struct {
+    TokenBuf *buf;
+    Token pos, end;
+} CondReader;
+
+static int cond_tag(CondReader *r) {
+    return r->pos < r->end ? r->buf->tags[r->pos] & ~PP_NOEXPAND : TT_EOF;
+}
+
+static long cond_expr(CondReader *r);
+
+static long cond_primary(CondReader *r) {
+    int tag = cond_tag(r);
+    if (tag == TT_EOF) panic("preprocess error: #if: expected an expression");
+    Token t = r->pos++;
+    const char *text = source_base + r->buf->offsets[t];
+    switch (tag) {
+        case TT_INT:
+            return strtol(text, NULL, 10);
+        case TT_CHAR:
+            if (text[1] != '\\') return text[1];
+            switch (text[2]) {
+                case 'n': return '\n';
+                case 't': return '\t';
+                case '0': return '\0';
+                default: return text[2];
             }
-            t = token_file;
-        } else panic("preprocess error: expected define or include after '#'");
-    }
-    for (Token *t = head.next; t != NULL; t = t->next) {
-        for (Symbol *sym = pp->defines; sym != NULL; sym = sym->next) {
-            if (!tokeneq(t, sym->token)) continue;
-            // replace token
-            t->tag = sym->pp_token->tag;
-            t->start = sym->pp_token->start;
-            t->len = sym->pp_token->len;
-            break;
+        case TT_IDENT:
+            return 0;
+        case TT_PAREN_L: {
+            long val = cond_expr(r);
+            if (cond_tag(r) != TT_PAREN_R) panic("preprocess error: #if: expected \')\'");
+            r->pos++;
+            return val;
+        }
+        case TT_PLUS: return cond_primary(r);
+        case TT_MINUS: return -cond_primary(r);
+        case TT_BANG: return !cond_primary(r);
+        default:
+            panic("preprocess error: #if: unexpected %.*s", r->buf->lens[t], text);
+            return 0;
+    }
+}
+
+static int cond_prec(int tag) {
+    switch (tag) {
+        case TT_PIPE_PIPE: return 1;
+        case TT_AND_AND: return 2;
+        case TT_AMPERSAND: return 3;
+        case TT_EQ_EQ: case TT_BANG_EQ: return 4;
+        case TT_ANGLE_L: case TT_ANGLE_R: case TT_ANGLE_L_EQ: case TT_ANGLE_R_EQ: return 5;
+        case TT_PLUS: case TT_MINUS: return 6;
+        case TT_STAR: case TT_SLASH: case TT_PERCENT: return 7;
+        default: return 0;
+    }
+}
+
+static long cond_binary(CondReader *r, int min_prec) {
+    long lhs = cond_primary(r);
+    for (;;) {
+        int tag = cond_tag(r);
+        int prec = cond_prec(tag);
+        if (prec == 0 || prec < min_prec) return lhs;
+        r->pos++;
+        long rhs = cond_binary(r, prec + 1);
+        switch (tag) {
+            case TT_PIPE_PIPE: lhs = lhs || rhs; break;
+            case TT_AND_AND: lhs = lhs && rhs; break;
+            case TT_AMPERSAND: lhs = lhs & rhs; break;
+            case TT_EQ_EQ: lhs = lhs == rhs; break;
+            case TT_BANG_EQ: lhs = lhs != rhs; break;
+            case TT_ANGLE_L: lhs = lhs < rhs; break;
+            case TT_ANGLE_R: lhs = lhs > rhs; break;
+            case TT_ANGLE_L_EQ: lhs = lhs <= rhs; break;
+            case TT_ANGLE_R_EQ: lhs = lhs >= rhs; break;
+            case TT_PLUS: lhs = lhs + rhs; break;
+            case TT_MINUS: lhs = lhs - rhs; break;
+            case TT_STAR: lhs = lhs * rhs; break;
+            case TT_SLASH:
+            case TT_PERCENT:
+                if (rhs == 0) panic("preprocess error: #if: division by zero");
+                lhs = tag == TT_SLASH ? lhs / rhs : lhs % rhs;
+                break;
+        }
+    }
+}
+
+static long cond_expr(CondReader *r) {
+    long cond = cond_binary(r, 1);
+    if (cond_tag(r) != TT_QUESTION) return cond;
+    r->pos++;
+    long then = cond_expr(r);
+    if (cond_tag(r) != TT_COLON) panic("preprocess error: #if: expected \':\'");
+    r->pos++;
+    long els = cond_expr(r);
+    return cond ? then : els;
+}
+
+// evaluate the #if expression in raw tokens from .. to - 1
+static bool eval_condition(Preprocessor *pp, Token from, Token to) {
+    static uint32_t digits; // "0 1", the texts of false and true
+    if (!digits) {
+        char *text = pp_text(3);
+        memcpy(text, "0 1", 3);
+        digits = text - source_base;
+    }
+    TokenBuf *raw = pp->raw, *s = pp->scratch;
+    Token start = s->len;
+    for (Token t = from; t < to; t++) {
+        if (raw->atoms[t] != (uint32_t)atom_defined) {
+            token_copy(s, raw, t);
+            continue;
         }
+        bool paren = t + 1 < to && raw->tags[t + 1] == TT_PAREN_L;
+        Token name = t + 1 + paren;
+        if (name >= to || raw->tags[name] != TT_IDENT) panic("preprocess error: #if: defined");
+        bool defined = hashmap_get_atom(pp->macros, raw->atoms[name]) != NULL;
+        token_push(s, TT_INT, digits + 2 * defined, 1, 0, raw->spaces[t]);
+        t = name + paren;
     }
-    return head.next;
+    CondReader r = {s, expand_range(pp, start, s->len), 0};
+    r.end = s->len;
+    if (r.pos == r.end) panic("preprocess error: #if with no expression");
+    long val = cond_expr(&r);
+    if (r.pos != r.end) panic("preprocess error: #if: unexpected tokens at the end");
+    s->len = 1;
+    return val != 0;
 }
 
+// conditional stack entries
+#define COND_ACTIVE 1        // this branch is being copied
+#define COND_PARENT_ACTIVE 2 // the enclosing one is
+#define COND_TAKEN 4         // a branch of this #if has been taken
+
+static void include(Preprocessor *pp, const char *path);
+
+// copy the raw tokens from t to their file's TT_EOF to token_buf, expanding
+// macros, splicing included files in place and dropping directives.
+// returns the TT_EOF.
+static Token preprocess_tokens(Preprocessor *pp, Token t, IncludeEntry *file) {
+    TokenBuf *raw = pp->raw; // grows while included files are lexed, so index it afresh each time
+    Stack *conds = stack_new(8);
+    bool active = true;
+    for (; raw->tags[t] != TT_EOF; t++) {
+        if (raw->tags[t] != TT_HASH) {
+            if (!active) continue;
+            if (raw->tags[t] == TT_IDENT && pp->macros->used && hashmap_get_atom(pp->macros, raw->atoms[t])) t = expand_in_file(pp, t);
+            else token_copy(&token_buf, raw, t);
+            continue;
+        }
+        Token token_directive = t + 1;
+        if (at_line_start(raw, t, token_directive)) continue; // null directive
+        int directive = raw->atoms[token_directive];
+        TokenTag tag = raw->tags[token_directive];
+        Token last = line_end(raw, token_directive);
+        if (directive == atom_ifdef || directive == atom_ifndef || tag == TT_KW_IF) {
+            bool cond = false;
+            if (active && tag == TT_KW_IF) {
+                cond = eval_condition(pp, token_directive + 1, last + 1);
+            } else if (active) {
+                Token token_name = token_directive + 1;
+                if (raw->tags[token_name] != TT_IDENT) panic("preprocess error: #ifdef");
+                bool defined = hashmap_get_atom(pp->macros, raw->atoms[token_name]) != NULL;
+                cond = directive == atom_ifdef ? defined : !defined;
+            }
+            stack_push(conds, (active && cond ? COND_ACTIVE | COND_TAKEN : 0) | (active ? COND_PARENT_ACTIVE : 0));
+        } else if (tag == TT_KW_ELSE || directive == atom_elif) {
+            if (conds->top == 0) panic("preprocess error: #%s without #if", tag == TT_KW_ELSE ? "else" : "elif");
+            int cond = stack_pop(conds);
+            bool take = (cond & COND_PARENT_ACTIVE) && !(cond & COND_TAKEN)
+                && (tag == TT_KW_ELSE || eval_condition(pp, token_directive + 1, last + 1));
+            stack_push(conds, (take ? COND_ACTIVE | COND_TAKEN : 0) | (cond & (COND_PARENT_ACTIVE | COND_TAKEN)));
+        } else if (directive == atom_endif) {
+            if (conds->top == 0) panic("preprocess error: #endif without #if");
+            stack_pop(conds);
+        } else if (!active) {
+            // skipped
+        } else if (tag == TT_PP_DEFINE) {
+            Token token_name = token_directive + 1;
+            if (token_name > last || raw->tags[token_name] != TT_IDENT) panic("preprocess error: #define");
+            append_define(pp, token_name, macro_parse(pp, token_name, last + 1));
+        } else if (directive == atom_undef) {
+            Token token_name = token_directive + 1;
+            if (token_name > last || raw->tags[token_name] != TT_IDENT) panic("preprocess error: #undef");
+            hashmap_put_atom(pp->macros, raw->atoms[token_name], NULL);
+            pp->generation++;
+        } else if (tag == TT_PP_INCLUDE) {
+            Token token_file = token_directive + 1;
+            if (raw->tags[token_file] != TT_STRING) panic("preprocess error: #include");
+            char *path = strndupl(source_base + raw->offsets[token_file] + 1, raw->lens[token_file] - 2);
+            include(pp, path);
+            free(path);
+        } else if (directive == atom_pragma) {
+            if (raw->atoms[token_directive + 1] == atom_once && file) file->once = true;
+        } else if (directive == atom_error) {
+            const char *start = source_base + raw->offsets[token_directive];
+            panic("#%.*s", (int)(source_base + raw->offsets[last] + raw->lens[last] - start), start);
+        } else panic("preprocess error: unknown directive after '#'");
+        t = last;
+        active = conds->top == 0 || (stack_top(conds) & COND_ACTIVE);
+    }
+    if (conds->top != 0) panic("preprocess error: unterminated #if");
+    free(conds->data);
+    free(conds);
+    return t;
+}
+
+static void include(Preprocessor *pp, const char *path) {
+    char *canonical = realpath(path, NULL);
+    if (!canonical) panic("cannot open %s: %s", path, strerror(errno));
+    IncludeEntry *file = hashmap_get(pp->includes, canonical, strlen(canonical));
+    if (file) {
+        free(canonical);
+        if (file->once || (file->guard && hashmap_get_atom(pp->macros, file->guard))) return;
+        preprocess_tokens(pp, file->first, file);
+        return;
+    }
+    file = calloc(1, sizeof(IncludeEntry));
+    hashmap_put(pp->includes, canonical, strlen(canonical), file);
+    file->first = tokenize(lexer_new(read_file(canonical)), pp->raw);
+    file->guard = include_guard(pp->raw, file->first);
+    preprocess_tokens(pp, file->first, file);
+}
+
+// preprocess pp->input into token_buf. returns its first token.
+Token preprocess(Preprocessor *pp) {
+    Token first = tokenbuf_end(&token_buf);
+    Token eof = preprocess_tokens(pp, tokenize(lexer_new(pp->input), pp->raw), NULL);
+    token_copy(&token_buf, pp->raw, eof);
+    for (Token t = first; t < token_buf.len; t++) token_buf.tags[t] &= ~PP_NOEXPAND;
+    return first;
+}
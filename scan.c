@@ -0,0 +1,125 @@
+#include "kcc.h"
+
+// Scanning
+//
+// kernels that find the end of a run of one character class for the lexer:
+// whitespace, identifier characters, and the bodies of comments and string
+// literals. each returns a pointer to the first byte that ends the run; a
+// '\0' always ends it. on x86-64 they test 16 bytes at a time with SSE2,
+// which every x86-64 CPU has, using aligned loads that never cross into the
+// next page, so they are safe at the end of any NUL-terminated buffer.
+// elsewhere, or built with -DSCAN_SCALAR, they go a byte at a time.
+
+#if defined(__SSE2__) && !defined(SCAN_SCALAR)
+#define SCAN_SSE2
+#endif
+
+static bool is_space_char(unsigned char c) {
+    return c == ' ' || (9 <= c && c <= 13); // isspace in the C locale
+}
+
+#ifndef SCAN_SSE2
+
+static bool is_ident_char(unsigned char c) {
+    return ('a' <= (c | 0x20) && (c | 0x20) <= 'z') || ('0' <= c && c <= '9') || c == '_';
+}
+
+static const char *space_run(const char *p) {
+    while (is_space_char(*p)) p++;
+    return p;
+}
+
+const char *scan_ident(const char *p) {
+    while (is_ident_char(*p)) p++;
+    return p;
+}
+
+const char *scan_line(const char *p) {
+    while (*p != '\n' && *p != '\0') p++;
+    return p;
+}
+
+const char *scan_star(const char *p) {
+    while (*p != '*' && *p != '\0') p++;
+    return p;
+}
+
+const char *scan_string(const char *p) {
+    while (*p != '"' && *p != '\\' && *p != '\0') p++;
+    return p;
+}
+
+const char *scan_impl_name(void) {
+    return "scalar";
+}
+
+#else
+#include <emmintrin.h>
+
+// SCAN_LOOP finds the first byte whose bit is set in STOP(v), a movemask
+// of the 16-byte vector v. runs are usually short, so the first load is
+// unaligned when it stays within p's page; otherwise it is aligned down
+// and the bits of the bytes before p are cleared.
+#define SCAN_LOOP(p, STOP) do { \
+        if (((uintptr_t)(p) & 4095) <= 4096 - 16) { \
+            uint32_t m = STOP(_mm_loadu_si128((const __m128i *)(p))); \
+            if (m) return (p) + __builtin_ctz(m); \
+        } \
+        const char *a = (const char *)((uintptr_t)(p) & ~(uintptr_t)15); \
+        uint32_t m = STOP(_mm_load_si128((const __m128i *)a)) & (uint32_t)(~0ull << ((p) - a)); \
+        while (!m) { \
+            a += 16; \
+            m = STOP(_mm_load_si128((const __m128i *)a)); \
+        } \
+        return a + __builtin_ctz(m); \
+    } while (0)
+
+#define EQ(v, c) _mm_cmpeq_epi8((v), _mm_set1_epi8(c))
+
+// (v - lo) <= (hi - lo), unsigned
+static inline __m128i in_range(__m128i v, char lo, char hi) {
+    __m128i x = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(hi - lo)), x);
+}
+
+static inline uint32_t not_space(__m128i v) {
+    __m128i space = _mm_or_si128(EQ(v, ' '), in_range(v, 9, 13));
+    return ~_mm_movemask_epi8(space) & 0xFFFF;
+}
+
+static inline uint32_t not_ident(__m128i v) {
+    __m128i alpha = in_range(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z');
+    __m128i ident = _mm_or_si128(_mm_or_si128(alpha, in_range(v, '0', '9')), EQ(v, '_'));
+    return ~_mm_movemask_epi8(ident) & 0xFFFF;
+}
+
+static inline uint32_t line_end(__m128i v) {
+    return _mm_movemask_epi8(_mm_or_si128(EQ(v, '\n'), EQ(v, 0)));
+}
+
+static inline uint32_t star_mask(__m128i v) {
+    return _mm_movemask_epi8(_mm_or_si128(EQ(v, '*'), EQ(v, 0)));
+}
+
+static inline uint32_t string_stop(__m128i v) {
+    __m128i stop = _mm_or_si128(_mm_or_si128(EQ(v, '"'), EQ(v, '\\')), EQ(v, 0));
+    return _mm_movemask_epi8(stop);
+}
+
+static const char *space_run(const char *p) { SCAN_LOOP(p, not_space); }
+const char *scan_ident(const char *p) { SCAN_LOOP(p, not_ident); }
+const char *scan_line(const char *p) { SCAN_LOOP(p, line_end); }
+const char *scan_star(const char *p) { SCAN_LOOP(p, star_mask); }
+const char *scan_string(const char *p) { SCAN_LOOP(p, string_stop); }
+
+const char *scan_impl_name(void) {
+    return "sse2";
+}
+#endif
+
+// a single separating space is the common case and not worth a vector
+const char *scan_space(const char *p) {
+    if (!is_space_char(p[0])) return p;
+    if (!is_space_char(p[1])) return p + 1;
+    return space_run(p + 2);
+}
@@ -2,7 +2,7 @@
 
 TEST_FNCALL="test_fncall"
 
-cat <<EOF | gcc -xc - -c -o $TEST_FNCALL
+TEST_FNCALL_SRC=$(cat <<EOF
 #include <stdlib.h>
 int ident(int a) { return a; }
 char ident_char(char a) { return a; }
@@ -19,6 +19,10 @@ void alloc4(int **p, int a, int b, int c, int d) {
     (*p)[3]=d;
 }
 EOF
+)
+echo "$TEST_FNCALL_SRC" | gcc -xc - -c -o $TEST_FNCALL
+# the same functions for --run, which resolves them with dlsym
+echo "$TEST_FNCALL_SRC" | gcc -xc - -shared -fPIC -o $TEST_FNCALL.so
 
 assert() {
     input="$1"
@@ -35,6 +39,25 @@ assert() {
         echo "$input => $expected expected, but got $actual"
         exit 1
     fi
+
+    # the same program through kcc's own assembler and ELF writer
+    echo "$input" | ./kcc -c -o tmp.o - || exit 1
+    cc -o tmp tmp.o $TEST_FNCALL
+    ./tmp
+    actual="$?"
+
+    if [ "$actual" != "$expected" ]; then
+        echo "$input => $expected expected with -c, but got $actual"
+        exit 1
+    fi
+
+    echo "$input" | LD_PRELOAD="$PWD/$TEST_FNCALL.so" ./kcc --run -
+    actual="$?"
+
+    if [ "$actual" != "$expected" ]; then
+        echo "$input => $expected expected with --run, but got $actual"
+        exit 1
+    fi
 }
 
 
@@ -65,6 +88,17 @@ assert 'int main(){return 3>2==3<5;}' 1
 assert 'int main(){return !1;}' 0
 assert 'int main(){return !0;}' 1
 assert 'int main(){return !(2==2);}' 0
+assert 'int x = 2*3+1; int main(){return x;}' 7
+assert 'int x = -(10-4)/2; int main(){return -x;}' 3
+assert 'int a[3] = {1+1, 2*2, 10%3}; int main(){return a[0]+a[1]+a[2];}' 7
+assert 'int main(){ int a[4]; return sizeof(a)+sizeof a[0]+sizeof(a+0); }' 28
+assert 'int main(){ int i=0; int y=i++*0; return i+y; }' 1
+assert 'int main(){ int i=5; return i*1+0*i+(i-0)/1; }' 10
+assert 'int main(){ int x=5; if (!!x) return 1; return 0; }' 1
+assert 'int main(){ int x=5; return !!x; }' 1
+assert 'int main(){ char c=3; return (1?c:0) + (0?c:4); }' 7
+assert 'int main(){ return (1<2) + (3<=2) + (2==2) + (2!=2) + (0&&ident(1)) + (1||ident(0)); }' 3
+assert 'enum E{A,B}; int main(){ int B=5; return B+A; }' 5
 assert 'int main(){int a;int b;a=1;b=2;return a+b;}' 3
 assert 'int main(){int a; int b; a = 3;
 b = 5 * 6 - 8;
@@ -78,6 +112,10 @@ assert 'int main(){return add3(1,2,4-3);}' 4
 assert 'int main(){return add4(1+2,2,3,4);}' 12
 assert 'int main(){return add5(1,2,3,4,5);}' 15
 assert 'int main(){return add6(1,2,3,4,5,6);}' 21
+assert 'int main(){return 1+(2+(3+(4+(5+(6+(7+8))))));}' 36
+assert 'int main(){return 1+(2+(3+(4+(5+(6+ident(7-add2(1,1)))))));}' 26
+assert 'int main(){int a=2,b=3; return a*(b+add3(a,b,add2(a,b)))-ident(a);}' 24
+assert 'int main(){return add6(1,2,3,4,5,add6(6,5,4,3,2,1));}' 36
 assert 'int main(){int a;a=0; if(a==0) return 3; return 1;}' 3
 assert 'int main(){int a;a=0; if(a==2) return 3; else return 1;}' 1
 assert 'int main(){int a;a=0; if(a==0) a = a + 2; else a = a + 3; return a;}' 2
@@ -268,8 +306,13 @@ assert 'int main() {int a = 0, sum = 0; do { a++; if (a % 2 == 0) continue; sum+
 assert 'int main() {int a = 0; do { a++; if (a == 10) break; } while (1); return a; }' 10
 
 assert 'int main() { int a = 2; switch (a) { case 0: return 1; case 1: return 2; case 2: return 3; default: return 4; }}' 3
-assert 'int main() { int a = 1; switch (a) { case 0: break; case 1: a += 3; /* fallthrough */ case 2: a += 4; break; default: return 3; }}' 8
+assert 'int main() { int a = 1; switch (a) { case 0: break; case 1: a += 3; /* fallthrough */ case 2: a += 4; break; default: return 3; } return a; }' 8
 assert 'int main() { int a = 0; switch (a) { default: return 4; case 0: return 1; case 1: return 2; case 2: return 3; } }' 1
+assert 'int main() { switch (5) { case 0: return 1; } return 9; }' 9
+assert 'int f(int x) { switch (x) { case 1: return 10; case 2: case 3: return 20; case 5: x += 100; case 6: return x; case 8: return 40; default: return 50; } } int main() { return f(1)+f(3)+f(5)+f(6)+f(7)+f(-1)+f(9)-100; }' 191
+assert 'int f(int x) { switch (x) { case -3: return 1; case -2: return 2; case -1: return 3; case 0: return 4; } return 5; } int main() { return f(-4)+f(-3)*2+f(-1)*4+f(0)*8+f(1)*16; }' 131
+assert 'int f(int x) { switch (x) { case 1000: return 1; case 7: return 2; case -500: return 3; case 42: return 4; case 99999: return 5; case 3: return 6; } return 7; } int main() { return f(1000)+f(7)*2+f(-500)*4+f(99999)*8+f(3)*16+f(8); }' 160
+assert 'int f(int x) { int r = 0; switch (x) { case 0: r++; case 10: r++; case 20: r++; case 30: r++; case 40: r++; case 50: r++; break; default: r = 100; } return r; } int main() { return f(0)*10+f(30)+f(5); }' 163
 
 assert 'int main() { union { int x; char y; } u; u.x = 258; return u.y; }' 2
 assert 'union test {int x; int y;}; int main() { union test u; u.x = 123; return u.y; }' 123
@@ -292,6 +335,8 @@ assert 'int main(){ enum E{X,}; return X; }' 0
 assert 'int main(){ enum {A,B}; int n=B; switch(n){case A: return 1; case B: return 7;} return 0; }' 7
 assert 'int main(){ enum {C0,C1}; return C1; }' 1
 assert 'int main(){ enum T{Q}; struct P{ enum T t; }; struct P p; p.t=Q; return p.t; }' 0
+assert 'int x=1; int main(){ int x=3; x=x+2; return x; }' 5
+assert 'int x=7; int f(){ return x; } int main(){ int x=3; return f()+x; }' 10
 
 assert 'int main(){ typedef int I; I x=40; return x+2; }' 42
 assert 'int main(){ typedef int* IP; int x=41; IP p=&x; (*p)++; return x; }' 42
@@ -309,11 +354,320 @@ assert '#define MACRO 5
 int main() {return MACRO;}' 5
 assert '#define MACRO "hello"
 int main() {return MACRO[0];}' 104
+assert 'int main(){ int ab=1; int ba=2; int abc=3; int a=4; return ab*100+ba*10+abc+a; }' 127
+assert 'struct P{int xy; int yx;}; int main(){ struct P p; p.yx=5; p.xy=7; int yx=1; return p.xy*10+p.yx+yx; }' 76
+printf '#define VALUE 40\nint plus2(int x);\n' > tmp.h
+assert '#include "tmp.h"
+int plus2(int x) {return x + 2;}
+int main() {return plus2(VALUE);}' 42
+assert 'int before() {return 1;}
+#include "tmp.h"
+#include "tmp.h"
+int main() {return before() + VALUE;}' 41
+assert '#define A 1
+#define A 2
+#define B A
+int main() {int AB=3; return A*10+AB;}' 23
+printf '#ifndef TMP_GUARD_H\n#define TMP_GUARD_H\nint guarded() { return 5; }\n#endif\n' > tmp_guard.h
+printf '#pragma once\nint once() { return 7; }\n' > tmp_once.h
+assert '#include "tmp_guard.h"
+#include "./tmp_guard.h"
+#include "tmp_once.h"
+#include "tmp_once.h"
+#include "tmp_guard.h"
+int main() {return guarded() * 10 + once();}' 57
+assert '#define A
+#define EMPTY
+#ifdef A
+#ifndef A
+int x = 1;
+#else
+int x = 2;
+#endif
+#else
+int x = 3;
+#endif
+#ifdef B
+#include "does_not_exist.h"
+#endif
+int main() {EMPTY return x;}' 2
+assert '#define ADD(a, b) ((a) + (b))
+#define SQ(x) ((x) * (x))
+#define TWICE(f, x) f(f(x))
+int main() {return ADD(1, 2) * 10 + SQ(ADD(1, 1)) + TWICE(SQ, 2) - 16;}' 34
+assert '#define CAT(a, b) a ## b
+#define XCAT(a, b) CAT(a, b)
+#define N 2
+#define STR(x) #x
+#define XSTR(x) STR(x)
+int main() {int xy = 3; int x2 = 4; char *s = XSTR(N); return CAT(x, y) * 10 + XCAT(x, N) + s[0] - 50;}' 34
+assert '#define SUM(first, ...) add3(first, ## __VA_ARGS__)
+#define COUNT(...) sizeof(#__VA_ARGS__)
+int main() {return SUM(1, 2, 3) + COUNT(a,b);}' 10
+assert 'int f(int x) {return x;}
+#define f(a) a + f(a)
+#define self self
+int main() {int self = 4; return f(self);}' 8
+assert '#define LIMIT 10
+#if defined(LIMIT) && LIMIT * 2 > 15
+#define SMALL 0
+#elif LIMIT
+#define SMALL 1
+#else
+#error not reached
+#endif
+#undef LIMIT
+#if !defined LIMIT && !SMALL
+int x = 6;
+#endif
+int main() {return x;}' 6
+assert '#define LONG(a, \
+             b) \
+    (a - /* a comment */ \
+     b)
+int main() {return LONG(9, 2);}' 7
 assert 'struct {int a;} x; int main() {x.a=0;x.a++;return x.a;}' 1
 assert 'void *malloc(); struct {int a;} *x; int main() {x=malloc(4);x->a=5;x->a--;return x->a;}' 4
 assert 'struct {int a;} x; int main() {x.a=0;++x.a;return x.a;}' 1
 assert 'int main() {return ident(-1) == -1;}' 1
 assert 'char ident_char(); int main() {return ident_char(-1) == -1;}' 1
 assert 'int main(){ int ans=0; for (int i=0;i<10;i++) { switch (i) { case 2: continue; default: break; } ans+=i;} return ans;}' 43
+assert 'int f(int x){ if (x) return 1; return 2; } int g(int x){ while (x) x--; return x; } int h(int x){ return x ? f(x) : g(x); } int main(){ return f(0)*100+g(3)*10+h(5); }' 201
+
+assert 'int main(){ /*/ return 1; */ return 2; }' 2
+assert 'int main(){ /** stars **/ return 3; /***/ }' 3
+assert 'int main(){ return "a\\\"b"[2] + "\\\\"[1]; }' 126
+assert 'int main(){                                                  int a_very_long_identifier_name_of_more_than_32_chars = 42;
+        return a_very_long_identifier_name_of_more_than_32_chars; } // no newline at the end' 42
+
+assert 'int main(){ int a = 3; int b = 0; return (a && b) + (a || b) * 2 + (b ? 10 : a > 2 ? 20 : 30); }' 22
+assert 'int main(){ int n = 0; for (int i = 0; i < 10; i++) { if (i % 3 == 0) continue; switch (i) { case 4: n += 100; break; case 8: n += i && n; break; default: n++; } if (n > 200) break; } return n; }' 105
+assert 'int main(){ int s = 0; int i = 0; do { s += i ? i : 50; return s; i++; } while (i < 3); return 7; }' 50
+assert 'int main(){ char c = 300; int x = c; c = c + 100; return x + c + 100; }' 32
+assert 'int main(){ int a = 1, b = 2, c = 3, d = 4, e = 5, f = 6, g = 7, t; for (int i = 0; i < 5; i++) { t = a; a = b; b = c; c = d; d = e; e = f; f = g; g = t; } return a * 10 + g; }' 65
+assert 'int sq(int x) { return x * x; } int main(){ int a = 3, b = 4; int c = sq(a) + sq(b); return a + b + c; }' 32
+assert 'struct P { int x; char c; struct P *next; }; int main(){ struct P ps[3]; for (int i = 0; i < 3; i++) { ps[i].x = i * 10; ps[i].c = i + 1; ps[i].next = &ps[(i + 1) % 3]; } struct P *p = &ps[1]; return p->x + p->next->c * 3 + p->next->next->x + ps[2].next->c; }' 20
+assert 'int g[8]; char s[8]; int *t[4]; int main(){ int a[8]; for (int i = 0; i < 8; i++) { a[i] = i; g[i] = -i; s[i] = 2 * i; } t[2] = &a[7]; t[3] = g + 6; int i = 5; return a[i] + g[i - 1] + s[i + 2] + *t[2] + *t[3] + 3[a] + (a + 1)[i]; }' 25
+assert 'int m[3][4]; int main(){ for (int i = 0; i < 3; i++) for (int j = 0; j < 4; j++) m[i][j] = i * j; int i = 2, j = 3; return m[i][j] + m[1][j - 1] + *(*(m + i) + 1); }' 10
+
+# the SSE2 scan kernels must agree with the scalar ones, built with -DSCAN_SCALAR
+cc -std=c11 -DSCAN_SCALAR -c -o tmp_scan.o scan.c || exit 1
+cc -pthread -o tmp_kcc_scalar $(ls *.o | grep -v -e '^tmp' -e '^scan\.o$') tmp_scan.o -ldl || exit 1
+prog='/* a block comment long enough to span several vectors: ************************** */
+int   long_identifier_number_one_abcdefghijklmnopqrstuvwxyz = 1;    // a line comment ... ... ...
+int main(){                                                                          char *s = "a string literal with \"escapes\" \\ and more text after them";
+    return long_identifier_number_one_abcdefghijklmnopqrstuvwxyz + s[20]; }'
+if [ "$(echo "$prog" | ./kcc -)" != "$(echo "$prog" | ./tmp_kcc_scalar -)" ]; then
+    echo "the scan kernels differ from the scalar ones"
+    exit 1
+fi
+rm -f tmp_scan.o tmp_kcc_scalar
+
+# codegen output must not depend on the number of threads
+prog='int f(int x){ if (x) return 1; return 2; } int g(int x){ for (;x;) x--; return x; } int main(){ return f(0)+g(3); }'
+if [ "$(echo "$prog" | ./kcc -j 1 -)" != "$(echo "$prog" | ./kcc -j 3 -)" ]; then
+    echo "output differs between -j 1 and -j 3"
+    exit 1
+fi
+
+# --emit-ir: blocks in SSA form, with a phi where && joins
+ir="$(echo 'int f(int a, int b) { return a && b; }' | ./kcc --emit-ir -)"
+if ! echo "$ir" | grep -q '^b2: # preds b0, b1$' || ! echo "$ir" | grep -q '^  v[0-9]* = phi v[0-9]* b0, v[0-9]* b1$'; then
+    echo "--emit-ir: no phi at the join of &&"
+    exit 1
+fi
+
+# promoted locals: no stack slot for the loop's locals, which merge in phis;
+# a local whose address is taken keeps its slot
+ir="$(echo 'int f(int n) { int s = 0; int i; for (i = 0; i < n; i++) s += i; return s; }' | ./kcc --emit-ir -)"
+if echo "$ir" | grep -qE ' (local|load|store) ' || [ "$(echo "$ir" | grep -c ' = phi ')" != 2 ]; then
+    echo "--emit-ir: locals of the loop not promoted"
+    exit 1
+fi
+if ! echo 'int f(int n) { int k = n; int *p = &k; return *p; }' | ./kcc --emit-ir - | grep -q ' local k$'; then
+    echo "--emit-ir: a local whose address is taken was promoted"
+    exit 1
+fi
+
+# member offsets and scaled indices fold into the memory operands
+asm="$(echo 'struct P { int x; int y; }; int f(struct P *p, int *a, int i) { return p->y + a[i]; }' | ./kcc -)"
+if ! echo "$asm" | grep -qE '\[(rdi|rbx|r1[0-5])\+4\]' || ! echo "$asm" | grep -qE '\[[a-z0-9]+\+[a-z0-9]+\*4\]' || echo "$asm" | grep -q imul; then
+    echo "addressing modes not folded"
+    exit 1
+fi
+
+# values not live across a call take caller-saved homes; unused saves go
+if echo 'int g(char *p, char c) { int i = c; return i; }' | ./kcc - | grep -qE 'rbx|r1[2-5]'; then
+    echo "leaf function saves a callee-saved register"
+    exit 1
+fi
+if ! echo 'int f(int v); int h(int a) { int x = a * 3; int y = f(x); return x + y; }' | ./kcc - | grep -qE 'mov \[rbp-[0-9]+\], (rbx|r1[2-5])$'; then
+    echo "value live across a call lost its callee-saved home"
+    exit 1
+fi
+
+# the peephole pass branches on the flags directly and reports its rules;
+# --no-peephole leaves the setcc/cmp sequence but computes the same result
+prog='int main() { int s = 0; int i; for (i = 0; i < 10; i++) if (i < 5) s += i; return s; }'
+if echo "$prog" | ./kcc - | grep -qE '^\s*cmp rax, 0' || ! echo "$prog" | ./kcc --no-peephole - | grep -qE '^\s*cmp rax, 0'; then
+    echo "peephole: setcc feeding a branch not folded"
+    exit 1
+fi
+echo "$prog" | ./kcc --no-peephole - > tmp.s && cc -o tmp tmp.s && ./tmp
+[ "$?" = 10 ] || { echo "--no-peephole: wrong result"; exit 1; }
+if ! echo "$prog" | ./kcc --peephole-report - 2>&1 >/dev/null | grep -qE '^setcc-branch +[1-9]'; then
+    echo "--peephole-report does not count setcc-branch"
+    exit 1
+fi
+# labels and call operands longer than the emitter's line buffer
+name=$(printf 'f%.0s' $(seq 300))
+assert "int $name(int x){ if (x) return 42; return 0; } int main(){ return $name(1); }" 42
+echo "int $name(){ return 42; } int main(){ return $name(); }" | ./kcc --no-peephole - > tmp.s && cc -o tmp tmp.s && ./tmp
+[ "$?" = 42 ] || { echo "--no-peephole: long function name"; exit 1; }
+
+# multiply, divide and modulo by constants: no idiv, and the same results
+# as gcc for every constant below over edge-case dividends. the 64-bit
+# dividends x * y are checked against idiv by the variable v.
+if echo 'int f(int x) { return x * 12 + x / 10 + x % -16 + x / 7; }' | ./kcc - | grep -qE 'idiv|imul .*, '; then
+    echo "strength reduction: idiv or imul by a constant"
+    exit 1
+fi
+consts="$(seq -66 66) 100 641 1000 12345 65537 1000000007 -1000000007 2147483647 -2147483647 1073741824 -1073741824"
+for k in $(seq 7 29); do consts="$consts $((1 << k)) $((-(1 << k))) $((3 << k)) $((-(9 << (k - 4))))"; done
+prog='int printf(); int xs[24]; int v;'
+body=''
+i=0
+for c in $consts; do
+    prog="$prog int mul$i(int x) { return x * ($c) + ($c) * x; }"
+    if [ "$c" = 0 ]; then
+        body="$body printf(\"%d \", mul$i(xs[j]));"
+    else
+        prog="$prog int div$i(int x) { return x / ($c); } int mod$i(int x) { return x % ($c); }"
+        prog="$prog int wide$i(int x, int y) { v = $c; return x * y / ($c) - x * y / v + x * y % ($c) - x * y % v; }"
+        body="$body printf(\"%d \", mul$i(xs[j])); if ($c != -1 || xs[j] != -2147483647 - 1) printf(\"%d %d \", div$i(xs[j]), mod$i(xs[j]));"
+        [ "$c" = -1 ] || body="$body if (wide$i(xs[j], xs[23 - j])) printf(\"wide $c \");"
+    fi
+    i=$((i + 1))
+done
+xs='0 1 -1 2 -2 7 -7 100 -100 2147483647 -2147483648 -2147483647 2147483646 12345678 -12345678 65535 -65536 1000000007 -999999999 46341 -46341 1073741824 -1073741824 314159265'
+i=0
+init=''
+for x in $xs; do init="$init xs[$i] = $x;"; i=$((i + 1)); done
+prog="$prog int main() { int j; $init for (j = 0; j < 24; j++) { $body printf(\"\\n\"); } return 0; }"
+echo "$prog" > tmp.c
+gcc -w -fwrapv -o tmp tmp.c && expected="$(./tmp)"
+./kcc tmp.c > tmp.s && cc -o tmp tmp.s && actual="$(./tmp)"
+./kcc -c -o tmp.o tmp.c && cc -o tmp tmp.o && actual_o="$(./tmp)"
+if [ -z "$expected" ] || [ "$actual" != "$expected" ] || [ "$actual_o" != "$expected" ]; then
+    echo "strength reduction: results differ from gcc"
+    exit 1
+fi
+rm -f tmp.c
+
+# -E prints the preprocessed tokens
+if [ "$(printf '#define F(x) x * 2\nint a = F(1 + 2);\n' | ./kcc -E -)" != "int a = 1 + 2 * 2 ;" ]; then
+    echo "-E output differs"
+    exit 1
+fi
+
+# # spaces its operand as written, also where it comes from macros (C11 6.10.3.5)
+strs='#define str(s) # s
+#define xstr(s) str(s)
+#define N 2
+#define INCFILE(n) vers ## n
+xstr(N+1) xstr(INCFILE(2).h) str( a  +/**/b )'
+if [ "$(echo "$strs" | ./kcc -E -)" != '"2+1" "vers2.h" "a + b"' ]; then
+    echo "# spaces its operand wrongly"
+    exit 1
+fi
+if ! printf '#define F(x) x\nint a = F(\n#define Q 1\nQ);\n' | ./kcc -E - 2>&1 | grep -q 'directive inside macro arguments'; then
+    echo "a directive inside macro arguments is not rejected"
+    exit 1
+fi
+for bad in '#define A(x) #y' '#define A(x) #' '#define A ## b' '#define A(x) x ##'; do
+    if ! printf '%s\nA(1);\n' "$bad" | ./kcc -E - 2>&1 | grep -q 'preprocess error: .#'; then
+        echo "$bad is not rejected"
+        exit 1
+    fi
+done
+if ! printf '#elif 1\n#endif\n' | ./kcc -E - 2>&1 | grep -q '#elif without #if'; then
+    echo "a stray #elif is reported wrongly"
+    exit 1
+fi
+
+# a precompiled header must act like including the header
+cat > tmp_pch.h <<'EOF'
+#ifndef TMP_PCH_H
+#define TMP_PCH_H
+#define LIMIT 10
+struct point { int x; int y; struct point *next; };
+typedef struct point Point;
+enum color { RED, GREEN, BLUE };
+typedef enum { SMALL, LARGE } Size;
+int plus2(int x);
+int counter;
+#endif
+EOF
+prog='int plus2(int x) { return x + 2; }
+int main() { Point p; Point q; p.x = LIMIT; p.y = BLUE; p.next = &q; q.x = LARGE; counter = GREEN;
+    return plus2(p.x) + p.y + p.next->x + counter + sizeof(Point); }'
+./kcc --emit-pch tmp.pch tmp_pch.h || exit 1
+echo "$prog" | ./kcc --include-pch tmp.pch - > tmp.s && cc -o tmp tmp.s && ./tmp
+if [ "$?" != 32 ]; then
+    echo "--include-pch: 32 expected"
+    exit 1
+fi
+if [ "$(printf '#include "tmp_pch.h"\n%s\n' "$prog" | ./kcc -)" != "$(echo "$prog" | ./kcc --include-pch tmp.pch -)" ]; then
+    echo "--include-pch differs from #include"
+    exit 1
+fi
+# a truncated or stale header is refused, not read out of bounds
+head -c 200 tmp.pch > tmp_short.pch
+cat tmp.pch tmp.pch > tmp_long.pch
+for pch in tmp_short.pch tmp_long.pch; do
+    if ! echo "$prog" | ./kcc --include-pch $pch - 2>&1 | grep -q 'corrupt precompiled header'; then
+        echo "--include-pch: $pch is not refused"
+        exit 1
+    fi
+done
+rm -f tmp_short.pch tmp_long.pch
+
+# a second compile of the same tokens comes from KCC_CACHE_DIR, skipping parse
+rm -rf tmp_cache
+export KCC_CACHE_DIR=tmp_cache
+prog='int main() { int x = 6; return x * 7; }'
+parsed() { echo "$1" | ./kcc $2 --time-report - 2>&1 >/dev/null | grep -q '^parse'; }
+parsed "$prog" || { echo "cache: first compile did not parse"; exit 1; }
+parsed "int main() { int x = 6;  /* same tokens */ return x * 7; }" && { echo "cache: same tokens missed"; exit 1; }
+parsed "$prog" --no-comments || { echo "cache: --no-comments hit the entry with comments"; exit 1; }
+echo "$prog" | ./kcc - > tmp.s && cc -o tmp tmp.s && ./tmp
+if [ "$?" != 42 ] || [ "$(cat tmp.s)" != "$(echo "$prog" | KCC_CACHE_DIR= ./kcc -)" ]; then
+    echo "cache: cached assembly differs"
+    exit 1
+fi
+echo "$prog" | ./kcc -c -o tmp.o - && echo "$prog" | ./kcc -c -o tmp2.o - && cmp -s tmp.o tmp2.o || { echo "cache: cached object differs"; exit 1; }
+# room for two entries: the least recently used one goes first
+rm -rf tmp_cache
+size=$(echo 'int main() { return 1; }' | KCC_CACHE_DIR= ./kcc - | wc -c)
+export KCC_CACHE_SIZE=$((size * 2))
+parsed 'int main() { return 1; }'
+parsed 'int main() { return 2; }'
+parsed 'int main() { return 1; }'
+parsed 'int main() { return 3; }'
+if parsed 'int main() { return 1; }' || ! parsed 'int main() { return 2; }' || [ "$(ls tmp_cache | wc -l)" != 2 ]; then
+    echo "cache: least recently used entry not evicted"
+    exit 1
+fi
+unset KCC_CACHE_DIR KCC_CACHE_SIZE
+rm -rf tmp_cache tmp2.o
+
+if ! echo 'int main(){return 0;}' | ./kcc --time-report=json - 2>&1 >/dev/null | grep -q '"instructions": [1-9]'; then
+    echo "--time-report=json does not report instructions"
+    exit 1
+fi
+if ! echo 'int main(){return 0;}' | ./kcc --time-report=json - 2>&1 >/dev/null | grep -qE '"read_file", [^}]*"allocs": [1-9].*"gen", [^}]*"allocs": [1-9]'; then
+    echo "--time-report misses the allocations of read_file or gen"
+    exit 1
+fi
 
 echo "all tests passed"
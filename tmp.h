@@ -0,0 +1,2 @@
+#define VALUE 40
+int plus2(int x);
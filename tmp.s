@@ -0,0 +1,17 @@
+# COMPILED BY KCC
+.intel_syntax noprefix
+
+.globl main
+.text
+main:
+  push rbp
+  mov rbp, rsp
+  sub rsp, 16
+.L0.0:
+  mov rax, 6
+  imul rax, 7
+.L.RETURN.main:
+  mov rsp, rbp
+  pop rbp
+  ret
+
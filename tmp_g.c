@@ -0,0 +1,2 @@
+int g(char *p, char c){ int i = c; return i; }
+int h(int a){ int x = a*3; int y = f(x); return x + y; }
@@ -0,0 +1,4 @@
+#ifndef TMP_GUARD_H
+#define TMP_GUARD_H
+int guarded() { return 5; }
+#endif
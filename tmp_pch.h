@@ -0,0 +1,10 @@
+#ifndef TMP_PCH_H
+#define TMP_PCH_H
+#define LIMIT 10
+struct point { int x; int y; struct point *next; };
+typedef struct point Point;
+enum color { RED, GREEN, BLUE };
+typedef enum { SMALL, LARGE } Size;
+int plus2(int x);
+int counter;
+#endif
@@ -1,11 +1,11 @@
 #include "kcc.h"
 
-Env *env_new(Symbol *local_vars, Symbol *global_vars, Symbol *func_types, Symbol *defined_types) {
+Env *env_new(HashMap *local_vars, HashMap *global_vars, HashMap *func_types, HashMap *enum_vals) {
     Env *env = calloc(1, sizeof(Env));
     env->local_vars = local_vars;
     env->global_vars = global_vars;
     env->func_types = func_types;
-    env->defined_types = defined_types;
+    env->enum_vals = enum_vals;
     return env;
 }
 
@@ -14,22 +14,22 @@ Type *type_char = &(Type){TYP_CHAR, 0};
 Type *type_int = &(Type){TYP_INT, 0};
 
 Type *pointer_to(Type *base) {
-    Type *ptr = calloc(1, sizeof(Type));
+    Type *ptr = arena_alloc(sizeof(Type));
     ptr->tag = TYP_PTR;
     ptr->base = base;
     return ptr;
 }
 
 Type *array_of(Type *base, int size) {
-    Type *arr = calloc(1, sizeof(Type));
+    Type *arr = arena_alloc(sizeof(Type));
     arr->tag = TYP_ARRAY;
     arr->base = base;
     arr->array_size = size;
     return arr;
 }
 
-Type *struct_new(Token *ident, Symbol *list, int size, int align) {
-    Type *typ = calloc(1, sizeof(Type));
+Type *struct_new(Token ident, Symbol *list, int size, int align) {
+    Type *typ = arena_alloc(sizeof(Type));
     typ->tag = TYP_STRUCT;
     typ->tagged_typ.ident = ident;
     typ->tagged_typ.list = list;
@@ -38,8 +38,8 @@ Type *struct_new(Token *ident, Symbol *list, int size, int align) {
     return typ;
 }
 
-Type *union_new(Token *ident, Symbol *list, int size, int align) {
-    Type *typ = calloc(1, sizeof(Type));
+Type *union_new(Token ident, Symbol *list, int size, int align) {
+    Type *typ = arena_alloc(sizeof(Type));
     typ->tag = TYP_UNION;
     typ->tagged_typ.ident = ident;
     typ->tagged_typ.list = list;
@@ -48,8 +48,8 @@ Type *union_new(Token *ident, Symbol *list, int size, int align) {
     return typ;
 }
 
-Type *enum_new(Token *ident, Symbol *list) {
-    Type *typ = calloc(1, sizeof(Type));
+Type *enum_new(Token ident, Symbol *list) {
+    Type *typ = arena_alloc(sizeof(Type));
     typ->tag = TYP_ENUM;
     typ->tagged_typ.ident = ident;
     typ->tagged_typ.list = list;
@@ -107,10 +107,10 @@ static Type *promote_if_integer(Type *type) {
     else return type;
 }
 
-bool tokeneq(Token *a, Token *b) {
+// identifiers only: they compare by atom
+bool tokeneq(Token a, Token b) {
     if (!a || !b) return false;
-    if (a->len != b->len) return false;
-    return strncmp(a->start, b->start, a->len) == 0;
+    return tok_atom(a) && tok_atom(a) == tok_atom(b);
 }
 
 static bool is_compatible(Type *a, Type *b) {
@@ -140,13 +140,13 @@ static Node *typed(Node *node, Env *env) {
         case NT_IDENT: {
             Symbol *var = find_symbol(ST_LVAR, env->local_vars, node->main_token);
             if (!var) var = find_symbol(ST_GVAR, env->global_vars, node->main_token);
-            if (!var) var = find_enum_val(env->defined_types, node->main_token);
-            if (!var) panic("undefined variable: %.*s", node->main_token->len, node->main_token->start);
+            if (!var) var = find_enum_val(env->enum_vals, node->main_token);
+            if (!var) panic("undefined variable: %.*s", tok_len(node->main_token), tok_start(node->main_token));
             node->type = var->type;
             break;
         }
         case NT_STRING:
-            node->type = array_of(type_char, node->main_token->len - 2 + 1); // -2: '"' * 2, +1: '\0'
+            node->type = array_of(type_char, tok_len(node->main_token) - 2 + 1); // -2: '"' * 2, +1: '\0'
             break;
         case NT_ADD: {
             Type *lhs_typ = promote_if_integer(typed(node->bin_expr.lhs, env)->type);
@@ -246,7 +246,7 @@ static Node *typed(Node *node, Env *env) {
             Type *lhs_typ = typed(lhs, env)->type;
             if (node->tag == NT_DOT && lhs_typ->tag != TYP_STRUCT && lhs_typ->tag != TYP_UNION)
                 panic("type check error: invalid member access");
-            Symbol *member_sym = find_member(lhs_typ->tagged_typ.list, member->main_token, NULL);
+            Symbol *member_sym = find_member(lhs_typ, member->main_token, NULL);
             if (!member_sym) panic("type check error: invalid member access");
             node->type = member_sym->type;
             break;
@@ -257,7 +257,7 @@ static Node *typed(Node *node, Env *env) {
             Type *lhs_typ = typed(lhs, env)->type;
             if (node->tag == NT_ARROW && (lhs_typ->tag != TYP_PTR || lhs_typ->base->tag != TYP_STRUCT))
                 panic("type check error: invalid member access");
-            Symbol *member_sym = find_member(lhs_typ->base->tagged_typ.list, member->main_token, NULL);
+            Symbol *member_sym = find_member(lhs_typ->base, member->main_token, NULL);
             if (!member_sym) panic("type check error: invalid member access");
             node->type = member_sym->type;
             break;
@@ -366,10 +366,12 @@ static Node *typed(Node *node, Env *env) {
 
 void type_funcs(Program *prog) {
     NodeList *funcs = prog->funcs;
-    Env *env = env_new(NULL, prog->global_vars, prog->func_types, prog->defined_types);
+    Env *env = env_new(NULL, prog->global_map, prog->func_map, prog->enum_map);
+    for (Symbol *var = prog->global_vars; var != NULL; var = var->next)
+        typed(var->init, env); // global initializers
     for (int i = 0; i < funcs->len; i++) {
         Node *fnode = funcs->nodes[i];
-        env->local_vars = fnode->func.locals; // set local variables
+        env->local_vars = fnode->func.local_map; // set local variables
         typed(fnode, env);
     }
     free(env);
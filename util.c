@@ -1,4 +1,5 @@
 #include "kcc.h"
+#include <stdatomic.h>
 
 Stack* stack_new(int capacity) {
     Stack *stack = calloc(1, sizeof(Stack));
@@ -27,3 +28,188 @@ void stack_push(Stack *stack, int val) {
     }
     stack->data[stack->top++] = val;
 }
+
+void stack_free(Stack *stack) {
+    free(stack->data);
+    free(stack);
+}
+
+// HashMap
+//
+// open addressing with linear probing, keyed either on (pointer, length)
+// strings or on atoms (interned identifiers, see intern). one map uses one
+// kind of key. string keys are not copied; they point into the source text
+// like tokens do. an atom key is stored as key == NULL, keylen == atom.
+
+#define HASHMAP_INIT_CAP 16
+#define HASHMAP_MAX_LOAD 70 // percent
+
+static uint64_t fnv1a(const char *key, int keylen) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (int i = 0; i < keylen; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+static uint64_t hash_atom(int atom) {
+    return ((uint64_t)atom * 0x9e3779b97f4a7c15) >> 32;
+}
+
+HashMap *hashmap_new(void) {
+    HashMap *map = calloc(1, sizeof(HashMap));
+    map->capacity = HASHMAP_INIT_CAP;
+    map->buckets = calloc(map->capacity, sizeof(HashEntry));
+    return map;
+}
+
+static HashEntry *hashmap_find(HashMap *map, const char *key, int keylen) {
+    uint64_t mask = map->capacity - 1;
+    for (uint64_t i = (key ? fnv1a(key, keylen) : hash_atom(keylen)) & mask; ; i = (i + 1) & mask) {
+        HashEntry *ent = &map->buckets[i];
+        if (!ent->keylen) return ent;
+        if (ent->keylen == keylen && (!key || memcmp(ent->key, key, keylen) == 0)) return ent;
+    }
+}
+
+static void hashmap_grow(HashMap *map) {
+    HashEntry *old = map->buckets;
+    int old_capacity = map->capacity;
+    map->capacity *= 2;
+    map->buckets = calloc(map->capacity, sizeof(HashEntry));
+    if (!map->buckets) panic("internal error: calloc failed");
+    for (int i = 0; i < old_capacity; i++) {
+        if (!old[i].keylen) continue;
+        *hashmap_find(map, old[i].key, old[i].keylen) = old[i];
+    }
+    free(old);
+}
+
+void *hashmap_get(HashMap *map, const char *key, int keylen) {
+    if (!map) return NULL;
+    return hashmap_find(map, key, keylen)->val;
+}
+
+// insert or overwrite; the newest definition shadows older ones
+void hashmap_put(HashMap *map, const char *key, int keylen, void *val) {
+    if (map->capacity * HASHMAP_MAX_LOAD <= (map->used + 1) * 100) hashmap_grow(map);
+    HashEntry *ent = hashmap_find(map, key, keylen);
+    if (!ent->keylen) {
+        ent->key = key;
+        ent->keylen = keylen;
+        map->used++;
+    }
+    ent->val = val;
+}
+
+void hashmap_free(HashMap *map) {
+    free(map->buckets);
+    free(map);
+}
+
+void *hashmap_get_atom(HashMap *map, int atom) {
+    return hashmap_get(map, NULL, atom);
+}
+
+void hashmap_put_atom(HashMap *map, int atom, void *val) {
+    hashmap_put(map, NULL, atom, val);
+}
+
+// Arena
+//
+// bump-pointer allocator for objects that live until the compiler exits
+// (tokens, nodes, symbols, types). one arena per compilation phase;
+// arena_use selects where arena_alloc draws from.
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+struct ArenaChunk {
+    ArenaChunk *next;
+    size_t size;
+    size_t pos;
+    _Alignas(16) char data[]; // allocations are rounded to 16, so each is aligned
+};
+
+static Arena *arenas;        // all arenas, for arena_report
+static Arena *current_arena;
+
+Arena *arena_new(const char *name) {
+    Arena *arena = calloc(1, sizeof(Arena));
+    arena->name = name;
+    Arena **p = &arenas;
+    while (*p) p = &(*p)->next;
+    *p = arena;
+    return arena;
+}
+
+void arena_use(Arena *arena) {
+    current_arena = arena;
+}
+
+static ArenaChunk *arena_grow(Arena *arena, size_t size) {
+    if (size < ARENA_CHUNK_SIZE) size = ARENA_CHUNK_SIZE;
+    ArenaChunk *chunk = calloc(1, sizeof(ArenaChunk) + size);
+    if (!chunk) panic("cannot allocate memory: %s", strerror(errno));
+    chunk->size = size;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->reserved += size;
+    return chunk;
+}
+
+// zero-filled memory from the current arena
+// (plain calloc when no arena is selected)
+void *arena_alloc(size_t size) {
+    Arena *arena = current_arena;
+    if (!arena) return calloc(1, size);
+    size = align_n(size, ARENA_ALIGN);
+    ArenaChunk *chunk = arena->chunks;
+    if (!chunk || chunk->size - chunk->pos < size) chunk = arena_grow(arena, size);
+    void *ptr = chunk->data + chunk->pos;
+    chunk->pos += size;
+    arena->used += size;
+    arena->nalloc++;
+    return ptr;
+}
+
+// allocations made outside the arenas (source text, token buffers, IR
+// chunks, emitter buffers), counted along with theirs. codegen threads
+// count too.
+static atomic_long heap_nalloc;
+static atomic_size_t heap_bytes;
+
+void count_alloc(size_t size) {
+    atomic_fetch_add_explicit(&heap_nalloc, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&heap_bytes, size, memory_order_relaxed);
+}
+
+// allocations and bytes handed out so far, by the arenas and elsewhere
+void alloc_totals(long *nalloc, size_t *used) {
+    *nalloc = atomic_load(&heap_nalloc);
+    *used = atomic_load(&heap_bytes);
+    for (Arena *arena = arenas; arena != NULL; arena = arena->next) {
+        *nalloc += arena->nalloc;
+        *used += arena->used;
+    }
+}
+
+void arena_report(FILE *fp) {
+    fprintf(fp, "%-12s %12s %12s %10s\n", "arena", "used", "reserved", "allocs");
+    size_t used = 0, reserved = 0;
+    long nalloc = 0;
+    for (Arena *arena = arenas; arena != NULL; arena = arena->next) {
+        fprintf(fp, "%-12s %12zu %12zu %10ld\n", arena->name, arena->used, arena->reserved, arena->nalloc);
+        used += arena->used;
+        reserved += arena->reserved;
+        nalloc += arena->nalloc;
+    }
+    fprintf(fp, "%-12s %12zu %12zu %10ld\n", "total", used, reserved, nalloc);
+}
+
+// Stats
+//
+// counted as the phases run and printed by --time-report
+
+Stats stats;